@@ -0,0 +1,359 @@
+#include "api.hpp"
+#include "gpmap.hpp"
+#include "log.hpp"
+#include "stat.hpp"
+#include "util.hpp"
+#include "uvsrv.hpp"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <string>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+using namespace cht;
+namespace cht::api {
+
+#ifdef GPM_API
+
+// longest line taken from a client
+constexpr u32 LINE_MAX_LEN = 128;
+
+constexpr u32 MAX_ACTIVE =
+    ((1 << GPM_LOOKUP_BITS) >> GPM_WORKER_BITS) * GPM_API_MAX_SHARE_PCT / 100;
+static_assert(MAX_ACTIVE > 0, "GPM_API_MAX_SHARE_PCT leaves no lookups");
+
+struct Client {
+    uv_pipe_t pipe;
+    std::deque<Nih> queue;
+    std::array<char, LINE_MAX_LEN> line;
+    u32 line_len;
+    // the line is too long and is being skipped to its end
+    bool line_skip;
+    // bumped for every connection, so lookups of an earlier client in the
+    // slot are not reported to this one
+    u32 gen;
+    u32 n_active;
+    bool reading;
+    bool is_set;
+};
+
+static uv_pipe_t g_server;
+static std::array<Client, GPM_API_MAX_CLIENTS> g_clients;
+// where the round robin over clients starts next
+static u32 g_next_client = 0;
+static u32 g_n_active = 0;
+
+// admission tokens, in thousandths
+static u64 g_admit_mtok = GPM_API_ADMIT_BURST * 1000;
+static u64 g_admit_refilled_ms;
+
+static char g_read_buf[1 << 16];
+
+static inline u32 make_tag(u32 slot) {
+    return (g_clients[slot].gen << 8) | (slot + 1);
+}
+
+// The client a tag belongs to, if it is still connected.
+static inline Client *tag_client(u32 tag) {
+    u32 slot = (tag & 0xff) - 1;
+    if (slot >= GPM_API_MAX_CLIENTS) {
+        return nullptr;
+    }
+    Client &cl = g_clients[slot];
+    if (!cl.is_set || cl.gen != (tag >> 8)) {
+        return nullptr;
+    }
+    return &cl;
+}
+
+static inline void append_hex(std::string &out, const Nih &ih) {
+    static constexpr char digits[] = "0123456789abcdef";
+    for (u8 byte : ih.raw) {
+        out.push_back(digits[byte >> 4]);
+        out.push_back(digits[byte & 0xf]);
+    }
+}
+
+static inline i32 hex_val(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static bool parse_hex(const char *str, u32 len, Nih &out) {
+    if (len != 2 * NIH_LEN) {
+        return false;
+    }
+    for (u32 ix = 0; ix < NIH_LEN; ix++) {
+        i32 hi = hex_val(str[2 * ix]);
+        i32 lo = hex_val(str[2 * ix + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out.raw[ix] = u8((hi << 4) | lo);
+    }
+    return true;
+}
+
+static inline bool backlogged(Client &cl) {
+    return uv_stream_get_write_queue_size(reinterpret_cast<uv_stream_t *>(
+               &cl.pipe)) > GPM_API_MAX_BACKLOG;
+}
+
+static void cb_read(uv_stream_t *, ssize_t, const uv_buf_t *);
+
+// Reads from the client only while it keeps up with our replies. Its lookups
+// are held back by pop_target meanwhile.
+static void update_reading(Client &cl) {
+    bool want_read = !backlogged(cl);
+    if (want_read == cl.reading) {
+        return;
+    }
+
+    auto *stream = reinterpret_cast<uv_stream_t *>(&cl.pipe);
+    if (want_read) {
+        uv_read_start(stream, &uvsrv::cb_alloc<g_read_buf>, &cb_read);
+    } else {
+        uv_read_stop(stream);
+        st_inc(ST_api_read_paused);
+    }
+    cl.reading = want_read;
+}
+
+static void on_written(u32 slot, u32 gen) {
+    Client &cl = g_clients[slot];
+    bool same_client =
+        cl.is_set && cl.gen == gen &&
+        !uv_is_closing(reinterpret_cast<uv_handle_t *>(&cl.pipe));
+
+    if (same_client && !cl.reading) {
+        update_reading(cl);
+    }
+}
+
+static void send_str(Client &cl, std::string &&data) {
+    u32 slot = &cl - g_clients.data();
+    if (uvsrv::send_str<on_written>(reinterpret_cast<uv_stream_t *>(&cl.pipe),
+                                    slot, cl.gen, std::move(data)) &&
+        cl.reading) {
+        update_reading(cl);
+    }
+}
+
+static void handle_line(Client &cl, const char *line, u32 len) {
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    Nih ih;
+    if (!parse_hex(line, len, ih)) {
+        st_inc(ST_api_bad_lines);
+        send_str(cl, "E bad_line\n");
+        return;
+    }
+
+    if (cl.queue.size() >= GPM_API_CLIENT_QUEUE) {
+        st_inc(ST_api_drop_queue_full);
+        std::string out = "E ";
+        append_hex(out, ih);
+        out += " queue_full\n";
+        send_str(cl, std::move(out));
+        return;
+    }
+
+    cl.queue.push_back(ih);
+    st_inc(ST_api_targets_queued);
+}
+
+static void cb_close_client(uv_handle_t *handle) {
+    Client &cl = *reinterpret_cast<Client *>(handle->data);
+    cl.queue.clear();
+    cl.is_set = false;
+
+    u32 n_clients = 0;
+    for (auto const &other : g_clients) {
+        n_clients += other.is_set;
+    }
+    st_set(ST_api_clients, n_clients);
+}
+
+static void cb_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    Client &cl = *reinterpret_cast<Client *>(stream->data);
+
+    if (nread < 0) {
+        if (nread != UV_EOF) {
+            WARN("API client read failed: %s", uv_strerror(nread))
+        }
+        uv_close(reinterpret_cast<uv_handle_t *>(stream), &cb_close_client);
+        return;
+    }
+
+    for (ssize_t ix = 0; ix < nread; ix++) {
+        char c = buf->base[ix];
+        if (c == '\n') {
+            if (cl.line_skip) {
+                st_inc(ST_api_bad_lines);
+                send_str(cl, "E bad_line\n");
+            } else {
+                handle_line(cl, cl.line.data(), cl.line_len);
+            }
+            cl.line_len = 0;
+            cl.line_skip = false;
+        } else if (cl.line_len < LINE_MAX_LEN) {
+            cl.line[cl.line_len++] = c;
+        } else {
+            cl.line_skip = true;
+        }
+    }
+}
+
+static void cb_connect(uv_stream_t *server, int status) {
+    if (status < 0) {
+        WARN("API connection failed: %s", uv_strerror(status))
+        return;
+    }
+
+    Client *cl = nullptr;
+    for (auto &slot : g_clients) {
+        if (!slot.is_set) {
+            cl = &slot;
+            break;
+        }
+    }
+
+    if (cl == nullptr) {
+        if (uvsrv::turn_away(server)) {
+            WARN("Turning away API client, %d already connected",
+                 GPM_API_MAX_CLIENTS)
+        }
+        return;
+    }
+
+    uv_pipe_init(server->loop, &cl->pipe, 0);
+    cl->pipe.data = cl;
+    if (uv_accept(server, reinterpret_cast<uv_stream_t *>(&cl->pipe)) < 0) {
+        uv_close(reinterpret_cast<uv_handle_t *>(&cl->pipe), nullptr);
+        return;
+    }
+
+    cl->gen = (cl->gen + 1) & 0xffffff;
+    cl->n_active = 0;
+    cl->line_len = 0;
+    cl->line_skip = false;
+    cl->reading = true;
+    cl->is_set = true;
+
+    uv_read_start(reinterpret_cast<uv_stream_t *>(&cl->pipe),
+                  &uvsrv::cb_alloc<g_read_buf>, &cb_read);
+    st_inc(ST_api_clients);
+}
+
+void init(uv_loop_t *loop) {
+    g_admit_refilled_ms = mono_ms();
+
+    unlink(GPM_API_SOCK_FN);
+
+    int status = uv_pipe_init(loop, &g_server, 0);
+    if (status >= 0) {
+        status = uv_pipe_bind(&g_server, GPM_API_SOCK_FN);
+    }
+    if (status >= 0) {
+        status = uv_listen(reinterpret_cast<uv_stream_t *>(&g_server),
+                           GPM_API_MAX_CLIENTS, &cb_connect);
+    }
+    if (status < 0) {
+        ERROR("Could not listen on " GPM_API_SOCK_FN ": %s",
+              uv_strerror(status))
+        exit(-1);
+    }
+}
+
+bool pop_target(Nih &ih, u32 &tag) {
+    if (g_n_active >= MAX_ACTIVE || gpm::n_free_lookups() == 0) {
+        return false;
+    }
+
+    u64 now = mono_ms();
+    g_admit_mtok = std::min(g_admit_mtok + (now - g_admit_refilled_ms) *
+                                               GPM_API_ADMIT_PER_S,
+                            u64(GPM_API_ADMIT_BURST) * 1000);
+    g_admit_refilled_ms = now;
+    if (g_admit_mtok < 1000) {
+        return false;
+    }
+
+    for (u32 ix = 0; ix < GPM_API_MAX_CLIENTS; ix++) {
+        u32 slot = (g_next_client + ix) % GPM_API_MAX_CLIENTS;
+        Client &cl = g_clients[slot];
+        if (!cl.is_set || cl.queue.empty() ||
+            cl.n_active >= GPM_API_CLIENT_ACTIVE || !cl.reading) {
+            continue;
+        }
+
+        ih = cl.queue.front();
+        cl.queue.pop_front();
+        tag = make_tag(slot);
+
+        cl.n_active++;
+        g_n_active++;
+        g_admit_mtok -= 1000;
+        g_next_client = slot + 1;
+
+        st_inc(ST_api_targets_started);
+        return true;
+    }
+    return false;
+}
+
+void on_peers(u32 tag, const Nih &ih, const Peerinfo peers[], u32 n_peers) {
+    Client *cl = tag_client(tag);
+    if (cl == nullptr) {
+        return;
+    }
+
+    std::string out;
+    out.reserve(n_peers * 64);
+    char addr[32];
+    for (u32 ix = 0; ix < n_peers; ix++) {
+        const u8 *ip = reinterpret_cast<const u8 *>(&peers[ix].in_addr);
+        snprintf(addr, sizeof(addr), " %u.%u.%u.%u:%u\n", ip[0], ip[1], ip[2],
+                 ip[3], ntohs(peers[ix].sin_port));
+        out += "P ";
+        append_hex(out, ih);
+        out += addr;
+    }
+
+    st_add(ST_api_peers_sent, n_peers);
+    send_str(*cl, std::move(out));
+}
+
+void on_done(u32 tag, const Nih &ih, bool found) {
+    st_inc(found ? ST_api_targets_found : ST_api_targets_not_found);
+    g_n_active--;
+
+    Client *cl = tag_client(tag);
+    if (cl == nullptr) {
+        return;
+    }
+    cl->n_active--;
+
+    std::string out = "D ";
+    append_hex(out, ih);
+    out += found ? " found\n" : " not_found\n";
+    send_str(*cl, std::move(out));
+}
+
+#endif // GPM_API
+
+} // namespace cht::api
@@ -0,0 +1,75 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+extern "C" {
+#include <uv.h>
+}
+
+using namespace cht;
+namespace cht::api {
+
+// Local API for getting peers for infohashes of our own, enabled with
+// GPM_API. Clients connect to the Unix socket GPM_API_SOCK_FN and write
+// infohashes as 40 hex digits, one per line. Each is chased by a targeted
+// get_peers lookup, whose peers are written back as they come in, as
+//     P <ih> <a.b.c.d>:<port>
+// and whose end is written as
+//     D <ih> found|not_found
+// Infohashes that do not fit the client's queue are answered with
+//     E <ih> queue_full
+// and lines that are not infohashes with
+//     E bad_line
+
+#ifndef GPM_API_SOCK_FN
+#define GPM_API_SOCK_FN "./data/gpm_api.sock"
+#endif
+// clients connected at once; more are turned away
+#ifndef GPM_API_MAX_CLIENTS
+#define GPM_API_MAX_CLIENTS 8
+#endif
+// targeted lookups one client can have running at once
+#ifndef GPM_API_CLIENT_ACTIVE
+#define GPM_API_CLIENT_ACTIVE 64
+#endif
+// infohashes one client can have waiting for a lookup
+#ifndef GPM_API_CLIENT_QUEUE
+#define GPM_API_CLIENT_QUEUE 65536
+#endif
+// targeted lookups started per second over all clients, and in a burst
+#ifndef GPM_API_ADMIT_PER_S
+#define GPM_API_ADMIT_PER_S 50
+#endif
+#ifndef GPM_API_ADMIT_BURST
+#define GPM_API_ADMIT_BURST 100
+#endif
+// share of all lookups, in percent, that may be targeted at once, so the
+// passive harvest always has lookups left
+#ifndef GPM_API_MAX_SHARE_PCT
+#define GPM_API_MAX_SHARE_PCT 25
+#endif
+// bytes a client may leave unread before we stop reading its infohashes and
+// starting its lookups
+#ifndef GPM_API_MAX_BACKLOG
+#define GPM_API_MAX_BACKLOG (1 << 20)
+#endif
+
+static_assert(GPM_API_MAX_CLIENTS < 256, "Client slot must fit the tag");
+
+#ifdef GPM_API
+// Binds GPM_API_SOCK_FN and accepts clients on the loop.
+void init(uv_loop_t *loop);
+
+// Takes the next client infohash to chase, if admission allows, and the tag
+// to start its lookup with.
+bool pop_target(Nih &ih, u32 &tag);
+
+// Writes the peers an r_gp brought for a targeted lookup to its client.
+void on_peers(u32 tag, const Nih &ih, const Peerinfo peers[], u32 n_peers);
+
+// Tells the client a targeted lookup ended.
+void on_done(u32 tag, const Nih &ih, bool found);
+#endif
+
+} // namespace cht::api
@@ -0,0 +1,102 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include "oa.hpp"
+#include <array>
+#include <vector>
+
+#include <sys/random.h>
+
+using namespace cht;
+namespace cht {
+
+/// Approximate set of recently seen Nihs, forgetting them after one to two
+/// rotations.
+///
+/// Two blocked Bloom filters of 2 ** LOG2_BLOCKS cache lines each are kept;
+/// adds go to the current one and lookups check both. Rotating clears the
+/// older filter and makes it current. Every Nih sets K_BITS bits in a single
+/// cache line, so a lookup touches at most two lines.
+template <u32 LOG2_BLOCKS, u32 K_BITS = 8>
+class RotatingBloom {
+  private:
+    static constexpr u32 N_BLOCKS = 1u << LOG2_BLOCKS;
+    static constexpr u32 BLOCK_WORDS = 8;
+
+    static_assert(LOG2_BLOCKS <= 32, "Too many blocks");
+    static_assert(K_BITS <= 8, "Only 8 bits are probed per block");
+
+    struct alignas(64) Block {
+        u64 words[BLOCK_WORDS];
+    };
+
+    using Filter = std::array<Block, N_BLOCKS>;
+
+    // on the heap, so the filter is cheap to keep per thread
+    std::vector<Filter> filters = std::vector<Filter>(2);
+    u32 current = 0;
+    u64 n_added = 0;
+    // keeps crafted infohashes from piling into one block
+    u64 seed;
+
+    u64 hash(const Nih &nih) const {
+        return oa::hash_ih_wide(nih, seed);
+    }
+
+    static u32 block_of(u64 h) {
+        return u32(h >> (64 - LOG2_BLOCKS)) & (N_BLOCKS - 1);
+    }
+
+    // The k-th bit is taken from the k-th 6-bit field of h, in the k-th word.
+    static bool test(const Block &block, u64 h) {
+        for (u32 k = 0; k < K_BITS; k++) {
+            u64 bit = u64(1) << ((h >> (6 * k)) & 63);
+            if (!(block.words[k] & bit)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  public:
+    RotatingBloom() {
+        getrandom(&seed, sizeof(seed), 0);
+    }
+
+    RotatingBloom(RotatingBloom const &) = delete;
+    RotatingBloom &operator=(RotatingBloom const &) = delete;
+
+    static constexpr u64 size_bytes() {
+        return 2 * sizeof(Filter);
+    }
+
+    // Number of adds since the last rotation.
+    u64 load() const {
+        return n_added;
+    }
+
+    bool contains(const Nih &nih) const {
+        u64 h = hash(nih);
+        u32 ix = block_of(h);
+        return test(filters[current][ix], h) ||
+               test(filters[current ^ 1][ix], h);
+    }
+
+    void add(const Nih &nih) {
+        u64 h = hash(nih);
+        Block &block = filters[current][block_of(h)];
+        for (u32 k = 0; k < K_BITS; k++) {
+            block.words[k] |= u64(1) << ((h >> (6 * k)) & 63);
+        }
+        n_added++;
+    }
+
+    void rotate() {
+        current ^= 1;
+        filters[current].fill({});
+        n_added = 0;
+    }
+};
+
+} // namespace cht
@@ -2,17 +2,73 @@
 #include "log.hpp"
 #include "stat.hpp"
 
+#include <algorithm>
+#include <array>
+
 using namespace cht;
 namespace cht {
 
 #define DIFF(x) (st_get(x) - st_get_old(x))
-#define RATE(x) (1000 * DIFF(x) / (double)(st_now_ms - st_old_ms))
+#define ELAPSED_MS                                                             \
+    (std::chrono::duration_cast<std::chrono::milliseconds>(now() - old())      \
+         .count())
+#define RATE(x) (1000 * DIFF(x) / (double)(ELAPSED_MS > 0 ? ELAPSED_MS : 1))
 
 // PUBLIC FUNCTIONS
 
 static u8 ctl_ping_window = 0;
 
+// reply latency histograms of the current and the previous window
+static std::array<std::array<u64, CTL_GPM_RTT_N_BUCKETS>, 2> g_gp_rtt_hist;
+static u32 g_gp_rtt_cur = 0;
+static u32 g_gp_rtt_window_age = 0;
+static u32 g_gpm_timeout_ms = CTL_GPM_TIMEOUT_MS;
+
+// with GPM_CONCURRENT, replies are timed from the GPM worker threads
+#ifdef GPM_CONCURRENT
+#define HIST_ADD(ctr) __atomic_fetch_add(&(ctr), 1, __ATOMIC_RELAXED)
+#define HIST_GET(ctr) __atomic_load_n(&(ctr), __ATOMIC_RELAXED)
+#define HIST_SET(ctr, val) __atomic_store_n(&(ctr), (val), __ATOMIC_RELAXED)
+#else
+#define HIST_ADD(ctr) ((ctr)++)
+#define HIST_GET(ctr) (ctr)
+#define HIST_SET(ctr, val) ((ctr) = (val))
+#endif
+
+// don't adapt the timeout on fewer replies than this
+constexpr u64 GP_RTT_MIN_SAMPLES = 200;
+
+static void ctl_update_gpm_timeout() {
+    u64 n_samples = 0;
+    for (auto const &hist : g_gp_rtt_hist) {
+        for (auto const &ctr : hist) {
+            n_samples += HIST_GET(ctr);
+        }
+    }
+
+    if (n_samples >= GP_RTT_MIN_SAMPLES) {
+        u64 want = n_samples * CTL_GPM_TIMEOUT_PCTILE / 100;
+        u64 seen = 0;
+        u32 bucket = 0;
+        for (; bucket < CTL_GPM_RTT_N_BUCKETS - 1; bucket++) {
+            seen += HIST_GET(g_gp_rtt_hist[0][bucket]) +
+                    HIST_GET(g_gp_rtt_hist[1][bucket]);
+            if (seen > want) {
+                break;
+            }
+        }
+        // the upper edge of the bucket, so the percentile is let through
+        u32 timeout_ms = (bucket + 1) * CTL_GPM_RTT_BUCKET_MS;
+        HIST_SET(g_gpm_timeout_ms,
+                 std::clamp(timeout_ms, u32(CTL_GPM_TIMEOUT_MIN_MS),
+                            u32(CTL_GPM_TIMEOUT_MAX_MS)));
+    }
+
+    st_set(ST_ctl_gpm_timeout_ms, g_gpm_timeout_ms);
+}
+
 void ctl_init() {
+    st_set(ST_ctl_gpm_timeout_ms, g_gpm_timeout_ms);
 }
 
 bool ctl_decide_ping(const Nih &nid) {
@@ -20,7 +76,40 @@ bool ctl_decide_ping(const Nih &nid) {
     // return (nid.ctl_byte & 0xf0) == (ctl_ping_window & 0xf0);
 }
 
+void ctl_record_gp_rtt(u64 rtt_ms) {
+    u64 bucket = rtt_ms / CTL_GPM_RTT_BUCKET_MS;
+    if (bucket >= CTL_GPM_RTT_N_BUCKETS) {
+        bucket = CTL_GPM_RTT_N_BUCKETS - 1;
+    }
+    HIST_ADD(g_gp_rtt_hist[HIST_GET(g_gp_rtt_cur)][bucket]);
+    st_click_gp_rtt(u32(bucket));
+}
+
+u32 ctl_gpm_timeout_ms() {
+    return HIST_GET(g_gpm_timeout_ms);
+}
+
 void ctl_rollover_hook() {
     ctl_ping_window++;
+    st_set(ST_ctl_rx_q_per_s, u64(RATE(ST_rx_q_tot)));
+#ifdef SI_CRAWL
+    // what the two harvest paths find per packet they cost us
+    u64 si_tx = DIFF(ST_tx_q_si);
+    u64 gp_tx = DIFF(ST_tx_q_gp) + DIFF(ST_tx_r_gp) + DIFF(ST_tx_r_ap);
+    st_set(ST_ctl_si_new_per_ktx,
+           1000 * DIFF(ST_si_ihs_new) / std::max(si_tx, u64(1)));
+    st_set(ST_ctl_gp_new_per_ktx,
+           1000 * DIFF(ST_gp_ihs_new) / std::max(gp_tx, u64(1)));
+#endif
+
+    ctl_update_gpm_timeout();
+    if (++g_gp_rtt_window_age == CTL_GPM_RTT_WINDOW) {
+        g_gp_rtt_window_age = 0;
+        u32 cur = g_gp_rtt_cur ^ 1;
+        for (auto &ctr : g_gp_rtt_hist[cur]) {
+            HIST_SET(ctr, 0);
+        }
+        HIST_SET(g_gp_rtt_cur, cur);
+    }
 }
 } // namespace cht
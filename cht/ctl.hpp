@@ -7,12 +7,42 @@
 using namespace cht;
 namespace cht {
 
-#ifndef CTL_GPM_TIMEOUT
+// get_peers time out after this long until enough replies were timed
+#ifndef CTL_GPM_TIMEOUT_MS
 #define CTL_GPM_TIMEOUT_MS 200
 #endif
+// ... after which the timeout follows this percentile of the reply latency
+#ifndef CTL_GPM_TIMEOUT_PCTILE
+#define CTL_GPM_TIMEOUT_PCTILE 95
+#endif
+// ... within these bounds
+#ifndef CTL_GPM_TIMEOUT_MIN_MS
+#define CTL_GPM_TIMEOUT_MIN_MS 50
+#endif
+#ifndef CTL_GPM_TIMEOUT_MAX_MS
+#define CTL_GPM_TIMEOUT_MAX_MS 1000
+#endif
+// ... over the replies of the last one to two windows of this many rollovers
+#ifndef CTL_GPM_RTT_WINDOW
+#define CTL_GPM_RTT_WINDOW 10
+#endif
+// the resolution of reply latency histograms
+#define CTL_GPM_RTT_BUCKET_MS 4
+#define CTL_GPM_RTT_N_BUCKETS (CTL_GPM_TIMEOUT_MAX_MS / CTL_GPM_RTT_BUCKET_MS + 1)
+
+static_assert(CTL_GPM_TIMEOUT_MIN_MS <= CTL_GPM_TIMEOUT_MS &&
+              CTL_GPM_TIMEOUT_MS <= CTL_GPM_TIMEOUT_MAX_MS);
+static_assert(CTL_GPM_TIMEOUT_PCTILE > 0 && CTL_GPM_TIMEOUT_PCTILE < 100);
 
 bool ctl_decide_ping(const Nih &nid);
 
+// Records how long a get_peers took to be answered, whether or not the
+// answer came in time.
+void ctl_record_gp_rtt(u64 rtt_ms);
+
+// The current get_peers timeout.
+u32 ctl_gpm_timeout_ms();
+
 // Function to be called on stat rollover, to compute control parameters
 // from the value of the counters and their values at the previous rollover.
 void ctl_rollover_hook();
@@ -0,0 +1,317 @@
+#include "db.hpp"
+#include "log.hpp"
+#include "oa.hpp"
+#include "stat.hpp"
+#include "util.hpp"
+
+#include <array>
+#include <vector>
+
+#include <sys/random.h>
+
+using namespace cht;
+namespace cht::db {
+
+constexpr u32 N_SHARDS = 1 << DB_LOG2_SHARDS;
+constexpr u32 SHARD_SLOTS = 1 << DB_LOG2_SHARD_SLOTS;
+constexpr u32 SLOT_MASK = SHARD_SLOTS - 1;
+// new infohashes evict old ones past this many per shard
+constexpr u32 MAX_LOAD = SHARD_SLOTS / 8 * 7;
+
+struct Entry {
+    Nih ih;
+    // last update or lookup, for eviction
+    u32 touched_s;
+    std::array<Peerinfo, DB_PEERS_PER_IH> peers;
+    // when each peer was last heard of
+    std::array<u32, DB_PEERS_PER_IH> seen_s;
+    u8 n_peers;
+    bool is_set;
+};
+
+struct Shard {
+    std::vector<Entry> slots;
+    u32 n_ihs;
+    u32 n_peers;
+    u32 sweep_pos;
+    u32 time_ctr;
+#ifdef GPM_CONCURRENT
+    bool lock;
+#endif
+};
+
+static std::array<Shard, N_SHARDS> g_shards;
+static u64 g_seed;
+static u64 g_start_ms;
+// where sample_ihs goes on, over all shards' slots
+static u32 g_sample_pos = 0;
+
+// Takes a shard for the current scope. Shards are only locked when GPM
+// workers may share them.
+class ShardGuard {
+  private:
+    [[maybe_unused]] Shard &shard;
+
+  public:
+    ShardGuard(Shard &shard) : shard(shard) {
+#ifdef GPM_CONCURRENT
+        while (__atomic_test_and_set(&shard.lock, __ATOMIC_ACQUIRE)) {
+            __builtin_ia32_pause();
+        }
+#endif
+    }
+    ~ShardGuard() {
+#ifdef GPM_CONCURRENT
+        __atomic_clear(&shard.lock, __ATOMIC_RELEASE);
+#endif
+    }
+};
+
+static inline u32 now_s() {
+    return u32((mono_ms() - g_start_ms) / 1000);
+}
+
+static inline u64 hash(const Nih &ih) {
+    return oa::hash_ih(ih, g_seed);
+}
+
+static inline Shard &shard_of(u64 h) {
+    return g_shards[h >> (64 - DB_LOG2_SHARDS)];
+}
+
+static inline u32 home_of(u64 h) {
+    return u32(h >> (64 - DB_LOG2_SHARDS - DB_LOG2_SHARD_SLOTS)) & SLOT_MASK;
+}
+
+static inline bool same_ih(const Nih &x, const Nih &y) {
+    return memcmp(x.raw.data(), y.raw.data(), NIH_LEN) == 0;
+}
+
+static inline bool same_peer(const Peerinfo &x, const Peerinfo &y) {
+    return memcmp(x.packed, y.packed, PEERINFO_LEN) == 0;
+}
+
+// The slot holding the ih, or the empty slot it would go in.
+static std::pair<bool, u32> find(const Shard &shard, const Nih &ih, u64 h) {
+    // the load cap guarantees an empty slot
+    return oa::find(
+        home_of(h), SLOT_MASK, [&](u32 ix) { return shard.slots[ix].is_set; },
+        [&](u32 ix) { return same_ih(shard.slots[ix].ih, ih); });
+}
+
+static void remove(Shard &shard, u32 pos) {
+    shard.n_ihs--;
+    shard.n_peers -= shard.slots[pos].n_peers;
+
+    oa::erase(
+        pos, SLOT_MASK, [&](u32 ix) { return shard.slots[ix].is_set; },
+        [&](u32 ix) { return home_of(hash(shard.slots[ix].ih)); },
+        [&](u32 from, u32 to) { shard.slots[to] = shard.slots[from]; },
+        [&](u32 ix) { shard.slots[ix].is_set = false; });
+}
+
+// Drops the expired peers of an entry, returning how many are left.
+static u8 expire(Shard &shard, Entry &entry, u32 now) {
+    u8 n_kept = 0;
+    for (u8 ix = 0; ix < entry.n_peers; ix++) {
+        if (now - entry.seen_s[ix] < DB_PEER_TTL_S) {
+            entry.peers[n_kept] = entry.peers[ix];
+            entry.seen_s[n_kept] = entry.seen_s[ix];
+            n_kept++;
+        }
+    }
+    u8 n_expired = entry.n_peers - n_kept;
+    if (n_expired > 0) {
+        st_add(ST_db_peers_expired, n_expired);
+        shard.n_peers -= n_expired;
+    }
+    entry.n_peers = n_kept;
+    return n_kept;
+}
+
+// Evicts the least recently touched of the entries from the home slot on,
+// looking at DB_EVICT_SAMPLE slots or until one is taken. The shard must not
+// be empty.
+static void evict_near(Shard &shard, u32 home) {
+    u32 victim = 0;
+    bool have_victim = false;
+    for (u32 ix = 0; ix < DB_EVICT_SAMPLE || !have_victim; ix++) {
+        u32 pos = (home + ix) & SLOT_MASK;
+        const Entry &entry = shard.slots[pos];
+        if (entry.is_set && (!have_victim || entry.touched_s <
+                                                 shard.slots[victim].touched_s)) {
+            victim = pos;
+            have_victim = true;
+        }
+    }
+    remove(shard, victim);
+    st_inc(ST_db_ih_evicted);
+}
+
+void init() {
+    getrandom(&g_seed, sizeof(g_seed), 0);
+    g_start_ms = mono_ms();
+
+    for (auto &shard : g_shards) {
+        shard.slots.resize(SHARD_SLOTS);
+        for (auto &entry : shard.slots) {
+            entry.is_set = false;
+        }
+    }
+
+    st_set(ST_db_mem_bytes, u64(N_SHARDS) * SHARD_SLOTS * sizeof(Entry));
+}
+
+void update_peers(const Nih &ih, const Peerinfo peers[], u32 n_peers) {
+    if (n_peers == 0) {
+        return;
+    }
+    st_inc(ST_db_update_peers);
+
+    u64 h = hash(ih);
+    Shard &shard = shard_of(h);
+    ShardGuard guard(shard);
+    u32 now = now_s();
+
+    auto [found, pos] = find(shard, ih, h);
+    if (!found) {
+        if (shard.n_ihs >= MAX_LOAD) {
+            evict_near(shard, home_of(h));
+            pos = find(shard, ih, h).second;
+        }
+        Entry &entry = shard.slots[pos];
+        entry.ih = ih;
+        entry.n_peers = 0;
+        entry.is_set = true;
+        shard.n_ihs++;
+    }
+
+    Entry &entry = shard.slots[pos];
+    entry.touched_s = now;
+    if (found) {
+        expire(shard, entry, now);
+    }
+
+    for (u32 px = 0; px < n_peers; px++) {
+        const Peerinfo &peer = peers[px];
+
+        u8 slot = 0;
+        u8 oldest = 0;
+        for (; slot < entry.n_peers; slot++) {
+            if (same_peer(entry.peers[slot], peer)) {
+                break;
+            }
+            if (entry.seen_s[slot] < entry.seen_s[oldest]) {
+                oldest = slot;
+            }
+        }
+
+        if (slot < entry.n_peers) {
+            st_inc(ST_db_rows_refreshed);
+        } else if (entry.n_peers < DB_PEERS_PER_IH) {
+            entry.n_peers++;
+            shard.n_peers++;
+            st_inc(ST_db_rows_inserted);
+        } else {
+            slot = oldest;
+            st_inc(ST_db_peers_replaced);
+        }
+
+        entry.peers[slot] = peer;
+        entry.seen_s[slot] = now;
+    }
+}
+
+u32 get_peers(const Nih &ih, Peerinfo out[], u32 max_out) {
+    u64 h = hash(ih);
+    Shard &shard = shard_of(h);
+    ShardGuard guard(shard);
+
+    struct timespec t0;
+    bool timed = (shard.time_ctr++ % DB_TIME_EVERY) == 0;
+    if (timed) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    }
+
+    st_inc(ST_db_lookups);
+
+    u32 n_out = 0;
+    auto [found, pos] = find(shard, ih, h);
+    if (found) {
+        Entry &entry = shard.slots[pos];
+        u32 now = now_s();
+        entry.touched_s = now;
+        for (u8 ix = 0; ix < entry.n_peers && n_out < max_out; ix++) {
+            if (now - entry.seen_s[ix] < DB_PEER_TTL_S) {
+                out[n_out++] = entry.peers[ix];
+            }
+        }
+        if (n_out > 0) {
+            st_inc(ST_db_lookup_hits);
+        }
+    }
+
+    if (timed) {
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        st_add(ST_db_lookup_ns_sum, u32((t1.tv_sec - t0.tv_sec) * 1000000000 +
+                                        (t1.tv_nsec - t0.tv_nsec)));
+        st_inc(ST_db_lookup_ns_n);
+    }
+
+    return n_out;
+}
+
+u32 sample_ihs(Nih out[], u32 max_out, u32 max_scan) {
+    u32 n_out = 0;
+    u32 n_scanned = 0;
+
+    while (n_scanned < max_scan && n_out < max_out) {
+        Shard &shard = g_shards[g_sample_pos >> DB_LOG2_SHARD_SLOTS];
+        ShardGuard guard(shard);
+
+        // up to the end of this shard
+        do {
+            const Entry &entry = shard.slots[g_sample_pos & SLOT_MASK];
+            // peers may have expired since the last sweep, that's fine
+            if (entry.is_set && entry.n_peers > 0) {
+                out[n_out++] = entry.ih;
+            }
+            g_sample_pos = (g_sample_pos + 1) % (N_SHARDS * SHARD_SLOTS);
+            n_scanned++;
+        } while ((g_sample_pos & SLOT_MASK) != 0 && n_scanned < max_scan &&
+                 n_out < max_out);
+    }
+
+    return n_out;
+}
+
+void sweep() {
+    u32 now = now_s();
+    u64 n_ihs = 0;
+    u64 n_peers = 0;
+
+    for (auto &shard : g_shards) {
+        ShardGuard guard(shard);
+
+        for (u32 ix = 0; ix < DB_SWEEP_SLOTS / N_SHARDS; ix++) {
+            u32 pos = shard.sweep_pos;
+            Entry &entry = shard.slots[pos];
+            if (entry.is_set && expire(shard, entry, now) == 0) {
+                // a later entry may have moved into this slot, so it is
+                // looked at again
+                remove(shard, pos);
+                continue;
+            }
+            shard.sweep_pos = (pos + 1) & SLOT_MASK;
+        }
+
+        n_ihs += shard.n_ihs;
+        n_peers += shard.n_peers;
+    }
+
+    st_set(ST_db_ihs, n_ihs);
+    st_set(ST_db_peers, n_peers);
+}
+
+} // namespace cht::db
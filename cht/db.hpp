@@ -0,0 +1,68 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht::db {
+
+// In-memory store of the peers we learned for infohashes, from q_ap and from
+// r_gp values. It takes a fixed amount of memory: 2 ** DB_LOG2_SHARDS shards
+// of 2 ** DB_LOG2_SHARD_SLOTS open-addressed slots, each holding up to
+// DB_PEERS_PER_IH peers for one infohash.
+//
+// Peers not heard of again for DB_PEER_TTL_S are dropped. A new peer for a
+// full infohash replaces the one heard of longest ago. A new infohash for a
+// full shard evicts the least recently touched of a few infohashes near its
+// slot.
+
+#ifndef DB_LOG2_SHARDS
+#define DB_LOG2_SHARDS 4
+#endif
+#ifndef DB_LOG2_SHARD_SLOTS
+#define DB_LOG2_SHARD_SLOTS 13
+#endif
+#ifndef DB_PEERS_PER_IH
+#define DB_PEERS_PER_IH 8
+#endif
+#ifndef DB_PEER_TTL_S
+#define DB_PEER_TTL_S 1800
+#endif
+// infohashes looked at to pick one to evict
+#ifndef DB_EVICT_SAMPLE
+#define DB_EVICT_SAMPLE 8
+#endif
+// how often expired peers are swept out, and how many slots at a time
+#ifndef DB_SWEEP_EVERY_MS
+#define DB_SWEEP_EVERY_MS 1000
+#endif
+#ifndef DB_SWEEP_SLOTS
+#define DB_SWEEP_SLOTS 8192
+#endif
+// time one in this many lookups
+#ifndef DB_TIME_EVERY
+#define DB_TIME_EVERY 64
+#endif
+
+static_assert(DB_PEERS_PER_IH < 256);
+static_assert(DB_EVICT_SAMPLE <= (1 << DB_LOG2_SHARD_SLOTS));
+
+void init();
+
+// Stores peers for an infohash, refreshing those already stored.
+void update_peers(const Nih &ih, const Peerinfo peers[], u32 n_peers);
+
+// Writes up to max_out live peers of the infohash to out and returns their
+// number.
+u32 get_peers(const Nih &ih, Peerinfo out[], u32 max_out);
+
+// Writes up to max_out infohashes that have peers to out, looking at no more
+// than max_scan slots. Every call goes on where the last one stopped, so
+// successive calls walk the whole store.
+u32 sample_ihs(Nih out[], u32 max_out, u32 max_scan);
+
+// Drops expired peers from the next DB_SWEEP_SLOTS slots and updates the
+// gauges. To be called every DB_SWEEP_EVERY_MS.
+void sweep();
+
+} // namespace cht::db
@@ -33,9 +33,20 @@ constexpr inline auto PNODE_LEN = (NIH_LEN + PEERINFO_LEN);
 constexpr inline u8 OUR_TOK_PG = 0x77;
 constexpr inline u8 OUR_TOK_GP = 0x78;
 constexpr inline u8 OUR_TOK_FN = 0x79;
-constexpr inline u8 OUR_TOKEN = 0x88;
+constexpr inline u8 OUR_TOK_SI = 0x7a;
 
-constexpr inline auto DB_FN = "./data/dht.db";
+// Total length of the t of our get_peers queries. The last byte is OUR_TOK_GP,
+// the others carry the GPM cell index and its generation, little-endian.
+#ifndef GP_TOK_LEN
+#define GP_TOK_LEN 4
+#endif
+static_assert(GP_TOK_LEN >= 3 && GP_TOK_LEN <= 6, "GP_TOK_LEN must be 3-6");
+
+// Length of the announce tokens we hand out, see token.hpp.
+#ifndef TOKEN_LEN
+#define TOKEN_LEN 8
+#endif
+static_assert(TOKEN_LEN >= 4 && TOKEN_LEN <= 8, "TOKEN_LEN must be 4-8");
 
 struct Nih_h {
     u8 high[2];
@@ -70,7 +81,9 @@ class Nih {
         return raw[1];
     }
     u32 checksum() const {
-        return *reinterpret_cast<u32 *>(raw[CSUM_OFFSET]);
+        u32 csum;
+        memcpy(&csum, raw.data() + CSUM_OFFSET, sizeof(u32));
+        return csum;
     }
     void clear() {
         std::fill(std::next(raw.begin() + CSUM_OFFSET), raw.end(), 0);
@@ -1,201 +1,1152 @@
 #include "gpmap.hpp"
+#include "bloom.hpp"
+#include "ring.hpp"
+#include "topk.hpp"
+#include "trace.hpp"
+#include "wheel.hpp"
+#include <algorithm>
 #include <cassert>
+#include <unordered_map>
+
+#if defined(GPM_CONCURRENT) && defined(GPM_TRACE)
+#error "GPM_TRACE needs a single GPM thread"
+#endif
 
 using namespace cht;
 namespace cht::gpm {
 
-static struct timespec __NOW_MS_now;
-static u64 now_ms;
+// Per-worker state. Shared tables are split into equal per-worker ranges
+// instead.
+#ifdef GPM_CONCURRENT
+#define GPM_LOCAL thread_local
+#else
+#define GPM_LOCAL
+#endif
+
+static GPM_LOCAL struct timespec __NOW_MS_now;
+static GPM_LOCAL u64 now_ms;
 
 #define UPDATE_NOW_MS()                                                        \
     clock_gettime(CLOCK_MONOTONIC_COARSE, &__NOW_MS_now);                      \
     now_ms = (__NOW_MS_now.tv_sec * 1000) + (__NOW_MS_now.tv_nsec / 1000000);
 
-constexpr u32 N_BINS = 1 << 16;
-// Random cells will be assigned from this array
+// The tok carries the cell index in its low GPM_IDX_BITS and a generation in
+// the rest, which is bumped on every take so late replies to a reused cell
+// are rejected.
+constexpr u32 TOK_BITS = 8 * (GP_TOK_LEN - 1);
+static_assert(GPM_IDX_BITS <= TOK_BITS, "GPM_IDX_BITS too wide for GP_TOK_LEN");
+static_assert(GPM_IDX_BITS <= 26, "GPM table too large");
+constexpr u32 GEN_BITS =
+    (TOK_BITS - GPM_IDX_BITS < 26) ? TOK_BITS - GPM_IDX_BITS : 26;
+constexpr u64 GEN_MASK = (u64(1) << GEN_BITS) - 1;
+
+constexpr u32 N_BINS = 1 << GPM_IDX_BITS;
+constexpr u64 IDX_MASK = N_BINS - 1;
+constexpr u32 N_LOOKUPS = 1 << GPM_LOOKUP_BITS;
+
+constexpr u32 N_WORKERS = 1 << GPM_WORKER_BITS;
+constexpr u32 BINS_PER_WORKER = N_BINS / N_WORKERS;
+constexpr u32 LOOKUPS_PER_WORKER = N_LOOKUPS / N_WORKERS;
+constexpr u32 PENDING_PER_WORKER = GPM_PENDING_MAX / N_WORKERS;
+
+static GPM_LOCAL u32 g_worker = 0;
+
+// The state word of a cell packs everything a reply is matched against, so
+// any worker can claim the cell with a single CAS:
+//   bits  0-1   Phase
+//   bits  2-5   hops from our rt to the node asked
+//   bits  6-31  generation of the last tok to hold the cell
+//   bits 32-63  nid checksum of the node asked
+// A free cell keeps the generation and checksum of its last tok, so late
+// replies to it can still be timed.
+enum Phase : u64 {
+    PH_FREE = 0, // on the owner's free list
+    PH_ARMED,    // get_peers in flight
+    PH_CLAIMED,  // a reply or a timeout is being handled
+};
+
+constexpr u32 HOP_SHIFT = 2;
+constexpr u32 GEN_SHIFT = 6;
+constexpr u32 CSUM_SHIFT = 32;
+static_assert(GP_MAX_HOPS < 16, "Hop count does not fit the state word");
+
+static inline u64 pack_state(Phase phase, u8 hop, u32 gen, u32 nid_checksum) {
+    return u64(phase) | (u64(hop) << HOP_SHIFT) | (u64(gen) << GEN_SHIFT) |
+           (u64(nid_checksum) << CSUM_SHIFT);
+}
+
+static inline Phase phase_of(u64 state) {
+    return Phase(state & 3);
+}
+
+static inline u8 hop_of(u64 state) {
+    return u8((state >> HOP_SHIFT) & 15);
+}
+
+static inline u32 gen_of(u64 state) {
+    return u32((state >> GEN_SHIFT) & GEN_MASK);
+}
+
+static inline u32 checksum_of(u64 state) {
+    return u32(state >> CSUM_SHIFT);
+}
+
+static inline u64 with_phase(u64 state, Phase phase) {
+    return (state & ~u64(3)) | phase;
+}
+
+// One get_peers in flight, addressed by its tok. Other workers only ever
+// touch the state word; the rest belongs to the worker owning the cell and is
+// published by arming it.
+struct GPMStatus {
+    u64 state;
+    u32 lookup;     // The lookup this get_peers belongs to
+    u32 lookup_gen; // ... and its generation when it was sent
+    u32 sent_ms;    // When, truncated
+};
+
+static std::array<GPMStatus, N_BINS> g_ifl_buf = {};
+
+static inline u32 owner_of(u32 idx) {
+    return idx / BINS_PER_WORKER;
+}
+
+static inline u64 load_state(u32 idx) {
+    return __atomic_load_n(&g_ifl_buf[idx].state, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_state(u32 idx, u64 state) {
+    __atomic_store_n(&g_ifl_buf[idx].state, state, __ATOMIC_RELEASE);
+}
+
+static inline bool cas_state(u32 idx, u64 expect, u64 want) {
+#ifdef GPM_CONCURRENT
+    return __atomic_compare_exchange_n(&g_ifl_buf[idx].state, &expect, want,
+                                       false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+#else
+    if (g_ifl_buf[idx].state != expect) {
+        return false;
+    }
+    g_ifl_buf[idx].state = want;
+    return true;
+#endif
+}
+
+// Free toks are kept in a FIFO intrusive list, so a tok sits idle for as long
+// as possible before reuse and late replies to it are unlikely to match.
+// Each worker has its own list over its own range of toks.
+constexpr u32 NIL_TOK = UINT32_MAX;
+static std::array<u32, N_BINS> g_free_next;
+static GPM_LOCAL u32 g_free_head = NIL_TOK;
+static GPM_LOCAL u32 g_free_tail = NIL_TOK;
+static GPM_LOCAL u32 g_n_free = 0;
+// when each tok was last put on the free list
+static std::array<u64, N_BINS> g_freed_ms;
+
+// Taken toks are expired from this wheel, in ms, by their index within the
+// worker's range
+static GPM_LOCAL TimerWheel<BINS_PER_WORKER> g_expiry(mono_ms());
+
+enum CandidateState : u8 {
+    C_FRESH = 0,
+    C_QUERIED,
+    C_RESPONDED,
+    C_FAILED,
+};
+
+struct Candidate {
+    PNode pnode;
+    u8 dkad;
+    u8 hop_ctr;
+    CandidateState state;
+};
 
-struct __attribute__((packed)) GPMStatus {
-  public:
-    Nih ih;                // The infohash being tracked
-    u32 last_nid_checksum; // The last peer we contacted
-    u64 hop_ctr : 7;
-    u64 last_reponse_ms : 56; // Last time we got a r_gp for this infohash
-    u64 is_set : 1;
+// An iterative get_peers lookup for one infohash.
+struct Lookup {
+    Nih ih;
+    // closest known nodes, ascending by dkad
+    std::array<Candidate, GPM_K> shortlist;
+    // every node this lookup has asked, so evicted nodes are not asked again
+    std::array<u32, GPM_MAX_QUERIES> queried;
+    u32 gen;
+    // nonzero for targeted lookups
+    u32 tag;
+    u8 n_short;
+    u8 n_queried;
+    u8 n_inflight;
+    u8 n_responded;
+    // responses in a row that did not bring a closer node
+    u8 n_stalled;
+    u8 best_dkad;
+    // a targeted lookup got values
+    bool found;
+    bool hit_hop_limit;
+    bool traced;
+    bool is_set;
 };
-static_assert(sizeof(GPMStatus) == 32);
 
-static std::array<GPMStatus, N_BINS> g_ifl_buf = {{{{{0}}}}};
+static std::array<Lookup, N_LOOKUPS> g_lookups;
+static GPM_LOCAL std::vector<u32> g_free_lookups;
+
+static GPM_LOCAL std::vector<Query> g_outbox;
+static GPM_LOCAL std::vector<Done> g_done;
+
+// Infohashes recently pursued or resolved. The filters are rotated every
+// GPM_SEEN_WINDOW_S, or early once they hold enough to near 1% false
+// positives.
+static GPM_LOCAL RotatingBloom<GPM_SEEN_LOG2_BLOCKS> g_seen;
+constexpr u64 SEEN_MAX_LOAD = (u64(1) << GPM_SEEN_LOG2_BLOCKS) * 512 / 12;
+static GPM_LOCAL u64 g_seen_rotated_ms;
+
+// An infohash waiting for a lookup to free up.
+struct Pending {
+    Nih ih;
+    u64 queued_ms;
+    // one bit per asking node, by nid checksum, to count distinct askers
+    u64 asker_bits;
+    u32 heap_pos;
+    bool via_ap;
+    bool hot;
+};
+
+constexpr u32 PENDING_SCORE_ASKER = 4;
+constexpr u32 PENDING_SCORE_AP = 64;
+constexpr u32 PENDING_SCORE_HOT = 32;
+
+static std::array<Pending, GPM_PENDING_MAX> g_pending;
+static GPM_LOCAL std::vector<u32> g_free_pending;
+// max-heap of pending slots by score, then by age
+static GPM_LOCAL std::vector<u32> g_pending_heap;
+// infohashes are uniform, so their first bytes make a fine hash
+struct IhHash {
+    size_t operator()(const Nih &ih) const {
+        u64 key;
+        memcpy(&key, ih.raw.data(), sizeof(u64));
+        return key;
+    }
+};
+// Nih == only compares the checksum
+struct IhEq {
+    bool operator()(const Nih &x, const Nih &y) const {
+        return x.raw == y.raw;
+    }
+};
+static GPM_LOCAL std::unordered_map<Nih, u32, IhHash, IhEq> g_pending_by_ih;
+static GPM_LOCAL u64 g_pending_swept_ms;
+
+#ifdef GPM_CONCURRENT
+// An r_gp one worker claimed for a lookup of another.
+struct Handoff {
+    tok_t tok;
+    u32 nid_checksum;
+    u32 rcvd_ms;
+    u8 n_nodes;
+    bool has_values;
+    // the get_peers had already timed out, so only the rtt is of use
+    bool late;
+    std::array<PNode, bd::MAX_NODES> nodes;
+};
+
+// the number of workers init was told would run
+static u32 g_n_workers = 1;
+// one ring per ordered pair of running workers, at from * g_n_workers + to
+static std::vector<SpscRing<Handoff, GPM_HANDOFF_LOG2>> g_handoffs;
+#endif
 
 //
 // INTERNAL FUNCTIONS
 //
 
-static inline GPMStatus &set_cell(u16 tok) {
-    UPDATE_NOW_MS()
-    auto &cell = g_ifl_buf[tok];
-    cell.last_reponse_ms = now_ms;
-    if (!cell.is_set) {
-        cell.is_set = true;
+static inline void push_free(u32 idx) {
+    g_free_next[idx] = NIL_TOK;
+    g_freed_ms[idx] = now_ms;
+    if (g_free_tail == NIL_TOK) {
+        g_free_head = idx;
+    } else {
+        g_free_next[g_free_tail] = idx;
+    }
+    g_free_tail = idx;
+    g_n_free++;
+}
+
+static inline u32 pop_free() {
+    assert(g_n_free > 0);
+    u32 idx = g_free_head;
+    g_free_head = g_free_next[idx];
+    if (g_free_head == NIL_TOK) {
+        g_free_tail = NIL_TOK;
+    }
+    g_n_free--;
+    return idx;
+}
+
+// Reserves a vacant tok of this worker in O(1) and arms its cell for a
+// get_peers to the candidate.
+static std::pair<bool, tok_t> take_tok(u32 lx, const Candidate &cand) {
+    if (g_n_free == 0) {
+        st_inc(ST_gpm_q_drop_no_tok);
+        return {false, 0};
+    }
+
+    u32 idx = pop_free();
+
+    st_add(ST_gpm_tok_reuse_ms_sum, now_ms - g_freed_ms[idx]);
+    st_inc(ST_gpm_tok_reuse_n);
+    st_set(ST_gpm_inflight, BINS_PER_WORKER - g_n_free);
+
+    GPMStatus &cell = g_ifl_buf[idx];
+    cell.lookup = lx;
+    cell.lookup_gen = g_lookups[lx].gen;
+    cell.sent_ms = u32(now_ms);
+
+    u32 gen = u32((gen_of(load_state(idx)) + 1) & GEN_MASK);
+    store_state(idx, pack_state(PH_ARMED, cand.hop_ctr, gen,
+                                cand.pnode.nid.checksum()));
+    g_expiry.schedule(idx % BINS_PER_WORKER, now_ms + ctl_gpm_timeout_ms());
+
+    return {true, (u64(gen) << GPM_IDX_BITS) | idx};
+}
+
+// Returns a cell this worker owns and claimed to its free list.
+static inline void release_cell(u32 idx, u64 claimed) {
+    assert(owner_of(idx) == g_worker && phase_of(claimed) == PH_CLAIMED);
+    g_expiry.cancel(idx % BINS_PER_WORKER);
+    store_state(idx, with_phase(claimed, PH_FREE));
+    push_free(idx);
+    st_set(ST_gpm_inflight, BINS_PER_WORKER - g_n_free);
+}
+
+static inline u64 read_tok(const bd::KRPC &krpc) {
+    assert(krpc.tok_len == GP_TOK_LEN);
+
+    u64 tok = 0;
+    for (int ix = 0; ix < GP_TOK_LEN - 1; ix++) {
+        tok |= u64(krpc.tok[ix]) << (8 * ix);
+    }
+    return tok;
+}
+
+// The state of the cell a tok points at, if the get_peers sent with that tok
+// is still in flight.
+static inline std::pair<bool, u64> armed_state(tok_t tok) {
+    u64 state = load_state(u32(tok & IDX_MASK));
+    if (phase_of(state) != PH_ARMED) {
+        return {false, 0};
+    }
+    if (gen_of(state) != ((tok >> GPM_IDX_BITS) & GEN_MASK)) {
+        return {false, 0};
     }
-    return cell;
+    return {true, state};
 }
 
-static inline void unset_cell(u16 tok) {
-    auto &cell = g_ifl_buf[tok];
-    if (!cell.is_set) {
-        cell.is_set = false;
+// Takes an armed cell for whoever is to handle its reply or timeout. Of all
+// the workers racing for a cell, exactly one wins. Returns the claimed state.
+static inline std::pair<bool, u64> claim_cell(u32 idx, u64 armed) {
+    u64 claimed = with_phase(armed, PH_CLAIMED);
+    return {cas_state(idx, armed, claimed), claimed};
+}
+
+// Claims the cell of the get_peers an r_gp answers.
+static inline std::pair<bool, u64> claim_reply(const bd::KRPC &krpc,
+                                               tok_t tok) {
+    auto [ok, state] = armed_state(tok);
+    if (!ok) {
+        if (phase_of(load_state(u32(tok & IDX_MASK))) == PH_ARMED) {
+            st_inc(ST_gpm_tok_stale_gen);
+        }
+        return {false, 0};
+    }
+    if (checksum_of(state) != krpc.nid->checksum()) {
+        return {false, 0};
+    }
+    return claim_cell(u32(tok & IDX_MASK), state);
+}
+
+// Times a reply to a get_peers of this worker that already timed out, if its
+// cell was not reused since. Timing only the replies that came in time would
+// drag the adaptive timeout down.
+static inline void time_late_reply(tok_t tok, u32 nid_checksum, u32 rcvd_ms) {
+    u32 idx = u32(tok & IDX_MASK);
+    u64 state = load_state(idx);
+    if (phase_of(state) == PH_FREE &&
+        gen_of(state) == ((tok >> GPM_IDX_BITS) & GEN_MASK) &&
+        checksum_of(state) == nid_checksum) {
+        ctl_record_gp_rtt(rcvd_ms - g_ifl_buf[idx].sent_ms);
+        st_inc(ST_gpm_r_gp_late);
+    }
+}
+
+static inline Lookup *get_lookup(const GPMStatus &cell) {
+    Lookup &lk = g_lookups[cell.lookup];
+    if (!lk.is_set || lk.gen != cell.lookup_gen) {
+        return nullptr;
+    }
+    return &lk;
+}
+
+static inline Candidate *find_candidate(Lookup &lk, u32 nid_checksum) {
+    for (u8 ix = 0; ix < lk.n_short; ix++) {
+        if (lk.shortlist[ix].pnode.nid.checksum() == nid_checksum) {
+            return &lk.shortlist[ix];
+        }
+    }
+    return nullptr;
+}
+
+static inline bool was_queried(const Lookup &lk, u32 nid_checksum) {
+    for (u8 ix = 0; ix < lk.n_queried; ix++) {
+        if (lk.queried[ix] == nid_checksum) {
+            return true;
+        }
     }
+    return false;
 }
 
-static inline void unset_cell(const KRPC &krpc) {
-    auto const &tok = *(u16 *)krpc.tok;
-    if (g_ifl_buf[tok].last_nid_checksum == krpc.nid->checksum) {
-        unset_cell(tok);
+// Puts a node on the shortlist if it is new and closer than the farthest one
+// there. Returns whether it was added.
+static bool add_candidate(Lookup &lk, const PNode &pnode, u8 this_dkad,
+                          u8 hop) {
+    if (find_candidate(lk, pnode.nid.checksum()) != nullptr ||
+        was_queried(lk, pnode.nid.checksum())) {
+        return false;
+    }
+
+    u8 pos = lk.n_short;
+    while (pos > 0 && lk.shortlist[pos - 1].dkad > this_dkad) {
+        pos--;
+    }
+    if (pos >= GPM_K) {
+        return false;
+    }
+
+    // the farthest one falls off the end if we are full
+    u8 last = (lk.n_short < GPM_K) ? lk.n_short++ : GPM_K - 1;
+    for (u8 ix = last; ix > pos; ix--) {
+        lk.shortlist[ix] = lk.shortlist[ix - 1];
     }
+    lk.shortlist[pos] = {pnode, this_dkad, hop, C_FRESH};
+    return true;
 }
 
-static inline void set_ih_status(u16 tok, const Nih &nid, const Nih &ih,
-                                 u8 hop) {
+#ifdef GPM_TRACE
+static u32 g_trace_ctr = 0;
+
+static void trace_event(const Lookup &lk, u32 lx, trace::Kind kind, u8 hop,
+                        u8 this_dkad, u8 aux, const PNode &pnode) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    GPMStatus &cell = set_cell(tok);
+    trace::Record rec = {};
+    rec.ts_us = u64(ts.tv_sec) * 1000000 + u64(ts.tv_nsec) / 1000;
+    rec.lookup = (u64(lx) << 32) | lk.gen;
+    rec.kind = kind;
+    rec.hop = hop;
+    rec.dkad = this_dkad;
+    rec.aux = aux;
+    rec.in_addr = pnode.peerinfo.in_addr;
+    rec.port = pnode.peerinfo.sin_port;
+    rec.nid = pnode.nid;
+    trace::emit(rec);
+}
 
-    cell.last_nid_checksum = nid.checksum;
-    cell.ih = ih;
-    cell.hop_ctr = hop;
+// Infohashes go where the node would for lookup start and end records.
+static inline PNode ih_node(const Nih &ih) {
+    PNode pnode = {};
+    pnode.nid = ih;
+    return pnode;
 }
 
-inline static std::pair<bool, GPMStatus &> lookup_tok(const bd::KRPC &krpc) {
-    assert(krpc.tok_len == 3);
+// The node a get_peers went to, as far as we still know it.
+static inline PNode traced_node(Lookup &lk, u32 nid_checksum) {
+    Candidate *cand = find_candidate(lk, nid_checksum);
+    if (cand != nullptr) {
+        return cand->pnode;
+    }
+    PNode pnode = {};
+    memcpy(pnode.nid.raw.data() + NIH_LEN - sizeof(u32), &nid_checksum,
+           sizeof(u32));
+    return pnode;
+}
+
+#define GPM_TRACE_EVENT(lk, lx, ...)                                           \
+    if ((lk).traced) {                                                         \
+        trace_event((lk), (lx), __VA_ARGS__);                                  \
+    }
+#else
+#define GPM_TRACE_EVENT(lk, lx, ...)
+#endif
 
-    u16 tok = *(u16 *)(krpc.tok);
-    GPMStatus &cell = g_ifl_buf[tok];
+static inline void rotate_seen() {
+    g_seen.rotate();
+    g_seen_rotated_ms = now_ms;
+    st_inc(ST_gpm_seen_rotations);
+}
 
-    if (!(cell.is_set) || cell.last_nid_checksum != krpc.nid->checksum) {
-        return {false, g_ifl_buf[0]};
+static inline void mark_seen(const Nih &ih) {
+    g_seen.add(ih);
+    if (g_seen.load() >= SEEN_MAX_LOAD) {
+        rotate_seen();
     }
+}
 
-    return {true, cell};
+static inline u32 pending_score(const Pending &pd) {
+    return __builtin_popcountll(pd.asker_bits) * PENDING_SCORE_ASKER +
+           (pd.via_ap ? PENDING_SCORE_AP : 0) +
+           (pd.hot ? PENDING_SCORE_HOT : 0);
 }
 
-// Writes up to MAX_GP_PNODES nodes to the next hop structure; could be
-// less, writes the actual number written to the structure.
-static inline void find_best_hops(NextHop &next_hop, const bd::KRPC &krpc,
-                                  const Nih &ih) {
-    u8 n_pnodes = (MAX_GP_PNODES < krpc.n_nodes) ? MAX_GP_PNODES : krpc.n_nodes;
+static inline bool pending_before(u32 px, u32 py) {
+    const Pending &x = g_pending[px];
+    const Pending &y = g_pending[py];
+    u32 sx = pending_score(x);
+    u32 sy = pending_score(y);
+    return sx > sy || (sx == sy && x.queued_ms < y.queued_ms);
+}
+
+static inline void heap_set(u32 pos, u32 px) {
+    g_pending_heap[pos] = px;
+    g_pending[px].heap_pos = pos;
+}
 
-    u8 this_dkad;
-    u8 this_ix;
-    u8 next_dkad;
-    u8 next_ix;
-    u8 best_ixes[MAX_GP_PNODES] = {0};
+static void sift_up(u32 pos) {
+    u32 px = g_pending_heap[pos];
+    while (pos > 0) {
+        u32 parent = (pos - 1) / 2;
+        if (!pending_before(px, g_pending_heap[parent])) {
+            break;
+        }
+        heap_set(pos, g_pending_heap[parent]);
+        pos = parent;
+    }
+    heap_set(pos, px);
+}
+
+static void sift_down(u32 pos) {
+    u32 px = g_pending_heap[pos];
+    u32 n = g_pending_heap.size();
+    while (true) {
+        u32 best = 2 * pos + 1;
+        if (best >= n) {
+            break;
+        }
+        if (best + 1 < n &&
+            pending_before(g_pending_heap[best + 1], g_pending_heap[best])) {
+            best++;
+        }
+        if (!pending_before(g_pending_heap[best], px)) {
+            break;
+        }
+        heap_set(pos, g_pending_heap[best]);
+        pos = best;
+    }
+    heap_set(pos, px);
+}
+
+static void remove_pending(u32 px) {
+    u32 pos = g_pending[px].heap_pos;
+    u32 last = g_pending_heap.back();
+    g_pending_heap.pop_back();
+    if (last != px) {
+        heap_set(pos, last);
+        sift_down(pos);
+        sift_up(g_pending[last].heap_pos);
+    }
+    g_pending_by_ih.erase(g_pending[px].ih);
+    g_free_pending.push_back(px);
+    st_set(ST_gpm_pending, g_pending_heap.size());
+}
+
+// Queues an infohash for pursuit, or raises its score if already queued.
+static void queue_pending(const Nih &ih, const Nih &asker, bool via_ap) {
+    // only ever called from handle_msg, on the loop thread that owns topk
+#ifdef TOPK
+    bool hot = topk::is_hot(ih);
+    if (hot) {
+        st_inc(ST_gpm_pending_hot);
+    }
+#else
+    bool hot = false;
+#endif
+
+    auto it = g_pending_by_ih.find(ih);
+    if (it != g_pending_by_ih.end()) {
+        Pending &pd = g_pending[it->second];
+        pd.asker_bits |= u64(1) << (asker.checksum() & 63);
+        pd.via_ap |= via_ap;
+        pd.hot |= hot;
+        sift_up(pd.heap_pos);
+        return;
+    }
+
+    if (g_free_pending.empty()) {
+        st_inc(ST_gpm_ih_drop_buf_overflow);
+        return;
+    }
+
+    u32 px = g_free_pending.back();
+    g_free_pending.pop_back();
+
+    Pending &pd = g_pending[px];
+    pd.ih = ih;
+    pd.queued_ms = now_ms;
+    pd.asker_bits = u64(1) << (asker.checksum() & 63);
+    pd.via_ap = via_ap;
+    pd.hot = hot;
+
+    g_pending_by_ih.insert({ih, px});
+    g_pending_heap.push_back(px);
+    sift_up(g_pending_heap.size() - 1);
+
+    st_inc(ST_gpm_pending_queued);
+    st_set(ST_gpm_pending, g_pending_heap.size());
+}
+
+// Drops queued infohashes older than GPM_PENDING_TTL_MS.
+static void sweep_pending() {
+    u32 first = g_worker * PENDING_PER_WORKER;
+    for (u32 px = first; px < first + PENDING_PER_WORKER; px++) {
+        Pending &pd = g_pending[px];
+        if (pd.heap_pos < g_pending_heap.size() &&
+            g_pending_heap[pd.heap_pos] == px &&
+            now_ms - pd.queued_ms > GPM_PENDING_TTL_MS) {
+            remove_pending(px);
+            st_inc(ST_gpm_pending_aged);
+        }
+    }
+}
+
+static void finish(u32 lx, trace::Outcome outcome) {
+    Lookup &lk = g_lookups[lx];
+    assert(lk.is_set);
+
+    st_add(ST_gpm_lookup_q_sum, lk.n_queried);
+
+    if (outcome == trace::OUT_VALUES) {
+        st_inc(ST_gpm_lookup_found);
+        mark_seen(lk.ih);
+    } else {
+        st_inc(ST_gpm_lookup_exhausted);
+    }
+
+    GPM_TRACE_EVENT(lk, lx, trace::TR_END, 0, 0, outcome, ih_node(lk.ih))
+
+    if (lk.tag != 0) {
+        g_done.push_back({lk.ih, lk.tag, outcome == trace::OUT_VALUES});
+    }
+
+    // get_peers still in flight find the generation changed and are dropped
+    lk.is_set = false;
+    lk.gen++;
+    g_free_lookups.push_back(lx);
+    st_set(ST_gpm_lookups, LOOKUPS_PER_WORKER - g_free_lookups.size());
+}
 
+// Queues get_peers to the closest unasked nodes until GPM_ALPHA are in
+// flight, and ends the lookup once there is nothing left to wait for.
+static void pump(u32 lx) {
+    Lookup &lk = g_lookups[lx];
+    bool out_of_toks = false;
+
+    for (u8 ix = 0; ix < lk.n_short && lk.n_inflight < GPM_ALPHA; ix++) {
+        if (lk.n_stalled >= GPM_ALPHA || lk.n_queried >= GPM_MAX_QUERIES) {
+            break;
+        }
+
+        Candidate &cand = lk.shortlist[ix];
+        if (cand.state != C_FRESH) {
+            continue;
+        }
+
+        auto [ok, tok] = take_tok(lx, cand);
+        if (!ok) {
+            out_of_toks = true;
+            break;
+        }
+
+        cand.state = C_QUERIED;
+        lk.queried[lk.n_queried++] = cand.pnode.nid.checksum();
+        lk.n_inflight++;
+
+        g_outbox.push_back({cand.pnode, lk.ih, tok});
+        GPM_TRACE_EVENT(lk, lx, trace::TR_SENT, cand.hop_ctr, cand.dkad, 0,
+                        cand.pnode)
+    }
+
+    if (lk.n_inflight > 0) {
+        return;
+    }
+
+    if (lk.found) {
+        finish(lx, trace::OUT_VALUES);
+    } else if (out_of_toks) {
+        finish(lx, trace::OUT_NO_TOK);
+    } else if (lk.n_queried >= GPM_MAX_QUERIES) {
+        finish(lx, trace::OUT_MAX_QUERIES);
+    } else if (lk.n_stalled >= GPM_ALPHA) {
+        finish(lx, trace::OUT_STALLED);
+    } else if (lk.n_responded == 0) {
+        finish(lx, trace::OUT_TIMEOUT);
+    } else if (lk.hit_hop_limit) {
+        finish(lx, trace::OUT_HOP_LIMIT);
+    } else {
+        finish(lx, trace::OUT_EXHAUSTED);
+    }
+}
+
+// Gives up on an unanswered get_peers this worker claimed, letting its lookup
+// move on.
+static void abandon_cell(u32 idx, u64 claimed) {
+    GPMStatus cell = g_ifl_buf[idx];
+    Lookup *lk = get_lookup(cell);
+
+    release_cell(idx, claimed);
+
+    if (lk == nullptr) {
+        return;
+    }
+
+    GPM_TRACE_EVENT(*lk, cell.lookup, trace::TR_FAILED, hop_of(claimed), 0, 0,
+                    traced_node(*lk, checksum_of(claimed)))
+
+    Candidate *cand = find_candidate(*lk, checksum_of(claimed));
+    if (cand != nullptr) {
+        cand->state = C_FAILED;
+    }
+    lk->n_inflight--;
+    pump(cell.lookup);
+}
+
+// Writes the indices of up to MAX_GP_PNODES nodes closest to the ih to
+// best_ixes, ascending by dkad, and returns their number. Nodes closer than
+// BULLSHIT_DKAD are skipped.
+static inline u8 find_best_hops(u8 best_ixes[], u8 best_dkads[],
+                                const PNode nodes[], u8 n_nodes,
+                                const Nih &ih) {
+    static_assert(bd::MAX_NODES <= 8, "dkad_nodes takes at most 8 nodes");
+
+    u8 dkads[bd::MAX_NODES];
+    dkad_nodes(ih, nodes, n_nodes, dkads);
+
+    // dkad in the high byte, so ties go to the earlier node
+    u16 keys[bd::MAX_NODES];
+    u8 n_keys = 0;
+
+    for (u8 ix = 0; ix < n_nodes; ix++) {
+        st_click_dkad(dkads[ix]);
+        if (dkads[ix] > BULLSHIT_DKAD) {
+            keys[n_keys++] = u16(dkads[ix] << 8) | ix;
+        }
+    }
+
+    std::sort(keys, keys + n_keys);
+
+    u8 n_best = std::min(n_keys, u8(MAX_GP_PNODES));
+    for (u8 ix = 0; ix < n_best; ix++) {
+        best_dkads[ix] = u8(keys[ix] >> 8);
+        best_ixes[ix] = u8(keys[ix]);
+    }
+
+    return n_best;
+}
+
+// Feeds the reply to a get_peers of this worker, whose cell it claimed, to
+// the lookup.
+static void apply_reply(u32 idx, u64 claimed, u32 rcvd_ms, bool has_values,
+                        const PNode nodes[], u8 n_nodes) {
+    GPMStatus cell = g_ifl_buf[idx];
+    u8 hop_ctr = hop_of(claimed);
+    u32 nid_checksum = checksum_of(claimed);
+
+    release_cell(idx, claimed);
+    ctl_record_gp_rtt(rcvd_ms - cell.sent_ms);
+
+    Lookup *lk = get_lookup(cell);
+    if (lk == nullptr) {
+        // the lookup ended while this was in flight
+        return;
+    }
+    lk->n_inflight--;
+    lk->n_responded++;
+
+    Candidate *cand = find_candidate(*lk, nid_checksum);
+    if (cand != nullptr) {
+        cand->state = C_RESPONDED;
+    }
+
+    if (has_values && lk->tag == 0) {
+        GPM_TRACE_EVENT(*lk, cell.lookup, trace::TR_REPLY, hop_ctr, 0,
+                        u8(n_nodes | 0x80), traced_node(*lk, nid_checksum))
+        finish(cell.lookup, trace::OUT_VALUES);
+        return;
+    }
+    // targeted lookups go on to collect peers from the other close nodes
+    lk->found |= has_values;
+
+    bool closer = false;
+
+    u8 best_ixes[MAX_GP_PNODES];
     u8 best_dkads[MAX_GP_PNODES];
-    std::fill(std::begin(best_dkads), std::end(best_dkads), 160);
+    u8 n_best = find_best_hops(best_ixes, best_dkads, nodes, n_nodes, lk->ih);
+
+    GPM_TRACE_EVENT(*lk, cell.lookup, trace::TR_REPLY, hop_ctr,
+                    n_best > 0 ? best_dkads[0] : 0,
+                    u8(n_nodes | (has_values ? 0x80 : 0)),
+                    traced_node(*lk, nid_checksum))
+
+    if (n_best > 0 && hop_ctr >= GP_MAX_HOPS) {
+        st_inc(ST_gpm_ih_drop_too_many_hops);
+        lk->hit_hop_limit = true;
+        n_best = 0;
+    }
 
-    bool displace = false;
+    for (u8 ix = 0; ix < n_best; ix++) {
+        if (add_candidate(*lk, nodes[best_ixes[ix]], best_dkads[ix],
+                          hop_ctr + 1) &&
+            best_dkads[ix] < lk->best_dkad) {
+            lk->best_dkad = best_dkads[ix];
+            closer = true;
+        }
+    }
 
-    for (u8 ix = 0; ix < krpc.n_nodes; ix += 1) {
-        this_dkad = dkad(ih, krpc.nodes[ix].nid);
-        st_click_dkad(this_dkad);
+    lk->n_stalled = closer ? 0 : lk->n_stalled + 1;
 
-        this_ix = ix;
-        for (u8 jx = 0; jx < MAX_GP_PNODES; jx++) {
-            if ((this_dkad < best_dkads[jx]) && (this_dkad > BULLSHIT_DKAD)) {
-                displace = true;
-            }
-            if (displace) {
-                next_dkad = best_dkads[jx];
-                next_ix = best_ixes[jx];
-                best_dkads[jx] = this_dkad;
-                best_ixes[jx] = this_ix;
-                this_ix = next_ix;
-                this_dkad = next_dkad;
+    pump(cell.lookup);
+}
+
+#ifdef GPM_CONCURRENT
+// Passes an r_gp for another worker's get_peers on to that worker. If its
+// ring is full the reply is lost, and the get_peers is left to time out.
+static void hand_off(const bd::KRPC &krpc, tok_t tok, u64 claimed, bool late) {
+    u32 idx = u32(tok & IDX_MASK);
+
+    Handoff ho;
+    ho.tok = tok;
+    ho.nid_checksum = krpc.nid->checksum();
+    ho.rcvd_ms = u32(now_ms);
+    ho.n_nodes = krpc.n_nodes;
+    ho.has_values = krpc.n_peers > 0;
+    ho.late = late;
+    std::copy(krpc.nodes, krpc.nodes + krpc.n_nodes, ho.nodes.begin());
+
+    if (g_handoffs[g_worker * g_n_workers + owner_of(idx)].push(ho)) {
+        st_inc(ST_gpm_handoffs);
+        return;
+    }
+
+    st_inc(ST_gpm_handoff_dropped);
+    if (!late) {
+        // we still hold the claim, so nobody else can have moved the cell
+        store_state(idx, with_phase(claimed, PH_ARMED));
+    }
+}
+
+// Takes up the r_gp other workers handed to this one.
+static void drain_handoffs() {
+    Handoff ho;
+    for (u32 from = 0; from < g_n_workers; from++) {
+        if (from == g_worker) {
+            continue;
+        }
+        auto &ring = g_handoffs[from * g_n_workers + g_worker];
+        while (ring.pop(ho)) {
+            u32 idx = u32(ho.tok & IDX_MASK);
+            if (ho.late) {
+                time_late_reply(ho.tok, ho.nid_checksum, ho.rcvd_ms);
+            } else {
+                apply_reply(idx, load_state(idx), ho.rcvd_ms, ho.has_values,
+                            ho.nodes.data(), ho.n_nodes);
             }
         }
-        displace = false;
     }
+}
+#endif
 
-    for (int dx = 0; dx < n_pnodes; dx++) {
-        next_hop.pnodes.push_back(krpc.nodes[best_ixes[dx]]);
+// Makes the calling thread the given worker and hands it its share of the
+// tables.
+static void setup_worker(u32 worker) {
+    assert(worker < N_WORKERS);
+    UPDATE_NOW_MS()
+    g_worker = worker;
+
+    u32 first_idx = worker * BINS_PER_WORKER;
+    for (u32 idx = first_idx; idx < first_idx + BINS_PER_WORKER; idx++) {
+        push_free(idx);
     }
+
+    g_free_lookups.reserve(LOOKUPS_PER_WORKER);
+    u32 first_lx = worker * LOOKUPS_PER_WORKER;
+    for (u32 lx = first_lx + LOOKUPS_PER_WORKER; lx > first_lx; lx--) {
+        g_free_lookups.push_back(lx - 1);
+    }
+    g_outbox.reserve(GPM_ALPHA * 4);
+    g_done.reserve(16);
+    g_seen_rotated_ms = now_ms;
+
+    g_free_pending.reserve(PENDING_PER_WORKER);
+    u32 first_px = worker * PENDING_PER_WORKER;
+    for (u32 px = first_px + PENDING_PER_WORKER; px > first_px; px--) {
+        g_free_pending.push_back(px - 1);
+    }
+    g_pending_heap.reserve(PENDING_PER_WORKER);
+    g_pending_by_ih.reserve(PENDING_PER_WORKER);
+    g_pending_swept_ms = now_ms;
 }
 
 //
 // PUBLIC FUNCTIONS
 //
 
-std::pair<bool, u16> take_tok() {
+void init(u32 n_workers) {
+    assert(n_workers >= 1 && n_workers <= N_WORKERS);
+#ifdef GPM_CONCURRENT
+    g_n_workers = n_workers;
+    if (n_workers > 1) {
+        g_handoffs = std::vector<SpscRing<Handoff, GPM_HANDOFF_LOG2>>(
+            n_workers * n_workers);
+    }
+#endif
+    setup_worker(0);
 
+#ifdef GPM_TRACE
+    trace::start();
+#endif
+}
+
+#ifdef GPM_CONCURRENT
+void init_worker(u32 worker) {
+    assert(worker > 0 && worker < g_n_workers);
+    setup_worker(worker);
+}
+#endif
+
+bool decide_pursue_q_gp_ih(const bd::KRPC &rcvd) {
+    // TODO connect to db and do actual business logic checks
+
+    if (g_seen.contains(*rcvd.ih)) {
+        st_inc(ST_ih_pursue_reject);
+        return false;
+    }
+    st_inc(ST_ih_pursue_accept);
+
+    if (g_free_lookups.empty()) {
+        UPDATE_NOW_MS()
+        queue_pending(*rcvd.ih, *rcvd.nid, false);
+        return false;
+    }
+    return true;
+}
+
+void note_q_ap_ih(const bd::KRPC &rcvd) {
+    if (g_seen.contains(*rcvd.ih)) {
+        st_inc(ST_gpm_pending_seen);
+        return;
+    }
     UPDATE_NOW_MS()
+    queue_pending(*rcvd.ih, *rcvd.nid, true);
+}
 
-    u16 tok = randint(0, 1 << 16);
+bool pop_pending(Nih &ih) {
+    if (g_free_lookups.empty()) {
+        return false;
+    }
 
-    for (auto &cell : g_ifl_buf) {
+    // an infohash may have been pursued since it was queued
+    while (!g_pending_heap.empty()) {
+        u32 px = g_pending_heap[0];
+        ih = g_pending[px].ih;
+        remove_pending(px);
 
-        if (!cell.is_set) {
-            return {true, tok};
+        if (!g_seen.contains(ih)) {
+            st_inc(ST_gpm_pending_admitted);
+            return true;
         }
+        st_inc(ST_gpm_pending_seen);
+    }
+    return false;
+}
 
-        if (cell.is_set && now_ms - cell.last_reponse_ms > CTL_GPM_TIMEOUT_MS) {
-            unset_cell(tok);
-            return {true, tok};
-        }
+bool start_lookup(const Nih &ih, const PNode seeds[], u8 n_seeds, u32 tag) {
+    UPDATE_NOW_MS()
 
-        tok++;
+    if (g_free_lookups.empty()) {
+        st_inc(ST_gpm_ih_drop_buf_overflow);
+        return false;
     }
 
-    st_inc(ST_gpm_ih_drop_buf_overflow);
-    return {false, 0};
-}
+    auto it = g_pending_by_ih.find(ih);
+    if (it != g_pending_by_ih.end()) {
+        remove_pending(it->second);
+    }
 
-std::pair<bool, u16> decide_pursue_q_gp_ih(const bd::KRPC &rcvd) {
-    // TODO connect to db and do actual business logic checks
+    u32 lx = g_free_lookups.back();
+    g_free_lookups.pop_back();
+    st_set(ST_gpm_lookups, LOOKUPS_PER_WORKER - g_free_lookups.size());
 
-    auto [ok, tok] = take_tok();
-    if (ok) {
-        return {true, tok};
-    } else {
-        return {false, 0};
+    Lookup &lk = g_lookups[lx];
+    lk.ih = ih;
+    lk.n_short = 0;
+    lk.n_queried = 0;
+    lk.n_inflight = 0;
+    lk.n_responded = 0;
+    lk.n_stalled = 0;
+    lk.best_dkad = 160;
+    lk.tag = tag;
+    lk.found = false;
+    lk.hit_hop_limit = false;
+    lk.is_set = true;
+#ifdef GPM_TRACE
+    lk.traced = (g_trace_ctr++ % GPM_TRACE_SAMPLE) == 0;
+#else
+    lk.traced = false;
+#endif
+    GPM_TRACE_EVENT(lk, lx, trace::TR_START, 0, 0, n_seeds, ih_node(ih))
+
+    mark_seen(ih);
+
+    for (u8 ix = 0; ix < n_seeds; ix++) {
+        u8 this_dkad = dkad(ih, seeds[ix].nid);
+        add_candidate(lk, seeds[ix], this_dkad, 0);
+        lk.best_dkad = std::min(lk.best_dkad, this_dkad);
     }
+
+    st_inc(ST_gpm_ih_inserted);
+    pump(lx);
+    return true;
 }
 
-void register_q_gp_ihash(const Nih &nid, const Nih &ih, u8 hop, u16 tok) {
-    if (hop > GP_MAX_HOPS) {
-        st_inc(ST_gpm_ih_drop_too_many_hops);
+void handle_r_gp(const bd::KRPC &krpc) {
+    UPDATE_NOW_MS()
+#ifdef GPM_CONCURRENT
+    drain_handoffs();
+#endif
+
+    tok_t tok = read_tok(krpc);
+    u32 idx = u32(tok & IDX_MASK);
+
+    auto [ok, claimed] = claim_reply(krpc, tok);
+    if (!ok) {
+        st_inc(ST_gpm_r_gp_lookup_failed);
+#ifdef GPM_CONCURRENT
+        if (owner_of(idx) != g_worker) {
+            u64 state = load_state(idx);
+            // the cells of workers that never ran look free too
+            if (owner_of(idx) < g_n_workers && phase_of(state) == PH_FREE &&
+                gen_of(state) == ((tok >> GPM_IDX_BITS) & GEN_MASK) &&
+                checksum_of(state) == krpc.nid->checksum()) {
+                hand_off(krpc, tok, state, true);
+            }
+            return;
+        }
+#endif
+        time_late_reply(tok, krpc.nid->checksum(), u32(now_ms));
         return;
     }
-    set_ih_status(tok, nid, ih, hop);
-    st_inc(ST_gpm_ih_inserted);
-};
 
-bool extract_tok(NextHop &next_hop, const bd::KRPC &krpc) {
+#ifdef GPM_CONCURRENT
+    if (owner_of(idx) != g_worker) {
+        hand_off(krpc, tok, claimed, false);
+        return;
+    }
+#endif
+    apply_reply(idx, claimed, u32(now_ms), krpc.n_peers > 0, krpc.nodes,
+                krpc.n_nodes);
+}
 
-    assert(krpc.n_nodes > 0);
+u32 n_free_lookups() {
+    return g_free_lookups.size();
+}
 
-    auto [ok, cell] = lookup_tok(krpc);
+bool pop_query(Query &out) {
+    if (g_outbox.empty()) {
+        return false;
+    }
+    out = g_outbox.back();
+    g_outbox.pop_back();
+    return true;
+}
 
-    if (!ok) {
-        st_inc(ST_gpm_r_gp_lookup_failed);
+bool pop_done(Done &out) {
+    if (g_done.empty()) {
         return false;
     }
+    out = g_done.back();
+    g_done.pop_back();
+    return true;
+}
 
-    next_hop.ih = cell.ih;
-    find_best_hops(next_hop, krpc, cell.ih);
-    next_hop.hop_ctr = cell.hop_ctr;
+void fail_query(tok_t tok) {
+    u32 idx = u32(tok & IDX_MASK);
+    assert(owner_of(idx) == g_worker);
 
-    unset_cell(krpc);
-    return true;
-};
+    auto [armed, state] = armed_state(tok);
+    if (!armed) {
+        return;
+    }
+    auto [ok, claimed] = claim_cell(idx, state);
+    if (ok) {
+        abandon_cell(idx, claimed);
+    }
+}
 
-void clear_tok(const bd::KRPC &krpc) {
-    unset_cell(krpc);
+void tick() {
+    UPDATE_NOW_MS()
+#ifdef GPM_CONCURRENT
+    drain_handoffs();
+#endif
+
+    if (now_ms - g_seen_rotated_ms >= GPM_SEEN_WINDOW_S * 1000) {
+        rotate_seen();
+    }
+
+    if (now_ms - g_pending_swept_ms >= 1000) {
+        sweep_pending();
+        g_pending_swept_ms = now_ms;
+    }
+    g_expiry.advance(now_ms, UINT32_MAX, [](u32 local_idx) {
+        u32 idx = g_worker * BINS_PER_WORKER + local_idx;
+        u64 state = load_state(idx);
+        if (phase_of(state) == PH_ARMED) {
+            auto [ok, claimed] = claim_cell(idx, state);
+            if (ok) {
+                st_inc(ST_gpm_tok_expired);
+                abandon_cell(idx, claimed);
+                return;
+            }
+        }
+        // another worker claimed it for a reply that is on its way here; if
+        // the reply gets lost, the cell is armed again and times out later
+        g_expiry.schedule(local_idx, now_ms + GPM_TICK_MS);
+    });
 }
 
 i32 get_tok_hops(const bd::KRPC &krpc) {
-    auto [ok, cell] = lookup_tok(krpc);
-    if (ok) {
-        return cell.hop_ctr;
+    auto [ok, state] = armed_state(read_tok(krpc));
+    if (ok && checksum_of(state) == krpc.nid->checksum()) {
+        return hop_of(state);
     }
     return -1;
 }
+
+bool get_tok_lookup(const bd::KRPC &krpc, Nih &ih, u32 &tag) {
+    tok_t tok = read_tok(krpc);
+    u32 idx = u32(tok & IDX_MASK);
+    // the lookup is only ours to read if the tok is
+    if (owner_of(idx) != g_worker) {
+        return false;
+    }
+
+    auto [ok, state] = armed_state(tok);
+    if (!ok || checksum_of(state) != krpc.nid->checksum()) {
+        return false;
+    }
+
+    Lookup *lk = get_lookup(g_ifl_buf[idx]);
+    if (lk == nullptr) {
+        return false;
+    }
+    ih = lk->ih;
+    tag = lk->tag;
+    return true;
+}
 } // namespace cht::gpm
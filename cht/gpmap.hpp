@@ -14,7 +14,7 @@ namespace cht::gpm {
 
 // The GetPeersManager engine
 
-// number of nodes to pursue from each get_peers nodes array
+// number of nodes considered from each get_peers nodes array
 #ifndef MAX_GP_PNODES
 #define MAX_GP_PNODES 8
 #endif
@@ -26,49 +26,155 @@ namespace cht::gpm {
 #ifndef GP_MAX_HOPS
 #define GP_MAX_HOPS 8
 #endif
+// log2 of the number of get_peers that can be in flight at once; must fit in
+// the GP_TOK_LEN - 1 non-marker bytes of the tok
+#ifndef GPM_IDX_BITS
+#define GPM_IDX_BITS 16
+#endif
+
+// size of the closest-nodes shortlist kept per lookup
+#ifndef GPM_K
+#define GPM_K 8
+#endif
+// get_peers in flight at once per lookup
+#ifndef GPM_ALPHA
+#define GPM_ALPHA 3
+#endif
+// cap on the get_peers sent over the whole lookup
+#ifndef GPM_MAX_QUERIES
+#define GPM_MAX_QUERIES 32
+#endif
+// log2 of the number of lookups that can run at once
+#ifndef GPM_LOOKUP_BITS
+#define GPM_LOOKUP_BITS 14
+#endif
+// infohashes pursued or resolved are not pursued again for one to two windows
+#ifndef GPM_SEEN_WINDOW_S
+#define GPM_SEEN_WINDOW_S 300
+#endif
+// log2 of the number of 64-byte blocks in each of the two filters that
+// remember them
+#ifndef GPM_SEEN_LOG2_BLOCKS
+#define GPM_SEEN_LOG2_BLOCKS 14
+#endif
+// infohashes waiting for a free lookup, best first
+#ifndef GPM_PENDING_MAX
+#define GPM_PENDING_MAX 4096
+#endif
+// ... for at most this long
+#ifndef GPM_PENDING_TTL_MS
+#define GPM_PENDING_TTL_MS 30000
+#endif
+// how often timed out get_peers are collected
+#ifndef GPM_TICK_MS
+#define GPM_TICK_MS 50
+#endif
+
+// With GPM_CONCURRENT, the GPM is run by up to 2 ** GPM_WORKER_BITS worker
+// threads. Each worker owns an equal share of the toks, lookups and pending
+// slots, and runs its own lookups; an r_gp may be handled by any worker.
+#ifndef GPM_WORKER_BITS
+#ifdef GPM_CONCURRENT
+#define GPM_WORKER_BITS 4
+#else
+#define GPM_WORKER_BITS 0
+#endif
+#endif
+// log2 of the r_gp one worker can have waiting for another
+#ifndef GPM_HANDOFF_LOG2
+#define GPM_HANDOFF_LOG2 8
+#endif
+
+static_assert(GPM_ALPHA <= GPM_K);
+static_assert(GPM_MAX_QUERIES < 256);
+#ifndef GPM_CONCURRENT
+static_assert(GPM_WORKER_BITS == 0, "Workers need GPM_CONCURRENT");
+#endif
+static_assert(GPM_WORKER_BITS <= GPM_LOOKUP_BITS &&
+              GPM_WORKER_BITS <= GPM_IDX_BITS);
+static_assert(GPM_PENDING_MAX % (1 << GPM_WORKER_BITS) == 0);
 
-struct NextHop {
+// our get_peers t, without the OUR_TOK_GP marker byte
+using tok_t = u64;
+
+// A get_peers the GPM wants sent.
+struct Query {
+    PNode dest;
     Nih ih;
-    std::vector<PNode> pnodes;
-    u8 hop_ctr = 0; // the hop number of the previous get peers call
+    tok_t tok;
+};
 
-    NextHop() {
-        pnodes.reserve(MAX_GP_PNODES);
-    };
+// A targeted lookup that ended.
+struct Done {
+    Nih ih;
+    u32 tag;
+    bool found;
 };
 
-// Reserves a vacant token.
-std::pair<bool, u16> take_tok();
-
-// Check whether a q_gp_ih should be pursued.
-// If this function returns true, a gpm_register_q_gp_ihash call is expected.
-// With the address of the first hop node.
-// If the ih should be pursued, the token to use is written to the first
-// argument.
-// NOTE: This function does not reserve the tok in any way, or make any
-// guarantees that the tok slot it has found will not be clobbered before it is
-// actuall reserved using the register functions. Thus, this is not
-// concurrency-safe, even in a single threaded mode. Register must be called in
-// the same contiguous block of execution!
-std::pair<bool, u16> decide_pursue_q_gp_ih(const bd::KRPC &);
-
-// Register the receipt of a q_gp infohash. Due to cache pressure or other
-// control parameters, this might silently drop the infohash - this is the
-// GPM's concern. Subsequent calls to gpm_extract_tok will return / nothing if
-// this happens.
-void register_q_gp_ihash(const Nih &nid, const Nih &ih, u8 hop, u16 tok);
-
-// Handles an r_gp message, finding the info hash it is associated with.
-// If the info hash should be pursued, returns true and fills out the passed
-// gpm_ih_status_t structure with the information of the next hop. Otherwise,
-// returns false.
-// This function deletes the entry if one is found.
-bool extract_tok(NextHop &, const bd::KRPC &);
-
-// Simply clears any cells for the given tok if they are still associated with
-// the same nid.
-void clear_tok(const bd::KRPC &);
+// Sets up the GPM for the given number of workers, at most
+// 2 ** GPM_WORKER_BITS, and makes the calling thread worker 0.
+void init(u32 n_workers = 1);
+
+#ifdef GPM_CONCURRENT
+// Makes the calling thread the given worker, which must not be 0. To be
+// called once from each other worker thread, after init. All other functions
+// act on the calling worker's share.
+void init_worker(u32 worker);
+#endif
+
+// Check whether a q_gp_ih should be pursued. Infohashes pursued within the
+// last GPM_SEEN_WINDOW_S or so are not. If there is no lookup free for it, the
+// infohash is queued to be handed out by pop_pending later.
+// If this function returns true, a start_lookup call is expected.
+bool decide_pursue_q_gp_ih(const bd::KRPC &);
+
+// Queues the infohash of a q_ap for pursuit, unless it was recently pursued.
+// Announced infohashes go ahead of those that were only asked for.
+void note_q_ap_ih(const bd::KRPC &);
+
+// Takes the best queued infohash, if a lookup is free for it. Infohashes
+// pursued since they were queued are dropped.
+// If this function returns true, a start_lookup call is expected.
+bool pop_pending(Nih &);
 
+// Starts an iterative lookup for the ih from the given contacts, which should
+// be the closest we know. Returns false if the lookup could not be started.
+// The first get_peers are queued for pop_query.
+// A nonzero tag makes it a targeted lookup, which is not ended by the first
+// values but goes on asking the closest nodes for more; its end is reported
+// through pop_done.
+bool start_lookup(const Nih &ih, const PNode seeds[], u8 n_seeds,
+                  u32 tag = 0);
+
+// The number of lookups that could be started right now.
+u32 n_free_lookups();
+
+// Feeds an r_gp to the lookup its tok belongs to. Values end the lookup;
+// nodes closer than any seen so far go on its shortlist. Any get_peers this
+// frees up are queued for pop_query. An r_gp for another worker's lookup is
+// handed to that worker, which takes it up on its next tick or r_gp.
+void handle_r_gp(const bd::KRPC &);
+
+// Takes the next queued get_peers to send, if any.
+bool pop_query(Query &);
+
+// Takes the next targeted lookup that ended, if any.
+bool pop_done(Done &);
+
+// Reports that a popped get_peers was not sent after all. This may queue a
+// replacement.
+void fail_query(tok_t);
+
+// Times out unanswered get_peers, queueing replacements. To be called every
+// GPM_TICK_MS.
+void tick();
+
+// The number of hops from our rt to the node that sent this r_gp, or -1 if
+// the tok is not ours anymore.
 i32 get_tok_hops(const bd::KRPC &);
 
+// Finds the lookup this r_gp belongs to, writing its ih and tag, which is 0
+// unless it is targeted. Returns false if the tok is not ours anymore.
+bool get_tok_lookup(const bd::KRPC &, Nih &ih, u32 &tag);
+
 } // namespace cht::gpm
@@ -0,0 +1,297 @@
+#include "hll.hpp"
+#include "log.hpp"
+#include "oa.hpp"
+#include "stat.hpp"
+
+#include <cmath>
+#include <vector>
+
+#include <sys/random.h>
+
+using namespace cht;
+namespace cht::hll {
+
+#ifdef HLL
+
+constexpr u32 N_REGS = 1 << HLL_LOG2_REGS;
+constexpr u32 N_SLOTS = 1 << HLL_LOG2_SLOTS;
+constexpr u32 SLOT_MASK = N_SLOTS - 1;
+constexpr u32 MAX_LOAD = N_SLOTS / 8 * 7;
+constexpr u32 NIL = UINT32_MAX;
+
+struct Sketch {
+    // (register << 6) | value for every register set so far, while sparse
+    std::vector<u16> sparse;
+    // all registers, once dense
+    std::vector<u8> dense;
+    // sum of 2 ** -value over all registers, and registers still zero, so
+    // estimating needs no pass over the registers
+    double inv_sum;
+    u32 n_zeros;
+};
+
+struct Entry {
+    Nih ih;
+    // recency list, most recently updated first
+    u32 prev;
+    u32 next;
+    Sketch peers;
+    Sketch askers;
+};
+
+// The table and a pool that grows to MAX_LOAD entries, reserved up front. The
+// pool never shrinks, so this is counted whole and the sketches get the rest
+// of HLL_MAX_BYTES.
+constexpr u64 FIXED_BYTES =
+    u64(N_SLOTS) * sizeof(u32) + u64(MAX_LOAD) * sizeof(Entry);
+static_assert(FIXED_BYTES <= HLL_MAX_BYTES / 2,
+              "HLL_LOG2_SLOTS is too large for HLL_MAX_BYTES");
+constexpr u64 SKETCH_BUDGET = HLL_MAX_BYTES - FIXED_BYTES;
+
+// Entries live in a pool so their indices stay put. The table maps
+// infohashes to them by open addressing; a slot holds pool index + 1, or 0.
+static std::vector<Entry> g_pool;
+static std::vector<u32> g_free;
+static std::vector<u32> g_slots;
+static u32 g_head = NIL;
+static u32 g_tail = NIL;
+static u32 g_n_entries = 0;
+static u64 g_seed;
+
+// heap bytes of all sketches
+static u64 g_sketch_bytes = 0;
+static u32 g_n_dense = 0;
+// largest estimates reached since the last report
+static u32 g_max_peers = 0;
+static u32 g_max_askers = 0;
+
+static inline u32 home_of(const Nih &ih) {
+    return u32(oa::hash_ih(ih, g_seed) >> (64 - HLL_LOG2_SLOTS));
+}
+
+static inline bool is_set(u32 pos) {
+    return g_slots[pos] != 0;
+}
+
+// 64 bit finalizer from murmur3, to spread peer addresses over registers
+static inline u64 mix(u64 x) {
+    x ^= g_seed;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline u64 heap_bytes(const Sketch &sk) {
+    return sk.sparse.capacity() * sizeof(u16) + sk.dense.capacity();
+}
+
+static void reset(Sketch &sk) {
+    g_sketch_bytes -= heap_bytes(sk);
+    g_n_dense -= !sk.dense.empty();
+    std::vector<u16>().swap(sk.sparse);
+    std::vector<u8>().swap(sk.dense);
+    sk.inv_sum = N_REGS;
+    sk.n_zeros = N_REGS;
+}
+
+// Raises a register to val if it's lower, keeping inv_sum and n_zeros.
+static inline void raise(Sketch &sk, u32 old_val, u32 val) {
+    sk.inv_sum += std::ldexp(1.0, -int(val)) - std::ldexp(1.0, -int(old_val));
+    sk.n_zeros -= old_val == 0;
+}
+
+static void densify(Sketch &sk) {
+    sk.dense.assign(N_REGS, 0);
+    for (u16 packed : sk.sparse) {
+        sk.dense[packed >> 6] = packed & 63;
+    }
+    std::vector<u16>().swap(sk.sparse);
+    g_n_dense++;
+}
+
+static void add_hash(Sketch &sk, u64 h) {
+    u32 reg = u32(h >> (64 - HLL_LOG2_REGS));
+    // rank of the first set bit in the rest, the hash has no more bits
+    // than that so it's at most 65 - HLL_LOG2_REGS
+    u64 rest = h << HLL_LOG2_REGS;
+    u32 val = rest == 0 ? 65 - HLL_LOG2_REGS : __builtin_clzll(rest) + 1;
+
+    u64 bytes_before = heap_bytes(sk);
+
+    if (sk.dense.empty()) {
+        bool found = false;
+        for (u16 &packed : sk.sparse) {
+            if (u32(packed >> 6) != reg) {
+                continue;
+            }
+            found = true;
+            if ((packed & 63) < val) {
+                raise(sk, packed & 63, val);
+                packed = u16((reg << 6) | val);
+            }
+            break;
+        }
+        if (!found) {
+            raise(sk, 0, val);
+            if (sk.sparse.size() < HLL_SPARSE_MAX) {
+                sk.sparse.push_back(u16((reg << 6) | val));
+            } else {
+                densify(sk);
+                sk.dense[reg] = val;
+            }
+        }
+    } else if (sk.dense[reg] < val) {
+        raise(sk, sk.dense[reg], val);
+        sk.dense[reg] = val;
+    }
+
+    g_sketch_bytes += heap_bytes(sk) - bytes_before;
+}
+
+static u32 estimate(const Sketch &sk) {
+    constexpr double m = N_REGS;
+    constexpr double alpha = 0.7213 / (1 + 1.079 / m);
+
+    double est = alpha * m * m / sk.inv_sum;
+    // small range correction, by linear counting
+    if (est <= 2.5 * m && sk.n_zeros > 0) {
+        est = m * std::log(m / sk.n_zeros);
+    }
+    return u32(std::min(est, double(UINT32_MAX)));
+}
+
+// The slot holding the pool index of the ih, or the empty slot it would go
+// in.
+static std::pair<bool, u32> find(const Nih &ih) {
+    // the load cap guarantees an empty slot
+    return oa::find(home_of(ih), SLOT_MASK, is_set, [&](u32 pos) {
+        return memcmp(g_pool[g_slots[pos] - 1].ih.raw.data(), ih.raw.data(),
+                      NIH_LEN) == 0;
+    });
+}
+
+static void unlink_entry(u32 ix) {
+    Entry &entry = g_pool[ix];
+    (entry.prev != NIL ? g_pool[entry.prev].next : g_head) = entry.next;
+    (entry.next != NIL ? g_pool[entry.next].prev : g_tail) = entry.prev;
+}
+
+static void push_front(u32 ix) {
+    Entry &entry = g_pool[ix];
+    entry.prev = NIL;
+    entry.next = g_head;
+    (g_head != NIL ? g_pool[g_head].prev : g_tail) = ix;
+    g_head = ix;
+}
+
+static void remove_slot(u32 pos) {
+    oa::erase(
+        pos, SLOT_MASK, is_set,
+        [](u32 ix) { return home_of(g_pool[g_slots[ix] - 1].ih); },
+        [](u32 from, u32 to) { g_slots[to] = g_slots[from]; },
+        [](u32 ix) { g_slots[ix] = 0; });
+}
+
+static void evict_tail() {
+    u32 ix = g_tail;
+    Entry &entry = g_pool[ix];
+
+    remove_slot(find(entry.ih).second);
+    unlink_entry(ix);
+    reset(entry.peers);
+    reset(entry.askers);
+    g_free.push_back(ix);
+    g_n_entries--;
+
+    st_inc(ST_hll_evicted);
+}
+
+// The entry of the ih, made most recently used, and created if needed.
+static Entry &touch(const Nih &ih) {
+    auto [found, pos] = find(ih);
+
+    if (found) {
+        u32 ix = g_slots[pos] - 1;
+        if (ix != g_head) {
+            unlink_entry(ix);
+            push_front(ix);
+        }
+        return g_pool[ix];
+    }
+
+    if (g_n_entries >= MAX_LOAD) {
+        evict_tail();
+        pos = find(ih).second;
+    }
+
+    u32 ix;
+    if (!g_free.empty()) {
+        ix = g_free.back();
+        g_free.pop_back();
+    } else {
+        ix = g_pool.size();
+        g_pool.emplace_back();
+        reset(g_pool[ix].peers);
+        reset(g_pool[ix].askers);
+    }
+
+    g_pool[ix].ih = ih;
+    g_slots[pos] = ix + 1;
+    push_front(ix);
+    g_n_entries++;
+    return g_pool[ix];
+}
+
+// Drops the least recently used entries until the sketches fit their budget
+// again, keeping at least the one just updated.
+static void enforce_cap() {
+    while (g_sketch_bytes > SKETCH_BUDGET && g_n_entries > 1) {
+        evict_tail();
+    }
+}
+
+void init() {
+    getrandom(&g_seed, sizeof(g_seed), 0);
+    g_slots.assign(N_SLOTS, 0);
+    g_pool.reserve(MAX_LOAD);
+}
+
+void add_peer(const Nih &ih, const Peerinfo &peer) {
+    Entry &entry = touch(ih);
+    add_hash(entry.peers, mix((u64(peer.in_addr) << 16) | peer.sin_port));
+    g_max_peers = std::max(g_max_peers, estimate(entry.peers));
+    enforce_cap();
+}
+
+void add_asker(const Nih &ih, u32 in_addr) {
+    Entry &entry = touch(ih);
+    add_hash(entry.askers, mix(in_addr));
+    g_max_askers = std::max(g_max_askers, estimate(entry.askers));
+    enforce_cap();
+}
+
+Estimate estimate(const Nih &ih) {
+    auto [found, pos] = find(ih);
+    if (!found) {
+        return {0, 0};
+    }
+    const Entry &entry = g_pool[g_slots[pos] - 1];
+    return {estimate(entry.peers), estimate(entry.askers)};
+}
+
+void report() {
+    st_set(ST_hll_ihs, g_n_entries);
+    st_set(ST_hll_dense, g_n_dense);
+    st_set(ST_hll_mem_bytes, FIXED_BYTES + g_sketch_bytes);
+    st_set(ST_hll_max_peers, g_max_peers);
+    st_set(ST_hll_max_askers, g_max_askers);
+    g_max_peers = 0;
+    g_max_askers = 0;
+}
+
+#endif // HLL
+
+} // namespace cht::hll
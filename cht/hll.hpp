@@ -0,0 +1,61 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht::hll {
+
+// Distinct peer and asker estimates per infohash, enabled with HLL. Every
+// tracked infohash has two HyperLogLog sketches of 2 ** HLL_LOG2_REGS
+// registers: one of the peers announcing it or returned for it in r_gp
+// values, one of the addresses asking for it with q_gp.
+//
+// A sketch starts sparse, as a list of its set registers, and turns dense
+// once that list would pass HLL_SPARSE_MAX. The table and its entries are
+// sized up front from HLL_LOG2_SLOTS, and the sketches get what's left of
+// HLL_MAX_BYTES; past that the least recently updated infohashes are dropped.
+// Only the loop thread may use this.
+
+#ifndef HLL_LOG2_REGS
+#define HLL_LOG2_REGS 10
+#endif
+#ifndef HLL_SPARSE_MAX
+#define HLL_SPARSE_MAX 128
+#endif
+#ifndef HLL_MAX_BYTES
+#define HLL_MAX_BYTES (64 << 20)
+#endif
+// log2 of the slots of the infohash table, which is kept at most 7/8 full.
+// The table and its entries may take at most half of HLL_MAX_BYTES.
+#ifndef HLL_LOG2_SLOTS
+#define HLL_LOG2_SLOTS 17
+#endif
+
+// sparse entries pack the register number above a 6 bit value
+static_assert(HLL_LOG2_REGS >= 4 && HLL_LOG2_REGS <= 10);
+static_assert(HLL_SPARSE_MAX * sizeof(u16) < (1 << HLL_LOG2_REGS));
+
+struct Estimate {
+    u32 peers;
+    u32 askers;
+};
+
+#ifdef HLL
+void init();
+
+// Counts a peer announcing the infohash or returned for it.
+void add_peer(const Nih &ih, const Peerinfo &peer);
+
+// Counts an address asking for the infohash.
+void add_asker(const Nih &ih, u32 in_addr);
+
+// The estimates for an infohash, zero if it's not tracked. Does not count as
+// a use for eviction.
+Estimate estimate(const Nih &ih);
+
+// Updates the gauges.
+void report();
+#endif
+
+} // namespace cht::hll
@@ -0,0 +1,518 @@
+#include "ihidx.hpp"
+#include "log.hpp"
+#include "stat.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace cht;
+namespace cht::ihidx {
+
+static constexpr u32 SLOT_WORDS = sizeof(Slot) / sizeof(u32);
+static_assert(SLOT_WORDS * sizeof(u32) == sizeof(Slot));
+
+static inline u64 table_size(u32 log2_slots) {
+    return HEADER_SIZE + (sizeof(Slot) << log2_slots);
+}
+
+static inline bool same_ih(const Nih &x, const Nih &y) {
+    // Nih == only compares checksums
+    return memcmp(x.raw.data(), y.raw.data(), NIH_LEN) == 0;
+}
+
+// Consistent copy of a slot, the seq word included. Fails only if it stays
+// torn for IHIDX_READ_RETRIES attempts.
+static bool load_slot(const Slot &slot, Slot &out) {
+    const u32 *words = reinterpret_cast<const u32 *>(&slot);
+    u32 buf[SLOT_WORDS];
+
+    for (int tries = 0; tries < IHIDX_READ_RETRIES; tries++) {
+        u32 seq = __atomic_load_n(words, __ATOMIC_ACQUIRE);
+        // the writer is in the middle of this slot
+        if (seq & 1) {
+            continue;
+        }
+        for (u32 wx = 0; wx < SLOT_WORDS; wx++) {
+            buf[wx] = __atomic_load_n(words + wx, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(words, __ATOMIC_RELAXED) == seq) {
+            memcpy(&out, buf, sizeof(Slot));
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Reader
+*/
+
+bool Reader::map_file(const char *fn, Map &out) {
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info = {0};
+    if (fstat(fd, &info) || u64(info.st_size) < HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    auto hdr = static_cast<const Header *>(addr);
+    if (hdr->magic != IHIDX_MAGIC || hdr->version != IHIDX_VERSION ||
+        hdr->log2_slots > IHIDX_LOG2_SLOTS_MAX ||
+        table_size(hdr->log2_slots) != u64(info.st_size)) {
+        munmap(addr, info.st_size);
+        return false;
+    }
+
+    out.hdr = hdr;
+    out.slots = reinterpret_cast<const Slot *>(static_cast<const u8 *>(addr) +
+                                               HEADER_SIZE);
+    out.map_size = info.st_size;
+    return true;
+}
+
+void Reader::unmap(Map &map) {
+    if (map.hdr != nullptr) {
+        munmap(const_cast<Header *>(map.hdr), map.map_size);
+    }
+    map = Map();
+}
+
+Reader::Probe Reader::probe(const Map &map, const Nih &ih, Entry &out) {
+    u64 mask = (u64(1) << map.hdr->log2_slots) - 1;
+    u64 ix = slot_of(ih, map.hdr->seed, map.hdr->log2_slots);
+    Slot slot;
+
+    for (u64 n = 0; n <= mask; n++, ix = (ix + 1) & mask) {
+        if (!load_slot(map.slots[ix], slot)) {
+            return PR_TORN;
+        }
+        if (slot.hits == 0) {
+            return PR_MISSING;
+        }
+        if (same_ih(slot.ih, ih)) {
+            out.first_seen = slot.first_seen;
+            out.last_seen = slot.last_seen;
+            out.hits = slot.hits;
+            out.sources = slot.sources;
+            return PR_FOUND;
+        }
+    }
+    return PR_MISSING;
+}
+
+bool Reader::reopen() {
+    unmap(cur);
+    unmap(next);
+    return map_file(IHIDX_FN, cur);
+}
+
+Reader::~Reader() {
+    unmap(cur);
+    unmap(next);
+}
+
+bool Reader::find(const Nih &ih, Entry &out) {
+    for (int tries = 0; tries < IHIDX_READ_RETRIES; tries++) {
+        if (cur.hdr == nullptr && !reopen()) {
+            return false;
+        }
+
+        u32 state = __atomic_load_n(&cur.hdr->state, __ATOMIC_ACQUIRE);
+        if (state == TS_RETIRED) {
+            reopen();
+            continue;
+        }
+
+        if (state == TS_GROWING) {
+            // A failure to map it means the growth just finished, and
+            // IHIDX_FN is the new table by now.
+            if (next.hdr == nullptr && (!map_file(IHIDX_NEXT_FN, next) ||
+                                        next.hdr->log2_slots !=
+                                            cur.hdr->log2_slots + 1)) {
+                reopen();
+                continue;
+            }
+            // Updated infohashes are only written to the new table, so it
+            // has to be checked first.
+            Probe pr = probe(next, ih, out);
+            if (pr == PR_FOUND) {
+                return true;
+            }
+            if (pr == PR_TORN) {
+                continue;
+            }
+        } else if (next.hdr != nullptr) {
+            unmap(next);
+        }
+
+        Probe pr = probe(cur, ih, out);
+        if (pr != PR_TORN) {
+            return pr == PR_FOUND;
+        }
+    }
+    return false;
+}
+
+u64 Reader::n_keys() {
+    if (cur.hdr == nullptr && !reopen()) {
+        return 0;
+    }
+    u64 n = __atomic_load_n(&cur.hdr->n_keys, __ATOMIC_ACQUIRE);
+    if (next.hdr != nullptr) {
+        n = std::max(n, __atomic_load_n(&next.hdr->n_keys, __ATOMIC_ACQUIRE));
+    }
+    return n;
+}
+
+u32 Reader::sample(Nih out[], u32 max_out, u32 max_scan) {
+    if (cur.hdr == nullptr && !reopen()) {
+        return 0;
+    }
+    if (__atomic_load_n(&cur.hdr->state, __ATOMIC_ACQUIRE) == TS_RETIRED &&
+        !reopen()) {
+        return 0;
+    }
+
+    u64 mask = (u64(1) << cur.hdr->log2_slots) - 1;
+    u32 n_out = 0;
+    Slot slot;
+
+    for (u32 n = 0; n < max_scan && n_out < max_out; n++) {
+        sample_pos = (sample_pos + 1) & mask;
+        // torn slots are just skipped
+        if (load_slot(cur.slots[sample_pos], slot) && slot.hits > 0) {
+            out[n_out++] = slot.ih;
+        }
+    }
+    return n_out;
+}
+
+/*
+Writer
+*/
+
+#ifdef IHIDX
+
+struct Table {
+    Header *hdr = nullptr;
+    Slot *slots = nullptr;
+    u64 mask = 0;
+};
+
+// Both are only touched by the ihlog writer thread after init. g_next is
+// mapped while g_cur is TS_GROWING.
+static Table g_cur;
+static Table g_next;
+static u64 g_grow_after_ms = 0;
+
+// written by the writer thread, read by the loop thread
+static u64 g_n_keys = 0;
+static u64 g_n_slots = 0;
+static u64 g_n_migrate_left = 0;
+static u64 g_n_full_dropped = 0;
+static u64 g_n_errors = 0;
+
+static inline void set_n_keys(Table &table, u64 n_keys) {
+    __atomic_store_n(&table.hdr->n_keys, n_keys, __ATOMIC_RELEASE);
+}
+
+static inline u64 n_slots(const Table &table) {
+    return table.mask + 1;
+}
+
+static bool map_table(int fd, u32 log2_slots, Table &out) {
+    void *addr = mmap(nullptr, table_size(log2_slots), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    out.hdr = static_cast<Header *>(addr);
+    out.slots =
+        reinterpret_cast<Slot *>(static_cast<u8 *>(addr) + HEADER_SIZE);
+    out.mask = (u64(1) << log2_slots) - 1;
+    return true;
+}
+
+static void unmap_table(Table &table) {
+    if (table.hdr != nullptr) {
+        munmap(table.hdr, table_size(table.hdr->log2_slots));
+    }
+    table = Table();
+}
+
+// Maps an existing table, checking it's ours and whole.
+static bool open_table(const char *fn, Table &out) {
+    int fd = open(fn, O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+
+    Header hdr;
+    struct stat info = {0};
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fstat(fd, &info) ||
+        hdr.magic != IHIDX_MAGIC || hdr.version != IHIDX_VERSION ||
+        hdr.log2_slots < IHIDX_LOG2_SLOTS_MIN ||
+        hdr.log2_slots > IHIDX_LOG2_SLOTS_MAX ||
+        table_size(hdr.log2_slots) != u64(info.st_size)) {
+        close(fd);
+        return false;
+    }
+
+    return map_table(fd, hdr.log2_slots, out);
+}
+
+// Creates an empty table at fn, which must not exist. Truncating a file in
+// place would SIGBUS any reader that has it mapped. The file is sparse, so a
+// big table takes disk space only as it fills.
+static bool create_table(const char *fn, u32 log2_slots, Table &out) {
+    int fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, table_size(log2_slots))) {
+        close(fd);
+        return false;
+    }
+    if (!map_table(fd, log2_slots, out)) {
+        return false;
+    }
+
+    Header &hdr = *out.hdr;
+    getrandom(&hdr.seed, sizeof(hdr.seed), 0);
+    hdr.log2_slots = log2_slots;
+    hdr.n_keys = 0;
+    hdr.state = TS_ACTIVE;
+    hdr.n_migrated = 0;
+    hdr.version = IHIDX_VERSION;
+    __atomic_store_n(&hdr.magic, IHIDX_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Slot of ih in the table, or the empty slot it would go to. The table is
+// never full, so there always is one.
+static u64 find_slot(const Table &table, const Nih &ih) {
+    u64 ix = slot_of(ih, table.hdr->seed, table.hdr->log2_slots);
+    while (table.slots[ix].hits != 0 && !same_ih(table.slots[ix].ih, ih)) {
+        ix = (ix + 1) & table.mask;
+    }
+    return ix;
+}
+
+static void write_slot(Slot &slot, const Slot &val) {
+    u32 *words = reinterpret_cast<u32 *>(&slot);
+    u32 buf[SLOT_WORDS];
+    memcpy(buf, &val, sizeof(Slot));
+
+    // we are the only writer, nobody can have changed seq under us
+    u32 seq = words[0];
+    __atomic_store_n(words, seq + 1, __ATOMIC_RELAXED);
+    // order the odd counter before any of the data stores
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (u32 wx = 1; wx < SLOT_WORDS; wx++) {
+        __atomic_store_n(words + wx, buf[wx], __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(words, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline bool growing() {
+    return g_next.hdr != nullptr;
+}
+
+static void add(const Nih &ih, u32 ts_s, u8 source) {
+    Table &dst = growing() ? g_next : g_cur;
+    Slot &slot = dst.slots[find_slot(dst, ih)];
+    Slot val = slot;
+
+    if (val.hits == 0) {
+        // While growing, an infohash not yet in the new table may still be
+        // waiting in the old one. It's copied over now, the old table is
+        // never written to again.
+        const Slot *old = nullptr;
+        if (growing()) {
+            old = g_cur.slots + find_slot(g_cur, ih);
+            if (old->hits == 0) {
+                old = nullptr;
+            }
+        }
+
+        if (old == nullptr &&
+            dst.hdr->n_keys >= n_slots(dst) * IHIDX_FULL_PCT / 100) {
+            ctr_add(g_n_full_dropped, 1);
+            return;
+        }
+
+        if (old != nullptr) {
+            val = *old;
+        } else {
+            val.ih = ih;
+            val.first_seen = ts_s;
+            val.last_seen = ts_s;
+            val.sources = 0;
+            memset(val._pad, 0, sizeof(val._pad));
+        }
+        set_n_keys(dst, dst.hdr->n_keys + 1);
+    }
+
+    val.first_seen = std::min(val.first_seen, ts_s);
+    val.last_seen = std::max(val.last_seen, ts_s);
+    if (val.hits < UINT32_MAX) {
+        val.hits++;
+    }
+    val.sources |= 1 << source;
+
+    write_slot(slot, val);
+}
+
+static void start_growth() {
+    // a reader still mapping a stale one keeps its pages after the unlink
+    unlink(IHIDX_NEXT_FN);
+    if (!create_table(IHIDX_NEXT_FN, g_cur.hdr->log2_slots + 1, g_next)) {
+        g_next = Table();
+        ctr_add(g_n_errors, 1);
+        g_grow_after_ms = mono_ms() + IHIDX_GROW_RETRY_MS;
+        return;
+    }
+
+    g_cur.hdr->n_migrated = 0;
+    // the new table is complete by now, so readers may go look at it
+    __atomic_store_n(&g_cur.hdr->state, TS_GROWING, __ATOMIC_RELEASE);
+}
+
+static void finish_growth() {
+    if (rename(IHIDX_NEXT_FN, IHIDX_FN) < 0) {
+        ctr_add(g_n_errors, 1);
+        return;
+    }
+
+    __atomic_store_n(&g_cur.hdr->state, TS_RETIRED, __ATOMIC_RELEASE);
+    unmap_table(g_cur);
+    g_cur = g_next;
+    g_next = Table();
+}
+
+static void migrate(u32 n_added) {
+    // Copying two old slots per added record finishes the growth before the
+    // new table is 60% full, so it never has to grow again right away.
+    u64 from = g_cur.hdr->n_migrated;
+    u64 to = std::min(from + std::max<u64>(IHIDX_MIGRATE_SLOTS, 2 * n_added),
+                      n_slots(g_cur));
+
+    for (u64 ix = from; ix < to; ix++) {
+        const Slot &old = g_cur.slots[ix];
+        if (old.hits == 0) {
+            continue;
+        }
+        // it's already there if it was updated since the growth started
+        Slot &slot = g_next.slots[find_slot(g_next, old.ih)];
+        if (slot.hits == 0) {
+            write_slot(slot, old);
+            set_n_keys(g_next, g_next.hdr->n_keys + 1);
+        }
+    }
+
+    __atomic_store_n(&g_cur.hdr->n_migrated, to, __ATOMIC_RELEASE);
+    if (to == n_slots(g_cur)) {
+        finish_growth();
+    }
+}
+
+void init() {
+    if (open_table(IHIDX_FN, g_cur)) {
+        INFO("Loaded infohash index " IHIDX_FN " with %lu infohashes",
+             g_cur.hdr->n_keys)
+    } else {
+        // moved aside rather than truncated, readers may have it mapped
+        if (access(IHIDX_FN, F_OK) == 0) {
+            if (rename(IHIDX_FN, IHIDX_BAD_FN) < 0) {
+                ERROR("Unusable infohash index " IHIDX_FN
+                      " could not be moved aside: %s",
+                      strerror(errno))
+                exit(-1);
+            }
+            ctr_add(g_n_errors, 1);
+            WARN("Unusable infohash index moved to " IHIDX_BAD_FN
+                 ", starting a new one.")
+        }
+        if (!create_table(IHIDX_FN, IHIDX_LOG2_SLOTS_MIN, g_cur)) {
+            ERROR("Could not create infohash index " IHIDX_FN ": %s",
+                  strerror(errno))
+            exit(-1);
+        }
+    }
+
+    if (g_cur.hdr->state == TS_GROWING) {
+        // Copying is idempotent and the old table was never written to
+        // while growing, so the growth picks up where it left off.
+        if (open_table(IHIDX_NEXT_FN, g_next) &&
+            g_next.hdr->log2_slots == g_cur.hdr->log2_slots + 1) {
+            INFO("Resuming growth of the infohash index at slot %lu",
+                 g_cur.hdr->n_migrated)
+        } else {
+            unmap_table(g_next);
+            __atomic_store_n(&g_cur.hdr->state, TS_ACTIVE, __ATOMIC_RELEASE);
+            start_growth();
+        }
+    } else if (g_cur.hdr->state != TS_ACTIVE) {
+        ERROR("Infohash index " IHIDX_FN " is in state %u, bailing.",
+              g_cur.hdr->state)
+        exit(-1);
+    } else {
+        // left over from a growth that died before it got going
+        unlink(IHIDX_NEXT_FN);
+    }
+}
+
+void apply(const ihlog::Record recs[], u32 n_recs) {
+    for (u32 ix = 0; ix < n_recs; ix++) {
+        add(recs[ix].ih, recs[ix].ts_ms / 1000, recs[ix].source);
+    }
+
+    if (growing()) {
+        migrate(n_recs);
+    } else if (g_cur.hdr->n_keys >= n_slots(g_cur) * IHIDX_GROW_PCT / 100 &&
+               g_cur.hdr->log2_slots < IHIDX_LOG2_SLOTS_MAX &&
+               mono_ms() >= g_grow_after_ms) {
+        start_growth();
+    }
+
+    Table &dst = growing() ? g_next : g_cur;
+    ctr_set(g_n_keys, dst.hdr->n_keys);
+    ctr_set(g_n_slots, n_slots(dst));
+    ctr_set(g_n_migrate_left,
+            growing() ? n_slots(g_cur) - g_cur.hdr->n_migrated : 0);
+}
+
+void report() {
+    st_set(ST_ihidx_keys, ctr_get(g_n_keys));
+    st_set(ST_ihidx_slots, ctr_get(g_n_slots));
+    st_set(ST_ihidx_migrate_left, ctr_get(g_n_migrate_left));
+    st_set(ST_ihidx_full_dropped, ctr_get(g_n_full_dropped));
+    st_set(ST_ihidx_errors, ctr_get(g_n_errors));
+}
+
+#endif // IHIDX
+
+} // namespace cht::ihidx
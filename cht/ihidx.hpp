@@ -0,0 +1,176 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include "ihlog.hpp"
+#include "oa.hpp"
+
+using namespace cht;
+namespace cht::ihidx {
+
+// Persistent index of every infohash in the ihlog stream, enabled with IHIDX.
+// It is an open-addressed hash table mapped shared from IHIDX_FN, keeping per
+// infohash when it was first and last seen, how often, and from which
+// sources. Only the ihlog writer thread updates it, so the loop never waits
+// on it and it survives restarts.
+//
+// Any process can map the file read-only and look infohashes up through a
+// Reader. Every slot is guarded by a sequence counter: the single writer
+// makes it odd while it rewrites the slot, readers retry torn reads a bounded
+// number of times.
+//
+// When the table gets too full a table of twice the size is created as
+// IHIDX_NEXT_FN and the old one is copied over IHIDX_MIGRATE_SLOTS slots at a
+// time. Meanwhile updates go to the new table and readers look in both. Once
+// everything is copied the new file is renamed over the old one and the old
+// table is marked retired, which sends readers to the new file.
+
+#ifndef IHIDX_FN
+#define IHIDX_FN "./data/ihidx.dat"
+#endif
+#define IHIDX_NEXT_FN IHIDX_FN ".next"
+// where an index that fails to load is moved, replacing an older one
+#define IHIDX_BAD_FN IHIDX_FN ".bad"
+// log2 of the slots of a new index, and of the most it grows to
+#ifndef IHIDX_LOG2_SLOTS_MIN
+#define IHIDX_LOG2_SLOTS_MIN 20
+#endif
+#ifndef IHIDX_LOG2_SLOTS_MAX
+#define IHIDX_LOG2_SLOTS_MAX 30
+#endif
+// grow once this many percent of the slots are taken
+#ifndef IHIDX_GROW_PCT
+#define IHIDX_GROW_PCT 70
+#endif
+// refuse new infohashes past this, if growing is impossible
+#ifndef IHIDX_FULL_PCT
+#define IHIDX_FULL_PCT 90
+#endif
+// old slots copied at least per batch of records while growing
+#ifndef IHIDX_MIGRATE_SLOTS
+#define IHIDX_MIGRATE_SLOTS 8192
+#endif
+// wait this long before trying again after growing failed
+#ifndef IHIDX_GROW_RETRY_MS
+#define IHIDX_GROW_RETRY_MS 60000
+#endif
+#ifndef IHIDX_READ_RETRIES
+#define IHIDX_READ_RETRIES 16
+#endif
+
+static_assert(IHIDX_LOG2_SLOTS_MIN <= IHIDX_LOG2_SLOTS_MAX);
+static_assert(IHIDX_LOG2_SLOTS_MAX <= 32);
+static_assert(IHIDX_GROW_PCT < IHIDX_FULL_PCT && IHIDX_FULL_PCT < 100);
+
+// bump whenever the layout of Header or Slot changes
+constexpr inline u32 IHIDX_VERSION = 1;
+constexpr inline u64 IHIDX_MAGIC = 0x3158444948544843; // "CHTHIDX1"
+
+enum TableState : u32 {
+    TS_ACTIVE = 1,
+    TS_GROWING, // being copied to IHIDX_NEXT_FN, which readers check first
+    TS_RETIRED, // replaced, readers have to map IHIDX_FN again
+};
+
+// Starts the file, the slots follow at HEADER_SIZE.
+struct Header {
+    u64 magic;
+    u32 version;
+    u32 log2_slots;
+    u64 seed; // for slot_of, random per table
+    u64 n_keys;
+    u32 state; // a TableState
+    u32 _pad;
+    u64 n_migrated; // old slots copied so far while TS_GROWING
+};
+
+constexpr inline u64 HEADER_SIZE = 4096;
+static_assert(sizeof(Header) <= HEADER_SIZE);
+
+// Times are unix seconds, sources a bitmask of 1 << ihlog::Source. A slot
+// with no hits is empty.
+struct Slot {
+    u32 seq;
+    Nih ih;
+    u32 first_seen;
+    u32 last_seen;
+    u32 hits;
+    u8 sources;
+    u8 _pad[3];
+};
+static_assert(sizeof(Slot) == 40, "Messed up ihidx Slot layout!");
+
+// What a lookup returns.
+struct Entry {
+    u32 first_seen;
+    u32 last_seen;
+    u32 hits;
+    u8 sources;
+};
+
+inline u64 slot_of(const Nih &ih, u64 seed, u32 log2_slots) {
+    return oa::hash_ih_wide(ih, seed) >> (64 - log2_slots);
+}
+
+// A read-only mapping of the index, for any process. Not thread safe, every
+// reading thread needs its own.
+class Reader {
+  private:
+    struct Map {
+        const Header *hdr = nullptr;
+        const Slot *slots = nullptr;
+        u64 map_size = 0;
+    };
+
+    Map cur;
+    // the table being grown into, while cur is TS_GROWING
+    Map next;
+    // where sample goes on
+    u64 sample_pos = 0;
+
+    enum Probe { PR_FOUND, PR_MISSING, PR_TORN };
+
+    static bool map_file(const char *fn, Map &out);
+    static void unmap(Map &map);
+    static Probe probe(const Map &map, const Nih &ih, Entry &out);
+    bool reopen();
+
+  public:
+    Reader() = default;
+    Reader(Reader const &) = delete;
+    Reader &operator=(Reader const &) = delete;
+    ~Reader();
+
+    // Looks the infohash up, following the index through growths. False if
+    // it's not in the index, if there is no index yet, or if it stayed torn
+    // for IHIDX_READ_RETRIES attempts.
+    bool find(const Nih &ih, Entry &out);
+
+    // Infohashes in the index, 0 if there is none yet.
+    u64 n_keys();
+
+    // Writes up to max_out infohashes of the index to out, looking at no more
+    // than max_scan slots. Every call goes on where the last one stopped.
+    // While the index grows only the old table is sampled.
+    u32 sample(Nih out[], u32 max_out, u32 max_scan);
+};
+
+#ifdef IHIDX
+#ifndef IHLOG
+#error "IHIDX is updated from the ihlog stream and needs IHLOG"
+#endif
+
+// Maps IHIDX_FN, creating it if needed, and picks up an interrupted growth.
+// Must be called before ihlog starts its writer thread.
+void init();
+
+// Adds a batch of records to the index and copies some old slots if it's
+// growing. Must only be called from the ihlog writer thread, which also calls
+// it with no records when it's idle.
+void apply(const ihlog::Record recs[], u32 n_recs);
+
+// Updates the index stats. Must only be called from the loop thread.
+void report();
+#endif
+
+} // namespace cht::ihidx
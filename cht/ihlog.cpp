@@ -0,0 +1,228 @@
+#include "ihlog.hpp"
+#include "ihidx.hpp"
+#include "log.hpp"
+#include "qsvc.hpp"
+#include "ring.hpp"
+#include "stat.hpp"
+#include "util.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace cht;
+namespace cht::ihlog {
+
+#ifdef IHLOG
+
+static SpscRing<Record, IHLOG_LOG2_RING> g_ring;
+
+// written by the loop thread
+static u64 g_n_pushed = 0;
+// written by the writer thread, read by the loop thread
+static u64 g_n_written = 0;
+static u64 g_n_lost = 0;
+static u64 g_n_synced = 0;
+static u64 g_n_segments = 0;
+static u64 g_n_write_errors = 0;
+
+static int g_fd = -1;
+// what the segment holds up to its last whole Record
+static u64 g_segment_bytes = 0;
+// a failed write may have left part of a Record past g_segment_bytes
+static bool g_torn = false;
+
+static inline u64 wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return u64(ts.tv_sec) * 1000 + u64(ts.tv_nsec) / 1000000;
+}
+
+static bool write_all(const void *buf, size_t len) {
+    const char *pos = static_cast<const char *>(buf);
+    while (len > 0) {
+        ssize_t n = write(g_fd, pos, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Opens a fresh segment. Returns -1 and sets errno if it could not.
+static int open_segment() {
+    char fn[sizeof(IHLOG_DIR) + 32];
+    u64 ms = wall_ms();
+
+    int fd;
+    do {
+        // segments opened within the same ms get the next free name
+        snprintf(fn, sizeof(fn), IHLOG_DIR "/%013lu.bin", ms++);
+        fd = open(fn, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    } while (fd < 0 && errno == EEXIST);
+
+    return fd;
+}
+
+static void roll_segment() {
+    int fd = open_segment();
+    if (fd < 0) {
+        // keep appending to the old segment and try again later
+        ctr_add(g_n_write_errors, 1);
+        return;
+    }
+
+    if (g_fd >= 0) {
+        fdatasync(g_fd);
+        close(g_fd);
+    }
+    g_fd = fd;
+    g_segment_bytes = 0;
+
+    g_torn = !write_all(IHLOG_MAGIC, sizeof(IHLOG_MAGIC));
+    if (g_torn) {
+        ctr_add(g_n_write_errors, 1);
+    } else {
+        g_segment_bytes = sizeof(IHLOG_MAGIC);
+    }
+    ctr_add(g_n_segments, 1);
+}
+
+// Cuts what a failed write left past the last whole Record, or else moves on
+// to a new segment. Returns whether the segment can be appended to.
+static bool repair_segment() {
+    if (ftruncate(g_fd, g_segment_bytes) == 0) {
+        // the magic may not have made it either
+        if (g_segment_bytes == 0 &&
+            write_all(IHLOG_MAGIC, sizeof(IHLOG_MAGIC))) {
+            g_segment_bytes = sizeof(IHLOG_MAGIC);
+        }
+        if (g_segment_bytes > 0) {
+            g_torn = false;
+            return true;
+        }
+    }
+    ctr_add(g_n_write_errors, 1);
+    roll_segment();
+    return !g_torn;
+}
+
+static void writer_loop() {
+    /*
+    Runs on its own thread. Only ever touches the consumer side of the ring,
+    the segment files, the counters above and the ihidx tables, so it does
+    not log or count stats itself.
+    */
+    std::vector<Record> batch(IHLOG_BATCH);
+    u64 synced_ms = mono_ms();
+    u64 n_unsynced = 0;
+
+    while (true) {
+        u32 n_batch = 0;
+        while (n_batch < IHLOG_BATCH && g_ring.pop(batch[n_batch])) {
+            n_batch++;
+        }
+
+        if (n_batch > 0) {
+            if (g_torn && !repair_segment()) {
+                ctr_add(g_n_lost, n_batch);
+            } else if (write_all(batch.data(), n_batch * sizeof(Record))) {
+                g_segment_bytes += n_batch * sizeof(Record);
+                n_unsynced += n_batch;
+                ctr_add(g_n_written, n_batch);
+            } else {
+                ctr_add(g_n_write_errors, 1);
+                ctr_add(g_n_lost, n_batch);
+                g_torn = true;
+                repair_segment();
+            }
+        }
+#ifdef IHIDX
+        // also while idle, so a growing index keeps moving
+        ihidx::apply(batch.data(), n_batch);
+#endif
+
+        u64 now = mono_ms();
+        if (n_unsynced > 0 && now - synced_ms >= IHLOG_SYNC_MS) {
+            if (fdatasync(g_fd) < 0) {
+                ctr_add(g_n_write_errors, 1);
+            }
+            ctr_add(g_n_synced, n_unsynced);
+            n_unsynced = 0;
+            synced_ms = now;
+        }
+
+        if (g_segment_bytes >= IHLOG_SEGMENT_BYTES) {
+            // the old segment is synced on the way out
+            roll_segment();
+            ctr_add(g_n_synced, n_unsynced);
+            n_unsynced = 0;
+        }
+
+        if (n_batch < IHLOG_BATCH) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+void start() {
+    if (mkdir(IHLOG_DIR, 0755) < 0 && errno != EEXIST) {
+        ERROR("Could not create " IHLOG_DIR ": %s", strerror(errno))
+        exit(-1);
+    }
+
+    roll_segment();
+    if (g_fd < 0) {
+        ERROR("Could not open a segment in " IHLOG_DIR ": %s",
+              strerror(errno))
+        exit(-1);
+    }
+
+    std::thread(writer_loop).detach();
+}
+
+void log_ih(Source source, const Nih &ih, const Peerinfo *peer) {
+    Record rec;
+    rec.ts_ms = wall_ms();
+    rec.ih = ih;
+    rec.in_addr = peer != nullptr ? peer->in_addr : 0;
+    rec.port = peer != nullptr ? peer->sin_port : 0;
+    rec.source = source;
+    rec._pad = 0;
+#ifdef QSVC
+    qsvc::publish(rec);
+#endif
+
+    if (g_ring.push(rec)) {
+        g_n_pushed++;
+        st_inc(ST_ihlog_records);
+    } else {
+        st_inc(ST_ihlog_dropped);
+    }
+}
+
+void report() {
+    u64 n_lost = ctr_get(g_n_lost);
+    u64 n_written = ctr_get(g_n_written);
+    u64 n_synced = ctr_get(g_n_synced);
+
+    st_set(ST_ihlog_lag, g_n_pushed - n_written - n_lost);
+    st_set(ST_ihlog_lost, n_lost);
+    st_set(ST_ihlog_unsynced, n_written - n_synced);
+    st_set(ST_ihlog_segments, ctr_get(g_n_segments));
+    st_set(ST_ihlog_write_errors, ctr_get(g_n_write_errors));
+}
+
+#endif // IHLOG
+
+} // namespace cht::ihlog
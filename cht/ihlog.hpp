@@ -0,0 +1,73 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht::ihlog {
+
+// Durable log of every infohash we come across, enabled with IHLOG. Events go
+// through a lock-free ring to a writer thread, which appends them as fixed
+// Records to segment files in IHLOG_DIR. A segment is named after the wall
+// clock ms it was opened at, starts with IHLOG_MAGIC and is closed once it
+// holds IHLOG_SEGMENT_BYTES. Writes are fdatasync'd every IHLOG_SYNC_MS.
+// A batch whose write fails is lost, and the segment is cut back to its last
+// whole Record, or a new one is started if that fails, so segments always
+// hold whole Records.
+
+#ifndef IHLOG_DIR
+#define IHLOG_DIR "./data/ihlog"
+#endif
+#ifndef IHLOG_SEGMENT_BYTES
+#define IHLOG_SEGMENT_BYTES (64 << 20)
+#endif
+#ifndef IHLOG_SYNC_MS
+#define IHLOG_SYNC_MS 1000
+#endif
+// log2 of the records the ring to the writer thread holds
+#ifndef IHLOG_LOG2_RING
+#define IHLOG_LOG2_RING 16
+#endif
+// records the writer takes from the ring per write
+#ifndef IHLOG_BATCH
+#define IHLOG_BATCH 1024
+#endif
+// peers logged from the values of one r_gp
+#ifndef IHLOG_R_GP_PEERS
+#define IHLOG_R_GP_PEERS 4
+#endif
+
+constexpr inline char IHLOG_MAGIC[8] = {'C', 'H', 'T', 'I', 'H', 'L', 'G', '1'};
+
+enum Source : u8 {
+    SRC_Q_GP = 1, // someone asked for the infohash
+    SRC_Q_AP,     // someone announced it; the peer is the announcer
+    SRC_R_GP,     // an r_gp for our lookup had values; the peer is one of them
+    SRC_R_SI,     // a BEP 51 sample from an r_si
+};
+
+// One event as stored in a segment. in_addr and port are as on the wire, and
+// zero without a peer.
+struct __attribute__((packed)) Record {
+    u64 ts_ms; // CLOCK_REALTIME
+    Nih ih;
+    u32 in_addr;
+    u16 port;
+    u8 source;
+    u8 _pad;
+};
+static_assert(sizeof(Record) == 36, "Messed up ihlog Record layout!");
+
+#ifdef IHLOG
+// Opens the first segment and starts the writer thread.
+void start();
+
+// Queues an event for the writer, never blocking. Must only be called from
+// the loop thread.
+void log_ih(Source, const Nih &, const Peerinfo *peer = nullptr);
+
+// Updates the writer's stats. Must only be called from the loop thread.
+void report();
+#endif
+
+} // namespace cht::ihlog
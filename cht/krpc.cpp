@@ -18,12 +18,16 @@ const char *get_method_name(Method method) {
         return "Q_FN";
     case Q_GP:
         return "Q_GP";
+    case Q_SI:
+        return "Q_SI";
     case R_FN:
         return "R_FN";
     case R_GP:
         return "R_GP";
     case R_PG:
         return "R_PG";
+    case R_SI:
+        return "R_SI";
     default:
         return "Mixed Method";
     }
@@ -162,6 +166,15 @@ void KRPC::xdecode(u32 data_len) {
                         XD_FAIL(ST_bd_y_port_overflow);
                     }
                     this->ap_port = u16(port);
+                } else if (xd_state == XD_IVAL &&
+                           xd_hist.current_key == IKEY_IMPLPORT) {
+                    this->ap_implied_port = port != 0;
+                } else if (xd_state == XD_IVAL &&
+                           xd_hist.current_key == IKEY_INTERVAL) {
+                    this->si_interval = port;
+                } else if (xd_state == XD_IVAL &&
+                           xd_hist.current_key == IKEY_NUM) {
+                    this->si_num = port;
                 }
                 xd_state = (xd_state == XD_OVAL) ? XD_OKEY : XD_IKEY;
                 continue;
@@ -282,6 +295,15 @@ void KRPC::xdecode(u32 data_len) {
                         continue;
                     }
                     goto xd_unknown_ikey;
+                case 3:
+                    if (XD_KEY_MATCH(data + start, NUM, slen)) {
+                        TRACE(">>> matched ikey NUM; * -> R_SI")
+                        xd_hist.msg_kind &= R_SI;
+                        xd_hist.current_key = IKEY_NUM;
+                        xd_hist.seen_keys |= IKEY_NUM;
+                        continue;
+                    }
+                    goto xd_unknown_ikey;
                 case 4:
                     if ((xd_hist.msg_kind & Q_AP) &&
                         XD_KEY_MATCH(data + start, NAME, slen)) {
@@ -295,6 +317,7 @@ void KRPC::xdecode(u32 data_len) {
                         TRACE(">>> matched ikey PORT")
                         // we do not the legal kinds, since other
                         // messages can have a port as extra data we ignore
+                        xd_hist.current_key = IKEY_PORT;
                         xd_hist.seen_keys |= IKEY_PORT;
                         continue;
                     }
@@ -302,8 +325,8 @@ void KRPC::xdecode(u32 data_len) {
                 case 5:
                     if (XD_KEY_MATCH(data + start, NODES, slen)) {
                         TRACE(">>> matched ikey NODES; * -> "
-                              "R_FN|R_GP")
-                        xd_hist.msg_kind &= (R_FN | R_GP);
+                              "R_FN|R_GP|R_SI")
+                        xd_hist.msg_kind &= (R_FN | R_GP | R_SI);
                         xd_hist.current_key = IKEY_NODES;
                         xd_hist.seen_keys |= IKEY_NODES;
                         continue;
@@ -327,13 +350,31 @@ void KRPC::xdecode(u32 data_len) {
                         continue;
                     }
                     if (XD_KEY_MATCH(data + start, TARGET, slen)) {
-                        TRACE(">>> matched ikey TARGET; * -> Q_FN")
-                        xd_hist.msg_kind &= Q_FN;
+                        TRACE(">>> matched ikey TARGET; * -> Q_FN|Q_SI")
+                        xd_hist.msg_kind &= (Q_FN | Q_SI);
                         xd_hist.current_key = IKEY_TARGET;
                         xd_hist.seen_keys |= IKEY_TARGET;
                         continue;
                     }
                     goto xd_unknown_ikey;
+                case 7:
+                    if (XD_KEY_MATCH(data + start, SAMPLES, slen)) {
+                        TRACE(">>> matched ikey SAMPLES; * -> R_SI")
+                        xd_hist.msg_kind &= R_SI;
+                        xd_hist.current_key = IKEY_SAMPLES;
+                        xd_hist.seen_keys |= IKEY_SAMPLES;
+                        continue;
+                    }
+                    goto xd_unknown_ikey;
+                case 8:
+                    if (XD_KEY_MATCH(data + start, INTERVAL, slen)) {
+                        TRACE(">>> matched ikey INTERVAL; * -> R_SI")
+                        xd_hist.msg_kind &= R_SI;
+                        xd_hist.current_key = IKEY_INTERVAL;
+                        xd_hist.seen_keys |= IKEY_INTERVAL;
+                        continue;
+                    }
+                    goto xd_unknown_ikey;
                 case 9:
                     if (XD_KEY_MATCH(data + start, INFO_HASH, slen)) {
                         TRACE(">>> matched ikey INFO_HASH; * -> "
@@ -388,12 +429,20 @@ void KRPC::xdecode(u32 data_len) {
                             continue;
                         }
                         goto xd_bad_q;
+                    case 17:
+                        if (!XD_VAL_MATCH(data + start, SI, slen)) {
+                            goto xd_bad_q;
+                        }
+                        TRACE("!!! q is Q_SI")
+                        xd_hist.msg_kind &= Q_SI;
+                        continue;
                     case 13:
                         if (!XD_VAL_MATCH(data + start, AP, slen)) {
                             goto xd_bad_q;
                         }
                         TRACE("!!! q is Q_AP")
                         xd_hist.msg_kind &= Q_AP;
+                        continue;
                     default:
                     xd_bad_q:
                         XD_FAIL(ST_bd_z_unknown_query);
@@ -464,6 +513,15 @@ void KRPC::xdecode(u32 data_len) {
                     TRACE("!!! TARGET = ...")
                     this->target = reinterpret_cast<const Nih *>(data + start);
                     continue;
+                case IKEY_SAMPLES:
+                    if ((slen % NIH_LEN) != 0) {
+                        XD_FAIL(ST_bd_y_bad_length_samples)
+                    }
+                    TRACE("!!! SAMPLES[%u]", slen / NIH_LEN);
+                    this->n_samples = slen / NIH_LEN;
+                    this->samples =
+                        reinterpret_cast<const Nih *>(data + start);
+                    continue;
                 case IKEY_NID:
                     if (slen != NIH_LEN) {
                         TRACE("slen = %u, bad nid msg: %.*s", slen, data_len,
@@ -566,8 +624,8 @@ void KRPC::validate(const XDHist &hist) {
                 XD_FAIL(ST_bd_y_ap_no_port)
             }
 #ifndef NOFILTER_AP
-            else if (hist.msg_kind == Q_AP &&
-                     !(this->token_len != 1 && this->token[0] == OUR_TOKEN)) {
+            // the token itself is checked against the sender in handle
+            else if (hist.msg_kind == Q_AP && this->token_len != TOKEN_LEN) {
                 TRACE("=== REJECT q_ap && unrecognized token")
                 XD_FAIL(ST_bd_z_token_unrecognized)
             }
@@ -587,6 +645,13 @@ void KRPC::validate(const XDHist &hist) {
             }
             TRACE("=== ACCEPT Q_FN")
             this->method = Q_FN;
+        } else if (hist.msg_kind == Q_SI) {
+            if (!(hist.seen_keys & IKEY_TARGET)) {
+                TRACE("=== REJECT q_si && ~target")
+                XD_FAIL(ST_bd_y_fn_no_target)
+            }
+            TRACE("=== ACCEPT Q_SI")
+            this->method = Q_SI;
         }
         // accept only simple pings
         else if (hist.msg_kind == Q_PG) {
@@ -603,13 +668,23 @@ void KRPC::validate(const XDHist &hist) {
     } else if (hist.msg_kind & R_ANY) {
         TRACE("??? DECIDING as reply")
 
+        // SAMPLES or INTERVAL or NUM <-> R_SI
+        if (hist.seen_keys & IKEY_ANY_SI) {
+            if (this->tok_len != 1 || this->tok[0] != OUR_TOK_SI) {
+                TRACE("=== REJECT r_si && not our si tok")
+                XD_FAIL(ST_bd_z_bad_tok_si)
+            }
+            TRACE("=== ACCEPT samples | interval | num -> R_SI")
+            this->method = R_SI;
+        }
         // TOKEN and (VALUES or NODES) <-> R_GP
-        if ((hist.seen_keys & IKEY_TOKEN) &&
+        else if ((hist.seen_keys & IKEY_TOKEN) &&
             hist.seen_keys & (IKEY_VALUES | IKEY_NODES)) {
             TRACE("??? DECIDING as R_GP")
             this->method = R_GP;
 
-            if (this->tok_len != 3 || this->tok[2] != OUR_TOK_GP) {
+            if (this->tok_len != GP_TOK_LEN ||
+                this->tok[GP_TOK_LEN - 1] != OUR_TOK_GP) {
                 TRACE("=== REJECT r_gp && not our gp tok")
                 XD_FAIL(ST_bd_z_bad_tok_gp)
             }
@@ -630,13 +705,19 @@ void KRPC::validate(const XDHist &hist) {
         //~TOKEN and ~VALUES and NODES <->R_FN
         else if (hist.seen_keys & IKEY_NODES) {
 
-            if (this->tok_len != 1 || this->tok[0] != OUR_TOK_FN) {
-                TRACE("=== REJECT r_fn && not our fn tok")
-                XD_FAIL(ST_bd_z_bad_tok_fn)
-            }
+            // nodes without BEP 51 answer sample_infohashes as find_node
+            if (this->tok_len == 1 && this->tok[0] == OUR_TOK_SI) {
+                TRACE("=== ACCEPT ~samples && nodes && our si tok -> R_SI")
+                this->method = R_SI;
+            } else {
+                if (this->tok_len != 1 || this->tok[0] != OUR_TOK_FN) {
+                    TRACE("=== REJECT r_fn && not our fn tok")
+                    XD_FAIL(ST_bd_z_bad_tok_fn)
+                }
 
-            TRACE("=== ACCEPT ~token && ~values && nodes -> R_FN")
-            this->method = R_FN;
+                TRACE("=== ACCEPT ~token && ~values && nodes -> R_FN")
+                this->method = R_FN;
+            }
         }
         //~NODES and ~VALUES <->R_PG
         else {
@@ -678,8 +759,13 @@ void KRPC::print() {
     } else if (method == Q_GP) {
         printf("\t\tQ_GP -> IH = %.*s\n", NIH_LEN, ih->raw);
 
-    } else if (method == Q_FN) {
-        printf("\t\tQ_FN -> TARGET = %.*s\n", NIH_LEN, target->raw);
+    } else if (method == Q_FN || method == Q_SI) {
+        printf("\t\t%s -> TARGET = %.*s\n", get_method_name(method), NIH_LEN,
+               target->raw);
+
+    } else if (method == R_SI) {
+        printf("\t\tR_SI -> SAMPLES[%u] = ... (INTERVAL = %u, NUM = %u)\n",
+               n_samples, si_interval, si_num);
 
     } else if (method == R_FN) {
         printf("\t\t R_FN -> NODES[%u] = ...\n", n_nodes);
@@ -34,25 +34,32 @@ namespace cht::bd {
 constexpr inline char keyname_ID[] = "id";
 constexpr inline char keyname_IMPLIED_PORT[] = "implied_port";
 constexpr inline char keyname_INFO_HASH[] = "info_hash";
+constexpr inline char keyname_INTERVAL[] = "interval";
 constexpr inline char keyname_NAME[] = "name";
 constexpr inline char keyname_NODES[] = "nodes";
+constexpr inline char keyname_NUM[] = "num";
 constexpr inline char keyname_PORT[] = "port";
+constexpr inline char keyname_SAMPLES[] = "samples";
 constexpr inline char keyname_TARGET[] = "target";
 constexpr inline char keyname_TOKEN[] = "token";
 constexpr inline char keyname_VALUES[] = "values";
 
 // breakdown:
-// i: id, implied_port, info_hash
-// n: name, nodes
+// i: id, implied_port, info_hash, interval
+// n: name, nodes, num
 // p: port
+// s: samples
 // t: target, token
 // v: values
 
 // by length:
 // 2: id
+// 3: num
 // 4: name, port
 // 5: nodes, token
 // 6: target, values
+// 7: samples
+// 8: interval
 // 9: info_hash
 // 12: implied_port
 
@@ -60,6 +67,7 @@ constexpr inline char valname_AP[] = "announce_peer";
 constexpr inline char valname_GP[] = "get_peers";
 constexpr inline char valname_FN[] = "find_node";
 constexpr inline char valname_PG[] = "ping";
+constexpr inline char valname_SI[] = "sample_infohashes";
 
 // BDECODE SIZES
 constexpr inline u16 MAXLEN = 1024;
@@ -94,19 +102,23 @@ enum Method {
     Q_FN = 1u << 1u,
     Q_GP = 1u << 2u,
     Q_PG = 1u << 3u,
+    Q_SI = 1u << 4u, // BEP 51 sample_infohashes
 
     R_FN = 1u << 5u,
     R_GP = 1u << 6u,
     R_PG = 1u << 7u,
+    R_SI = 1u << 8u,
 
-    R_ANY = (R_FN | R_GP | R_PG),
-    Q_ANY = (Q_AP | Q_FN | Q_GP | Q_PG),
+    R_ANY = (R_FN | R_GP | R_PG | R_SI),
+    Q_ANY = (Q_AP | Q_FN | Q_GP | Q_PG | Q_SI),
     ANY = R_ANY | Q_ANY,
 
 };
 
 MK_BIT_OPERATORS(Method)
 
+const char *get_method_name(Method);
+
 enum Key {
     NOKEY = 0,
     IKEY_VALUES = 1u,
@@ -123,6 +135,11 @@ enum Key {
     OKEY_Q = 1u << 11u,
     OKEY_R = 1u << 12u,
     OKEY_Y = 1u << 13u,
+    IKEY_SAMPLES = 1u << 14u,
+    IKEY_INTERVAL = 1u << 15u,
+    IKEY_NUM = 1u << 16u,
+
+    IKEY_ANY_SI = (IKEY_SAMPLES | IKEY_INTERVAL | IKEY_NUM),
 
     IKEY_ANY_BODY =
         (IKEY_NODES | IKEY_VALUES | IKEY_IH | IKEY_TARGET | IKEY_TOKEN),
@@ -162,6 +179,12 @@ class KRPC {
     const u8 *ap_name = nullptr;
     bool ap_implied_port = false;
 
+    // null if the r_si had no samples, i.e. the node does not do BEP 51
+    u32 n_samples = 0;
+    const Nih *samples = nullptr;
+    u32 si_interval = 0; // s
+    u32 si_num = 0;
+
   private:
     enum XDState {
         XD_START,
@@ -215,6 +238,11 @@ class KRPC {
         ap_name_len = 0;
         ap_name = nullptr;
         ap_implied_port = false;
+
+        n_samples = 0;
+        samples = nullptr;
+        si_interval = 0;
+        si_num = 0;
     }
     void parse_msg(u32 nread) {
         // NO CLEAR
@@ -1,13 +1,26 @@
+#include "api.hpp"
 #include "ctl.hpp"
+#include "db.hpp"
 #include "dht.hpp"
 #include "gpmap.hpp"
+#include "hll.hpp"
+#include "ihidx.hpp"
+#include "ihlog.hpp"
 #include "krpc.hpp"
 #include "log.hpp"
 #include "msg.hpp"
+#include "qsvc.hpp"
 #include "rt.hpp"
+#include "serve.hpp"
+#include "si.hpp"
 #include "spamfilter.hpp"
+#include "token.hpp"
+#include "topk.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <array>
 #include <functional>
 #include <vector>
 
@@ -37,13 +50,29 @@ namespace cht {
 
 #define AS_SIN(x) ((const SIN *)(x))
 
-constexpr u32 MSG_SEND_LEN = 256;
+constexpr u32 MSG_SEND_LEN = MSG_BUF_LEN;
 
 // UV HANDLES
 static uv_loop_t *main_loop;
 static uv_udp_t g_udp_server;
 static uv_timer_t g_statgather_timer;
 static uv_timer_t g_bootstrap_timer;
+static uv_timer_t g_rt_snapshot_timer;
+static uv_timer_t g_rt_refresh_timer;
+static uv_timer_t g_rt_fill_timer;
+static uv_timer_t g_gpm_tick_timer;
+static uv_timer_t g_db_sweep_timer;
+static uv_timer_t g_token_timer;
+#ifdef SI_CRAWL
+static uv_timer_t g_si_timer;
+#endif
+#ifdef SERVE
+static uv_timer_t g_serve_timer;
+#endif
+
+static u64 g_start_ms;
+// q_fn the fill crawler may still send before hearing back
+static u32 g_fill_tokens = RT_FILL_MAX_TOKENS;
 
 static std::vector<KRPC *> recv_buf_pool;
 static std::vector<uv_udp_send_t *> send_req_pool;
@@ -120,6 +149,9 @@ static void cb_recv_msg(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
     }
 
     st_inc(ST_rx_tot);
+    if (krpc->method & bd::Q_ANY) {
+        st_inc(ST_rx_q_tot);
+    }
     handle_msg(*krpc, *AS_SIN(saddr));
 
 cb_recv_msg_early_free:
@@ -205,9 +237,78 @@ void ping_sweep_nodes(const KRPC &krpc) {
     }
 }
 
-static void handle_msg(const KRPC &krpc, const SIN &saddr) {
+// Starts a lookup for the ih from its closest contacts in the rt, leaving out
+// the node with the given nid checksum.
+static bool seed_lookup(const Nih &ih, const PNode neigs[], u8 n_neigs,
+                        u32 skip_checksum, u32 tag = 0) {
+    std::array<PNode, RT_K_NEIGHBORS> seeds;
+    u8 n_seeds = 0;
+    for (u8 ix = 0; ix < n_neigs; ix++) {
+        if (neigs[ix].nid.checksum() != skip_checksum) {
+            seeds[n_seeds++] = neigs[ix];
+        }
+    }
+    if (n_seeds == 0) {
+        seeds[n_seeds++] = g_rt.get_random_valid_node();
+    }
+
+    return gpm::start_lookup(ih, seeds.data(), n_seeds, tag);
+}
+
+// Sends the get_peers the gpm has queued, telling it about any we drop, and
+// starts lookups for queued infohashes as lookups free up. Infohashes from
+// API clients go first, as far as their admission rate allows.
+static void send_gp_queries() {
+    gpm::Query query;
+    Nih ih;
+#ifdef GPM_API
+    u32 tag;
+#endif
+
+    while (true) {
+        if (gpm::pop_query(query)) {
+            if (!spam_check_tx_q_gp(query.dest.peerinfo.in_addr, query.ih)) {
+                gpm::fail_query(query.tok);
+                continue;
+            }
+
+            const auto &write_fn = [ih = query.ih, dest = query.dest.nid,
+                                    tok = query.tok](auto &buf) {
+                buf.len = msg::q_gp(reinterpret_cast<u8 *>(buf.base), dest,
+                                    ih, tok);
+            };
+
+            if (!send_msg(write_fn, query.dest, ST_tx_q_gp)) {
+                gpm::fail_query(query.tok);
+            }
+#ifdef GPM_API
+        } else if (api::pop_target(ih, tag)) {
+            std::array<PNode, RT_K_NEIGHBORS> neigs;
+            u8 n_neigs =
+                g_rt.get_neighbor_contacts(ih, neigs.data(), RT_K_NEIGHBORS);
+            if (!seed_lookup(ih, neigs.data(), n_neigs, 0, tag)) {
+                api::on_done(tag, ih, false);
+            }
+#endif
+        } else if (gpm::pop_pending(ih)) {
+            std::array<PNode, RT_K_NEIGHBORS> neigs;
+            u8 n_neigs =
+                g_rt.get_neighbor_contacts(ih, neigs.data(), RT_K_NEIGHBORS);
+            seed_lookup(ih, neigs.data(), n_neigs, 0);
+        } else {
+            break;
+        }
+    }
+
+#ifdef GPM_API
+    gpm::Done done;
+    while (gpm::pop_done(done)) {
+        api::on_done(done.tag, done.ih, done.found);
+    }
+#endif
+}
 
-    gpm::NextHop next_hop;
+static void handle_msg(const KRPC &krpc, const SIN &saddr) {
 
     switch (krpc.method) {
     case bd::Q_PG: {
@@ -223,13 +324,36 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
         break;
     }
 
-    case bd::Q_FN: {
-        st_inc(ST_rx_q_fn);
+    // without SERVE we have no samples to give, so q_si is answered as a
+    // find_node
+    case bd::Q_FN:
+    case bd::Q_SI: {
+        st_inc(krpc.method == bd::Q_SI ? ST_rx_q_si : ST_rx_q_fn);
+
+        std::array<PNode, RT_K_NEIGHBORS> payload;
+        u8 n_payload = g_rt.get_neighbor_contacts(*krpc.target, payload.data(),
+                                                  RT_K_NEIGHBORS);
+
+#ifdef SERVE
+        if (krpc.method == bd::Q_SI) {
+            const serve::Samples &samples = serve::next_samples();
+            auto const &write_fn = [krp = bd::KReply(krpc), payload, n_payload,
+                                    &samples](auto &buf) {
+                buf.len = msg::r_si(reinterpret_cast<u8 *>(buf.base), krp,
+                                    SERVE_SI_INTERVAL_S, payload.data(),
+                                    n_payload, samples.enc, samples.len);
+            };
 
-        auto payload = g_rt.get_neighbor_contact(*krpc.target);
+            send_msg(write_fn, saddr, ST_tx_r_si);
+            g_rt.insert_contact(krpc, saddr, 0);
+            break;
+        }
+#endif
 
-        auto const &write_fn = [krp = bd::KReply(krpc), payload](auto &buf) {
-            buf.len = msg::r_fn(reinterpret_cast<u8 *>(buf.base), krp, payload);
+        auto const &write_fn = [krp = bd::KReply(krpc), payload,
+                                n_payload](auto &buf) {
+            buf.len = msg::r_fn(reinterpret_cast<u8 *>(buf.base), krp,
+                                payload.data(), n_payload);
         };
 
         send_msg(write_fn, saddr, ST_tx_r_fn);
@@ -240,29 +364,51 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
 
     case bd::Q_GP: {
         st_inc(ST_rx_q_gp);
+#ifdef IHLOG
+        ihlog::log_ih(ihlog::SRC_Q_GP, *krpc.ih);
+#endif
+#ifdef HLL
+        hll::add_asker(*krpc.ih, saddr.sin_addr.s_addr);
+#endif
+#ifdef TOPK
+        topk::note(*krpc.ih);
+#endif
+#ifdef SI_CRAWL
+        si::note_gp_ih(*krpc.ih);
+#endif
+
+        bool pursue = gpm::decide_pursue_q_gp_ih(krpc);
 
-        auto [pursue, tok] = gpm::decide_pursue_q_gp_ih(krpc);
-        auto ih_neig = g_rt.get_neighbor_contact(*krpc.ih);
+        std::array<PNode, RT_K_NEIGHBORS> ih_neigs;
+        u8 n_ih_neigs = g_rt.get_neighbor_contacts(*krpc.ih, ih_neigs.data(),
+                                                   RT_K_NEIGHBORS);
 
         if (pursue) {
+            seed_lookup(*krpc.ih, ih_neigs.data(), n_ih_neigs,
+                        krpc.nid->checksum());
+            send_gp_queries();
+        }
 
-            if (ih_neig.nid.checksum == krpc.nid->checksum) {
-                ih_neig = g_rt.get_random_valid_node();
-            }
+        // reply to the sender node
 
-            auto const &write_fn = [=, tok = tok, ih = *krpc.ih](auto &buf) {
-                buf.len = msg::q_gp(reinterpret_cast<u8 *>(buf.base),
-                                    ih_neig.nid, ih, tok);
-            };
+        std::array<u8, TOKEN_LEN> ap_token;
+        token::make(saddr.sin_addr.s_addr, ap_token.data());
 
-            send_msg(write_fn, ih_neig, ST_tx_q_gp);
-            gpm::register_q_gp_ihash(ih_neig.nid, *krpc.ih, 0, tok);
+#ifdef SERVE
+        std::array<Peerinfo, SERVE_GP_VALUES> values;
+        u8 n_values = db::get_peers(*krpc.ih, values.data(), SERVE_GP_VALUES);
+        if (n_values > 0) {
+            st_inc(ST_tx_r_gp_values);
         }
-
-        // reply to the sender node
+#else
+        std::array<Peerinfo, 0> values;
+        u8 n_values = 0;
+#endif
 
         auto const &write_fn = [=, krp = bd::KReply(krpc)](auto &buf) {
-            buf.len = msg::r_gp(reinterpret_cast<u8 *>(buf.base), krp, ih_neig);
+            buf.len = msg::r_gp(reinterpret_cast<u8 *>(buf.base), krp,
+                                ih_neigs.data(), n_ih_neigs, ap_token.data(),
+                                values.data(), n_values);
         };
 
         send_msg(write_fn, saddr, ST_tx_r_gp);
@@ -276,12 +422,17 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
 
         DEBUG("got q_ap!")
 
-        // u16 ap_port;
-        // if (krpc->ap_implied_port) {
-        //     ap_port = saddr->sin_port;
-        // } else {
-        //     ap_port = (u16)krpc->ap_port;
-        // }
+#ifndef NOFILTER_AP
+        if (!token::check(saddr.sin_addr.s_addr, krpc.token, krpc.token_len)) {
+            st_inc(ST_bd_z_ap_bad_token);
+            break;
+        }
+#endif
+
+        Peerinfo announced;
+        announced.in_addr = saddr.sin_addr.s_addr;
+        announced.sin_port =
+            krpc.ap_implied_port ? saddr.sin_port : htons(krpc.ap_port);
 
         if (krpc.ap_name_len > 0) {
             if (!is_valid_utf8((unsigned char *)(krpc.ap_name),
@@ -292,8 +443,22 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
             // TODO handle AP with name
         }
 
-        // TODO db_update_peers(ih, [compact_peerinfo_bytes(saddr[0],
-        // ap_port)])
+        db::update_peers(*krpc.ih, &announced, 1);
+#ifdef IHLOG
+        ihlog::log_ih(ihlog::SRC_Q_AP, *krpc.ih, &announced);
+#endif
+#ifdef HLL
+        hll::add_peer(*krpc.ih, announced);
+#endif
+#ifdef TOPK
+        topk::note(*krpc.ih);
+#endif
+#ifdef SI_CRAWL
+        si::note_gp_ih(*krpc.ih);
+#endif
+
+        gpm::note_q_ap_ih(krpc);
+        send_gp_queries();
 
         const auto &write_fn = [krp = bd::KReply(krpc)](auto &buf) {
             buf.len = msg::r_pg(reinterpret_cast<u8 *>(buf.base), krp);
@@ -312,7 +477,8 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
             break;
         }
         ping_sweep_nodes(krpc);
-        // No add contact since we only q_fn the bootstrap node
+        g_fill_tokens = std::min(g_fill_tokens + 1, u32(RT_FILL_MAX_TOKENS));
+        g_rt.insert_contact(krpc, saddr, 1);
         break;
     }
 
@@ -327,43 +493,40 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
                 st_click_gp_n_hops(val);
             }
 #endif
-            gpm::clear_tok(krpc);
-            // TODO handle peer
+            Nih ih;
+            u32 tag;
+            if (gpm::get_tok_lookup(krpc, ih, tag)) {
+                db::update_peers(ih, krpc.peers, krpc.n_peers);
+#ifdef IHLOG
+                for (u32 ix = 0;
+                     ix < std::min(krpc.n_peers, u32(IHLOG_R_GP_PEERS)); ix++) {
+                    ihlog::log_ih(ihlog::SRC_R_GP, ih, &krpc.peers[ix]);
+                }
+#endif
+#ifdef HLL
+                for (u32 ix = 0; ix < krpc.n_peers; ix++) {
+                    hll::add_peer(ih, krpc.peers[ix]);
+                }
+#endif
+#ifdef SI_CRAWL
+                si::note_gp_ih(ih);
+#endif
+#ifdef GPM_API
+                if (tag != 0) {
+                    api::on_peers(tag, ih, krpc.peers, krpc.n_peers);
+                }
+#endif
+            }
             g_rt.insert_contact(krpc, saddr, 4);
         }
 
-        if (krpc.n_nodes == 0) {
-            break;
-        }
-
-        st_inc(ST_rx_r_gp_nodes);
-        ping_sweep_nodes(krpc);
-
-        if (!gpm::extract_tok(next_hop, krpc)) {
-            break;
+        if (krpc.n_nodes > 0) {
+            st_inc(ST_rx_r_gp_nodes);
+            ping_sweep_nodes(krpc);
         }
 
-        for (auto const &pn : next_hop.pnodes) {
-
-            if (!spam_check_tx_q_gp(pn.peerinfo.in_addr, next_hop.ih)) {
-                continue;
-            }
-
-            auto [ok, tok] = gpm::take_tok();
-            if (!ok) {
-                break;
-            }
-
-            const auto &write_fn = [ih = next_hop.ih, dest = pn.nid,
-                                    tok = tok](auto &buf) {
-                buf.len =
-                    msg::q_gp(reinterpret_cast<u8 *>(buf.base), dest, ih, tok);
-            };
-
-            send_msg(write_fn, pn, ST_tx_q_gp);
-            gpm::register_q_gp_ihash(pn.nid, next_hop.ih, next_hop.hop_ctr + 1,
-                                     tok);
-        }
+        gpm::handle_r_gp(krpc);
+        send_gp_queries();
         break;
     }
 
@@ -373,6 +536,15 @@ static void handle_msg(const KRPC &krpc, const SIN &saddr) {
         break;
     }
 
+    case bd::R_SI: {
+        st_inc(ST_rx_r_si);
+#ifdef SI_CRAWL
+        si::on_reply(krpc);
+#endif
+        g_rt.insert_contact(krpc, saddr, 1);
+        break;
+    }
+
     default:
         ERROR("Fell through in message handle! Not OK!")
         assert(0);
@@ -387,6 +559,40 @@ void init_subsystems() {
     // rt::init();
     VERBOSE("Initializing st...")
     st_init();
+    VERBOSE("Initializing gpm...")
+    gpm::init();
+    VERBOSE("Initializing db...")
+    db::init();
+    VERBOSE("Initializing token...")
+    token::init();
+#ifdef HLL
+    VERBOSE("Initializing hll...")
+    hll::init();
+#endif
+#ifdef SI_CRAWL
+    VERBOSE("Initializing si...")
+    si::init();
+#endif
+#ifdef TOPK
+    VERBOSE("Initializing topk...")
+    topk::init();
+#endif
+#ifdef IHIDX
+    VERBOSE("Initializing ihidx...")
+    ihidx::init();
+#endif
+#ifdef IHLOG
+    VERBOSE("Starting ihlog...")
+    ihlog::start();
+#endif
+#ifdef SERVE
+    VERBOSE("Initializing serve...")
+    serve::init();
+#endif
+#ifdef QSVC
+    VERBOSE("Starting qsvc...")
+    qsvc::start();
+#endif
     INFO("Initialized.")
     INFO("Rolling over stats every %d ms", STAT_ROLLOVER_FREQ_MS)
     INFO("Heartbeat every %d rollovers", STAT_HB_EVERY)
@@ -394,10 +600,71 @@ void init_subsystems() {
 #ifdef CTL_PPS_TARGET
     INFO("\ttarget ping rate: %.2f", CTL_PPS_TARGET);
 #endif
-    INFO("\tget peers timeout: %d ms", CTL_GPM_TIMEOUT_MS);
+    INFO("\tget peers timeout: %d ms, then p%d of replies within [%d, %d] ms",
+         CTL_GPM_TIMEOUT_MS, CTL_GPM_TIMEOUT_PCTILE, CTL_GPM_TIMEOUT_MIN_MS,
+         CTL_GPM_TIMEOUT_MAX_MS);
+    INFO("\tget peers tok: %d bytes, %d queries in flight", GP_TOK_LEN,
+         1 << GPM_IDX_BITS)
+    INFO("\tget peers lookups: %d at once, k = %d, alpha = %d",
+         1 << GPM_LOOKUP_BITS, GPM_K, GPM_ALPHA)
+    INFO("\tnot pursuing infohashes again for %d s", GPM_SEEN_WINDOW_S)
+    INFO("Keeping up to %d peers for each of %d infohashes for %d s",
+         DB_PEERS_PER_IH, 1 << (DB_LOG2_SHARDS + DB_LOG2_SHARD_SLOTS),
+         DB_PEER_TTL_S)
+    INFO("Snapshotting rt to " RT_FN " every %d ms", RT_SNAPSHOT_EVERY_MS)
+    INFO("Refreshing rt contacts stale after %d s, up to %d every %d ms",
+         RT_STALE_S, RT_REFRESH_BUDGET, RT_REFRESH_EVERY_MS)
 #ifdef MSG_CLOSE_SID
     INFO("Configured with MSG_CLOSE_SID: matching nids to 4 bytes.")
 #endif
+#ifdef RT_CONCURRENT
+    INFO("Configured with RT_CONCURRENT: sharing seqlocked rt " RT_SHM_FN)
+#endif
+#ifdef IHLOG
+    INFO("Configured with IHLOG: logging infohashes to " IHLOG_DIR)
+    INFO("\tsyncing every %d ms, %d MiB segments", IHLOG_SYNC_MS,
+         IHLOG_SEGMENT_BYTES >> 20)
+#endif
+#ifdef IHIDX
+    INFO("Configured with IHIDX: indexing infohashes in " IHIDX_FN)
+    INFO("\tgrowing from 2^%d slots at %d%% load, up to 2^%d slots",
+         IHIDX_LOG2_SLOTS_MIN, IHIDX_GROW_PCT, IHIDX_LOG2_SLOTS_MAX)
+#endif
+#ifdef HLL
+    INFO("Configured with HLL: estimating distinct peers and askers in %d "
+         "MiB at most", HLL_MAX_BYTES >> 20)
+#endif
+#ifdef TOPK
+    INFO("Configured with TOPK: publishing the hottest %d of %d infohashes to "
+         TOPK_FN, TOPK_PUBLISH, 1 << TOPK_LOG2_K)
+    INFO("\thalving counts every %d rollovers", TOPK_HALVE_EVERY)
+#endif
+#ifdef SI_CRAWL
+    INFO("Configured with SI_CRAWL: sending up to %d q_si every %d ms",
+         SI_BUDGET, SI_EVERY_MS)
+    INFO("\tasking contacts again after [%d, %d] s as they request",
+         SI_MIN_INTERVAL_S, SI_MAX_INTERVAL_S)
+#endif
+#ifdef SERVE
+    INFO("Configured with SERVE: answering q_si with %d samples, up to %d "
+         "values in r_gp", SERVE_SI_SAMPLES, SERVE_GP_VALUES)
+    INFO("\trebuilding one of %d sample buffers every %d ms",
+         SERVE_SI_BUFS, SERVE_REBUILD_MS)
+#endif
+#ifdef QSVC
+    INFO("Configured with QSVC: answering queries on " QSVC_SOCK_FN)
+    INFO("\tanswering up to %d peer and estimate queries per gpm tick",
+         QSVC_ASKS_PER_TICK)
+#endif
+#ifdef GPM_API
+    INFO("Configured with GPM_API: taking infohashes on " GPM_API_SOCK_FN)
+    INFO("\tstarting up to %d lookups/s, %d%% of lookups at most",
+         GPM_API_ADMIT_PER_S, GPM_API_MAX_SHARE_PCT)
+#endif
+#ifdef GPM_TRACE
+    INFO("Configured with GPM_TRACE: tracing 1 in %d lookups to " GPM_TRACE_FN,
+         GPM_TRACE_SAMPLE)
+#endif
 #ifdef RT_BIG
     INFO("Configured with RT_BIG: using depth-three routing table.")
 #endif
@@ -412,11 +679,132 @@ void init_subsystems() {
 }
 
 void loop_statgather_cb(uv_timer_t *timer) {
+#ifdef IHLOG
+    ihlog::report();
+#endif
+#ifdef IHIDX
+    ihidx::report();
+#endif
+#ifdef QSVC
+    qsvc::report();
+#endif
+#ifdef HLL
+    hll::report();
+#endif
+#ifdef TOPK
+    topk::publish();
+#endif
     st_rollover();
     DEBUG("Rolled over stats.")
 }
 
+void loop_gpm_tick_cb(uv_timer_t *timer) {
+    gpm::tick();
+    send_gp_queries();
+#ifdef QSVC
+    qsvc::serve_asks();
+#endif
+}
+
+void loop_db_sweep_cb(uv_timer_t *timer) {
+    db::sweep();
+}
+
+#ifdef SERVE
+void loop_serve_cb(uv_timer_t *timer) {
+    serve::rebuild();
+}
+#endif
+
+void loop_token_cb(uv_timer_t *timer) {
+    token::rotate();
+}
+
+void loop_rt_snapshot_cb(uv_timer_t *timer) {
+    g_rt.snapshot(main_loop);
+}
+
+void loop_rt_refresh_cb(uv_timer_t *timer) {
+    std::array<PNode, RT_REFRESH_BUDGET> stale;
+    u32 n_stale = g_rt.collect_stale(stale.data(), RT_REFRESH_BUDGET);
+
+    for (u32 ix = 0; ix < n_stale; ix++) {
+        if (!spam_check_tx_pg(stale[ix].peerinfo.in_addr)) {
+            continue;
+        }
+
+        msg_write_t write_fn = [nid = stale[ix].nid](uv_buf_t &buf) -> void {
+            buf.len = msg::q_pg(reinterpret_cast<u8 *>(buf.base), nid);
+        };
+
+        send_msg(write_fn, stale[ix], ST_tx_q_pg);
+    }
+}
+
+void loop_rt_fill_cb(uv_timer_t *timer) {
+    static bool reported_warmup = false;
+
+    u32 occupied = g_rt.occupancy();
+    st_set(ST_rt_occupied, occupied);
+
+    if (!reported_warmup && occupied >= 9 * (rt::RT::capacity() / 10)) {
+        reported_warmup = true;
+        st_set(ST_rt_warmup_90_ms, mono_ms() - g_start_ms);
+        INFO("rt reached 90%% occupancy %lu ms after startup",
+             mono_ms() - g_start_ms)
+    }
+
+    // unanswered q_fn eventually give their token back
+    g_fill_tokens =
+        std::min(g_fill_tokens + RT_FILL_LEAK_TOKENS, u32(RT_FILL_MAX_TOKENS));
+
+    std::array<rt::FillQuery, RT_FILL_MAX_TOKENS> queries;
+    u32 n_queries = g_rt.collect_fill_queries(queries.data(), g_fill_tokens);
+
+    for (u32 ix = 0; ix < n_queries; ix++) {
+        auto const &write_fn = [dest = queries[ix].dest.nid,
+                                target = queries[ix].target](auto &buf) {
+            buf.len =
+                msg::q_fn(reinterpret_cast<u8 *>(buf.base), dest, target);
+        };
+
+        if (send_msg(write_fn, queries[ix].dest, ST_tx_q_fn)) {
+            g_fill_tokens--;
+            st_inc(ST_rt_fill_q_fn);
+        }
+    }
+}
+
+#ifdef SI_CRAWL
+void loop_si_cb(uv_timer_t *timer) {
+    std::array<PNode, SI_BUDGET> dests;
+    u32 n_dests = si::collect_queries(dests.data(), SI_BUDGET);
+
+    for (u32 ix = 0; ix < n_dests; ix++) {
+        if (!spam_check_tx_pg(dests[ix].peerinfo.in_addr)) {
+            continue;
+        }
+
+        // the target only picks the nodes that come with the samples
+        Nih target;
+        getrandom(target.raw.data(), NIH_LEN, 0);
+
+        auto const &write_fn = [dest = dests[ix].nid, target](auto &buf) {
+            buf.len =
+                msg::q_si(reinterpret_cast<u8 *>(buf.base), dest, target);
+        };
+
+        send_msg(write_fn, dests[ix], ST_tx_q_si);
+    }
+}
+#endif
+
 void loop_bootstrap_cb(uv_timer_t *timer) {
+    // the fill crawler takes over once there are contacts to ask
+    if (g_rt.occupancy() >= RT_BOOTSTRAP_BELOW) {
+        return;
+    }
+
     Nih random_target;
     getrandom(random_target.raw, NIH_LEN, 0);
 
@@ -432,6 +820,7 @@ void loop_bootstrap_cb(uv_timer_t *timer) {
 }; // namespace cht
 
 int main(int argc, char *argv[]) {
+    g_start_ms = mono_ms();
     init_subsystems();
 
     int status;
@@ -466,6 +855,71 @@ int main(int argc, char *argv[]) {
 
     CHECK(status, "boostrap start")
 
+    // INIT RT SNAPSHOTS
+    status = uv_timer_init(main_loop, &g_rt_snapshot_timer);
+    CHECK(status, "rt snapshot timer init");
+    status = uv_timer_start(&g_rt_snapshot_timer, &loop_rt_snapshot_cb,
+                            RT_SNAPSHOT_EVERY_MS, RT_SNAPSHOT_EVERY_MS);
+    CHECK(status, "rt snapshot start")
+
+    // INIT RT FILL CRAWLER
+    status = uv_timer_init(main_loop, &g_rt_fill_timer);
+    CHECK(status, "rt fill timer init");
+    status = uv_timer_start(&g_rt_fill_timer, &loop_rt_fill_cb,
+                            RT_FILL_EVERY_MS, RT_FILL_EVERY_MS);
+    CHECK(status, "rt fill start")
+
+    // INIT RT LIVENESS REFRESH
+    status = uv_timer_init(main_loop, &g_rt_refresh_timer);
+    CHECK(status, "rt refresh timer init");
+    status = uv_timer_start(&g_rt_refresh_timer, &loop_rt_refresh_cb,
+                            RT_REFRESH_EVERY_MS, RT_REFRESH_EVERY_MS);
+    CHECK(status, "rt refresh start")
+
+    // INIT GPM TIMEOUTS
+    status = uv_timer_init(main_loop, &g_gpm_tick_timer);
+    CHECK(status, "gpm tick timer init");
+    status = uv_timer_start(&g_gpm_tick_timer, &loop_gpm_tick_cb, GPM_TICK_MS,
+                            GPM_TICK_MS);
+    CHECK(status, "gpm tick start")
+
+    // INIT PEER STORE EXPIRY
+    status = uv_timer_init(main_loop, &g_db_sweep_timer);
+    CHECK(status, "db sweep timer init");
+    status = uv_timer_start(&g_db_sweep_timer, &loop_db_sweep_cb,
+                            DB_SWEEP_EVERY_MS, DB_SWEEP_EVERY_MS);
+    CHECK(status, "db sweep start")
+
+    // INIT ANNOUNCE TOKEN ROTATION
+    status = uv_timer_init(main_loop, &g_token_timer);
+    CHECK(status, "token timer init");
+    status = uv_timer_start(&g_token_timer, &loop_token_cb, TOKEN_ROTATE_MS,
+                            TOKEN_ROTATE_MS);
+    CHECK(status, "token start")
+
+#ifdef SI_CRAWL
+    // INIT SAMPLE_INFOHASHES CRAWLER
+    status = uv_timer_init(main_loop, &g_si_timer);
+    CHECK(status, "si timer init");
+    status =
+        uv_timer_start(&g_si_timer, &loop_si_cb, SI_EVERY_MS, SI_EVERY_MS);
+    CHECK(status, "si start")
+#endif
+
+#ifdef SERVE
+    // INIT SAMPLE BUFFER ROTATION
+    status = uv_timer_init(main_loop, &g_serve_timer);
+    CHECK(status, "serve timer init");
+    status = uv_timer_start(&g_serve_timer, &loop_serve_cb, SERVE_REBUILD_MS,
+                            SERVE_REBUILD_MS);
+    CHECK(status, "serve start")
+#endif
+
+#ifdef GPM_API
+    // INIT TARGETED LOOKUP API
+    api::init(main_loop);
+#endif
+
     // RUN LOOP
     INFO("Starting loop.")
     uv_run(main_loop, UV_RUN_DEFAULT);
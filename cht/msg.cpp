@@ -2,7 +2,8 @@
 #include <cassert>
 #include <uv.h>
 
-#include <charconv>
+#include <algorithm>
+#include <array>
 
 using namespace cht;
 namespace cht::msg {
@@ -25,21 +26,36 @@ static constexpr u8 Q_FN_PROTO[] = {
 static constexpr i32 Q_FN_SID_OFFSET = 12;
 static constexpr i32 Q_FN_TARGET_OFFSET = 43;
 
-static constexpr u8 Q_GP_PROTO[97] = {
-    'd', '1', ':', 'a', 'd', '2', ':', 'i', 'd', '2', '0',        ':', // 12
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,                    // 22
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,                    // 32
-    '9', ':', 'i', 'n', 'f', 'o', '_', 'h', 'a', 's', 'h',        '2',
+// BEP 51, laid out as Q_FN_PROTO up to the q
+static constexpr u8 Q_SI_PROTO[] = {
+    'd', '1', ':',        'a', 'd', '2', ':', 'i', 'd', '2', '0', ':', // 12
+    0,   0,   0,          0,   0,   0,   0,   0,   0,   0,             // 22
+    0,   0,   0,          0,   0,   0,   0,   0,   0,   0,             // 32
+    '6', ':', 't',        'a', 'r', 'g', 'e', 't', '2', '0', ':',      // 43
+    0,   0,   0,          0,   0,   0,   0,   0,   0,   0,             // 53
+    0,   0,   0,          0,   0,   0,   0,   0,   0,   0,             // 63
+    'e', '1', ':',        'q', '1', '7', ':',                          // 70
+    's', 'a', 'm',        'p', 'l', 'e', '_', 'i', 'n', 'f', 'o',      // 81
+    'h', 'a', 's',        'h', 'e', 's', '1', ':', 't',                // 90
+    '1', ':', OUR_TOK_SI, '1', ':', 'y', '1', ':', 'q', 'e',           // 100
+};
+
+// the t of get_peers queries is variable width, see GP_TOK_LEN
+static constexpr u8 Q_GP_HEAD[84] = {
+    'd', '1', ':', 'a', 'd', '2', ':', 'i', 'd', '2', '0', ':', // 12
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,             // 22
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,             // 32
+    '9', ':', 'i', 'n', 'f', 'o', '_', 'h', 'a', 's', 'h', '2',
     '0', ':', // 46
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,          0,
-    0,   0,   0,   0,   0,   0,   0,   0,                              // 66
-    'e', '1', ':', 'q', '9', ':', 'g', 'e', 't', '_', 'p',        'e', // 78
-    'e', 'r', 's', '1', ':', 't', '3', ':', 0,   0,   OUR_TOK_GP, '1', // 90
-    ':', 'y', '1', ':', 'q', 'e',                                      // 96
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,                       // 66
+    'e', '1', ':', 'q', '9', ':', 'g', 'e', 't', '_', 'p', 'e', // 78
+    'e', 'r', 's', '1', ':', 't',                               // 84
 };
 static constexpr i32 Q_GP_SID_OFFSET = 12;
 static constexpr i32 Q_GP_IH_OFFSET = 46;
-static constexpr i32 Q_GP_TOK_OFFSET = 86;
+
+static constexpr u8 Q_TAIL[7] = {'1', ':', 'y', '1', ':', 'q', 'e'};
 
 static constexpr u8 Q_PG_PROTO[] = {
     'd', '1', ':', 'a',        'd', '2', ':', 'i', 'd', '2', '0', ':', // 12
@@ -59,15 +75,53 @@ static constexpr u8 R_BASE[38] = {
 };
 static constexpr i16 R_SID_OFFSET = -20;
 
-static constexpr u8 R_NODES[36] = {
-    '5', ':', 'n', 'o', 'd', 'e', 's', '2', '6', ':', // 10
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0, 0,
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0, 0,
+static constexpr u8 R_NODES[7] = {
+    '5', ':', 'n', 'o', 'd', 'e', 's',
+};
+
+// Bencoded string length prefixes, e.g. "26:", indexed by string length.
+struct LenPrefix {
+    u8 len;
+    u8 raw[4];
+};
+
+constexpr u32 MAX_PREFIXED_LEN = std::max<u32>(PNODE_LEN * RT_K_NEIGHBORS,
+                                              NIH_LEN * MSG_SI_MAX_SAMPLES);
+static_assert(MAX_PREFIXED_LEN >= bd::MAXLEN_TOK);
+static_assert(MAX_PREFIXED_LEN < 1000);
+
+static constexpr auto LEN_PREFIX = [] {
+    std::array<LenPrefix, MAX_PREFIXED_LEN + 1> out = {};
+    for (u32 len = 0; len <= MAX_PREFIXED_LEN; len++) {
+        auto &pfx = out[len];
+        if (len >= 100) {
+            pfx.raw[pfx.len++] = '0' + len / 100;
+        }
+        if (len >= 10) {
+            pfx.raw[pfx.len++] = '0' + (len / 10) % 10;
+        }
+        pfx.raw[pfx.len++] = '0' + len % 10;
+        pfx.raw[pfx.len++] = ':';
+    }
+    return out;
+}();
+
+static constexpr u8 R_TOKEN[7] = {
+    '5', ':', 't', 'o', 'k', 'e', 'n',
+};
+
+static constexpr u8 R_VALUES[9] = {
+    '6', ':', 'v', 'a', 'l', 'u', 'e', 's', 'l',
 };
-static constexpr i16 R_NODES_OFFSET = -26;
 
-static constexpr u8 R_TOKEN[10] = {
-    '5', ':', 't', 'o', 'k', 'e', 'n', '1', ':', OUR_TOKEN,
+static constexpr u8 R_INTERVAL[10] = {
+    '8', ':', 'i', 'n', 't', 'e', 'r', 'v', 'a', 'l',
+};
+
+static constexpr u8 R_NUM[5] = {'3', ':', 'n', 'u', 'm'};
+
+static constexpr u8 R_SAMPLES[9] = {
+    '7', ':', 's', 'a', 'm', 'p', 'l', 'e', 's',
 };
 
 template <size_t N>
@@ -76,15 +130,46 @@ static inline void append(i32 &offset, u8 *dst, const u8 src[N]) {
     offset += N;
 }
 
+static inline void append_len_prefix(i32 &offset, u8 *dst, u32 len) {
+    assert(len <= MAX_PREFIXED_LEN);
+    const auto &pfx = LEN_PREFIX[len];
+    memcpy(dst + offset, pfx.raw, pfx.len);
+    offset += pfx.len;
+}
+
+static inline void append_int(i32 &offset, u8 *dst, u64 val) {
+    u8 digits[20];
+    u32 n_digits = 0;
+    do {
+        digits[n_digits++] = '0' + val % 10;
+        val /= 10;
+    } while (val > 0);
+
+    dst[offset++] = 'i';
+    while (n_digits > 0) {
+        dst[offset++] = digits[--n_digits];
+    }
+    dst[offset++] = 'e';
+}
+
+static inline void append_nodes(i32 &offset, u8 *buf, const PNode nodes[],
+                                u8 n_nodes) {
+    assert(n_nodes <= RT_K_NEIGHBORS);
+    append<sizeof(R_NODES)>(offset, buf, R_NODES);
+    append_len_prefix(offset, buf, n_nodes * PNODE_LEN);
+    memcpy(buf + offset, nodes, n_nodes * PNODE_LEN);
+    offset += n_nodes * PNODE_LEN;
+}
+
 static inline void close_r_with_tok(i32 &offset, u8 *buf,
                                     const bd::KReply &krpc) {
     // close inner dict
     buf[offset++] = 'e';
 
-    offset +=
-        sprintf(reinterpret_cast<char *>(buf + offset), "1:t%u:", krpc.tok_len);
-    // Can't use sprintf because
-    // of possible null bytes
+    buf[offset++] = '1';
+    buf[offset++] = ':';
+    buf[offset++] = 't';
+    append_len_prefix(offset, buf, krpc.tok_len);
     memcpy(buf + offset, krpc.tok, krpc.tok_len);
     offset += krpc.tok_len;
 
@@ -103,15 +188,23 @@ static inline void write_sid(u8 *buf, const Nih &nid) {
     write_sid_raw(buf);
 }
 
-i32 q_gp(u8 *buf, const Nih &nid, const Nih &infohash, u16 tok) {
+i32 q_gp(u8 *buf, const Nih &nid, const Nih &infohash, u64 tok) {
 
-    memcpy(buf, Q_GP_PROTO, sizeof(Q_GP_PROTO));
+    i32 offset = 0;
 
+    append<sizeof(Q_GP_HEAD)>(offset, buf, Q_GP_HEAD);
     write_sid(buf + Q_GP_SID_OFFSET, nid);
     set_nih(buf + Q_GP_IH_OFFSET, infohash.raw._raw);
-    *reinterpret_cast<u16 *>(buf + Q_GP_TOK_OFFSET) = tok;
 
-    return sizeof(Q_GP_PROTO);
+    append_len_prefix(offset, buf, GP_TOK_LEN);
+    for (int ix = 0; ix < GP_TOK_LEN - 1; ix++) {
+        buf[offset++] = u8(tok >> (8 * ix));
+    }
+    buf[offset++] = OUR_TOK_GP;
+
+    append<sizeof(Q_TAIL)>(offset, buf, Q_TAIL);
+
+    return offset;
 }
 
 i32 q_fn(u8 *buf, const Nih &nid, const Nih &target) {
@@ -123,6 +216,15 @@ i32 q_fn(u8 *buf, const Nih &nid, const Nih &target) {
     return sizeof(Q_FN_PROTO);
 }
 
+i32 q_si(u8 *buf, const Nih &nid, const Nih &target) {
+    memcpy(buf, Q_SI_PROTO, sizeof(Q_SI_PROTO));
+
+    set_nih(buf + Q_FN_TARGET_OFFSET, target.raw._raw);
+    write_sid(buf + Q_FN_SID_OFFSET, nid);
+
+    return sizeof(Q_SI_PROTO);
+}
+
 i32 q_pg(u8 *buf, const Nih &nid) {
     memcpy(buf, Q_PG_PROTO, sizeof(Q_PG_PROTO));
     write_sid(buf + Q_PG_SID_OFFSET, nid);
@@ -130,32 +232,85 @@ i32 q_pg(u8 *buf, const Nih &nid) {
     return sizeof(Q_PG_PROTO);
 }
 
-i32 r_fn(u8 *buf, const bd::KReply &krpc, const PNode &pnode) {
+i32 r_fn(u8 *buf, const bd::KReply &krpc, const PNode nodes[], u8 n_nodes) {
 
     i32 offset = 0;
 
     append<sizeof(R_BASE)>(offset, buf, R_BASE);
     write_sid(buf + offset + R_SID_OFFSET, krpc.nid);
 
-    append<sizeof(R_NODES)>(offset, buf, R_NODES);
-    set_pnode(buf + offset + R_NODES_OFFSET, pnode.raw);
+    append_nodes(offset, buf, nodes, n_nodes);
 
     close_r_with_tok(offset, buf, krpc);
 
     return offset;
 }
 
-i32 r_gp(u8 *buf, const bd::KReply &krpc, const PNode &payload) {
+i32 r_gp(u8 *buf, const bd::KReply &krpc, const PNode nodes[], u8 n_nodes,
+         const u8 token[], const Peerinfo values[], u8 n_values) {
 
+    assert(n_values <= MSG_GP_MAX_VALUES);
     i32 offset = 0;
 
     append<sizeof(R_BASE)>(offset, buf, R_BASE);
     write_sid(buf + offset + R_SID_OFFSET, krpc.nid);
 
-    append<sizeof(R_NODES)>(offset, buf, R_NODES);
-    set_pnode(buf + offset + R_NODES_OFFSET, payload.raw);
+    append_nodes(offset, buf, nodes, n_nodes);
 
     append<sizeof(R_TOKEN)>(offset, buf, R_TOKEN);
+    append_len_prefix(offset, buf, TOKEN_LEN);
+    memcpy(buf + offset, token, TOKEN_LEN);
+    offset += TOKEN_LEN;
+
+    if (n_values > 0) {
+        append<sizeof(R_VALUES)>(offset, buf, R_VALUES);
+        for (u32 ix = 0; ix < n_values; ix++) {
+            append_len_prefix(offset, buf, PEERINFO_LEN);
+            memcpy(buf + offset, values[ix].packed, PEERINFO_LEN);
+            offset += PEERINFO_LEN;
+        }
+        buf[offset++] = 'e';
+    }
+
+    close_r_with_tok(offset, buf, krpc);
+
+    return offset;
+}
+
+i32 si_samples(u8 *buf, u32 num, const Nih samples[], u32 n_samples) {
+
+    assert(n_samples <= MSG_SI_MAX_SAMPLES);
+    i32 offset = 0;
+
+    append<sizeof(R_NUM)>(offset, buf, R_NUM);
+    append_int(offset, buf, num);
+
+    append<sizeof(R_SAMPLES)>(offset, buf, R_SAMPLES);
+    append_len_prefix(offset, buf, n_samples * NIH_LEN);
+    for (u32 ix = 0; ix < n_samples; ix++) {
+        set_nih(buf + offset, samples[ix].raw._raw);
+        offset += NIH_LEN;
+    }
+
+    return offset;
+}
+
+i32 r_si(u8 *buf, const bd::KReply &krpc, u32 interval_s, const PNode nodes[],
+         u8 n_nodes, const u8 samples[], u32 samples_len) {
+
+    i32 offset = 0;
+
+    append<sizeof(R_BASE)>(offset, buf, R_BASE);
+    write_sid(buf + offset + R_SID_OFFSET, krpc.nid);
+
+    append<sizeof(R_INTERVAL)>(offset, buf, R_INTERVAL);
+    append_int(offset, buf, interval_s);
+
+    append_nodes(offset, buf, nodes, n_nodes);
+
+    // num and samples, already encoded
+    memcpy(buf + offset, samples, samples_len);
+    offset += samples_len;
 
     close_r_with_tok(offset, buf, krpc);
 
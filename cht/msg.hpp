@@ -15,17 +15,44 @@ constexpr inline u8 SID4 = 0;
 constexpr inline u8 SID4 = 0xff;
 #endif
 
-#define MSG_BUF_LEN 256
+#define MSG_BUF_LEN 1024
 
-static_assert(100 + bd::MAXLEN_TOK < MSG_BUF_LEN);
+// the most infohashes an r_si and peers an r_gp carry
+#ifndef MSG_SI_MAX_SAMPLES
+#define MSG_SI_MAX_SAMPLES 20
+#endif
+#ifndef MSG_GP_MAX_VALUES
+#define MSG_GP_MAX_VALUES 16
+#endif
+
+// "3:numi<u32>e7:samples<len>:" and the samples
+constexpr inline u32 MSG_SI_SAMPLES_MAXLEN = 40 + NIH_LEN * MSG_SI_MAX_SAMPLES;
 
-i32 q_gp(u8 buf[], const Nih &nid, const Nih &ih, u16 tok);
+// largest replies are an r_si or an r_gp carrying a full nodes string
+static_assert(100 + PNODE_LEN * RT_K_NEIGHBORS + MSG_SI_SAMPLES_MAXLEN +
+                  bd::MAXLEN_TOK <
+              MSG_BUF_LEN);
+static_assert(100 + PNODE_LEN * RT_K_NEIGHBORS + 8 * MSG_GP_MAX_VALUES + 16 +
+                  bd::MAXLEN_TOK <
+              MSG_BUF_LEN);
+
+i32 q_gp(u8 buf[], const Nih &nid, const Nih &ih, u64 tok);
 i32 q_fn(u8 buf[], const Nih &nid, const Nih &target);
 i32 q_pg(u8 buf[], const Nih &nid);
-i32 r_fn(u8 buf[], const bd::KReply &, const PNode &);
-i32 r_gp(u8 buf[], const bd::KReply &, const PNode &);
+i32 q_si(u8 buf[], const Nih &nid, const Nih &target);
+i32 r_fn(u8 buf[], const bd::KReply &, const PNode nodes[], u8 n_nodes);
+// token is TOKEN_LEN bytes, see token.hpp
+i32 r_gp(u8 buf[], const bd::KReply &, const PNode nodes[], u8 n_nodes,
+         const u8 token[], const Peerinfo values[] = nullptr,
+         u8 n_values = 0);
 i32 r_pg(u8 buf[], const bd::KReply &);
 
+// Bencodes the num and samples keys of an r_si, at most MSG_SI_SAMPLES_MAXLEN
+// bytes, so they can be built once and handed to any number of r_si.
+i32 si_samples(u8 buf[], u32 num, const Nih samples[], u32 n_samples);
+i32 r_si(u8 buf[], const bd::KReply &, u32 interval_s, const PNode nodes[],
+         u8 n_nodes, const u8 samples[], u32 samples_len);
+
 void init_msg();
 
 } // namespace cht::msg
@@ -0,0 +1,68 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+#include <utility>
+
+using namespace cht;
+namespace cht::oa {
+
+/// Pieces shared by the open-addressed tables keyed by infohash. They probe
+/// linearly from a home slot taken from the top bits of the hash, and erase
+/// by shifting entries back instead of leaving tombstones. Slots are named by
+/// position, and the table is reached through the callbacks, so entries can
+/// be stored inline or as indices into a pool.
+
+// Infohashes are close to random already, so a multiply of the first word
+// spreads them. The seed keeps crafted ones from piling into one run.
+inline u64 hash_ih(const Nih &ih, u64 seed) {
+    u64 lo;
+    memcpy(&lo, ih.raw.data(), sizeof(u64));
+    return (lo ^ seed) * 0x9e3779b97f4a7c15ull;
+}
+
+// hash_ih with the second word folded in, which also fills the low bits.
+inline u64 hash_ih_wide(const Nih &ih, u64 seed) {
+    u64 hi;
+    memcpy(&hi, ih.raw.data() + sizeof(u64), sizeof(u64));
+    u64 h = hash_ih(ih, seed);
+    return h ^ (hi + (h >> 29));
+}
+
+// The slot from home on for which matches(pos) holds, or the empty slot it
+// would go in. The table of mask + 1 slots must not be full.
+template <typename IsSet, typename Matches>
+inline std::pair<bool, u32> find(u32 home, u32 mask, IsSet &&is_set,
+                                 Matches &&matches) {
+    u32 pos = home;
+    while (is_set(pos)) {
+        if (matches(pos)) {
+            return {true, pos};
+        }
+        pos = (pos + 1) & mask;
+    }
+    return {false, pos};
+}
+
+// Empties slot pos, shifting later entries of its probe run back so lookups
+// never need tombstones. home_of(pos) is the home slot of the entry at pos,
+// move(from, to) copies an entry over and clear(pos) empties a slot.
+template <typename IsSet, typename HomeOf, typename Move, typename Clear>
+inline void erase(u32 pos, u32 mask, IsSet &&is_set, HomeOf &&home_of,
+                  Move &&move, Clear &&clear) {
+    u32 hole = pos;
+    u32 next = (pos + 1) & mask;
+    while (is_set(next)) {
+        u32 home = home_of(next);
+        // the entry may move back if the hole is not before its home
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            move(next, hole);
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    clear(hole);
+}
+
+} // namespace cht::oa
@@ -0,0 +1,751 @@
+#include "qsvc.hpp"
+#include "hll.hpp"
+#include "ihidx.hpp"
+#include "log.hpp"
+#include "ring.hpp"
+#include "stat.hpp"
+#include "util.hpp"
+#include "uvsrv.hpp"
+
+#include <array>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+#include <uv.h>
+}
+
+using namespace cht;
+namespace cht::qsvc {
+
+#ifdef QSVC
+
+// a query for the loop, for OP_PEERS or OP_CARD
+struct Ask {
+    Nih ih;
+    u8 op;
+};
+
+struct Answer {
+    u8 n_peers;
+    Peerinfo peers[MAX_PEERS];
+    Card card;
+};
+
+// The service thread asks, the loop answers in the same order. The service
+// thread never has more queries out than a ring holds, so the loop always
+// has room for its answers.
+static SpscRing<Ask, QSVC_LOG2_RING> g_asks;
+static SpscRing<Answer, QSVC_LOG2_RING> g_answers;
+
+static constexpr u64 STREAM_N = u64(1) << QSVC_SUB_LOG2_RING;
+static constexpr u64 STREAM_MASK = STREAM_N - 1;
+static constexpr u32 EVENT_WORDS = sizeof(Event) / sizeof(u32);
+static_assert(EVENT_WORDS * sizeof(u32) == sizeof(Event));
+
+// The subscriber stream, as the words of STREAM_N Events. Only the loop
+// thread writes it, and it publishes every event by bumping g_stream_head
+// after writing it.
+static std::vector<u32> g_stream(STREAM_N * EVENT_WORDS);
+static u64 g_stream_head = 0;
+
+static inline u32 *event_words(u64 pos) {
+    return g_stream.data() + (pos & STREAM_MASK) * EVENT_WORDS;
+}
+
+/*
+Everything below up to serve_asks belongs to the service thread, which
+does not log or count stats itself.
+*/
+
+struct Request {
+    u64 seq;
+    ReqHeader hdr;
+    u8 status;
+    // peer answers still to come
+    u32 n_waiting;
+    u64 t0_us;
+    std::string entries;
+};
+
+struct Client {
+    uv_pipe_t pipe;
+    std::vector<u8> inbuf;
+    // unanswered requests, oldest first
+    std::deque<Request> pending;
+    u64 next_seq;
+    // bumped for every connection, so answers for an earlier client in the
+    // slot are not given to this one
+    u32 gen;
+    bool reading;
+    bool is_set;
+};
+
+// a query out to the loop
+struct Asked {
+    u32 slot;
+    u32 gen;
+    u64 req_seq;
+};
+
+static uv_loop_t g_loop;
+static uv_pipe_t g_server;
+static uv_async_t g_wake;
+static std::array<Client, QSVC_MAX_CLIENTS> g_clients;
+static std::deque<Asked> g_asked;
+static ihidx::Reader g_index;
+
+static char g_read_buf[1 << 16];
+
+struct Subscriber {
+    uv_pipe_t pipe;
+    // events before this have been sent or filtered out
+    u64 cursor;
+    SubRequest filter;
+    // what came in of the next SubRequest so far
+    std::array<u8, sizeof(SubRequest)> req;
+    u32 req_len;
+    // the part of an event a short write left unsent, which goes first
+    std::array<u8, sizeof(Event)> rest;
+    u32 rest_off;
+    u32 rest_len;
+    bool subscribed;
+    bool is_set;
+};
+
+// a run of adjacent events going out in one iovec
+struct Run {
+    u64 from;
+    u32 n_events;
+};
+
+static uv_pipe_t g_sub_server;
+static uv_timer_t g_sub_timer;
+static std::array<Subscriber, QSVC_SUB_MAX> g_subs;
+
+// written by the service thread, read by the loop thread
+static u64 g_n_clients = 0;
+static u64 g_n_requests = 0;
+static u64 g_n_ihs = 0;
+static u64 g_n_busy = 0;
+static u64 g_n_bad_ops = 0;
+static u64 g_lat_us_sum = 0;
+static u64 g_lat_n = 0;
+// also reset by the loop thread
+static u64 g_lat_us_max = 0;
+static u64 g_n_subs = 0;
+static u64 g_n_sub_events = 0;
+static u64 g_n_sub_skipped = 0;
+static u64 g_n_sub_torn = 0;
+
+// what the loop thread reported so far
+static u64 g_rep_requests = 0;
+static u64 g_rep_ihs = 0;
+static u64 g_rep_busy = 0;
+static u64 g_rep_bad_ops = 0;
+static u64 g_rep_lat_us_sum = 0;
+static u64 g_rep_lat_n = 0;
+static u64 g_rep_sub_events = 0;
+static u64 g_rep_sub_skipped = 0;
+static u64 g_rep_sub_torn = 0;
+
+static inline u64 mono_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1000000 + u64(ts.tv_nsec) / 1000;
+}
+
+static inline u64 backlog(Client &cl) {
+    return uv_stream_get_write_queue_size(
+        reinterpret_cast<uv_stream_t *>(&cl.pipe));
+}
+
+// Whether the client in the slot is still the one that had gen, and has not
+// started closing.
+static inline bool is_live(Client &cl, u32 gen) {
+    return cl.is_set && cl.gen == gen &&
+           !uv_is_closing(reinterpret_cast<uv_handle_t *>(&cl.pipe));
+}
+
+static void pump(Client &cl);
+
+static void on_written(u32 slot, u32 gen) {
+    Client &cl = g_clients[slot];
+    // we may have stopped reading until the client caught up
+    if (is_live(cl, gen) && !cl.reading) {
+        pump(cl);
+    }
+}
+
+static void send_str(Client &cl, std::string &&data) {
+    u32 slot = &cl - g_clients.data();
+    uvsrv::send_str<on_written>(reinterpret_cast<uv_stream_t *>(&cl.pipe),
+                                slot, cl.gen, std::move(data));
+}
+
+// Sends the replies of finished requests at the front, keeping them in
+// request order.
+static void flush(Client &cl) {
+    std::string out;
+    u64 now = mono_us();
+
+    while (!cl.pending.empty() && cl.pending.front().n_waiting == 0) {
+        Request &req = cl.pending.front();
+
+        RespHeader hdr;
+        hdr.len = sizeof(hdr) - sizeof(hdr.len) + req.entries.size();
+        hdr.id = req.hdr.id;
+        hdr.op = req.hdr.op;
+        hdr.status = req.status;
+        hdr.n_ihs = req.status == RS_OK ? req.hdr.n_ihs : 0;
+        hdr._pad = 0;
+        out.append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        out += req.entries;
+
+        u64 lat_us = now - req.t0_us;
+        ctr_add(g_lat_us_sum, lat_us);
+        ctr_add(g_lat_n, 1);
+        u64 max = __atomic_load_n(&g_lat_us_max, __ATOMIC_RELAXED);
+        while (lat_us > max &&
+               !__atomic_compare_exchange_n(&g_lat_us_max, &max, lat_us, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+
+        cl.pending.pop_front();
+    }
+
+    if (!out.empty()) {
+        send_str(cl, std::move(out));
+    }
+}
+
+static void handle_request(Client &cl, const ReqHeader &hdr, const u8 *ihs) {
+    Request &req = cl.pending.emplace_back();
+    req.seq = cl.next_seq++;
+    req.hdr = hdr;
+    req.status = RS_OK;
+    req.n_waiting = 0;
+    req.t0_us = mono_us();
+
+    ctr_add(g_n_requests, 1);
+    ctr_add(g_n_ihs, hdr.n_ihs);
+
+    Nih ih;
+    ihidx::Entry entry;
+
+    switch (hdr.op) {
+    case OP_SEEN:
+        for (u32 ix = 0; ix < hdr.n_ihs; ix++) {
+            memcpy(ih.raw.data(), ihs + ix * NIH_LEN, NIH_LEN);
+            req.entries.push_back(g_index.find(ih, entry) ? 1 : 0);
+        }
+        break;
+    case OP_COUNTS:
+        req.entries.reserve(hdr.n_ihs * sizeof(Counts));
+        for (u32 ix = 0; ix < hdr.n_ihs; ix++) {
+            memcpy(ih.raw.data(), ihs + ix * NIH_LEN, NIH_LEN);
+            Counts counts = {0};
+            if (g_index.find(ih, entry)) {
+                counts.first_seen = entry.first_seen;
+                counts.last_seen = entry.last_seen;
+                counts.hits = entry.hits;
+                counts.sources = entry.sources;
+            }
+            req.entries.append(reinterpret_cast<const char *>(&counts),
+                               sizeof(counts));
+        }
+        break;
+    case OP_PEERS:
+    case OP_CARD:
+        if (g_asked.size() + hdr.n_ihs > g_asks.capacity()) {
+            req.status = RS_BUSY;
+            ctr_add(g_n_busy, 1);
+            break;
+        }
+        for (u32 ix = 0; ix < hdr.n_ihs; ix++) {
+            Ask ask;
+            memcpy(ask.ih.raw.data(), ihs + ix * NIH_LEN, NIH_LEN);
+            ask.op = hdr.op;
+            g_asks.push(ask);
+            g_asked.push_back({u32(&cl - g_clients.data()), cl.gen, req.seq});
+        }
+        req.n_waiting = hdr.n_ihs;
+        break;
+    default:
+        req.status = RS_BAD_OP;
+        ctr_add(g_n_bad_ops, 1);
+        break;
+    }
+}
+
+static void cb_close_client(uv_handle_t *handle) {
+    Client &cl = *reinterpret_cast<Client *>(handle->data);
+    cl.pending.clear();
+    cl.inbuf.clear();
+    cl.is_set = false;
+    ctr_set(g_n_clients, g_n_clients - 1);
+}
+
+static void cb_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    Client &cl = *reinterpret_cast<Client *>(stream->data);
+
+    if (nread < 0) {
+        uv_close(reinterpret_cast<uv_handle_t *>(stream), &cb_close_client);
+        return;
+    }
+
+    cl.inbuf.insert(cl.inbuf.end(), buf->base, buf->base + nread);
+    pump(cl);
+}
+
+// Handles the whole requests in the client's buffer, as far as its pending
+// limit allows, sends what replies it can, and reads more only while the
+// client keeps up with them.
+static void pump(Client &cl) {
+    // answering the requests that need no peer lookups frees their slots for
+    // more of the buffer
+    size_t pos;
+    do {
+        pos = 0;
+        while (cl.pending.size() < QSVC_CLIENT_PENDING &&
+               cl.inbuf.size() - pos >= sizeof(ReqHeader)) {
+            ReqHeader hdr;
+            memcpy(&hdr, cl.inbuf.data() + pos, sizeof(hdr));
+            size_t len = sizeof(hdr) + hdr.n_ihs * NIH_LEN;
+            if (cl.inbuf.size() - pos < len) {
+                break;
+            }
+            handle_request(cl, hdr, cl.inbuf.data() + pos + sizeof(hdr));
+            pos += len;
+        }
+        cl.inbuf.erase(cl.inbuf.begin(), cl.inbuf.begin() + pos);
+        flush(cl);
+    } while (pos > 0 && backlog(cl) <= QSVC_MAX_BACKLOG);
+
+    bool want_read = cl.pending.size() < QSVC_CLIENT_PENDING &&
+                     backlog(cl) <= QSVC_MAX_BACKLOG;
+    if (want_read == cl.reading) {
+        return;
+    }
+
+    auto *stream = reinterpret_cast<uv_stream_t *>(&cl.pipe);
+    if (want_read) {
+        uv_read_start(stream, &uvsrv::cb_alloc<g_read_buf>, &cb_read);
+    } else {
+        uv_read_stop(stream);
+    }
+    cl.reading = want_read;
+}
+
+static void cb_wake(uv_async_t *) {
+    Answer ans;
+    while (g_answers.pop(ans)) {
+        Asked asked = g_asked.front();
+        g_asked.pop_front();
+
+        Client &cl = g_clients[asked.slot];
+        if (!is_live(cl, asked.gen)) {
+            continue;
+        }
+
+        Request &req = cl.pending[asked.req_seq - cl.pending.front().seq];
+        if (req.hdr.op == OP_PEERS) {
+            req.entries.push_back(ans.n_peers);
+            req.entries.append(reinterpret_cast<const char *>(ans.peers),
+                               ans.n_peers * sizeof(Peerinfo));
+        } else {
+            req.entries.append(reinterpret_cast<const char *>(&ans.card),
+                               sizeof(Card));
+        }
+        req.n_waiting--;
+
+        if (req.n_waiting == 0) {
+            pump(cl);
+        }
+    }
+}
+
+static void cb_connect(uv_stream_t *server, int status) {
+    if (status < 0) {
+        return;
+    }
+
+    Client *cl = nullptr;
+    for (auto &slot : g_clients) {
+        if (!slot.is_set) {
+            cl = &slot;
+            break;
+        }
+    }
+
+    if (cl == nullptr) {
+        uvsrv::turn_away(server);
+        return;
+    }
+
+    uv_pipe_init(server->loop, &cl->pipe, 0);
+    cl->pipe.data = cl;
+    if (uv_accept(server, reinterpret_cast<uv_stream_t *>(&cl->pipe)) < 0) {
+        uv_close(reinterpret_cast<uv_handle_t *>(&cl->pipe), nullptr);
+        return;
+    }
+
+    cl->gen++;
+    cl->next_seq = 0;
+    cl->reading = false;
+    cl->is_set = true;
+    ctr_add(g_n_clients, 1);
+
+    pump(*cl);
+}
+
+/*
+Subscribers
+*/
+
+// Copy of an event the loop thread may be overwriting, which is fine to
+// filter on: if it was, the subscriber is about to be skipped past it.
+static inline void load_event(u64 pos, Event &out) {
+    const u32 *words = event_words(pos);
+    u32 buf[EVENT_WORDS];
+    for (u32 wx = 0; wx < EVENT_WORDS; wx++) {
+        buf[wx] = __atomic_load_n(words + wx, __ATOMIC_RELAXED);
+    }
+    memcpy(&out, buf, sizeof(Event));
+}
+
+static inline bool keeps(const SubRequest &filter, const Event &ev) {
+    if (filter.sources != 0 && !(filter.sources & (1 << ev.rec.source))) {
+        return false;
+    }
+    if (filter.sample > 1) {
+        // infohashes are uniform, and this keeps the same ones every time
+        u32 prefix;
+        memcpy(&prefix, ev.rec.ih.raw.data(), sizeof(prefix));
+        return prefix % filter.sample == 0;
+    }
+    return true;
+}
+
+static void cb_close_sub(uv_handle_t *handle) {
+    Subscriber &sub = *reinterpret_cast<Subscriber *>(handle->data);
+    sub.is_set = false;
+    ctr_set(g_n_subs, g_n_subs - 1);
+}
+
+static void drop_sub(Subscriber &sub) {
+    auto *handle = reinterpret_cast<uv_handle_t *>(&sub.pipe);
+    if (!uv_is_closing(handle)) {
+        uv_close(handle, &cb_close_sub);
+    }
+}
+
+// Sends the rest of a short-written event. False while some is still left.
+static bool send_rest(Subscriber &sub) {
+    if (sub.rest_len == 0) {
+        return true;
+    }
+
+    uv_buf_t buf = uv_buf_init(
+        reinterpret_cast<char *>(sub.rest.data()) + sub.rest_off, sub.rest_len);
+    int n = uv_try_write(reinterpret_cast<uv_stream_t *>(&sub.pipe), &buf, 1);
+    if (n < 0) {
+        if (n != UV_EAGAIN) {
+            drop_sub(sub);
+        }
+        return false;
+    }
+
+    sub.rest_off += n;
+    sub.rest_len -= n;
+    if (sub.rest_len > 0) {
+        return false;
+    }
+    ctr_add(g_n_sub_events, 1);
+    return true;
+}
+
+// Writes the subscriber as many of its events as its socket takes right now,
+// straight out of the ring.
+static void feed(Subscriber &sub) {
+    if (!sub.subscribed || !send_rest(sub)) {
+        return;
+    }
+
+    auto *stream = reinterpret_cast<uv_stream_t *>(&sub.pipe);
+    std::array<uv_buf_t, QSVC_SUB_IOV> bufs;
+    std::array<Run, QSVC_SUB_IOV> runs;
+    Event ev;
+
+    while (true) {
+        u64 head = __atomic_load_n(&g_stream_head, __ATOMIC_ACQUIRE);
+
+        // Events within a quarter ring of being overwritten are given up on,
+        // so the loop thread can't catch up with a writev in progress.
+        if (head - sub.cursor > STREAM_N - STREAM_N / 4) {
+            u64 skip_to = head - STREAM_N / 2;
+            ctr_add(g_n_sub_skipped, skip_to - sub.cursor);
+            sub.cursor = skip_to;
+        }
+
+        u32 n_runs = 0;
+        u64 pos = sub.cursor;
+        for (; pos < head; pos++) {
+            load_event(pos, ev);
+            if (!keeps(sub.filter, ev)) {
+                continue;
+            }
+            Run *last = n_runs > 0 ? &runs[n_runs - 1] : nullptr;
+            // adjacent in the ring, not just in the stream
+            if (last != nullptr && last->from + last->n_events == pos &&
+                (pos & STREAM_MASK) != 0) {
+                last->n_events++;
+                continue;
+            }
+            if (n_runs == QSVC_SUB_IOV) {
+                break;
+            }
+            runs[n_runs++] = {pos, 1};
+        }
+
+        if (n_runs == 0) {
+            sub.cursor = pos;
+            return;
+        }
+
+        u64 n_bytes = 0;
+        for (u32 rx = 0; rx < n_runs; rx++) {
+            u64 len = u64(runs[rx].n_events) * sizeof(Event);
+            bufs[rx] = uv_buf_init(
+                reinterpret_cast<char *>(event_words(runs[rx].from)), len);
+            n_bytes += len;
+        }
+
+        int n = uv_try_write(stream, bufs.data(), n_runs);
+        if (n < 0) {
+            if (n != UV_EAGAIN) {
+                drop_sub(sub);
+            }
+            return;
+        }
+
+        // the skip above leaves enough room that this should never happen
+        if (__atomic_load_n(&g_stream_head, __ATOMIC_ACQUIRE) - runs[0].from >
+            STREAM_N) {
+            ctr_add(g_n_sub_torn, 1);
+        }
+
+        if (u64(n) == n_bytes) {
+            ctr_add(g_n_sub_events, n_bytes / sizeof(Event));
+            sub.cursor = pos;
+            continue;
+        }
+
+        // A short write, find where it stopped. A partly written event is
+        // finished from a copy before anything else goes out.
+        ctr_add(g_n_sub_events, n / sizeof(Event));
+        u64 left = n;
+        for (u32 rx = 0;; rx++) {
+            u64 len = u64(runs[rx].n_events) * sizeof(Event);
+            if (left >= len) {
+                left -= len;
+                continue;
+            }
+            u64 at = runs[rx].from + left / sizeof(Event);
+            u32 off = left % sizeof(Event);
+            sub.cursor = at;
+            if (off > 0) {
+                memcpy(sub.rest.data(), event_words(at), sizeof(Event));
+                sub.rest_off = off;
+                sub.rest_len = sizeof(Event) - off;
+                sub.cursor = at + 1;
+            }
+            return;
+        }
+    }
+}
+
+static void cb_sub_feed(uv_timer_t *) {
+    for (auto &sub : g_subs) {
+        if (sub.is_set) {
+            feed(sub);
+        }
+    }
+}
+
+static void cb_sub_read(uv_stream_t *stream, ssize_t nread,
+                        const uv_buf_t *buf) {
+    Subscriber &sub = *reinterpret_cast<Subscriber *>(stream->data);
+
+    if (nread < 0) {
+        drop_sub(sub);
+        return;
+    }
+
+    for (ssize_t ix = 0; ix < nread; ix++) {
+        sub.req[sub.req_len++] = buf->base[ix];
+        if (sub.req_len < sizeof(SubRequest)) {
+            continue;
+        }
+        memcpy(&sub.filter, sub.req.data(), sizeof(SubRequest));
+        sub.req_len = 0;
+        if (!sub.subscribed) {
+            // the stream starts now, not with what the ring still holds
+            sub.cursor = __atomic_load_n(&g_stream_head, __ATOMIC_ACQUIRE);
+            sub.subscribed = true;
+        }
+    }
+}
+
+static void cb_sub_connect(uv_stream_t *server, int status) {
+    if (status < 0) {
+        return;
+    }
+
+    Subscriber *sub = nullptr;
+    for (auto &slot : g_subs) {
+        if (!slot.is_set) {
+            sub = &slot;
+            break;
+        }
+    }
+
+    if (sub == nullptr) {
+        uvsrv::turn_away(server);
+        return;
+    }
+
+    uv_pipe_init(server->loop, &sub->pipe, 0);
+    sub->pipe.data = sub;
+    if (uv_accept(server, reinterpret_cast<uv_stream_t *>(&sub->pipe)) < 0) {
+        uv_close(reinterpret_cast<uv_handle_t *>(&sub->pipe), nullptr);
+        return;
+    }
+
+    sub->req_len = 0;
+    sub->rest_len = 0;
+    sub->subscribed = false;
+    sub->is_set = true;
+    ctr_add(g_n_subs, 1);
+
+    uv_read_start(reinterpret_cast<uv_stream_t *>(&sub->pipe),
+                  &uvsrv::cb_alloc<g_read_buf>, &cb_sub_read);
+}
+
+static void listen_on(uv_pipe_t &server, const char *fn,
+                      uv_connection_cb cb_connect, int backlog) {
+    unlink(fn);
+
+    int status = uv_pipe_init(&g_loop, &server, 0);
+    if (status >= 0) {
+        status = uv_pipe_bind(&server, fn);
+    }
+    if (status >= 0) {
+        status = uv_listen(reinterpret_cast<uv_stream_t *>(&server), backlog,
+                           cb_connect);
+    }
+    if (status < 0) {
+        ERROR("Could not listen on %s: %s", fn, uv_strerror(status))
+        exit(-1);
+    }
+}
+
+void start() {
+    int status = uv_loop_init(&g_loop);
+    if (status >= 0) {
+        status = uv_async_init(&g_loop, &g_wake, &cb_wake);
+    }
+    if (status >= 0) {
+        status = uv_timer_init(&g_loop, &g_sub_timer);
+    }
+    if (status < 0) {
+        ERROR("Could not set up the qsvc loop: %s", uv_strerror(status))
+        exit(-1);
+    }
+
+    listen_on(g_server, QSVC_SOCK_FN, &cb_connect, QSVC_MAX_CLIENTS);
+    listen_on(g_sub_server, QSVC_SUB_SOCK_FN, &cb_sub_connect, QSVC_SUB_MAX);
+    uv_timer_start(&g_sub_timer, &cb_sub_feed, QSVC_SUB_FEED_MS,
+                   QSVC_SUB_FEED_MS);
+
+    // the loop is only ever run from here on
+    std::thread([] { uv_run(&g_loop, UV_RUN_DEFAULT); }).detach();
+}
+
+/*
+Loop thread
+*/
+
+void publish(const ihlog::Record &rec) {
+    Event ev;
+    ev.len = sizeof(Event) - sizeof(ev.len);
+    ev.seq = g_stream_head;
+    ev.rec = rec;
+
+    u32 buf[EVENT_WORDS];
+    memcpy(buf, &ev, sizeof(Event));
+    u32 *words = event_words(g_stream_head);
+    for (u32 wx = 0; wx < EVENT_WORDS; wx++) {
+        __atomic_store_n(words + wx, buf[wx], __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&g_stream_head, g_stream_head + 1, __ATOMIC_RELEASE);
+}
+
+void serve_asks() {
+    Ask ask;
+    Answer ans;
+    u32 n_served = 0;
+
+    while (n_served < QSVC_ASKS_PER_TICK && g_asks.pop(ask)) {
+        ans.n_peers = 0;
+        ans.card = {0, 0};
+        if (ask.op == OP_PEERS) {
+            ans.n_peers = db::get_peers(ask.ih, ans.peers, MAX_PEERS);
+        } else {
+#ifdef HLL
+            hll::Estimate est = hll::estimate(ask.ih);
+            ans.card = {est.peers, est.askers};
+#endif
+        }
+        g_answers.push(ans);
+        n_served++;
+    }
+
+    if (n_served > 0) {
+        st_add(ST_qsvc_loop_queries, n_served);
+        uv_async_send(&g_wake);
+    }
+}
+
+// Adds what a counter of the service thread gained since the last report.
+static inline void report_ctr(stat_t stat, const u64 &ctr, u64 &reported) {
+    u64 now = ctr_get(ctr);
+    st_add(stat, u32(now - reported));
+    reported = now;
+}
+
+void report() {
+    st_set(ST_qsvc_clients, ctr_get(g_n_clients));
+    report_ctr(ST_qsvc_requests, g_n_requests, g_rep_requests);
+    report_ctr(ST_qsvc_ihs, g_n_ihs, g_rep_ihs);
+    report_ctr(ST_qsvc_busy, g_n_busy, g_rep_busy);
+    report_ctr(ST_qsvc_bad_ops, g_n_bad_ops, g_rep_bad_ops);
+    report_ctr(ST_qsvc_lat_us_sum, g_lat_us_sum, g_rep_lat_us_sum);
+    report_ctr(ST_qsvc_lat_n, g_lat_n, g_rep_lat_n);
+    st_set(ST_qsvc_lat_us_max,
+           __atomic_exchange_n(&g_lat_us_max, 0, __ATOMIC_RELAXED));
+    st_set(ST_qsvc_subs, ctr_get(g_n_subs));
+    report_ctr(ST_qsvc_sub_events, g_n_sub_events, g_rep_sub_events);
+    report_ctr(ST_qsvc_sub_skipped, g_n_sub_skipped, g_rep_sub_skipped);
+    report_ctr(ST_qsvc_sub_torn, g_n_sub_torn, g_rep_sub_torn);
+}
+
+#endif // QSVC
+
+} // namespace cht::qsvc
@@ -0,0 +1,163 @@
+// vi:ft=cpp
+#pragma once
+
+#include "db.hpp"
+#include "dht.hpp"
+#include "ihlog.hpp"
+
+using namespace cht;
+namespace cht::qsvc {
+
+// Read-only query service for local tools, enabled with QSVC. It runs its own
+// libuv loop on its own thread and answers on the Unix socket QSVC_SOCK_FN.
+//
+// Seen and count queries are answered on that thread from a read-only
+// ihidx::Reader mapping. The peer store and the hll sketches belong to the
+// loop thread, so peer and estimate queries are passed to it through a ring
+// and answered from a timer, at most QSVC_ASKS_PER_TICK at a time; the
+// service thread never touches loop data.
+//
+// Clients may pipeline requests. Every request is a ReqHeader followed by
+// n_ihs infohashes, and gets a RespHeader followed by n_ihs entries for its
+// op, in the order the requests came in. All integers are in host order, the
+// sockets are local.
+//
+// Subscribers on QSVC_SUB_SOCK_FN get a live stream of what ihlog logs. The
+// loop thread writes every record as an Event into a broadcast ring of
+// 2 ** QSVC_SUB_LOG2_RING events and never waits for anyone. Each subscriber
+// has its own cursor into the ring and is written to straight out of it with
+// writev, picking out the events its SubRequest filter keeps. A subscriber
+// that falls too far behind is skipped ahead, which shows as a gap in the
+// event seqs. Nothing is sent until the first SubRequest, and a later one
+// replaces the filter.
+
+#ifndef QSVC_SOCK_FN
+#define QSVC_SOCK_FN "./data/qsvc.sock"
+#endif
+// clients connected at once; more are turned away
+#ifndef QSVC_MAX_CLIENTS
+#define QSVC_MAX_CLIENTS 16
+#endif
+// requests a client can have unanswered before we stop reading from it
+#ifndef QSVC_CLIENT_PENDING
+#define QSVC_CLIENT_PENDING 64
+#endif
+// bytes a client may leave unread before we stop reading from it
+#ifndef QSVC_MAX_BACKLOG
+#define QSVC_MAX_BACKLOG (1 << 20)
+#endif
+// log2 of the queries that can be waiting on the loop
+#ifndef QSVC_LOG2_RING
+#define QSVC_LOG2_RING 12
+#endif
+// queries the loop answers per gpm tick
+#ifndef QSVC_ASKS_PER_TICK
+#define QSVC_ASKS_PER_TICK 256
+#endif
+
+#ifndef QSVC_SUB_SOCK_FN
+#define QSVC_SUB_SOCK_FN "./data/qsvc_sub.sock"
+#endif
+#ifndef QSVC_SUB_MAX
+#define QSVC_SUB_MAX 16
+#endif
+#ifndef QSVC_SUB_LOG2_RING
+#define QSVC_SUB_LOG2_RING 16
+#endif
+// how often subscribers are fed, and the most iovecs per writev
+#ifndef QSVC_SUB_FEED_MS
+#define QSVC_SUB_FEED_MS 20
+#endif
+#ifndef QSVC_SUB_IOV
+#define QSVC_SUB_IOV 256
+#endif
+
+static_assert(QSVC_SUB_LOG2_RING >= 4);
+
+enum Op : u8 {
+    OP_SEEN = 1, // entry: u8, 1 if the infohash is in the index
+    OP_COUNTS,   // entry: a Counts
+    OP_PEERS,    // entry: u8 n_peers, then n_peers packed Peerinfo
+    OP_CARD,     // entry: a Card
+};
+
+enum Status : u8 {
+    RS_OK = 0,
+    RS_BAD_OP, // no entries follow
+    RS_BUSY,   // too many queries waiting on the loop, no entries follow
+};
+
+struct __attribute__((packed)) ReqHeader {
+    u32 id; // echoed in the reply
+    u8 op;
+    u8 n_ihs;
+    u16 _pad;
+};
+static_assert(sizeof(ReqHeader) == 8, "Messed up qsvc ReqHeader layout!");
+
+struct __attribute__((packed)) RespHeader {
+    u32 len; // of the reply after this field
+    u32 id;
+    u8 op;
+    u8 status;
+    u8 n_ihs;
+    u8 _pad;
+};
+static_assert(sizeof(RespHeader) == 12, "Messed up qsvc RespHeader layout!");
+
+// Times are unix seconds and sources a bitmask of 1 << ihlog::Source, as in
+// ihidx::Entry. All zero if the infohash is not in the index.
+struct __attribute__((packed)) Counts {
+    u32 first_seen;
+    u32 last_seen;
+    u32 hits;
+    u8 sources;
+    u8 _pad[3];
+};
+static_assert(sizeof(Counts) == 16, "Messed up qsvc Counts layout!");
+
+// Distinct peers and askers as estimated by hll. Zero if the infohash is not
+// tracked, or without HLL.
+struct __attribute__((packed)) Card {
+    u32 peers;
+    u32 askers;
+};
+static_assert(sizeof(Card) == 8, "Messed up qsvc Card layout!");
+
+// Sent by subscribers to set their filter.
+struct __attribute__((packed)) SubRequest {
+    u8 sources; // bitmask of 1 << ihlog::Source to keep, 0 for all
+    u8 _pad;
+    u16 sample; // keep one in this many infohashes, 0 or 1 for all
+    u32 _pad2;
+};
+static_assert(sizeof(SubRequest) == 8, "Messed up qsvc SubRequest layout!");
+
+// One event of the subscriber stream.
+struct __attribute__((packed)) Event {
+    u32 len; // of the event after this field
+    u64 seq; // counts all events, filtered out and skipped ones too
+    ihlog::Record rec;
+};
+static_assert(sizeof(Event) == 48, "Messed up qsvc Event layout!");
+
+// most peers in an OP_PEERS entry
+constexpr inline u32 MAX_PEERS = DB_PEERS_PER_IH;
+
+#ifdef QSVC
+// Binds QSVC_SOCK_FN and QSVC_SUB_SOCK_FN and starts the service thread.
+void start();
+
+// Puts a record into the subscriber stream. Must only be called from the
+// loop thread.
+void publish(const ihlog::Record &);
+
+// Answers the queries the service thread passed on. Must only be called
+// from the loop thread, every gpm tick.
+void serve_asks();
+
+// Updates the service stats. Must only be called from the loop thread.
+void report();
+#endif
+
+} // namespace cht::qsvc
@@ -0,0 +1,70 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include <array>
+
+using namespace cht;
+namespace cht {
+
+/// Bounded lock-free queue of 2 ** LOG2_N items between exactly one producer
+/// thread and one consumer thread.
+///
+/// Neither side ever blocks or allocates: push fails when the ring is full
+/// and pop fails when it is empty. Each side keeps a cached copy of the other
+/// side's index, so the shared cache lines are only touched when the cached
+/// copy runs out.
+template <typename T, u32 LOG2_N>
+class SpscRing {
+  private:
+    static constexpr u64 N = u64(1) << LOG2_N;
+    static constexpr u64 MASK = N - 1;
+
+    // written by the producer
+    alignas(64) u64 head = 0;
+    u64 cached_tail = 0;
+    // written by the consumer
+    alignas(64) u64 tail = 0;
+    u64 cached_head = 0;
+
+    alignas(64) std::array<T, N> slots;
+
+  public:
+    SpscRing() = default;
+    SpscRing(SpscRing const &) = delete;
+    SpscRing &operator=(SpscRing const &) = delete;
+
+    static constexpr u64 capacity() {
+        return N;
+    }
+
+    // Producer side.
+    bool push(const T &item) {
+        u64 h = head;
+        if (h - cached_tail == N) {
+            cached_tail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+            if (h - cached_tail == N) {
+                return false;
+            }
+        }
+        slots[h & MASK] = item;
+        __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Consumer side.
+    bool pop(T &out) {
+        u64 t = tail;
+        if (t == cached_head) {
+            cached_head = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            if (t == cached_head) {
+                return false;
+            }
+        }
+        out = slots[t & MASK];
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+} // namespace cht
@@ -4,10 +4,14 @@
 #include "util.hpp"
 #include <cerrno>
 #include <cstdio>
+#include <ctime>
 #include <endian.h>
 #include <fcntl.h>
 #include <netinet/ip.h>
+#include <signal.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -20,66 +24,524 @@ using namespace cht;
 using bd::KRPC;
 namespace cht::rt {
 
-RT::Nodeinfo *RT::load_rt() {
+static bool read_full(int fd, void *dst, u64 len) {
+    u8 *ptr = static_cast<u8 *>(dst);
+    while (len > 0) {
+        ssize_t nread = read(fd, ptr, len);
+        if (nread <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nread;
+        len -= nread;
+    }
+    return true;
+}
 
-    int fd = open(RT_FN, O_RDWR | O_CREAT);
+static bool write_full(int fd, const void *src, u64 len) {
+    const u8 *ptr = static_cast<const u8 *>(src);
+    while (len > 0) {
+        ssize_t nwritten = write(fd, ptr, len);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nwritten;
+        len -= nwritten;
+    }
+    return true;
+}
 
+bool RT::load_image(const char *fn, Nodeinfo *dst) {
+    /*
+    Reads a snapshot image into `dst`. Returns false, leaving `dst` in an
+    unspecified state, if the image is missing, truncated or corrupt.
+    */
+
+    int fd = open(fn, O_RDONLY);
     if (fd == -1) {
-        ERROR("Could not open rt file, bailing.");
-        exit(-1);
+        INFO("No rt image at %s: %s", fn, strerror(errno))
+        return false;
     }
 
     struct stat info = {0};
-
     if (fstat(fd, &info)) {
-        ERROR("Could not stat rt file: %s, bailing.", strerror(errno))
+        WARN("Could not stat rt image %s: %s", fn, strerror(errno))
+        close(fd);
+        return false;
+    }
+
+    // unversioned raw table from before snapshots, written by MAP_SHARED
+    if (info.st_size == RT_SIZE) {
+        bool ok = read_full(fd, dst, RT_SIZE);
+        close(fd);
+        if (ok) {
+            WARN("Imported legacy headerless rt image %s", fn)
+        }
+        return ok;
+    }
+
+    ImageHeader hdr;
+    if (info.st_size != sizeof(ImageHeader) + RT_SIZE ||
+        !read_full(fd, &hdr, sizeof(hdr))) {
+        WARN("Bad size (%ld) rt image %s", info.st_size, fn)
+        close(fd);
+        return false;
+    }
+
+    if (hdr.magic != RT_IMAGE_MAGIC || hdr.version != RT_IMAGE_VERSION ||
+        hdr.n_cells != RT_N_CELLS || hdr.cell_size != sizeof(Nodeinfo)) {
+        WARN("Incompatible rt image %s [version %u]", fn, hdr.version)
+        close(fd);
+        return false;
+    }
+
+    bool ok = read_full(fd, dst, RT_SIZE);
+    close(fd);
+
+    if (!ok || fnv1a64(reinterpret_cast<u8 *>(dst), RT_SIZE) != hdr.checksum) {
+        WARN("Checksum mismatch in rt image %s", fn)
+        return false;
+    }
+
+    INFO("Loaded rt image %s written at %lu", fn, hdr.created_s)
+    return true;
+}
+
+u32 RT::count_occupied(Nodeinfo *rt) {
+    u32 n_occupied = 0;
+    for (u32 ix = 0; ix < RT_N_CELLS; ix++) {
+        n_occupied += !rt[ix].is_empty();
+    }
+    return n_occupied;
+}
+
+RT::Nodeinfo *RT::alloc_rt() {
+
+    void *addr = mmap(nullptr, RT_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED) {
+        ERROR("Failed to mmap rt: %s.", strerror(errno));
         exit(-1);
     }
 
-    if (info.st_size != RT_SIZE) {
-        WARN("Bad size (%ld) rt file found.", info.st_size)
-        WARN("Will be truncating this file!")
-        if (ftruncate(fd, RT_SIZE)) {
-            ERROR("Could not truncate file: %s, bailing", strerror(errno))
+    return static_cast<Nodeinfo *>(addr);
+}
+
+#ifndef RT_CONCURRENT
+RT::Nodeinfo *RT::load_rt() {
+
+    auto rt = alloc_rt();
+
+    if (!load_image(RT_FN, rt) && !load_image(RT_OLD_FN, rt)) {
+        st_inc(ST_rt_load_bad_image);
+        WARN("Starting with an empty rt.")
+        memset(rt, 0, RT_SIZE);
+    }
+    n_occupied = count_occupied(rt);
+
+    snap_job.cells = alloc_rt();
+    snap_owner = true;
+
+    INFO("Allocated rt of size %lu * %u", sizeof(Nodeinfo), RT_N_CELLS)
+    return rt;
+}
+#else
+RT::Nodeinfo *RT::load_rt() {
+    /*
+    Startups are serialized on a lock file. If nobody holds a shared flock on
+    the table, any table there is left over from processes that are all gone,
+    possibly mid-write, so it is rebuilt from the snapshot image and we write
+    the snapshots. Otherwise we join the live table.
+    */
+
+    int lock_fd = open(RT_SHM_LOCK_FN, O_RDWR | O_CREAT, 0600);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX)) {
+        ERROR("Could not lock " RT_SHM_LOCK_FN ": %s, bailing.",
+              strerror(errno))
+        exit(-1);
+    }
+
+    shm_fd = open(RT_SHM_FN, O_RDWR | O_CREAT, 0600);
+    if (shm_fd == -1) {
+        ERROR("Could not open shared rt " RT_SHM_FN ": %s, bailing.",
+              strerror(errno))
+        exit(-1);
+    }
+
+    bool rebuild = flock(shm_fd, LOCK_EX | LOCK_NB) == 0;
+    if (!rebuild && errno != EWOULDBLOCK) {
+        ERROR("Could not lock shared rt: %s, bailing.", strerror(errno))
+        exit(-1);
+    }
+
+    struct stat info = {0};
+    if (rebuild) {
+        // truncating first zeroes every counter and the header
+        if (ftruncate(shm_fd, 0) || ftruncate(shm_fd, RT_MAP_SIZE)) {
+            ERROR("Could not size shared rt: %s, bailing.", strerror(errno))
             exit(-1);
         }
+    } else if (fstat(shm_fd, &info) || info.st_size != RT_MAP_SIZE) {
+        ERROR("Unusable shared rt " RT_SHM_FN ", bailing.")
+        exit(-1);
     }
 
-    void *addr =
-        mmap(nullptr, RT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *addr = mmap(nullptr, RT_MAP_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, shm_fd, 0);
 
     if (addr == MAP_FAILED) {
-        ERROR("Failed to mmap rt file: %s.", strerror(errno));
+        ERROR("Failed to mmap shared rt: %s.", strerror(errno));
+        exit(-1);
+    }
+
+    auto rt = static_cast<Nodeinfo *>(addr);
+    __seq = reinterpret_cast<u32 *>(static_cast<u8 *>(addr) + RT_SIZE);
+    __seen = __seq + RT_N_CELLS;
+    __shm = reinterpret_cast<ShmHeader *>(__seen + RT_N_CELLS);
+
+    if (rebuild) {
+        if (!load_image(RT_FN, rt) && !load_image(RT_OLD_FN, rt)) {
+            st_inc(ST_rt_load_bad_image);
+            WARN("Starting with an empty rt.")
+            memset(rt, 0, RT_SIZE);
+        }
+        __shm->n_occupied = count_occupied(rt);
+        __shm->magic = RT_IMAGE_MAGIC;
+        __shm->version = RT_SHM_VERSION;
+        INFO("Built shared rt " RT_SHM_FN)
+    } else if (__shm->magic != RT_IMAGE_MAGIC ||
+               __shm->version != RT_SHM_VERSION) {
+        ERROR("Incompatible shared rt " RT_SHM_FN " [version %u], bailing.",
+              __shm->version)
         exit(-1);
+    } else {
+        INFO("Joined shared rt " RT_SHM_FN " [snapshots by %u]",
+             u32(__atomic_load_n(&__shm->owner, __ATOMIC_RELAXED)))
+    }
+
+    // held until we exit, however that happens
+    if (flock(shm_fd, LOCK_SH)) {
+        ERROR("Could not lock shared rt: %s, bailing.", strerror(errno))
+        exit(-1);
+    }
+    close(lock_fd);
+
+    stuck_seq.assign(RT_N_CELLS, 0);
+    snap_job.cells = alloc_rt();
+    snap_owner = claim_snapshots();
+
+    return rt;
+}
+#endif
+
+bool RT::claim_snapshots() {
+#ifdef RT_CONCURRENT
+    u32 pid = u32(getpid());
+    u64 now_s = mono_ms() / 1000;
+    u64 owner = __atomic_load_n(&__shm->owner, __ATOMIC_ACQUIRE);
+    u32 owner_pid = u32(owner);
+    u64 renewed_s = owner >> 32;
+
+    // kill with no signal fails with ESRCH only once the owner is gone
+    if (owner_pid != pid && owner_pid != 0 &&
+        renewed_s + RT_OWNER_LEASE_S >= now_s &&
+        !(kill(pid_t(owner_pid), 0) && errno == ESRCH)) {
+        return false;
+    }
+
+    // fails if somebody else renewed or took over in the meantime
+    if (!__atomic_compare_exchange_n(&__shm->owner, &owner,
+                                     (now_s << 32) | pid, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    if (owner_pid != pid && owner_pid != 0) {
+        st_inc(ST_rt_snap_takeover);
+        INFO("Took over rt snapshots from process %u", owner_pid)
+    }
+#endif
+    return true;
+}
+
+void RT::repair_stuck_cells() {
+#ifdef RT_CONCURRENT
+    /*
+    A writer that died inside update_cell leaves the counter of its cell odd,
+    and nobody could ever write or read the cell again. Writers hold a cell
+    for nanoseconds, so a counter still at the same odd value a snapshot
+    period later belongs to a dead writer. We finish its write by clearing
+    the cell, whatever it left there may be torn.
+    */
+
+    for (u32 ix = 0; ix < RT_N_CELLS; ix++) {
+        u32 seq = __atomic_load_n(__seq + ix, __ATOMIC_ACQUIRE);
+
+        // counters start at 0, so no stuck counter is ever 0
+        if (!(seq & 1) || stuck_seq[ix] != seq) {
+            stuck_seq[ix] = seq & 1 ? seq : 0;
+            continue;
+        }
+
+        u64 *words = reinterpret_cast<u64 *>(__rt + ix);
+        Nodeinfo torn;
+        memcpy(&torn, words, sizeof(Nodeinfo));
+        for (u32 wx = 0; wx < CELL_WORDS; wx++) {
+            __atomic_store_n(words + wx, u64(0), __ATOMIC_RELAXED);
+        }
+        add_occupied(-i32(!torn.is_empty()));
+        __atomic_store_n(__seq + ix, seq + 1, __ATOMIC_RELEASE);
+
+        stuck_seq[ix] = 0;
+        st_inc(ST_rt_cells_repaired);
+        WARN("Cleared rt cell %u left mid-write by a dead writer", ix)
+    }
+#endif
+}
+
+void RT::schedule_all() {
+    // Contacts of unknown age, like those from the image, get their first
+    // liveness check spread over a stale period so they aren't all pinged
+    // at once.
+
+    u64 now_s = mono_ms() / 1000;
+    Nodeinfo cell;
+
+    for (u32 ix = 0; ix < RT_N_CELLS; ix++) {
+        if (!load_cell(ix, cell) || cell.is_empty()) {
+            liveness.cancel(ix);
+            continue;
+        }
+        u32 seen = seen_s(ix);
+        liveness.schedule(ix, seen != 0 ? seen + RT_STALE_S
+                                        : now_s + randint(1, RT_STALE_S));
     }
+}
+
+u32 RT::seen_s(u32 ix) const {
+#ifdef RT_CONCURRENT
+    return __atomic_load_n(__seen + ix, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+void RT::add_occupied(i32 delta) {
+#ifdef RT_CONCURRENT
+    __atomic_fetch_add(&__shm->n_occupied, u32(delta), __ATOMIC_RELAXED);
+#else
+    n_occupied += delta;
+#endif
+}
+
+void RT::snapshot_work_cb(uv_work_t *req) {
+    /*
+    Runs on the uv threadpool. Never touches the live table, only the copy.
+    The image is written to a temp file and renamed over the previous one,
+    which is kept as a fallback, so a crash at any point leaves at least one
+    complete image on disk.
+    */
+
+    auto &job = *static_cast<SnapshotJob *>(req->data);
+
+    job.ok = false;
+    job.bytes = 0;
+    job.err = 0;
+    job.hdr.checksum = fnv1a64(reinterpret_cast<u8 *>(job.cells), RT_SIZE);
+
+    int fd = open(RT_TMP_FN, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        job.err = errno;
+        job.end_ms = mono_ms();
+        return;
+    }
+
+    bool ok = write_full(fd, &job.hdr, sizeof(job.hdr)) &&
+              write_full(fd, job.cells, RT_SIZE) && fdatasync(fd) == 0;
     close(fd);
-    INFO("Memmaped rt of size %lu * %lu", sizeof(Nodeinfo),
-         RT_SIZE / sizeof(Nodeinfo))
-    return static_cast<Nodeinfo *>(addr);
+
+    if (ok) {
+        // a missing previous image is fine
+        if (rename(RT_FN, RT_OLD_FN) && errno != ENOENT) {
+            ok = false;
+        } else {
+            ok = rename(RT_TMP_FN, RT_FN) == 0;
+        }
+    }
+
+    job.err = ok ? 0 : errno;
+    job.ok = ok;
+    job.bytes = ok ? sizeof(job.hdr) + RT_SIZE : 0;
+    job.end_ms = mono_ms();
+}
+
+void RT::snapshot_after_cb(uv_work_t *req, int status) {
+    auto &job = *static_cast<SnapshotJob *>(req->data);
+
+    g_rt.snap_in_flight = false;
+
+    if (status < 0 || !job.ok) {
+        st_inc(ST_rt_snap_fail);
+        WARN("Failed to write rt snapshot: %s", strerror(job.err))
+        return;
+    }
+
+    st_inc(ST_rt_snap_ok);
+    st_add(ST_rt_snap_bytes, job.bytes);
+    st_set(ST_rt_snap_ms, job.end_ms - job.start_ms);
+    VERBOSE("Wrote rt snapshot in %lu ms", job.end_ms - job.start_ms)
+}
+
+void RT::snapshot(uv_loop_t *loop) {
+
+    bool was_owner = snap_owner;
+    snap_owner = claim_snapshots();
+    if (!snap_owner) {
+        return;
+    }
+
+    // our wheel only knows the cells we wrote
+    if (!was_owner) {
+        std::fill(refresh_fails.begin(), refresh_fails.end(), 0);
+        schedule_all();
+    }
+
+    repair_stuck_cells();
+
+    if (snap_in_flight) {
+        st_inc(ST_rt_snap_skip);
+        return;
+    }
+
+    snap_job.start_ms = mono_ms();
+#ifdef RT_CONCURRENT
+    for (u32 ix = 0; ix < RT_N_CELLS; ix++) {
+        if (!load_cell(ix, snap_job.cells[ix])) {
+            memset(&snap_job.cells[ix], 0, sizeof(Nodeinfo));
+        }
+    }
+#else
+    memcpy(snap_job.cells, __rt, RT_SIZE);
+#endif
+
+    snap_job.hdr = {
+        .magic = RT_IMAGE_MAGIC,
+        .version = RT_IMAGE_VERSION,
+        .n_cells = RT_N_CELLS,
+        .cell_size = sizeof(Nodeinfo),
+        ._pad = 0,
+        .checksum = 0,
+        .created_s = u64(time(nullptr)),
+    };
+    snap_job.req.data = &snap_job;
+
+    if (uv_queue_work(loop, &snap_job.req, &snapshot_work_cb,
+                      &snapshot_after_cb) < 0) {
+        st_inc(ST_rt_snap_fail);
+        return;
+    }
+    snap_in_flight = true;
+}
+
+inline u32 RT::cell_ix(const Nih &nid) {
+    return cell_ix(nid.a, nid.b);
 }
 
-inline RT::Nodeinfo *RT::get_cell(const Nih &nid) const {
-    return get_cell(nid.a, nid.b);
+inline u32 RT::cell_ix(u8 a, u8 b) {
+    return 256 * a + b;
+}
+
+inline bool RT::load_cell(u32 ix, Nodeinfo &out) const {
+#ifdef RT_CONCURRENT
+    const u64 *words = reinterpret_cast<const u64 *>(__rt + ix);
+    u64 buf[CELL_WORDS];
+
+    for (int tries = 0; tries < RT_READ_RETRIES; tries++) {
+        if (seq_try_read<CELL_WORDS>(__seq + ix, words, buf)) {
+            memcpy(&out, buf, sizeof(Nodeinfo));
+            return true;
+        }
+        st_inc(ST_rt_read_torn);
+    }
+
+    st_inc(ST_rt_read_gave_up);
+    return false;
+#else
+    out = __rt[ix];
+    return true;
+#endif
 }
 
-inline RT::Nodeinfo *RT::get_cell(u8 a, u8 b) const {
-    return __rt + 256 * a + b;
+template <typename F>
+inline bool RT::update_cell(u32 ix, F &&update) {
+#ifdef RT_CONCURRENT
+    // Somebody else is writing this cell. It's a cache, losing the write is
+    // cheaper than waiting.
+    SeqWrite res = seq_try_update<CELL_WORDS>(
+        __seq + ix, reinterpret_cast<u64 *>(__rt + ix), [&](u64 buf[]) {
+            Nodeinfo cell;
+            memcpy(&cell, buf, sizeof(Nodeinfo));
+            if (!update(cell)) {
+                return false;
+            }
+            memcpy(buf, &cell, sizeof(Nodeinfo));
+            return true;
+        });
+
+    if (res == SW_CONTENDED) {
+        st_inc(ST_rt_write_contended);
+    }
+    return res == SW_CHANGED;
+#else
+    return update(__rt[ix]);
+#endif
 }
 
 inline void RT::set_cell(const Nih &nid, const SIN &addr, u8 qual) {
     set_cell(nid, addr.sin_addr.s_addr, addr.sin_port, qual);
 }
 
-inline void RT::set_cell(const Nih &nid, u32 in_addr, u16 sin_port, u8 qual) {
+inline void RT::mark_seen(u32 ix, bool same_node) {
+    if (refresh_fails[ix] > 0 && same_node) {
+        st_inc(ST_rt_refreshed);
+    }
+    refresh_fails[ix] = 0;
+
+    u32 now_s = u32(mono_ms() / 1000);
+#ifdef RT_CONCURRENT
+    __atomic_store_n(__seen + ix, now_s, __ATOMIC_RELAXED);
+#endif
+    liveness.schedule(ix, now_s + RT_STALE_S);
+}
 
-    Nodeinfo &cell = *get_cell(nid);
+inline void RT::set_cell(const Nih &nid, u32 in_addr, u16 sin_port, u8 qual) {
 
-    cell.nih_l = nid.rt.low;
-    // These are all in network byte order
-    cell.peerinfo.sin_port = sin_port;
-    cell.peerinfo.in_addr = in_addr;
-    // TODO
-    // cell.quality = CLIP_Q(qual);
+    u32 ix = cell_ix(nid);
+    bool same_node = false;
+    bool was_empty = false;
+
+    bool written = update_cell(ix, [&](Nodeinfo &cell) {
+        same_node = cell.nih_l == nid.rt.low;
+        was_empty = cell.is_empty();
+        cell.nih_l = nid.rt.low;
+        // These are all in network byte order
+        cell.peerinfo.sin_port = sin_port;
+        cell.peerinfo.in_addr = in_addr;
+        // TODO
+        // cell.quality = CLIP_Q(qual);
+        return true;
+    });
+
+    if (written) {
+        add_occupied(was_empty);
+        mark_seen(ix, same_node);
+    }
 }
 
 void RT::insert_contact(const KRPC &krpc, const SIN &addr, u8 base_qual) {
@@ -109,11 +571,11 @@ void RT::adj_quality(const Nih &nid, i64 delta) {
     can be found. Otherwise, does nothing.
     */
 
-    Nodeinfo &cell = *get_cell(nid);
+    Nodeinfo cell;
 
     // the contact we're trying to adjust has been replaced!
     // just do nothing in this case
-    if (cell.nih_l != nid.rt.low) {
+    if (!load_cell(cell_ix(nid), cell) || cell.nih_l != nid.rt.low) {
         return;
     }
 
@@ -125,22 +587,166 @@ void RT::delete_node(const Nih &target) {
     A node has been very naughty. It must be annihilated!
     */
 
-    Nodeinfo &cell = *get_cell(target);
-    // check the node hasn't been replaced in the interim
-    if (cell.nih_l == target.rt.low) {
+    bool deleted = update_cell(cell_ix(target), [&](Nodeinfo &cell) {
+        // check the node hasn't been replaced in the interim
+        if (cell.nih_l != target.rt.low) {
+            return false;
+        }
         cell.nih_l.checksum = 0;
+        return true;
+    });
+
+    if (deleted) {
+        add_occupied(-1);
+        liveness.cancel(cell_ix(target));
     }
 }
 
+u32 RT::collect_stale(PNode *out, u32 max_n) {
+    /*
+    Cells come due on the liveness wheel either because nothing has been
+    heard from them for RT_STALE_S, or because the refresh ping we sent has
+    gone unanswered for RT_REFRESH_RETRY_S. Any contact insert for a cell
+    pushes it back out by RT_STALE_S.
+    */
+
+    if (!snap_owner) {
+        return 0;
+    }
+
+    u64 now_s = mono_ms() / 1000;
+    u32 n_out = 0;
+    Nodeinfo cell;
+
+    liveness.advance(now_s, max_n, [&](u32 ix) {
+        if (!load_cell(ix, cell)) {
+            // a writer is mid-update, look again shortly
+            liveness.schedule(ix, now_s + 1);
+            return;
+        }
+        if (cell.is_empty()) {
+            refresh_fails[ix] = 0;
+            return;
+        }
+
+        // another process may have heard from it since we last looked
+        u32 seen = seen_s(ix);
+        if (seen != 0 && seen + RT_STALE_S > now_s) {
+            refresh_fails[ix] = 0;
+            liveness.schedule(ix, seen + RT_STALE_S);
+            return;
+        }
+
+        if (refresh_fails[ix] >= RT_REFRESH_MAX_FAILS) {
+            bool evicted = update_cell(ix, [&](Nodeinfo &cur) {
+                if (cur.nih_l != cell.nih_l) {
+                    return false;
+                }
+                cur.nih_l.checksum = 0;
+                return true;
+            });
+            refresh_fails[ix] = 0;
+            if (evicted) {
+                add_occupied(-1);
+                st_inc(ST_rt_evicted);
+            } else if (load_cell(ix, cell) && !cell.is_empty()) {
+                // replaced under us, or the write was contended
+                liveness.schedule(ix, now_s + RT_STALE_S);
+            }
+            return;
+        }
+
+        refresh_fails[ix]++;
+        st_inc(ST_rt_stale);
+
+        out[n_out++] = {
+            .nid.rt.high.a = u8(ix >> 8),
+            .nid.rt.high.b = u8(ix & 0xff),
+            .nid.rt.low = cell.nih_l,
+            .peerinfo = cell.peerinfo,
+        };
+        liveness.schedule(ix, now_s + RT_REFRESH_RETRY_S);
+    });
+
+    return n_out;
+}
+
+u32 RT::collect_fill_queries(FillQuery *out, u32 max_n) {
+    /*
+    Sweeps a cursor over the table looking for holes: cells that are empty
+    or whose contact is being refreshed. For each hole, finds the closest
+    contact that is not itself under suspicion, to be asked for nodes with a
+    target inside the hole's prefix.
+    */
+
+#ifdef RT_CONCURRENT
+    u64 now_s = mono_ms() / 1000;
+#endif
+    u32 n_out = 0;
+    Nodeinfo cell;
+
+    for (u32 scanned = 0; scanned < RT_FILL_SCAN && n_out < max_n;
+         scanned++) {
+
+        u32 hole_ix = fill_cursor;
+        fill_cursor = (fill_cursor + 1) % RT_N_CELLS;
+
+        if (load_cell(hole_ix, cell) && !cell.is_empty() &&
+            refresh_fails[hole_ix] == 0) {
+#ifdef RT_CONCURRENT
+            // pick up contacts other processes inserted
+            if (snap_owner && !liveness.is_scheduled(hole_ix)) {
+                u32 seen = seen_s(hole_ix);
+                liveness.schedule(hole_ix,
+                                  seen != 0 ? std::max(u64(seen) + RT_STALE_S,
+                                                       now_s)
+                                            : now_s + randint(1, RT_STALE_S));
+            }
+#endif
+            continue;
+        }
+
+        bool found = false;
+        for (u32 dist = 1; dist < RT_NEIGHBOR_SCAN; dist++) {
+            u32 ix = hole_ix ^ dist;
+
+            if (refresh_fails[ix] > 0 || !load_cell(ix, cell) ||
+                cell.is_empty()) {
+                continue;
+            }
+
+            auto &query = out[n_out++];
+            query.dest = {
+                .nid.rt.high.a = u8(ix >> 8),
+                .nid.rt.high.b = u8(ix & 0xff),
+                .nid.rt.low = cell.nih_l,
+                .peerinfo = cell.peerinfo,
+            };
+            getrandom(query.target.raw.data(), NIH_LEN, 0);
+            query.target.raw[0] = u8(hole_ix >> 8);
+            query.target.raw[1] = u8(hole_ix & 0xff);
+
+            found = true;
+            break;
+        }
+
+        if (!found) {
+            st_inc(ST_rt_fill_no_contact);
+        }
+    }
+
+    return n_out;
+}
+
 const PNode RT::get_neighbor_contact(const Nih &target) const {
     /*
     Returns a nid from the array of nids `narr` whose first two bytes
     match the target.
     */
 
-    Nodeinfo &out_cell = *get_cell(target);
+    Nodeinfo out_cell;
 
-    if (out_cell.is_empty()) {
+    if (!load_cell(cell_ix(target), out_cell) || out_cell.is_empty()) {
         st_inc(ST_rt_miss);
         return get_random_valid_node();
     }
@@ -152,6 +758,55 @@ const PNode RT::get_neighbor_contact(const Nih &target) const {
     };
 }
 
+u8 RT::get_neighbor_contacts(const Nih &target, PNode *out, u8 max_n) const {
+    /*
+    Walks the cells whose prefix is closest to the target's. Since the cell
+    index is the two byte prefix, xoring it with an increasing distance
+    visits cells in order of increasing prefix distance.
+    */
+
+    u32 target_ix = cell_ix(target);
+    u8 n_out = 0;
+    Nodeinfo cell;
+
+    for (u32 dist = 0; dist < RT_NEIGHBOR_SCAN && n_out < max_n; dist++) {
+        u32 ix = target_ix ^ dist;
+
+        if (!load_cell(ix, cell) || cell.is_empty()) {
+            continue;
+        }
+
+        out[n_out++] = {
+            .nid.rt.high.a = u8(ix >> 8),
+            .nid.rt.high.b = u8(ix & 0xff),
+            .nid.rt.low = cell.nih_l,
+            .peerinfo = cell.peerinfo,
+        };
+    }
+
+    if (n_out == 0) {
+        st_inc(ST_rt_miss);
+        out[n_out++] = get_random_valid_node();
+    }
+
+    return n_out;
+}
+
+bool RT::get_contact(u32 ix, PNode &out) const {
+    Nodeinfo cell;
+    if (!load_cell(ix, cell) || cell.is_empty()) {
+        return false;
+    }
+
+    out = {
+        .nid.rt.high.a = u8(ix >> 8),
+        .nid.rt.high.b = u8(ix & 0xff),
+        .nid.rt.low = cell.nih_l,
+        .peerinfo = cell.peerinfo,
+    };
+    return true;
+}
+
 const PNode RT::get_random_valid_node() const {
     /*
         Returns a random non-zero, valid node from the current routing
@@ -161,17 +816,16 @@ const PNode RT::get_random_valid_node() const {
         find no node at all.
         */
 
-    u32 start = u32(randint(0, RT_SIZE));
-    u32 end = RT_SIZE;
+    u32 start = u32(randint(0, RT_N_CELLS));
+    u32 end = RT_N_CELLS;
+    Nodeinfo out;
 
     while (start > 0) {
         for (u32 ix = start; ix < end; ix++) {
             u8 ax = u8(ix >> 8);
             u8 bx = ix & 0xff;
 
-            Nodeinfo &out = *get_cell(ax, bx);
-
-            if (!out.is_empty()) {
+            if (load_cell(ix, out) && !out.is_empty()) {
                 return {
                     .nid.rt.high.a = ax,
                     .nid.rt.high.b = bx,
@@ -2,19 +2,115 @@
 #pragma once
 #include "dht.hpp"
 #include "krpc.hpp"
+#include "seqlock.hpp"
 #include "util.hpp"
+#include "wheel.hpp"
 #include <netinet/ip.h>
 
+extern "C" {
+#include <uv.h>
+}
+
 using namespace cht;
 using bd::KRPC;
 using SIN = struct sockaddr_in;
 
 namespace cht::rt {
 
-/// If this is set, the routing table is half a GiB, which is very
-/// cache-unfriendly This can be considered experimental (even though it was the
-/// first to be used).
+/// The live table is kept in anonymous memory. This file only holds the last
+/// complete snapshot, which is validated and loaded at startup.
 #define RT_FN "./data/rt.dat"
+#define RT_TMP_FN RT_FN ".tmp"
+#define RT_OLD_FN RT_FN ".old"
+
+// Write a snapshot of the routing table every X ms
+#ifndef RT_SNAPSHOT_EVERY_MS
+#define RT_SNAPSHOT_EVERY_MS 60000
+#endif
+
+/// With RT_CONCURRENT the table is mapped shared from a tmpfs file so several
+/// threads or crawler processes can use it at once. Every cell is guarded by
+/// a sequence counter: writers claim it with a CAS and drop their write if
+/// another writer holds it, readers retry torn reads a bounded number of times.
+///
+/// Every process holds a shared flock on the file while it uses the table.
+/// The first process to start when nobody holds it rebuilds it from the
+/// snapshot image. One process at a time writes the snapshots: it renews a
+/// lease in the shared header every snapshot period, and any other process
+/// takes the role over once the owner has exited or let the lease lapse.
+/// Only the snapshot owner pings stale contacts and evicts dead ones, going
+/// by when any process last heard from each contact.
+#ifdef RT_CONCURRENT
+#ifndef RT_SHM_FN
+#define RT_SHM_FN "/dev/shm/cht_rt.dat"
+#endif
+#define RT_SHM_LOCK_FN RT_SHM_FN ".lock"
+#ifndef RT_READ_RETRIES
+#define RT_READ_RETRIES 16
+#endif
+#ifndef RT_OWNER_LEASE_S
+#define RT_OWNER_LEASE_S (3 * RT_SNAPSHOT_EVERY_MS / 1000)
+#endif
+static_assert(RT_OWNER_LEASE_S * 1000 > RT_SNAPSHOT_EVERY_MS,
+              "The snapshot owner must renew its lease before it lapses");
+#endif
+
+// bump whenever the layout of Nodeinfo or of the image header changes
+constexpr inline u32 RT_IMAGE_VERSION = 1;
+constexpr inline u64 RT_IMAGE_MAGIC = 0x314d495452544843; // "CHTRTIM1"
+// bump whenever the layout of the shared table changes
+constexpr inline u32 RT_SHM_VERSION = 2;
+
+// number of contacts returned in r_fn and r_gp replies
+#ifndef RT_K_NEIGHBORS
+#define RT_K_NEIGHBORS 8
+#endif
+// how many cells around the target to look at for neighbors, in order of
+// increasing xor distance of their two byte prefix
+#ifndef RT_NEIGHBOR_SCAN
+#define RT_NEIGHBOR_SCAN 512
+#endif
+static_assert(RT_NEIGHBOR_SCAN <= 256 * 256);
+
+// contacts not heard from for this long are pinged to check they are alive
+#ifndef RT_STALE_S
+#define RT_STALE_S 900
+#endif
+// wait this long for a refresh ping reply before trying again
+#ifndef RT_REFRESH_RETRY_S
+#define RT_REFRESH_RETRY_S 60
+#endif
+// evict contacts that ignored this many refresh pings in a row
+#ifndef RT_REFRESH_MAX_FAILS
+#define RT_REFRESH_MAX_FAILS 3
+#endif
+// run the refresh every X ms, pinging at most RT_REFRESH_BUDGET contacts
+#ifndef RT_REFRESH_EVERY_MS
+#define RT_REFRESH_EVERY_MS 1000
+#endif
+#ifndef RT_REFRESH_BUDGET
+#define RT_REFRESH_BUDGET 64
+#endif
+
+// fill crawler: every X ms, look at up to RT_FILL_SCAN cells for holes and
+// send q_fn into them, with at most RT_FILL_MAX_TOKENS unanswered
+#ifndef RT_FILL_EVERY_MS
+#define RT_FILL_EVERY_MS 100
+#endif
+#ifndef RT_FILL_SCAN
+#define RT_FILL_SCAN 1024
+#endif
+#ifndef RT_FILL_MAX_TOKENS
+#define RT_FILL_MAX_TOKENS 64
+#endif
+// tokens given back each fill tick for q_fn that were never answered
+#ifndef RT_FILL_LEAK_TOKENS
+#define RT_FILL_LEAK_TOKENS 4
+#endif
+// only fall back to the bootstrap node while the table is this empty
+#ifndef RT_BOOTSTRAP_BELOW
+#define RT_BOOTSTRAP_BELOW 64
+#endif
 
 #define RT_Q_WIDTH 3
 #define RT_MAX_Q ((1 << RT_Q_WIDTH) - 1) // check quality bitwidth in Nodeinfo
@@ -37,6 +133,12 @@ void init();
 
 bool validate_addr(u32, u16);
 
+// A find_node aimed at a hole in the table.
+struct FillQuery {
+    PNode dest; // a known good contact near the hole
+    Nih target; // a random target inside the hole's prefix
+};
+
 class RT {
   private:
     struct Nodeinfo {
@@ -50,10 +152,85 @@ class RT {
     };
     static_assert(sizeof(Nodeinfo) == 24, "Bad nodeinfo size");
 
+    // Precedes the cell array in the snapshot image.
+    struct ImageHeader {
+        u64 magic;
+        u32 version;
+        u32 n_cells;
+        u32 cell_size;
+        u32 _pad;
+        u64 checksum; // fnv1a64 of the cell array
+        u64 created_s;
+    };
+    static_assert(sizeof(ImageHeader) == 40, "Bad image header size");
+
+    // Owns the copy of the table being written by the snapshot worker.
+    struct SnapshotJob {
+        uv_work_t req;
+        ImageHeader hdr;
+        Nodeinfo *cells;
+        u64 start_ms;
+        u64 end_ms;
+        u64 bytes;
+        int err;
+        bool ok;
+    };
+
+    static constexpr u32 RT_N_CELLS = 256 * 256;
+    static constexpr u32 RT_SIZE = sizeof(Nodeinfo) * RT_N_CELLS;
+    static constexpr u32 CELL_WORDS = sizeof(Nodeinfo) / sizeof(u64);
+    static_assert(CELL_WORDS * sizeof(u64) == sizeof(Nodeinfo));
+
+#ifdef RT_CONCURRENT
+    // Ends the shared table, set up by whoever builds it.
+    struct ShmHeader {
+        u64 magic;
+        u32 version;
+        u32 n_occupied;
+        // pid of the snapshot writer in the low half, when it last renewed
+        // its lease in the high half, in mono_ms seconds
+        u64 owner;
+    };
+
+    // the cell array is followed by one sequence counter per cell, and by
+    // when the contact of each cell was last heard from, in mono_ms seconds
+    static constexpr u32 RT_MAP_SIZE =
+        RT_SIZE + 2 * sizeof(u32) * RT_N_CELLS + sizeof(ShmHeader);
+    u32 *__seq;
+    u32 *__seen;
+    ShmHeader *__shm;
+    // holds our shared flock on the table
+    int shm_fd = -1;
+    // the odd counter each cell had at the last snapshot, or 0
+    std::vector<u32> stuck_seq;
+#endif
+
+    // Liveness tracking, only used by the snapshot owner. Cells are due on
+    // the wheel (in seconds) when they go stale or when their refresh ping
+    // times out. Under RT_CONCURRENT cells other processes fill are put on
+    // it by the fill sweep, and it is rebuilt on taking over.
+    TimerWheel<RT_N_CELLS> liveness = TimerWheel<RT_N_CELLS>(mono_ms() / 1000);
+    std::vector<u8> refresh_fails = std::vector<u8>(RT_N_CELLS, 0);
+
+#ifndef RT_CONCURRENT
+    u32 n_occupied = 0;
+#endif
+    u32 fill_cursor = 0;
+
+    SnapshotJob snap_job;
+    bool snap_in_flight = false;
+    // only one process sharing the table writes snapshots, see
+    // claim_snapshots
+    bool snap_owner;
+
+    // Declared last: load_rt sets up n_occupied, snap_job and snap_owner, so
+    // they must be initialized before it runs.
     Nodeinfo *__rt;
-    static constexpr u32 RT_SIZE = sizeof(Nodeinfo) * 256 * 256;
 
     RT() : __rt(load_rt()) {
+        if (snap_owner) {
+            schedule_all();
+        }
     }
 
     static inline bool check_evict(u8 cur_qual, u8 cand_qual) {
@@ -73,10 +250,31 @@ class RT {
     }
 
     Nodeinfo *load_rt();
-    Nodeinfo *get_cell(const Nih &nid) const;
-    Nodeinfo *get_cell(u8 a, u8 b) const;
+    Nodeinfo *alloc_rt();
+    // Only for a table nobody else uses yet.
+    static u32 count_occupied(Nodeinfo *rt);
+    void schedule_all();
+    void add_occupied(i32 delta);
+    // When any process last heard from the contact of the cell, 0 if unknown.
+    u32 seen_s(u32 ix) const;
+    // Whether we write the snapshots, renewing or taking over the lease.
+    bool claim_snapshots();
+    void repair_stuck_cells();
+    static bool load_image(const char *fn, Nodeinfo *dst);
+    static void snapshot_work_cb(uv_work_t *);
+    static void snapshot_after_cb(uv_work_t *, int);
+    static u32 cell_ix(const Nih &nid);
+    static u32 cell_ix(u8 a, u8 b);
+    // Consistent copy of a cell. Fails only if it stays torn for
+    // RT_READ_RETRIES attempts.
+    bool load_cell(u32 ix, Nodeinfo &out) const;
+    // Applies `update` to the cell in place, it returns whether it changed
+    // anything. Never waits: fails if another writer holds the cell.
+    template <typename F>
+    bool update_cell(u32 ix, F &&update);
     void set_cell(const Nih &nid, const SIN &addr, u8 qual);
     void set_cell(const Nih &nid, u32 in_addr, u16 sin_port, u8 qual);
+    void mark_seen(u32 ix, bool same_node);
 
   public:
     static constexpr PNode bootstrap_node = {
@@ -106,8 +304,38 @@ class RT {
     void adj_quality(const Nih &nid, i64 delta);
     void delete_node(const Nih &target);
 
+    // Copies the live table and hands it to the uv threadpool to be written
+    // out as a checksummed image. Does nothing if a snapshot is in flight.
+    void snapshot(uv_loop_t *loop);
+
+    // Writes up to `max_n` contacts that have gone stale to `out`, to be
+    // pinged by the caller. Evicts contacts that failed too many refreshes.
+    // Does nothing unless we are the snapshot owner.
+    u32 collect_stale(PNode *out, u32 max_n);
+
+    // Writes up to `max_n` find_node queries aimed at empty or stale cells.
+    u32 collect_fill_queries(FillQuery *out, u32 max_n);
+
+    u32 occupancy() const {
+#ifdef RT_CONCURRENT
+        return __atomic_load_n(&__shm->n_occupied, __ATOMIC_RELAXED);
+#else
+        return n_occupied;
+#endif
+    }
+
+    static constexpr u32 capacity() {
+        return RT_N_CELLS;
+    }
+
     const PNode get_neighbor_contact(const Nih &target) const;
+    // Writes up to `max_n` contacts close to `target` to `out`, closest
+    // first. Always writes at least one contact.
+    u8 get_neighbor_contacts(const Nih &target, PNode *out, u8 max_n) const;
     const PNode get_random_valid_node() const;
+    // Copies the contact of cell `ix`, false if the cell is empty. Cells are
+    // indexed by the first two bytes of their nid.
+    bool get_contact(u32 ix, PNode &out) const;
 };
 
 bool validate_addr(u32 in_addr, u16 sin_port);
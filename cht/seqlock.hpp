@@ -0,0 +1,65 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht {
+
+/// Sequence locks over cells of WORDS u64, each guarded by its own u32
+/// counter, for tables shared between threads or processes. A writer makes
+/// the counter odd with a CAS, stores the words and makes it even again. A
+/// writer that finds the counter odd or loses the CAS gives up, it never
+/// waits. Readers copy the words and try again if the counter was odd or
+/// moved under them. Counters start at 0.
+
+enum SeqWrite { SW_CONTENDED, SW_UNCHANGED, SW_CHANGED };
+
+// One read attempt. False if the cell was torn.
+template <u32 WORDS>
+inline bool seq_try_read(const u32 *seq, const u64 *words, u64 out[WORDS]) {
+    u32 before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    // a writer is in the middle of this cell
+    if (before & 1) {
+        return false;
+    }
+    for (u32 wx = 0; wx < WORDS; wx++) {
+        out[wx] = __atomic_load_n(words + wx, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) == before;
+}
+
+// Claims the cell and applies `update` to a copy of its words, which are
+// stored back only if it returns true.
+template <u32 WORDS, typename F>
+inline SeqWrite seq_try_update(u32 *seq, u64 *words, F &&update) {
+    u32 before = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+    if ((before & 1) ||
+        !__atomic_compare_exchange_n(seq, &before, before + 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return SW_CONTENDED;
+    }
+    // order the odd counter before any of the data stores
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    u64 buf[WORDS];
+    for (u32 wx = 0; wx < WORDS; wx++) {
+        buf[wx] = __atomic_load_n(words + wx, __ATOMIC_RELAXED);
+    }
+
+    bool changed = update(buf);
+
+    if (changed) {
+        for (u32 wx = 0; wx < WORDS; wx++) {
+            __atomic_store_n(words + wx, buf[wx], __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_store_n(seq, before + 2, __ATOMIC_RELEASE);
+    return changed ? SW_CHANGED : SW_UNCHANGED;
+}
+
+} // namespace cht
@@ -0,0 +1,77 @@
+#include "serve.hpp"
+#include "db.hpp"
+#include "ihidx.hpp"
+#include "stat.hpp"
+
+#include <algorithm>
+#include <array>
+
+using namespace cht;
+namespace cht::serve {
+
+#ifdef SERVE
+
+static std::array<Samples, SERVE_SI_BUFS> g_bufs;
+// the buffer handed out next, and the one rebuilt next
+static u32 g_next = 0;
+static u32 g_oldest = 0;
+
+#ifdef IHIDX
+static ihidx::Reader g_index;
+#endif
+
+static void build(Samples &buf) {
+    std::array<Nih, SERVE_SI_SAMPLES> samples;
+    u64 num = st_get(ST_db_ihs);
+
+    // the store is small, so it gets at most half the samples
+    u32 n_db =
+        db::sample_ihs(samples.data(), SERVE_SI_SAMPLES / 2, SERVE_SCAN);
+    u32 n_samples = n_db;
+
+#ifdef IHIDX
+    std::array<Nih, SERVE_SI_SAMPLES> from_idx;
+    u32 n_idx = g_index.sample(from_idx.data(), SERVE_SI_SAMPLES - n_db,
+                               SERVE_SCAN);
+    for (u32 ix = 0; ix < n_idx; ix++) {
+        bool dup = false;
+        for (u32 jx = 0; jx < n_db && !dup; jx++) {
+            dup = memcmp(samples[jx].raw.data(), from_idx[ix].raw.data(),
+                         NIH_LEN) == 0;
+        }
+        if (!dup) {
+            samples[n_samples++] = from_idx[ix];
+        }
+    }
+    // most infohashes with peers are indexed too
+    num = std::max(num, g_index.n_keys());
+#endif
+
+    buf.len = msg::si_samples(buf.enc, u32(std::min<u64>(num, UINT32_MAX)),
+                              samples.data(), n_samples);
+
+    st_inc(ST_serve_si_rebuilds);
+    st_set(ST_serve_si_db_samples, n_db);
+    st_set(ST_serve_si_idx_samples, n_samples - n_db);
+}
+
+void init() {
+    for (auto &buf : g_bufs) {
+        build(buf);
+    }
+}
+
+void rebuild() {
+    build(g_bufs[g_oldest]);
+    g_oldest = (g_oldest + 1) % SERVE_SI_BUFS;
+}
+
+const Samples &next_samples() {
+    const Samples &buf = g_bufs[g_next];
+    g_next = (g_next + 1) % SERVE_SI_BUFS;
+    return buf;
+}
+
+#endif // SERVE
+
+} // namespace cht::serve
@@ -0,0 +1,66 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include "msg.hpp"
+
+using namespace cht;
+namespace cht::serve {
+
+// Answers from our own stores, enabled with SERVE. Nodes that get useful
+// answers keep us in their tables and ask us more, which is what we harvest.
+//
+// q_si get samples from SERVE_SI_BUFS buffers, bencoded ahead of time and
+// handed out in turn, so a reply costs one memcpy more than an r_fn. Every
+// SERVE_SI_INTERVAL_S / SERVE_SI_BUFS one buffer is rebuilt, with up to half
+// of its samples taken from infohashes the peer store has peers for and the
+// rest from the infohash index under IHIDX, looking at no more than
+// SERVE_SCAN slots of either. Askers that wait the interval we tell them get
+// a new buffer.
+//
+// r_gp carry up to SERVE_GP_VALUES peers of the store besides the nodes. Only
+// the loop thread may use this.
+
+#ifndef SERVE_SI_BUFS
+#define SERVE_SI_BUFS 4
+#endif
+#ifndef SERVE_SI_SAMPLES
+#define SERVE_SI_SAMPLES 20
+#endif
+// the interval of our r_si
+#ifndef SERVE_SI_INTERVAL_S
+#define SERVE_SI_INTERVAL_S 60
+#endif
+#ifndef SERVE_SCAN
+#define SERVE_SCAN 4096
+#endif
+#ifndef SERVE_GP_VALUES
+#define SERVE_GP_VALUES 8
+#endif
+
+#define SERVE_REBUILD_MS (SERVE_SI_INTERVAL_S * 1000 / SERVE_SI_BUFS)
+
+static_assert(SERVE_SI_SAMPLES <= MSG_SI_MAX_SAMPLES);
+static_assert(SERVE_GP_VALUES <= MSG_GP_MAX_VALUES);
+// BEP 51 caps the interval at six hours
+static_assert(SERVE_SI_INTERVAL_S > 0 && SERVE_SI_INTERVAL_S <= 21600);
+static_assert(SERVE_REBUILD_MS > 0);
+
+// The num and samples keys of an r_si, as msg::si_samples writes them.
+struct Samples {
+    u8 enc[msg::MSG_SI_SAMPLES_MAXLEN];
+    u32 len;
+};
+
+#ifdef SERVE
+// Builds every buffer.
+void init();
+
+// Rebuilds the oldest buffer. To be called every SERVE_REBUILD_MS.
+void rebuild();
+
+// The buffer for the next r_si. It stays valid until the next rebuild.
+const Samples &next_samples();
+#endif
+
+} // namespace cht::serve
@@ -7,6 +7,7 @@
 #include "rt.hpp"
 #include "spamfilter.hpp"
 #include "stat.hpp"
+#include "token.hpp"
 #include <chrono>
 #include <sys/random.h>
 
@@ -24,7 +25,7 @@ using msg_write_t = std::function<u32(u8 *)>;
 namespace cht {
 
 static constexpr u16 PORT = 6881;
-static constexpr u16 SEND_LEN = 256;
+static constexpr u16 SEND_LEN = MSG_BUF_LEN;
 
 static inline const udp::endpoint as_endpoint(const Peerinfo &pinfo) {
     return udp::endpoint(make_address_v4(be32toh(pinfo.in_addr)),
@@ -107,8 +108,6 @@ class KRPCServer {
 
         st_inc(ST_rx_tot);
 
-        gpm::NextHop next_hop;
-
         switch (krpc.method) {
         case bd::Q_PG: {
             st_inc(ST_rx_q_pg);
@@ -127,10 +126,13 @@ class KRPCServer {
         case bd::Q_FN: {
             st_inc(ST_rx_q_fn);
 
-            auto payload = g_rt.get_neighbor_contact(*krpc.target);
+            std::array<PNode, RT_K_NEIGHBORS> payload;
+            u8 n_payload = g_rt.get_neighbor_contacts(
+                *krpc.target, payload.data(), RT_K_NEIGHBORS);
 
-            auto const &write_fn = [krp = bd::KReply(krpc), payload](auto buf) {
-                return msg::r_fn(buf, krp, payload);
+            auto const &write_fn = [krp = bd::KReply(krpc), payload,
+                                    n_payload](auto buf) {
+                return msg::r_fn(buf, krp, payload.data(), n_payload);
             };
 
             send_msg(write_fn, sender, ST_tx_r_fn);
@@ -143,27 +145,37 @@ class KRPCServer {
         case bd::Q_GP: {
             st_inc(ST_rx_q_gp);
 
-            auto [pursue, tok] = gpm::decide_pursue_q_gp_ih(krpc);
-            auto ih_neig = g_rt.get_neighbor_contact(*krpc.ih);
+            bool pursue = gpm::decide_pursue_q_gp_ih(krpc);
 
-            if (pursue) {
+            std::array<PNode, RT_K_NEIGHBORS> ih_neigs;
+            u8 n_ih_neigs = g_rt.get_neighbor_contacts(
+                *krpc.ih, ih_neigs.data(), RT_K_NEIGHBORS);
 
-                if (ih_neig.nid.checksum == krpc.nid->checksum) {
-                    ih_neig = g_rt.get_random_valid_node();
+            if (pursue) {
+                std::array<PNode, RT_K_NEIGHBORS> seeds;
+                u8 n_seeds = 0;
+                for (u8 ix = 0; ix < n_ih_neigs; ix++) {
+                    if (ih_neigs[ix].nid.checksum() !=
+                        krpc.nid->checksum()) {
+                        seeds[n_seeds++] = ih_neigs[ix];
+                    }
+                }
+                if (n_seeds == 0) {
+                    seeds[n_seeds++] = g_rt.get_random_valid_node();
                 }
 
-                auto const &write_fn = [=, tok = tok, ih = *krpc.ih](auto buf) {
-                    return msg::q_gp(buf, ih_neig.nid, ih, tok);
-                };
-
-                send_msg(write_fn, as_endpoint(ih_neig.peerinfo), ST_tx_q_gp);
-                gpm::register_q_gp_ihash(ih_neig.nid, *krpc.ih, 0, tok);
+                gpm::start_lookup(*krpc.ih, seeds.data(), n_seeds);
+                send_gp_queries();
             }
 
             // reply to the sender node
 
+            std::array<u8, TOKEN_LEN> ap_token;
+            token::make(in_addr(sender), ap_token.data());
+
             auto const &write_fn = [=, krp = bd::KReply(krpc)](auto buf) {
-                return msg::r_gp(buf, krp, ih_neig);
+                return msg::r_gp(buf, krp, ih_neigs.data(), n_ih_neigs,
+                                 ap_token.data());
             };
 
             send_msg(write_fn, sender, ST_tx_r_gp);
@@ -178,6 +190,13 @@ class KRPCServer {
 
             DEBUG("got q_ap!")
 
+#ifndef NOFILTER_AP
+            if (!token::check(in_addr(sender), krpc.token, krpc.token_len)) {
+                st_inc(ST_bd_z_ap_bad_token);
+                break;
+            }
+#endif
+
             // u16 ap_port;
             // if (krpc->ap_implied_port) {
             //     ap_port = saddr->sin_port;
@@ -229,43 +248,18 @@ class KRPCServer {
                     st_click_gp_n_hops(val);
                 }
 #endif
-                gpm::clear_tok(krpc);
                 // TODO handle peer
                 g_rt.insert_contact(krpc, in_addr(sender),
                                     htobe16(sender.port()), 4);
             }
 
-            if (krpc.n_nodes == 0) {
-                break;
-            }
-
-            st_inc(ST_rx_r_gp_nodes);
-            ping_sweep_nodes(krpc);
-
-            if (!gpm::extract_tok(next_hop, krpc)) {
-                break;
+            if (krpc.n_nodes > 0) {
+                st_inc(ST_rx_r_gp_nodes);
+                ping_sweep_nodes(krpc);
             }
 
-            for (auto const &pn : next_hop.pnodes) {
-
-                if (!spam_check_tx_q_gp(pn.peerinfo.in_addr, next_hop.ih)) {
-                    continue;
-                }
-
-                auto [ok, tok] = gpm::take_tok();
-                if (!ok) {
-                    break;
-                }
-
-                const auto &write_fn = [ih = next_hop.ih, dest = pn.nid,
-                                        tok = tok](auto buf) {
-                    return msg::q_gp(buf, dest, ih, tok);
-                };
-
-                send_msg(write_fn, as_endpoint(pn.peerinfo), ST_tx_q_gp);
-                gpm::register_q_gp_ihash(pn.nid, next_hop.ih,
-                                         next_hop.hop_ctr + 1, tok);
-            }
+            gpm::handle_r_gp(krpc);
+            send_gp_queries();
             break;
         }
 
@@ -298,6 +292,24 @@ class KRPCServer {
                            });
     }
 
+    void send_gp_queries() {
+        gpm::Query query;
+
+        while (gpm::pop_query(query)) {
+            if (!spam_check_tx_q_gp(query.dest.peerinfo.in_addr, query.ih)) {
+                gpm::fail_query(query.tok);
+                continue;
+            }
+
+            const auto &write_fn = [ih = query.ih, dest = query.dest.nid,
+                                    tok = query.tok](auto buf) {
+                return msg::q_gp(buf, dest, ih, tok);
+            };
+
+            send_msg(write_fn, as_endpoint(query.dest.peerinfo), ST_tx_q_gp);
+        }
+    }
+
     void ping_sweep_nodes(const KRPC &krpc) {
         for (int ix = 0; ix < krpc.n_nodes; ix++) {
 
@@ -0,0 +1,120 @@
+#include "si.hpp"
+#include "bloom.hpp"
+#include "ihlog.hpp"
+#include "rt.hpp"
+#include "stat.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <vector>
+
+using namespace cht;
+using rt::g_rt;
+namespace cht::si {
+
+#ifdef SI_CRAWL
+
+// When the contact of a cell is next due, and which contact that was for.
+struct Due {
+    u32 nid_tail;
+    u32 due_s;
+};
+
+static std::vector<Due> g_due;
+static u32 g_cursor = 0;
+
+// Infohashes seen lately, from either path. Rotated once it holds enough to
+// near 1% false positives.
+static RotatingBloom<SI_KNOWN_LOG2_BLOCKS> g_known;
+constexpr u64 KNOWN_MAX_LOAD = (u64(1) << SI_KNOWN_LOG2_BLOCKS) * 512 / 12;
+
+static inline u32 now_s() {
+    return u32(mono_ms() / 1000);
+}
+
+static inline u32 nid_tail(const Nih &nid) {
+    u32 tail;
+    memcpy(&tail, nid.raw.data() + NIH_LEN - sizeof(u32), sizeof(u32));
+    return tail;
+}
+
+// Whether the infohash was not seen lately, remembering it.
+static bool note_new(const Nih &ih) {
+    if (g_known.contains(ih)) {
+        return false;
+    }
+    g_known.add(ih);
+    if (g_known.load() >= KNOWN_MAX_LOAD) {
+        g_known.rotate();
+        st_inc(ST_si_known_rotations);
+    }
+    return true;
+}
+
+void init() {
+    g_due.assign(rt::RT::capacity(), {0, 0});
+}
+
+u32 collect_queries(PNode *out, u32 max_n) {
+    u32 now = now_s();
+    u32 n_out = 0;
+    PNode contact;
+
+    for (u32 scanned = 0; scanned < SI_SCAN && n_out < max_n; scanned++) {
+        u32 ix = g_cursor;
+        g_cursor = (g_cursor + 1) % rt::RT::capacity();
+
+        if (!g_rt.get_contact(ix, contact)) {
+            continue;
+        }
+
+        // a new contact in the cell is due right away
+        Due &due = g_due[ix];
+        u32 tail = nid_tail(contact.nid);
+        if (due.nid_tail == tail && now < due.due_s) {
+            continue;
+        }
+
+        due.nid_tail = tail;
+        due.due_s = now + SI_RETRY_S;
+        out[n_out++] = contact;
+    }
+
+    return n_out;
+}
+
+void on_reply(const bd::KRPC &krpc) {
+    const Nih &nid = *krpc.nid;
+    Due &due = g_due[(u32(nid.raw[0]) << 8) | nid.raw[1]];
+    due.nid_tail = nid_tail(nid);
+
+    if (krpc.samples == nullptr) {
+        st_inc(ST_rx_r_si_no_samples);
+        due.due_s = now_s() + SI_UNSUPPORTED_S;
+        return;
+    }
+
+    due.due_s = now_s() + std::clamp(krpc.si_interval, u32(SI_MIN_INTERVAL_S),
+                                     u32(SI_MAX_INTERVAL_S));
+
+    u32 n_new = 0;
+    for (u32 ix = 0; ix < krpc.n_samples; ix++) {
+#ifdef IHLOG
+        ihlog::log_ih(ihlog::SRC_R_SI, krpc.samples[ix]);
+#endif
+        n_new += note_new(krpc.samples[ix]);
+    }
+
+    st_add(ST_rx_r_si_samples, krpc.n_samples);
+    st_add(ST_si_ihs_new, n_new);
+}
+
+void note_gp_ih(const Nih &ih) {
+    if (note_new(ih)) {
+        st_inc(ST_gp_ihs_new);
+    }
+}
+
+#endif // SI_CRAWL
+
+} // namespace cht::si
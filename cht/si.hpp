@@ -0,0 +1,65 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include "krpc.hpp"
+
+using namespace cht;
+namespace cht::si {
+
+// BEP 51 sample_infohashes crawler, enabled with SI_CRAWL. Every SI_EVERY_MS a
+// cursor moves on through up to SI_SCAN rt cells, and at most SI_BUDGET of
+// their contacts that are due get a q_si. A contact is due again once the
+// interval of its last r_si has passed, clamped to [SI_MIN_INTERVAL_S,
+// SI_MAX_INTERVAL_S]. Contacts that did not answer are retried after
+// SI_RETRY_S, and those without BEP 51 after SI_UNSUPPORTED_S.
+//
+// Samples are logged to ihlog as SRC_R_SI. To compare the yield with the q_gp
+// path, samples and the q_gp, q_ap and r_gp infohashes are checked against
+// one filter of recently seen infohashes, and ctl reports new infohashes per
+// 1000 packets sent for both. Only the loop thread may use this.
+
+#ifndef SI_EVERY_MS
+#define SI_EVERY_MS 100
+#endif
+#ifndef SI_SCAN
+#define SI_SCAN 1024
+#endif
+#ifndef SI_BUDGET
+#define SI_BUDGET 16
+#endif
+#ifndef SI_MIN_INTERVAL_S
+#define SI_MIN_INTERVAL_S 60
+#endif
+// the largest interval BEP 51 allows
+#ifndef SI_MAX_INTERVAL_S
+#define SI_MAX_INTERVAL_S 21600
+#endif
+#ifndef SI_RETRY_S
+#define SI_RETRY_S 600
+#endif
+#ifndef SI_UNSUPPORTED_S
+#define SI_UNSUPPORTED_S 21600
+#endif
+// log2 of the cache lines of each half of the filter of seen infohashes
+#ifndef SI_KNOWN_LOG2_BLOCKS
+#define SI_KNOWN_LOG2_BLOCKS 16
+#endif
+
+static_assert(SI_MIN_INTERVAL_S <= SI_MAX_INTERVAL_S);
+
+#ifdef SI_CRAWL
+void init();
+
+// Writes up to `max_n` contacts due for a q_si to `out`. They are not due
+// again until they answer or SI_RETRY_S passes.
+u32 collect_queries(PNode *out, u32 max_n);
+
+// Logs the samples of an r_si and schedules the next q_si to its sender.
+void on_reply(const bd::KRPC &);
+
+// Counts an infohash from the q_gp path, for comparison.
+void note_gp_ih(const Nih &ih);
+#endif
+
+} // namespace cht::si
@@ -35,6 +35,17 @@ static chr::time_point<chr::steady_clock> st_time_old;
 static u64 g_ctr[ST__ST_ENUM_END] = {0};
 static u64 g_ctr_old[ST__ST_ENUM_END] = {0};
 
+// with GPM_CONCURRENT, the GPM workers count from their own threads
+#ifdef GPM_CONCURRENT
+#define CTR_ADD(ctr, val) __atomic_fetch_add(&(ctr), (val), __ATOMIC_RELAXED)
+#define CTR_SET(ctr, val) __atomic_store_n(&(ctr), (val), __ATOMIC_RELAXED)
+#define CTR_GET(ctr) __atomic_load_n(&(ctr), __ATOMIC_RELAXED)
+#else
+#define CTR_ADD(ctr, val) ((ctr) += (val))
+#define CTR_SET(ctr, val) ((ctr) = (val))
+#define CTR_GET(ctr) (ctr)
+#endif
+
 static inline void rollover_time() {
     st_time_old = st_time_now;
     st_time_now = chr::steady_clock::now();
@@ -43,6 +54,7 @@ static inline void rollover_time() {
 #ifdef STAT_AUX
 static u64 g_dkad_ctr[161] = {0};
 static u64 g_n_hops_ctr[GP_MAX_HOPS + 1] = {0};
+static u64 g_gp_rtt_ctr[CTL_GPM_RTT_N_BUCKETS] = {0};
 #endif
 
 void st_init() {
@@ -66,6 +78,10 @@ void st_init() {
         for (int ix = 0; ix <= GP_MAX_HOPS; ix++) {
             fprintf(csv_aux, "gp_hops_%d,", ix);
         }
+        // named by the lower edge of the bucket, in ms
+        for (int ix = 0; ix < CTL_GPM_RTT_N_BUCKETS; ix++) {
+            fprintf(csv_aux, "gp_rtt_%d,", ix * CTL_GPM_RTT_BUCKET_MS);
+        }
         fprintf(csv_aux, "\n");
     }
     ENDWITH(csv_aux, "Could not open aux CSV " STAT_AUX_FN " for writing")
@@ -74,7 +90,7 @@ void st_init() {
 }
 
 void st_inc(stat_t stat) {
-    g_ctr[stat]++;
+    CTR_ADD(g_ctr[stat], 1);
 }
 
 void st_dec(stat_t stat) {
@@ -82,34 +98,49 @@ void st_dec(stat_t stat) {
 }
 
 void st_set(stat_t stat, u64 val) {
-    g_ctr[stat] = val;
+    CTR_SET(g_ctr[stat], val);
 }
 
 void st_inc_debug(stat_t stat) {
-    g_ctr[stat]++;
+    CTR_ADD(g_ctr[stat], 1);
     DEBUG("%s -> %lu", stat_names[stat], g_ctr[stat]);
 }
 
 void st_add(stat_t stat, u32 val) {
-    g_ctr[stat] += val;
+    CTR_ADD(g_ctr[stat], val);
 }
 
 void st_click_dkad(u8 dkad) {
 #ifdef STAT_AUX
     assert(dkad <= 160);
-    g_dkad_ctr[dkad]++;
+    CTR_ADD(g_dkad_ctr[dkad], 1);
 #endif
 };
 
 void st_click_gp_n_hops(u8 n_hops) {
 #ifdef STAT_AUX
     assert(n_hops < sizeof(g_n_hops_ctr));
-    g_n_hops_ctr[n_hops]++;
+    CTR_ADD(g_n_hops_ctr[n_hops], 1);
+#endif
+}
+
+void st_click_gp_rtt(u32 bucket) {
+#ifdef STAT_AUX
+    assert(bucket < CTL_GPM_RTT_N_BUCKETS);
+    CTR_ADD(g_gp_rtt_ctr[bucket], 1);
 #endif
 }
 
+chr::time_point<chr::steady_clock> now() {
+    return st_time_now;
+}
+
+chr::time_point<chr::steady_clock> old() {
+    return st_time_old;
+}
+
 u64 st_get(stat_t stat) {
-    return g_ctr[stat];
+    return CTR_GET(g_ctr[stat]);
 }
 
 u64 st_get_old(stat_t stat) {
@@ -126,7 +157,7 @@ void st_rollover() {
     ctl_rollover_hook();
 
     for (int ix = 0; ix < ST__ST_ENUM_END; ix++) {
-        g_ctr_old[ix] = g_ctr[ix];
+        g_ctr_old[ix] = CTR_GET(g_ctr[ix]);
     };
 
     if (next_heartbeat != STAT_HB_EVERY - 1) {
@@ -163,9 +194,13 @@ void st_rollover() {
             fprintf(csv_aux, "%lu,", g_dkad_ctr[ix]);
         }
         // hop statistics
-        for (int ix = 0; ix < GP_MAX_HOPS; ix++) {
+        for (int ix = 0; ix <= GP_MAX_HOPS; ix++) {
             fprintf(csv_aux, "%lu,", g_n_hops_ctr[ix]);
         }
+        // get_peers reply latency statistics
+        for (int ix = 0; ix < CTL_GPM_RTT_N_BUCKETS; ix++) {
+            fprintf(csv_aux, "%lu,", g_gp_rtt_ctr[ix]);
+        }
         fprintf(csv_aux, "\n");
     }
     ENDWITH(csv_aux, "Could not open CSV " STAT_AUX_FN " for writing")
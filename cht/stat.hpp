@@ -37,6 +37,10 @@ namespace cht {
     X(ctl_n_send_bufs)                                                         \
     X(ctl_n_gpm_bufs)                                                          \
     X(ctl_ping_window)                                                         \
+    X(ctl_rx_q_per_s) /* inbound query rate, what feeds the harvest */        \
+    X(ctl_gpm_timeout_ms)                                                      \
+    X(ctl_si_new_per_ktx) /* new infohashes per 1000 q_si */                   \
+    X(ctl_gp_new_per_ktx) /* ... per 1000 q_gp, r_gp and r_ap */               \
     /* spam stats */                                                           \
     X(spam_size_ping)                                                          \
     X(spam_ping_overflow)                                                      \
@@ -48,16 +52,21 @@ namespace cht {
     X(rx_spam)                                                                 \
     X(rx_tot)                                                                  \
     X(rx_err)                                                                  \
+    X(rx_q_tot)                                                                \
     X(rx_q_ap)                                                                 \
     X(rx_q_fn)                                                                 \
     X(rx_q_pg)                                                                 \
     X(rx_q_gp)                                                                 \
+    X(rx_q_si)                                                                 \
     X(rx_r_ap)                                                                 \
     X(rx_r_fn)                                                                 \
     X(rx_r_gp)                                                                 \
     X(rx_r_gp_nodes)                                                           \
     X(rx_r_gp_values)                                                          \
     X(rx_r_pg)                                                                 \
+    X(rx_r_si)                                                                 \
+    X(rx_r_si_samples)                                                         \
+    X(rx_r_si_no_samples) /* nodes without BEP 51 */                           \
     /* transmitted message statistics */                                       \
     X(tx_msg_drop_early_error)                                                 \
     X(tx_msg_drop_late_error)                                                  \
@@ -70,26 +79,131 @@ namespace cht {
     X(tx_q_pg)                                                                 \
     X(tx_q_gp)                                                                 \
     X(tx_q_gp_drop_spam)                                                       \
+    X(tx_q_si)                                                                 \
     X(tx_r_ap)                                                                 \
     X(tx_r_fn)                                                                 \
     X(tx_r_gp)                                                                 \
+    X(tx_r_gp_values) /* ... carrying peers we stored */                       \
     X(tx_r_pg)                                                                 \
+    X(tx_r_si)                                                                 \
     /* routing table constant */                                               \
     X(rt_replace_accept)                                                       \
     X(rt_replace_reject)                                                       \
     X(rt_replace_invalid)                                                      \
     X(rt_newnode_invalid)                                                      \
     X(rt_miss)                                                                 \
+    X(rt_load_bad_image)                                                       \
+    X(rt_snap_ok)                                                              \
+    X(rt_snap_fail)                                                            \
+    X(rt_snap_skip)                                                            \
+    X(rt_snap_bytes)                                                           \
+    X(rt_snap_ms)                                                              \
+    X(rt_snap_takeover) /* from an owner that died or let its lease lapse */   \
+    X(rt_occupied)                                                             \
+    X(rt_warmup_90_ms)                                                         \
+    X(rt_fill_q_fn)                                                            \
+    X(rt_fill_no_contact)                                                      \
+    X(rt_stale)                                                                \
+    X(rt_refreshed)                                                            \
+    X(rt_evicted)                                                              \
+    X(rt_read_torn)                                                            \
+    X(rt_read_gave_up)                                                         \
+    X(rt_write_contended)                                                      \
+    X(rt_cells_repaired) /* left mid-write by a dead writer */                 \
     /* database interaction statistics */                                      \
     X(gpm_ih_drop_buf_overflow)                                                \
     X(gpm_ih_drop_too_many_hops)                                               \
     X(gpm_ih_inserted)                                                         \
     X(gpm_r_gp_lookup_failed)                                                  \
+    X(gpm_r_gp_late) /* replies after their get_peers timed out */             \
+    X(gpm_handoffs) /* r_gp passed to the worker owning their tok */           \
+    X(gpm_handoff_dropped) /* ... lost to a full ring */                       \
+    X(gpm_inflight)                                                            \
+    X(gpm_q_drop_no_tok)                                                       \
+    X(gpm_lookups)                                                             \
+    X(gpm_lookup_found) /* lookups ended by values */                          \
+    X(gpm_lookup_exhausted) /* lookups that ran out of closer nodes */         \
+    X(gpm_lookup_q_sum) /* get_peers sent by ended lookups */                  \
+    X(gpm_seen_rotations)                                                      \
+    X(gpm_pending)                                                             \
+    X(gpm_pending_queued)                                                      \
+    X(gpm_pending_admitted)                                                    \
+    X(gpm_pending_aged)                                                        \
+    X(gpm_pending_seen) /* skipped or dropped, as recently pursued */          \
+    X(gpm_pending_hot) /* queued while topk::is_hot */                         \
+    X(gpm_trace_records)                                                       \
+    X(gpm_trace_dropped) /* trace ring full */                                 \
+    X(gpm_tok_expired)                                                         \
+    X(gpm_tok_stale_gen) /* replies to a tok whose cell was since reused */    \
+    X(gpm_tok_reuse_ms_sum) /* time toks sat free before being taken */        \
+    X(gpm_tok_reuse_n)                                                         \
+    X(api_clients)                                                             \
+    X(api_targets_queued)                                                      \
+    X(api_targets_started)                                                     \
+    X(api_targets_found)                                                       \
+    X(api_targets_not_found)                                                   \
+    X(api_peers_sent)                                                          \
+    X(api_drop_queue_full)                                                     \
+    X(api_read_paused) /* stopped reading a client until it caught up */       \
+    X(api_bad_lines)                                                           \
     X(db_update_peers)                                                         \
     X(db_rows_inserted)                                                        \
+    X(db_rows_refreshed)                                                       \
+    X(db_peers_replaced) /* peers pushed out by the per-ih cap */              \
+    X(db_peers_expired) /* peers past DB_PEER_TTL_S */                         \
+    X(db_ih_evicted) /* infohashes pushed out of a full shard */               \
+    X(db_ihs)                                                                  \
+    X(db_peers)                                                                \
+    X(db_mem_bytes)                                                            \
+    X(db_lookups)                                                              \
+    X(db_lookup_hits)                                                          \
+    X(db_lookup_ns_sum) /* sampled lookup latency */                           \
+    X(db_lookup_ns_n)                                                          \
+    X(ihlog_records)                                                           \
+    X(ihlog_dropped) /* ring to the writer full */                             \
+    X(ihlog_lag) /* records the writer has yet to write */                     \
+    X(ihlog_unsynced) /* records written but not yet synced */                 \
+    X(ihlog_segments)                                                          \
+    X(ihlog_write_errors)                                                      \
+    X(ihlog_lost) /* records a failed write took down */                       \
+    X(ihidx_keys)                                                              \
+    X(ihidx_slots)                                                             \
+    X(ihidx_migrate_left) /* old slots still to copy while growing */          \
+    X(ihidx_full_dropped) /* new infohashes refused, can't grow */             \
+    X(ihidx_errors)                                                            \
+    X(qsvc_clients)                                                            \
+    X(qsvc_requests)                                                           \
+    X(qsvc_ihs) /* infohashes asked about */                                   \
+    X(qsvc_loop_queries) /* answered by the loop */                            \
+    X(qsvc_busy) /* peer requests refused, ring full */                        \
+    X(qsvc_bad_ops)                                                            \
+    X(qsvc_lat_us_sum) /* request to reply */                                  \
+    X(qsvc_lat_n)                                                              \
+    X(qsvc_lat_us_max)                                                         \
+    X(qsvc_subs)                                                               \
+    X(qsvc_sub_events) /* sent to subscribers */                               \
+    X(qsvc_sub_skipped) /* events slow subscribers missed */                   \
+    X(qsvc_sub_torn) /* sent while being overwritten */                        \
+    X(hll_ihs)                                                                 \
+    X(hll_dense) /* sketches past sparse */                                    \
+    X(hll_mem_bytes)                                                           \
+    X(hll_evicted) /* least recently updated, over the cap */                  \
+    X(hll_max_peers) /* largest estimate updated this window */                \
+    X(hll_max_askers)                                                          \
+    X(topk_counters)                                                           \
+    X(topk_replaced) /* smallest counter taken over */                         \
+    X(topk_max_count)                                                          \
+    X(topk_min_count) /* bounds the count of the untracked */                  \
+    X(topk_errors)                                                             \
+    X(si_ihs_new) /* samples not seen lately */                                \
+    X(gp_ihs_new) /* ... and q_gp, q_ap and r_gp infohashes */                 \
+    X(si_known_rotations)                                                      \
+    X(serve_si_rebuilds)                                                       \
+    X(serve_si_db_samples) /* infohashes with peers in the last buffer */      \
+    X(serve_si_idx_samples) /* ... and from the infohash index */              \
     /* infohash lookup cycle statistics... mind these well */                  \
-    X(ih_pursue_accept) /* ignore a q_gp infohash */                           \
-    X(ih_pursue_reject) /* pursue '' */                                        \
+    X(ih_pursue_accept) /* pursue a q_gp infohash */                           \
+    X(ih_pursue_reject) /* ignore '', as recently pursued */                   \
     /* A: the message is accepted */                                           \
     X(bd_a_no_error)                                                           \
     /* X: the bdecoding is ill-formed or we can't handle the message at all */ \
@@ -105,6 +219,7 @@ namespace cht {
     X(bd_y_bad_length_ih)                                                      \
     X(bd_y_bad_length_nid)                                                     \
     X(bd_y_bad_length_target)                                                  \
+    X(bd_y_bad_length_samples)                                                 \
     X(bd_y_inconsistent_type)                                                  \
     X(bd_y_no_nid)                                                             \
     X(bd_y_no_tok)                                                             \
@@ -119,6 +234,7 @@ namespace cht {
     X(bd_z_bad_tok_fn)                                                         \
     X(bd_z_bad_tok_gp)                                                         \
     X(bd_z_bad_tok_pg)                                                         \
+    X(bd_z_bad_tok_si)                                                         \
     X(bd_z_token_too_long)                                                     \
     X(bd_z_token_unrecognized)                                                 \
     X(bd_z_naked_value)                                                        \
@@ -166,6 +282,7 @@ void st_set(stat_t, u64);
 // aux stats
 void st_click_dkad(u8);
 void st_click_gp_n_hops(u8);
+void st_click_gp_rtt(u32);
 
 u64 st_get(stat_t);
 u64 st_get_old(stat_t);
@@ -0,0 +1,65 @@
+#include "token.hpp"
+#include "log.hpp"
+#include "util.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/random.h>
+
+using namespace cht;
+namespace cht::token {
+
+static u64 g_secrets[2][2];
+// index of the current secret
+static u32 g_cur = 0;
+
+static inline u64 hash(u32 in_addr, u32 which) {
+    return siphash24(g_secrets[which], reinterpret_cast<const u8 *>(&in_addr),
+                     sizeof(in_addr));
+}
+
+// Reads of at most 256 bytes are never short once the pool is initialized,
+// but a failure would leave a secret anyone could guess.
+static bool fill_secret(u64 secret[2]) {
+    ssize_t n = getrandom(secret, 2 * sizeof(u64), 0);
+    if (n != ssize_t(2 * sizeof(u64))) {
+        ERROR("Could not draw a token secret: %s",
+              n < 0 ? strerror(errno) : "short read")
+        return false;
+    }
+    return true;
+}
+
+void init() {
+    if (!fill_secret(g_secrets[0]) || !fill_secret(g_secrets[1])) {
+        exit(-1);
+    }
+}
+
+void rotate() {
+    // keeping the current secret a while longer is better than a stale one
+    if (fill_secret(g_secrets[g_cur ^ 1])) {
+        g_cur ^= 1;
+    }
+}
+
+void make(u32 in_addr, u8 out[]) {
+    u64 val = hash(in_addr, g_cur);
+    memcpy(out, &val, TOKEN_LEN);
+}
+
+bool check(u32 in_addr, const u8 token[], u32 token_len) {
+    if (token_len != TOKEN_LEN) {
+        return false;
+    }
+    for (u32 which : {g_cur, g_cur ^ 1}) {
+        u64 val = hash(in_addr, which);
+        if (memcmp(token, &val, TOKEN_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace cht::token
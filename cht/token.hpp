@@ -0,0 +1,35 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht::token {
+
+// Announce tokens as BEP 5 has them. The token an r_gp hands out is the first
+// TOKEN_LEN bytes of a SipHash-2-4 of the requester's IPv4 address, keyed with
+// a random secret that is replaced every TOKEN_ROTATE_MS. A q_ap is taken if
+// its token matches under the current or the previous secret, so a token is
+// good for TOKEN_ROTATE_MS to twice that. Checking costs at most two hashes
+// and keeps nothing per requester, so forged announces are dropped before
+// they reach the peer store. Only the loop thread may use this.
+
+#ifndef TOKEN_ROTATE_MS
+#define TOKEN_ROTATE_MS 300000
+#endif
+
+static_assert(TOKEN_ROTATE_MS > 0);
+
+void init();
+
+// Replaces the secret, the current one becomes the previous one. To be called
+// every TOKEN_ROTATE_MS.
+void rotate();
+
+// Writes the token for the address, TOKEN_LEN bytes.
+void make(u32 in_addr, u8 out[]);
+
+// Whether the token is one we handed out to the address lately.
+bool check(u32 in_addr, const u8 token[], u32 token_len);
+
+} // namespace cht::token
@@ -0,0 +1,294 @@
+#include "topk.hpp"
+#include "log.hpp"
+#include "oa.hpp"
+#include "stat.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include <sys/random.h>
+
+using namespace cht;
+namespace cht::topk {
+
+#ifdef TOPK
+
+constexpr u32 K = 1 << TOPK_LOG2_K;
+// the slot table is kept at most a quarter full
+constexpr u32 LOG2_SLOTS = TOPK_LOG2_K + 2;
+constexpr u32 SLOT_MASK = (1 << LOG2_SLOTS) - 1;
+constexpr u32 NIL = UINT32_MAX;
+
+struct Counter {
+    Nih ih;
+    u32 count;
+    u32 err;
+    u32 bucket;
+    // the other counters of the bucket
+    u32 prev;
+    u32 next;
+};
+
+// All counters of one count. Buckets are listed by count, smallest first.
+struct Bucket {
+    u32 count;
+    u32 first;
+    u32 prev;
+    u32 next;
+};
+
+static std::array<Counter, K> g_ctrs;
+static std::array<Bucket, K> g_buckets;
+static std::vector<u32> g_free_buckets;
+static u32 g_n_ctrs = 0;
+static u32 g_low = NIL;
+static u32 g_high = NIL;
+
+// a slot holds counter index + 1, or 0
+static std::array<u32, 1 << LOG2_SLOTS> g_slots;
+static u64 g_seed;
+
+// counted messages, decayed with the counts
+static u64 g_n_counted = 0;
+static u32 g_hot_count = UINT32_MAX;
+static u32 g_rollovers = 0;
+
+static inline u32 home_of(const Nih &ih) {
+    return u32(oa::hash_ih(ih, g_seed) >> (64 - LOG2_SLOTS));
+}
+
+static inline bool is_set(u32 pos) {
+    return g_slots[pos] != 0;
+}
+
+// The slot holding the counter of the ih, or the empty slot it would go in.
+static std::pair<bool, u32> find(const Nih &ih) {
+    return oa::find(home_of(ih), SLOT_MASK, is_set, [&](u32 pos) {
+        return memcmp(g_ctrs[g_slots[pos] - 1].ih.raw.data(), ih.raw.data(),
+                      NIH_LEN) == 0;
+    });
+}
+
+static void remove_slot(u32 pos) {
+    oa::erase(
+        pos, SLOT_MASK, is_set,
+        [](u32 ix) { return home_of(g_ctrs[g_slots[ix] - 1].ih); },
+        [](u32 from, u32 to) { g_slots[to] = g_slots[from]; },
+        [](u32 ix) { g_slots[ix] = 0; });
+}
+
+// Lists a new bucket between prev and next, either of which may be NIL.
+static u32 new_bucket(u32 count, u32 prev, u32 next) {
+    u32 bx = g_free_buckets.back();
+    g_free_buckets.pop_back();
+
+    Bucket &bucket = g_buckets[bx];
+    bucket.count = count;
+    bucket.first = NIL;
+    bucket.prev = prev;
+    bucket.next = next;
+    (prev != NIL ? g_buckets[prev].next : g_low) = bx;
+    (next != NIL ? g_buckets[next].prev : g_high) = bx;
+    return bx;
+}
+
+static void attach(u32 cx, u32 bx) {
+    Counter &ctr = g_ctrs[cx];
+    Bucket &bucket = g_buckets[bx];
+    ctr.bucket = bx;
+    ctr.prev = NIL;
+    ctr.next = bucket.first;
+    if (bucket.first != NIL) {
+        g_ctrs[bucket.first].prev = cx;
+    }
+    bucket.first = cx;
+}
+
+// Takes the counter out of its bucket, dropping the bucket if that empties it.
+static void detach(u32 cx) {
+    Counter &ctr = g_ctrs[cx];
+    Bucket &bucket = g_buckets[ctr.bucket];
+    (ctr.prev != NIL ? g_ctrs[ctr.prev].next : bucket.first) = ctr.next;
+    if (ctr.next != NIL) {
+        g_ctrs[ctr.next].prev = ctr.prev;
+    }
+
+    if (bucket.first == NIL) {
+        (bucket.prev != NIL ? g_buckets[bucket.prev].next : g_low) =
+            bucket.next;
+        (bucket.next != NIL ? g_buckets[bucket.next].prev : g_high) =
+            bucket.prev;
+        g_free_buckets.push_back(ctr.bucket);
+    }
+}
+
+static void bump(u32 cx) {
+    Counter &ctr = g_ctrs[cx];
+    u32 bx = ctr.bucket;
+    Bucket &bucket = g_buckets[bx];
+    u32 count = ++ctr.count;
+
+    if (bucket.first == cx && ctr.next == NIL &&
+        (bucket.next == NIL || g_buckets[bucket.next].count > count)) {
+        // alone in its bucket, which can just move up
+        bucket.count = count;
+        return;
+    }
+
+    u32 to = bucket.next;
+    if (to == NIL || g_buckets[to].count != count) {
+        // the bucket keeps other counters, so a free one is left
+        to = new_bucket(count, bx, bucket.next);
+    }
+    detach(cx);
+    attach(cx, to);
+}
+
+// Puts a fresh counter into the bucket of count 1, which comes after the
+// counters halved down to 0 if there are any.
+static void attach_low(u32 cx) {
+    g_ctrs[cx].count = 1;
+    u32 prev = NIL;
+    u32 bx = g_low;
+    if (bx != NIL && g_buckets[bx].count == 0) {
+        prev = bx;
+        bx = g_buckets[bx].next;
+    }
+    if (bx == NIL || g_buckets[bx].count != 1) {
+        bx = new_bucket(1, prev, bx);
+    }
+    attach(cx, bx);
+}
+
+// Halves all counts, merging buckets that end up equal. Halving keeps the
+// order, so only neighbours can merge. Errors are rounded up instead, so
+// count - err stays a lower bound on the halved true count.
+static void halve() {
+    u32 bx = g_low;
+    while (bx != NIL) {
+        Bucket &bucket = g_buckets[bx];
+        u32 next = bucket.next;
+        bucket.count >>= 1;
+        for (u32 cx = bucket.first; cx != NIL; cx = g_ctrs[cx].next) {
+            Counter &ctr = g_ctrs[cx];
+            ctr.count >>= 1;
+            ctr.err = std::min(ctr.err - (ctr.err >> 1), ctr.count);
+        }
+
+        u32 px = bucket.prev;
+        if (px != NIL && g_buckets[px].count == bucket.count) {
+            while (bucket.first != NIL) {
+                u32 cx = bucket.first;
+                detach(cx);
+                attach(cx, px);
+            }
+        }
+        bx = next;
+    }
+    g_n_counted >>= 1;
+}
+
+void init() {
+    getrandom(&g_seed, sizeof(g_seed), 0);
+    g_slots.fill(0);
+    g_free_buckets.reserve(K);
+    for (u32 bx = K; bx-- > 0;) {
+        g_free_buckets.push_back(bx);
+    }
+}
+
+void note(const Nih &ih) {
+    g_n_counted++;
+
+    auto [found, pos] = find(ih);
+    if (found) {
+        bump(g_slots[pos] - 1);
+        return;
+    }
+
+    u32 cx;
+    if (g_n_ctrs < K) {
+        cx = g_n_ctrs++;
+        g_ctrs[cx].err = 0;
+        attach_low(cx);
+    } else {
+        // take over one of the smallest counters, which bounds how often we
+        // could have missed this ih
+        cx = g_buckets[g_low].first;
+        remove_slot(find(g_ctrs[cx].ih).second);
+        pos = find(ih).second;
+        g_ctrs[cx].err = g_ctrs[cx].count;
+        bump(cx);
+        st_inc(ST_topk_replaced);
+    }
+
+    g_ctrs[cx].ih = ih;
+    g_slots[pos] = cx + 1;
+}
+
+bool is_hot(const Nih &ih) {
+    auto [found, pos] = find(ih);
+    if (!found) {
+        return false;
+    }
+    const Counter &ctr = g_ctrs[g_slots[pos] - 1];
+    return ctr.count >= g_hot_count && ctr.count - ctr.err >= TOPK_HOT_MIN;
+}
+
+void publish() {
+    u32 n_listed = 0;
+    // all listed counters are hot if there are fewer than TOPK_HOT
+    g_hot_count = 1;
+
+    FILE *f = fopen(TOPK_TMP_FN, "w");
+    if (f != nullptr) {
+        fprintf(f, "# %lu %lu %u\n", u64(time(0)), g_n_counted,
+                g_low != NIL && g_n_ctrs == K ? g_buckets[g_low].count : 0);
+    }
+
+    for (u32 bx = g_high; bx != NIL && n_listed < TOPK_PUBLISH;
+         bx = g_buckets[bx].prev) {
+        const Bucket &bucket = g_buckets[bx];
+        if (bucket.count == 0) {
+            break;
+        }
+        for (u32 cx = bucket.first; cx != NIL && n_listed < TOPK_PUBLISH;
+             cx = g_ctrs[cx].next) {
+            const Counter &ctr = g_ctrs[cx];
+            if (++n_listed == TOPK_HOT) {
+                g_hot_count = bucket.count;
+            }
+            if (f == nullptr) {
+                continue;
+            }
+            for (u32 ix = 0; ix < NIH_LEN; ix++) {
+                fprintf(f, "%02x", ctr.ih.raw[ix]);
+            }
+            fprintf(f, " %u %u\n", ctr.count, ctr.err);
+        }
+    }
+
+    if (f == nullptr || fclose(f) != 0 || rename(TOPK_TMP_FN, TOPK_FN) != 0) {
+        st_inc(ST_topk_errors);
+        WARN("Could not write " TOPK_FN ": %s", strerror(errno))
+    }
+
+    st_set(ST_topk_counters, g_n_ctrs);
+    st_set(ST_topk_max_count, g_high != NIL ? g_buckets[g_high].count : 0);
+    // an infohash without a counter was seen at most this often
+    st_set(ST_topk_min_count,
+           g_low != NIL && g_n_ctrs == K ? g_buckets[g_low].count : 0);
+
+    if (++g_rollovers == TOPK_HALVE_EVERY) {
+        g_rollovers = 0;
+        halve();
+    }
+}
+
+#endif // TOPK
+
+} // namespace cht::topk
@@ -0,0 +1,66 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht::topk {
+
+// The hottest infohashes of q_gp and q_ap, enabled with TOPK. A Space-Saving
+// summary of 2 ** TOPK_LOG2_K counters: a counted infohash bumps its counter,
+// any other takes over the smallest one and inherits its count as its error.
+// Counters are kept in buckets of equal count, ordered by count, so every
+// message costs O(1) whatever the skew.
+//
+// A counter's count is an upper bound on how often its infohash was seen,
+// count - err a lower bound; an infohash without a counter was seen at most
+// as often as the smallest count. Counts are halved every TOPK_HALVE_EVERY
+// rollovers, so they follow the recent stream.
+//
+// Every rollover the largest TOPK_PUBLISH counters are written to TOPK_FN, as
+// a "# unix_time counted min_count" line and then one "infohash count err"
+// line each, largest first, with hex infohashes. min_count is 0 until all
+// counters are taken. The file is replaced by rename, so readers never see it
+// half written. Only the loop thread may use this.
+
+#ifndef TOPK_FN
+#define TOPK_FN "./data/topk.txt"
+#endif
+#define TOPK_TMP_FN TOPK_FN ".tmp"
+#ifndef TOPK_LOG2_K
+#define TOPK_LOG2_K 10
+#endif
+#ifndef TOPK_PUBLISH
+#define TOPK_PUBLISH 100
+#endif
+#ifndef TOPK_HALVE_EVERY
+#define TOPK_HALVE_EVERY 60
+#endif
+// infohashes counted as much as the largest this many counters were at the
+// last rollover, and seen at least TOPK_HOT_MIN times for sure, are hot
+#ifndef TOPK_HOT
+#define TOPK_HOT 32
+#endif
+#ifndef TOPK_HOT_MIN
+#define TOPK_HOT_MIN 4
+#endif
+
+static_assert(TOPK_LOG2_K >= 4 && TOPK_LOG2_K <= 16);
+static_assert(TOPK_PUBLISH <= (1 << TOPK_LOG2_K));
+static_assert(TOPK_HOT <= TOPK_PUBLISH);
+
+#ifdef TOPK
+void init();
+
+// Counts a q_gp or q_ap for the infohash.
+void note(const Nih &ih);
+
+// Whether the infohash is hot, for prioritizing lookups.
+bool is_hot(const Nih &ih);
+
+// Writes TOPK_FN, decays the counts when due and updates the stats. To be
+// called every rollover.
+void publish();
+#endif
+
+} // namespace cht::topk
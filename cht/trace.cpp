@@ -0,0 +1,60 @@
+#include "trace.hpp"
+#include "log.hpp"
+#include "ring.hpp"
+#include "stat.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <thread>
+
+using namespace cht;
+namespace cht::trace {
+
+#ifdef GPM_TRACE
+
+static SpscRing<Record, GPM_TRACE_LOG2_RING> g_ring;
+static FILE *g_trace_file = nullptr;
+
+static void writer_loop() {
+    /*
+    Runs on its own thread. Only ever touches the consumer side of the ring
+    and the trace file, so it does not log or count stats.
+    */
+    Record rec;
+
+    while (true) {
+        u32 n_written = 0;
+        while (g_ring.pop(rec)) {
+            fwrite(&rec, sizeof(rec), 1, g_trace_file);
+            n_written++;
+        }
+        if (n_written == 0) {
+            fflush(g_trace_file);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+void start() {
+    g_trace_file = fopen(GPM_TRACE_FN, "wb");
+    if (g_trace_file == nullptr) {
+        ERROR("Could not open trace file " GPM_TRACE_FN ": %s",
+              strerror(errno))
+        exit(-1);
+    }
+    fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, g_trace_file);
+
+    std::thread(writer_loop).detach();
+}
+
+void emit(const Record &rec) {
+    if (g_ring.push(rec)) {
+        st_inc(ST_gpm_trace_records);
+    } else {
+        st_inc(ST_gpm_trace_dropped);
+    }
+}
+
+#endif // GPM_TRACE
+
+} // namespace cht::trace
@@ -0,0 +1,69 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+
+using namespace cht;
+namespace cht::trace {
+
+// Tracing of sampled get_peers lookups, enabled with GPM_TRACE. Records go
+// through a lock-free ring to a writer thread that appends them to
+// GPM_TRACE_FN; gptrace/main.c summarizes the file offline.
+
+#ifndef GPM_TRACE_FN
+#define GPM_TRACE_FN "./data/gpm_trace.bin"
+#endif
+// trace one in this many lookups
+#ifndef GPM_TRACE_SAMPLE
+#define GPM_TRACE_SAMPLE 64
+#endif
+// log2 of the records the ring to the writer thread holds
+#ifndef GPM_TRACE_LOG2_RING
+#define GPM_TRACE_LOG2_RING 16
+#endif
+
+constexpr inline char TRACE_MAGIC[8] = {'C', 'H', 'T', 'G', 'P', 'T', 'R', '1'};
+
+enum Kind : u8 {
+    TR_START = 1, // lookup started; nid is the infohash, aux the seed count
+    TR_SENT,      // get_peers sent to nid
+    TR_REPLY,     // r_gp from nid; aux is the node count, | 0x80 with values
+    TR_FAILED,    // get_peers to nid timed out or was never sent
+    TR_END,       // lookup ended; nid is the infohash, aux an Outcome
+};
+
+enum Outcome : u8 {
+    OUT_VALUES = 1,  // someone had peers
+    OUT_STALLED,     // replies stopped bringing closer nodes
+    OUT_EXHAUSTED,   // every node on the shortlist was asked
+    OUT_TIMEOUT,     // nobody replied at all
+    OUT_HOP_LIMIT,   // closer nodes were past GP_MAX_HOPS
+    OUT_NO_TOK,      // no tok was free for the next get_peers
+    OUT_MAX_QUERIES, // GPM_MAX_QUERIES were sent
+};
+
+// One trace event as stored in the file, after TRACE_MAGIC. All fields are
+// in host order except in_addr and port, which are as on the wire.
+struct __attribute__((packed)) Record {
+    u64 ts_us;  // CLOCK_MONOTONIC
+    u64 lookup; // lookup index << 32 | lookup generation
+    u8 kind;
+    u8 hop; // hops from our rt to the node
+    u8 dkad; // of the node to the infohash; TR_REPLY: best node returned
+    u8 aux;
+    u32 in_addr;
+    u16 port;
+    u8 _pad[2];
+    Nih nid;
+};
+static_assert(sizeof(Record) == 48, "Messed up trace Record layout!");
+
+#ifdef GPM_TRACE
+// Opens GPM_TRACE_FN and starts the writer thread.
+void start();
+
+// Queues a record for the writer. Must only be called from the loop thread.
+void emit(const Record &);
+#endif
+
+} // namespace cht::trace
@@ -1,6 +1,13 @@
 #include "util.hpp"
 #include <cassert>
 #include <cstdlib>
+#include <ctime>
+
+#include <endian.h>
+#if defined(__AVX512F__) && defined(__AVX512CD__) && defined(__AVX512BW__)
+#include <immintrin.h>
+#define DKAD_AVX512
+#endif
 
 using namespace cht;
 
@@ -10,6 +17,76 @@ u64 randint(u64 mn, u64 mx) {
     return mn + rand() / (RAND_MAX / (mx - mn) + 1);
 }
 
+/// Coarse monotonic clock in milliseconds.
+u64 mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/// 64-bit FNV-1a, used to checksum on-disk images.
+u64 fnv1a64(const u8 *data, u64 len) {
+    u64 hash = 0xcbf29ce484222325;
+    for (u64 ix = 0; ix < len; ix++) {
+        hash ^= data[ix];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static inline void sipround(u64 &v0, u64 &v1, u64 &v2, u64 &v3) {
+    v0 += v1;
+    v1 = (v1 << 13) | (v1 >> 51);
+    v1 ^= v0;
+    v0 = (v0 << 32) | (v0 >> 32);
+    v2 += v3;
+    v3 = (v3 << 16) | (v3 >> 48);
+    v3 ^= v2;
+    v0 += v3;
+    v3 = (v3 << 21) | (v3 >> 43);
+    v3 ^= v0;
+    v2 += v1;
+    v1 = (v1 << 17) | (v1 >> 47);
+    v1 ^= v2;
+    v2 = (v2 << 32) | (v2 >> 32);
+}
+
+/// SipHash-2-4 of data under a 128-bit key, for hashes an attacker must not
+/// be able to predict.
+u64 siphash24(const u64 key[2], const u8 *data, u64 len) {
+    u64 v0 = key[0] ^ 0x736f6d6570736575;
+    u64 v1 = key[1] ^ 0x646f72616e646f6d;
+    u64 v2 = key[0] ^ 0x6c7967656e657261;
+    u64 v3 = key[1] ^ 0x7465646279746573;
+
+    u64 ix = 0;
+    u64 word;
+    for (; ix + 8 <= len; ix += 8) {
+        memcpy(&word, data + ix, sizeof(word));
+        word = le64toh(word);
+        v3 ^= word;
+        sipround(v0, v1, v2, v3);
+        sipround(v0, v1, v2, v3);
+        v0 ^= word;
+    }
+
+    // the last bytes, and the length in the top byte
+    word = len << 56;
+    for (u64 shift = 0; ix < len; ix++, shift += 8) {
+        word |= u64(data[ix]) << shift;
+    }
+    v3 ^= word;
+    sipround(v0, v1, v2, v3);
+    sipround(v0, v1, v2, v3);
+    v0 ^= word;
+
+    v2 ^= 0xff;
+    for (int round = 0; round < 4; round++) {
+        sipround(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 /*
  * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
  * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
@@ -84,9 +161,56 @@ u8 dkad(const Nih &x, const Nih &y) {
         if (z == 0) {
             d -= 8;
         } else {
-            return d - g_dkad_tab[z];
+            return d - 8 + g_dkad_tab[z];
         }
     }
     return 0;
 }
+
+/// Takes the log kademlia distance from the target to each of the nodes.
+/// Only the first 64 bits of each nid are compared; nodes agreeing with the
+/// target on all of them are rare enough to be handed to dkad.
+void dkad_nodes(const Nih &target, const PNode nodes[], u8 n_nodes, u8 out[]) {
+    assert(n_nodes <= 8);
+
+    u64 target_hi;
+    memcpy(&target_hi, target.raw.data(), sizeof(u64));
+
+#ifdef DKAD_AVX512
+    // one 64-bit lane per node, in the order of the nodes
+    const __m512i offsets =
+        _mm512_setr_epi64(0, PNODE_LEN, 2 * PNODE_LEN, 3 * PNODE_LEN,
+                          4 * PNODE_LEN, 5 * PNODE_LEN, 6 * PNODE_LEN,
+                          7 * PNODE_LEN);
+    // reverses the bytes of each lane, making the nid prefixes big-endian
+    const __m512i bswap64 = _mm512_set_epi8(
+        8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+        13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1,
+        2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+
+    const __mmask8 valid = __mmask8((1u << n_nodes) - 1);
+
+    __m512i x = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), valid,
+                                            offsets, nodes, 1);
+    x = _mm512_xor_si512(x, _mm512_set1_epi64(i64(target_hi)));
+    x = _mm512_shuffle_epi8(x, bswap64);
+
+    __m512i d = _mm512_sub_epi64(_mm512_set1_epi64(160), _mm512_lzcnt_epi64(x));
+    _mm512_mask_cvtepi64_storeu_epi8(out, valid, d);
+
+    u32 deep = _mm512_mask_cmpeq_epi64_mask(valid, x, _mm512_setzero_si512());
+    while (deep != 0) {
+        u32 ix = __builtin_ctz(deep);
+        out[ix] = dkad(target, nodes[ix].nid);
+        deep &= deep - 1;
+    }
+#else
+    for (u8 ix = 0; ix < n_nodes; ix++) {
+        u64 node_hi;
+        memcpy(&node_hi, nodes[ix].raw, sizeof(u64));
+        u64 x = be64toh(node_hi ^ target_hi);
+        out[ix] = (x != 0) ? 160 - __builtin_clzll(x) : dkad(target, nodes[ix].nid);
+    }
+#endif
+}
 } // namespace cht
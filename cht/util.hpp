@@ -11,6 +11,22 @@ namespace cht {
 u64 randint(u64, u64);
 bool is_valid_utf8(const unsigned char[], u64);
 u8 dkad(const Nih &, const Nih &);
+void dkad_nodes(const Nih &, const PNode[], u8, u8[]);
+u64 fnv1a64(const u8 *, u64);
+u64 siphash24(const u64 key[2], const u8 *, u64);
+u64 mono_ms();
+
+/// Counters kept by one thread and read from others. Only the owning thread
+/// stores to them, so it may read them plainly.
+inline void ctr_set(u64 &ctr, u64 val) {
+    __atomic_store_n(&ctr, val, __ATOMIC_RELEASE);
+}
+inline void ctr_add(u64 &ctr, u64 by) {
+    ctr_set(ctr, ctr + by);
+}
+inline u64 ctr_get(const u64 &ctr) {
+    return __atomic_load_n(&ctr, __ATOMIC_ACQUIRE);
+}
 
 /// Manages N "tickets", meant to be indices into some resource array
 template <u64 N, stat_t ACCT, stat_t OFLOW_ACCT = ST__ST_ENUM_END>
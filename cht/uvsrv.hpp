@@ -0,0 +1,70 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include <string>
+
+#include <uv.h>
+
+using namespace cht;
+namespace cht::uvsrv {
+
+/// Plumbing shared by the Unix socket services. Their clients sit in fixed
+/// slots with a generation bumped on every connection, so a write finishing
+/// after its client went away is not credited to whoever took the slot.
+
+struct WriteReq {
+    uv_write_t req;
+    std::string data;
+    u32 slot;
+    u32 gen;
+};
+
+// Called when a write to the client in slot, as it was at gen, is done.
+using WrittenCb = void (*)(u32 slot, u32 gen);
+
+template <WrittenCb ON_WRITTEN>
+void cb_write(uv_write_t *req, int status) {
+    auto *wr = reinterpret_cast<WriteReq *>(req->data);
+    u32 slot = wr->slot;
+    u32 gen = wr->gen;
+    delete wr;
+    ON_WRITTEN(slot, gen);
+}
+
+// Queues data for the stream. False if libuv refused it, and then ON_WRITTEN
+// is not called.
+template <WrittenCb ON_WRITTEN>
+bool send_str(uv_stream_t *stream, u32 slot, u32 gen, std::string &&data) {
+    auto *wr = new WriteReq{{}, std::move(data), slot, gen};
+    wr->req.data = wr;
+    uv_buf_t buf = uv_buf_init(wr->data.data(), wr->data.size());
+    if (uv_write(&wr->req, stream, &buf, 1, &cb_write<ON_WRITTEN>) < 0) {
+        delete wr;
+        return false;
+    }
+    return true;
+}
+
+// Hands out BUF for every read, which is fine as long as each read is handled
+// to the end before the next one starts, as on a single loop.
+template <auto &BUF>
+void cb_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    buf->base = BUF;
+    buf->len = sizeof(BUF);
+}
+
+// Accepts a connection there is no slot for and closes it right away, rather
+// than leaving it in the listen backlog. False if the accept failed.
+inline bool turn_away(uv_stream_t *server) {
+    auto *pipe = new uv_pipe_t;
+    uv_pipe_init(server->loop, pipe, 0);
+    bool accepted =
+        uv_accept(server, reinterpret_cast<uv_stream_t *>(pipe)) == 0;
+    uv_close(reinterpret_cast<uv_handle_t *>(pipe), [](uv_handle_t *handle) {
+        delete reinterpret_cast<uv_pipe_t *>(handle);
+    });
+    return accepted;
+}
+
+} // namespace cht::uvsrv
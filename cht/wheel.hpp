@@ -0,0 +1,179 @@
+// vi:ft=cpp
+#pragma once
+
+#include "dht.hpp"
+#include <vector>
+
+using namespace cht;
+namespace cht {
+
+/// Hierarchical timer wheel over N items, identified by their index.
+///
+/// Level l has 2 ** SLOT_BITS slots, each covering 2 ** (SLOT_BITS * l)
+/// ticks; items in upper levels are cascaded down as the wheel turns.
+/// Items are linked intrusively by index, so scheduling, rescheduling and
+/// cancelling are all O(1) and the wheel never allocates after construction.
+/// Deadlines further out than the wheel spans are clamped to its span.
+template <u32 N, u32 SLOT_BITS = 8, u32 LEVELS = 2>
+class TimerWheel {
+  private:
+    static_assert(SLOT_BITS * LEVELS < 64, "Wheel span overflows a tick");
+
+    static constexpr u32 NIL = UINT32_MAX;
+    static constexpr u32 N_SLOTS = 1u << SLOT_BITS;
+    static constexpr u64 SLOT_MASK = N_SLOTS - 1;
+    static constexpr u64 SPAN = u64(1) << (SLOT_BITS * LEVELS);
+    // items that are due, waiting for advance to hand them out
+    static constexpr u32 DUE_LIST = LEVELS * N_SLOTS;
+    static constexpr u32 N_LISTS = DUE_LIST + 1;
+
+    static_assert(N < NIL, "Too many items for the wheel");
+
+    struct Link {
+        u32 prev;
+        u32 next;
+        u32 list;
+        u64 deadline;
+    };
+
+    std::vector<Link> links = std::vector<Link>(N, {NIL, NIL, NIL, 0});
+    std::vector<u32> heads = std::vector<u32>(N_LISTS, NIL);
+    u64 now_tick;
+    u32 n_scheduled = 0;
+
+    void link(u32 id, u32 list) {
+        auto &lk = links[id];
+        lk.list = list;
+        lk.prev = NIL;
+        lk.next = heads[list];
+        if (lk.next != NIL) {
+            links[lk.next].prev = id;
+        }
+        heads[list] = id;
+    }
+
+    void unlink(u32 id) {
+        auto &lk = links[id];
+        if (lk.prev != NIL) {
+            links[lk.prev].next = lk.next;
+        } else {
+            heads[lk.list] = lk.next;
+        }
+        if (lk.next != NIL) {
+            links[lk.next].prev = lk.prev;
+        }
+        lk.list = NIL;
+    }
+
+    void place(u32 id) {
+        u64 deadline = links[id].deadline;
+
+        if (deadline <= now_tick) {
+            link(id, DUE_LIST);
+            return;
+        }
+
+        u64 delta = deadline - now_tick;
+        for (u32 level = 0; level < LEVELS; level++) {
+            if (delta < (u64(1) << (SLOT_BITS * (level + 1)))) {
+                u64 slot = (deadline >> (SLOT_BITS * level)) & SLOT_MASK;
+                link(id, level * N_SLOTS + u32(slot));
+                return;
+            }
+        }
+        assert(0);
+    }
+
+    // Moves every item of a list to wherever it belongs at the current tick.
+    void cascade(u32 list) {
+        u32 id = heads[list];
+        heads[list] = NIL;
+        while (id != NIL) {
+            u32 next = links[id].next;
+            place(id);
+            id = next;
+        }
+    }
+
+    void tick() {
+        now_tick++;
+        for (u32 level = LEVELS - 1; level > 0; level--) {
+            // upper level slots are only due when all lower levels wrapped
+            if ((now_tick & ((u64(1) << (SLOT_BITS * level)) - 1)) != 0) {
+                continue;
+            }
+            u64 slot = (now_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+            cascade(level * N_SLOTS + u32(slot));
+        }
+        cascade(u32(now_tick & SLOT_MASK));
+    }
+
+  public:
+    TimerWheel(u64 start_tick = 0) : now_tick(start_tick) {
+    }
+
+    TimerWheel(TimerWheel const &) = delete;
+    TimerWheel &operator=(TimerWheel const &) = delete;
+
+    u64 now() const {
+        return now_tick;
+    }
+
+    u32 size() const {
+        return n_scheduled;
+    }
+
+    bool is_scheduled(u32 id) const {
+        return links[id].list != NIL;
+    }
+
+    u64 deadline(u32 id) const {
+        return links[id].deadline;
+    }
+
+    // (Re)schedules an item to expire at the given tick.
+    void schedule(u32 id, u64 deadline) {
+        assert(id < N);
+        if (is_scheduled(id)) {
+            unlink(id);
+        } else {
+            n_scheduled++;
+        }
+        if (deadline > now_tick + SPAN - 1) {
+            deadline = now_tick + SPAN - 1;
+        }
+        links[id].deadline = deadline;
+        place(id);
+    }
+
+    void cancel(u32 id) {
+        assert(id < N);
+        if (is_scheduled(id)) {
+            unlink(id);
+            n_scheduled--;
+        }
+    }
+
+    // Turns the wheel up to `to_tick` and calls `on_expire(id)` for at most
+    // `budget` due items, which are unscheduled before the call and may be
+    // rescheduled from it. Due items over budget are kept for the next call.
+    // Returns the number of items handed out.
+    template <typename F>
+    u32 advance(u64 to_tick, u32 budget, F &&on_expire) {
+        while (now_tick < to_tick) {
+            tick();
+        }
+
+        u32 n_expired = 0;
+        while (n_expired < budget && heads[DUE_LIST] != NIL) {
+            u32 id = heads[DUE_LIST];
+            unlink(id);
+            n_scheduled--;
+            n_expired++;
+            on_expire(id);
+        }
+        return n_expired;
+    }
+};
+
+} // namespace cht
@@ -0,0 +1,203 @@
+// Checks the peer store, see cht/db.cpp, on a small table where probe runs
+// collide all the time. Peers past the TTL must be swept out while the
+// infohashes shifted back over them stay found, and a full store must evict
+// exactly as many infohashes as it counts, losing no other one.
+//
+//     dbc
+//
+// Built with a short DB_PEER_TTL_S, it sleeps past that once.
+
+#include <array>
+
+#include "../cht/db.hpp"
+#include "../cht/stat.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if DB_PEER_TTL_S > 10
+#error "dbcheck needs a short DB_PEER_TTL_S"
+#endif
+
+using namespace cht;
+
+constexpr u32 N_SLOTS = (1 << DB_LOG2_SHARDS) << DB_LOG2_SHARD_SLOTS;
+// as in db, per shard
+constexpr u32 MAX_LOAD = (1 << DB_LOG2_SHARD_SLOTS) / 8 * 7;
+constexpr u32 CAPACITY = (1 << DB_LOG2_SHARDS) * MAX_LOAD;
+
+static std::array<u64, ST__ST_ENUM_END> g_counters;
+static std::array<u64, ST__ST_ENUM_END> g_gauges;
+
+namespace cht {
+void st_inc(stat_t st) {
+    g_counters[st]++;
+}
+void st_add(stat_t st, u32 val) {
+    g_counters[st] += val;
+}
+void st_set(stat_t st, u64 val) {
+    g_gauges[st] = val;
+}
+} // namespace cht
+
+static u32 g_n_failed = 0;
+
+#define CHECK(cond, ...)                                                       \
+    if (!(cond)) {                                                             \
+        printf("FAIL %s:%d: ", __func__, __LINE__);                            \
+        printf(__VA_ARGS__);                                                   \
+        printf("\n");                                                          \
+        g_n_failed++;                                                          \
+    }
+
+static std::mt19937_64 g_rng(0);
+
+static std::vector<Nih> random_ihs(u32 n) {
+    std::vector<Nih> ihs(n);
+    for (auto &ih : ihs) {
+        for (auto &byte : ih.raw) {
+            byte = u8(g_rng());
+        }
+    }
+    return ihs;
+}
+
+// The k-th peer of the n-th infohash of a run, so what comes back can be
+// told apart.
+static Peerinfo peer_of(u32 run, u32 n, u32 k) {
+    Peerinfo peer;
+    peer.in_addr = (run << 24) | n;
+    peer.sin_port = u16(k + 1);
+    return peer;
+}
+
+static u32 n_peers_of(const Nih &ih, u32 run, u32 n) {
+    Peerinfo out[DB_PEERS_PER_IH];
+    u32 n_out = db::get_peers(ih, out, DB_PEERS_PER_IH);
+    for (u32 ix = 0; ix < n_out; ix++) {
+        CHECK(out[ix].in_addr == peer_of(run, n, 0).in_addr,
+              "infohash %u of run %u has peer %08x", n, run, out[ix].in_addr)
+    }
+    return n_out;
+}
+
+static void sweep_all() {
+    // sweeping a slot again after a removal takes a step too
+    for (u32 ix = 0; ix < 4 * N_SLOTS / DB_SWEEP_SLOTS + 1; ix++) {
+        db::sweep();
+    }
+}
+
+static void check_peers() {
+    Nih ih = random_ihs(1)[0];
+    Peerinfo peers[DB_PEERS_PER_IH + 4];
+    for (u32 k = 0; k < DB_PEERS_PER_IH + 4; k++) {
+        peers[k] = peer_of(0, 0, k);
+    }
+
+    db::update_peers(ih, peers, DB_PEERS_PER_IH + 4);
+    CHECK(n_peers_of(ih, 0, 0) == DB_PEERS_PER_IH, "peers not capped")
+
+    u64 refreshed = g_counters[ST_db_rows_refreshed];
+    Peerinfo out[DB_PEERS_PER_IH];
+    u32 n_out = db::get_peers(ih, out, DB_PEERS_PER_IH);
+    db::update_peers(ih, out, n_out);
+    CHECK(g_counters[ST_db_rows_refreshed] - refreshed == n_out,
+          "known peers not refreshed")
+    CHECK(n_peers_of(ih, 0, 0) == DB_PEERS_PER_IH, "refresh added peers")
+
+    for (u32 ix = 0; ix < n_out; ix++) {
+        for (u32 jx = 0; jx < ix; jx++) {
+            CHECK(out[ix].sin_port != out[jx].sin_port, "peer %u twice",
+                  out[ix].sin_port)
+        }
+    }
+}
+
+// Half a store that expires, then a quarter that doesn't. Sweeping out the
+// first removes slots all over the probe runs of the second, which is
+// returned.
+static std::vector<Nih> check_expiry() {
+    std::vector<Nih> old_ihs = random_ihs(CAPACITY / 2);
+    for (u32 n = 0; n < old_ihs.size(); n++) {
+        Peerinfo peer = peer_of(1, n, 0);
+        db::update_peers(old_ihs[n], &peer, 1);
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(DB_PEER_TTL_S + 1));
+
+    std::vector<Nih> new_ihs = random_ihs(CAPACITY / 4);
+    for (u32 n = 0; n < new_ihs.size(); n++) {
+        Peerinfo peer = peer_of(2, n, 0);
+        db::update_peers(new_ihs[n], &peer, 1);
+    }
+    CHECK(g_counters[ST_db_ih_evicted] == 0, "evicted below the load cap")
+
+    sweep_all();
+
+    // the peer of check_peers expired too
+    CHECK(g_gauges[ST_db_ihs] == new_ihs.size(), "%lu infohashes, not %zu",
+          g_gauges[ST_db_ihs], new_ihs.size())
+    CHECK(g_gauges[ST_db_peers] == new_ihs.size(), "%lu peers, not %zu",
+          g_gauges[ST_db_peers], new_ihs.size())
+    for (u32 n = 0; n < old_ihs.size(); n++) {
+        CHECK(n_peers_of(old_ihs[n], 1, n) == 0, "expired infohash %u found",
+              n)
+    }
+    for (u32 n = 0; n < new_ihs.size(); n++) {
+        CHECK(n_peers_of(new_ihs[n], 2, n) == 1, "infohash %u lost", n)
+    }
+    return new_ihs;
+}
+
+// Four times what the store holds on top of what check_expiry left. Every
+// infohash must be found right after it went in, and all that weren't
+// evicted at the end.
+static void check_eviction(const std::vector<Nih> &kept) {
+    u64 evicted_before = g_counters[ST_db_ih_evicted];
+
+    std::vector<Nih> ihs = random_ihs(4 * CAPACITY);
+    for (u32 n = 0; n < ihs.size(); n++) {
+        Peerinfo peer = peer_of(3, n, 0);
+        db::update_peers(ihs[n], &peer, 1);
+        CHECK(n_peers_of(ihs[n], 3, n) == 1, "infohash %u lost on insert", n)
+    }
+
+    u64 n_evicted = g_counters[ST_db_ih_evicted] - evicted_before;
+    u64 n_found = 0;
+    for (u32 n = 0; n < kept.size(); n++) {
+        n_found += n_peers_of(kept[n], 2, n);
+    }
+    for (u32 n = 0; n < ihs.size(); n++) {
+        n_found += n_peers_of(ihs[n], 3, n);
+    }
+
+    CHECK(n_found == kept.size() + ihs.size() - n_evicted,
+          "%lu found, but %zu went in and %lu were evicted", n_found,
+          kept.size() + ihs.size(), n_evicted)
+    // every shard got far more than it holds, and stays full
+    CHECK(n_found == CAPACITY, "%lu found when full, not %u", n_found,
+          CAPACITY)
+    sweep_all();
+    CHECK(g_gauges[ST_db_ihs] == CAPACITY, "%lu counted when full, not %u",
+          g_gauges[ST_db_ihs], CAPACITY)
+}
+
+int main() {
+    db::init();
+
+    check_peers();
+    check_eviction(check_expiry());
+
+    if (g_n_failed > 0) {
+        printf("%u checks failed\n", g_n_failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,178 @@
+// Checks and times the ranking of get_peers reply nodes, see dkad_nodes in
+// cht/util.cpp and find_best_hops in cht/gpmap.cpp. Every ranking is checked
+// against a bit-by-bit reference, and the sorted index lists are written to
+// the dump file so the builds with and without AVX-512 can be compared.
+//
+//     dkb [dump file]
+
+#include <array>
+
+#include "../cht/util.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace cht;
+
+// as in gpmap
+constexpr u8 MAX_NODES = 8;
+constexpr u8 BULLSHIT_DKAD = 100;
+constexpr u8 MAX_GP_PNODES = 8;
+
+constexpr u32 N_VERIFY = 1 << 18;
+constexpr u32 N_BENCH = 1 << 14;
+constexpr u32 BENCH_PASSES = 1 << 10;
+
+#if defined(__AVX512F__) && defined(__AVX512CD__) && defined(__AVX512BW__)
+constexpr const char *PATH = "avx512";
+#else
+constexpr const char *PATH = "scalar";
+#endif
+
+struct Reply {
+    Nih ih;
+    PNode nodes[MAX_NODES];
+    u8 n_nodes;
+};
+
+// 160 minus the number of leading bits shared, one bit at a time
+static u8 ref_dkad(const Nih &x, const Nih &y) {
+    for (u32 bit = 0; bit < 160; bit++) {
+        u8 mask = u8(0x80 >> (bit % 8));
+        if ((x.raw[bit / 8] ^ y.raw[bit / 8]) & mask) {
+            return u8(160 - bit);
+        }
+    }
+    return 0;
+}
+
+// stable insertion by dkad, as find_best_hops did before dkad_nodes
+static u8 ref_rank(const Reply &rep, u8 best_ixes[]) {
+    u8 dkads[MAX_NODES];
+    u8 n_best = 0;
+
+    for (u8 ix = 0; ix < rep.n_nodes; ix++) {
+        u8 d = ref_dkad(rep.ih, rep.nodes[ix].nid);
+        if (d <= BULLSHIT_DKAD) {
+            continue;
+        }
+        u8 pos = n_best++;
+        while (pos > 0 && dkads[pos - 1] > d) {
+            dkads[pos] = dkads[pos - 1];
+            best_ixes[pos] = best_ixes[pos - 1];
+            pos--;
+        }
+        dkads[pos] = d;
+        best_ixes[pos] = ix;
+    }
+
+    return std::min(n_best, MAX_GP_PNODES);
+}
+
+// find_best_hops without the stats
+static inline u8 rank(const Reply &rep, u8 best_ixes[]) {
+    u8 dkads[MAX_NODES];
+    dkad_nodes(rep.ih, rep.nodes, rep.n_nodes, dkads);
+
+    u16 keys[MAX_NODES];
+    u8 n_keys = 0;
+
+    for (u8 ix = 0; ix < rep.n_nodes; ix++) {
+        if (dkads[ix] > BULLSHIT_DKAD) {
+            keys[n_keys++] = u16(dkads[ix] << 8) | ix;
+        }
+    }
+
+    std::sort(keys, keys + n_keys);
+
+    u8 n_best = std::min(n_keys, MAX_GP_PNODES);
+    for (u8 ix = 0; ix < n_best; ix++) {
+        best_ixes[ix] = u8(keys[ix]);
+    }
+
+    return n_best;
+}
+
+// Nodes share a random number of leading bits with the ih, now and then all
+// of them, so both the lzcnt and the fallback to dkad are exercised.
+static void make_replies(std::vector<Reply> &reps, std::mt19937_64 &rng) {
+    for (auto &rep : reps) {
+        for (auto &byte : rep.ih.raw) {
+            byte = u8(rng());
+        }
+        rep.n_nodes = u8(rng() % 4 == 0 ? 1 + rng() % MAX_NODES : MAX_NODES);
+
+        for (u8 ix = 0; ix < MAX_NODES; ix++) {
+            u8 *nid = rep.nodes[ix].raw;
+            for (u32 bx = 0; bx < PNODE_LEN; bx++) {
+                nid[bx] = u8(rng());
+            }
+
+            u32 shared = (rng() % 64 == 0) ? 160 : rng() % 96;
+            memcpy(nid, rep.ih.raw.data(), shared / 8);
+            if (shared < 160 && shared % 8 != 0) {
+                u8 keep = u8(0xff00 >> (shared % 8));
+                nid[shared / 8] = (rep.ih.raw[shared / 8] & keep) |
+                                  (nid[shared / 8] & ~keep);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    FILE *dump = nullptr;
+    if (argc > 1 && (dump = fopen(argv[1], "wb")) == nullptr) {
+        fprintf(stderr, "cannot open %s\n", argv[1]);
+        return 2;
+    }
+
+    std::mt19937_64 rng(0xd1ad);
+
+    std::vector<Reply> reps(N_VERIFY);
+    make_replies(reps, rng);
+
+    u32 n_bad = 0;
+    for (const auto &rep : reps) {
+        u8 got[MAX_NODES], want[MAX_NODES];
+        u8 n_got = rank(rep, got);
+        u8 n_want = ref_rank(rep, want);
+
+        if (n_got != n_want || memcmp(got, want, n_got) != 0) {
+            n_bad++;
+        }
+        if (dump != nullptr) {
+            fputc(n_got, dump);
+            fwrite(got, 1, n_got, dump);
+        }
+    }
+    if (dump != nullptr) {
+        fclose(dump);
+    }
+
+    reps.resize(N_BENCH);
+    make_replies(reps, rng);
+
+    u64 sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (u32 pass = 0; pass < BENCH_PASSES; pass++) {
+        for (const auto &rep : reps) {
+            u8 best[MAX_NODES];
+            u8 n_best = rank(rep, best);
+            sink += n_best != 0 ? best[0] + n_best : 0;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+    printf("%s: %u/%u rankings differ from the reference, %.1f ns per R_GP "
+           "(%lu)\n",
+           PATH, n_bad, N_VERIFY, ns / (double(N_BENCH) * BENCH_PASSES), sink);
+
+    return n_bad == 0 ? 0 : 1;
+}
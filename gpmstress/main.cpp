@@ -0,0 +1,269 @@
+// Stress test and benchmark for GPM_CONCURRENT, see cht/gpmap.cpp. Every
+// worker runs lookups for random infohashes and answers its get_peers with
+// fake r_gp, each handed to a random worker and some to two at once, so
+// replies race each other and the timeouts for their cells. Then replies stop
+// until every lookup has timed out, and each worker checks that all of its
+// toks and lookups came back.
+//
+//     gpms [seconds per run]
+
+#include <array>
+
+#include "../cht/gpmap.hpp"
+#include "../cht/ring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef GPM_CONCURRENT
+#error "gpmstress needs GPM_CONCURRENT"
+#endif
+
+using namespace cht;
+
+constexpr u32 MAX_WORKERS = 1 << GPM_WORKER_BITS;
+constexpr u32 TIMEOUT_MS = 100;
+constexpr u32 QUIESCE_MS = 30000;
+constexpr u32 REPLY_NODES = 4;
+// log2 of the replies one worker can have waiting for another
+constexpr u32 MAIL_LOG2 = 8;
+
+// counters are shared, gauges are per worker like the GPM's own state
+static std::array<std::atomic<u64>, ST__ST_ENUM_END> g_counters;
+static thread_local std::array<u64, ST__ST_ENUM_END> g_gauges;
+
+namespace cht {
+void st_inc(stat_t st) {
+    g_counters[st].fetch_add(1, std::memory_order_relaxed);
+}
+void st_add(stat_t st, u32 val) {
+    g_counters[st].fetch_add(val, std::memory_order_relaxed);
+}
+void st_set(stat_t st, u64 val) {
+    g_gauges[st] = val;
+}
+void st_click_dkad(u8) {}
+void ctl_record_gp_rtt(u64) {}
+u32 ctl_gpm_timeout_ms() {
+    return TIMEOUT_MS;
+}
+} // namespace cht
+
+struct Reply {
+    u8 tok[GP_TOK_LEN];
+    Nih nid;
+    u8 n_nodes;
+    bool has_values;
+    std::array<PNode, REPLY_NODES> nodes;
+};
+
+// one ring per ordered pair of workers, at from * n_workers + to
+static std::vector<SpscRing<Reply, MAIL_LOG2>> g_mail;
+
+static std::atomic<u32> g_n_ready;
+static std::atomic<u32> g_n_quiet;
+static std::atomic<bool> g_answering;
+static std::atomic<bool> g_stop;
+
+struct Result {
+    u64 n_handled = 0;
+    bool ok = true;
+};
+
+static void random_bytes(u8 *out, u32 len, std::mt19937_64 &rng) {
+    for (u32 ix = 0; ix < len; ix++) {
+        out[ix] = u8(rng());
+    }
+}
+
+// a node sharing a random number of leading bits with the ih
+static void random_node(PNode &node, const Nih &ih, std::mt19937_64 &rng) {
+    random_bytes(node.raw, PNODE_LEN, rng);
+    memcpy(node.raw, ih.raw.data(), rng() % 6);
+}
+
+static Reply make_reply(const gpm::Query &q, std::mt19937_64 &rng) {
+    Reply r;
+    for (u32 ix = 0; ix < GP_TOK_LEN - 1; ix++) {
+        r.tok[ix] = u8(q.tok >> (8 * ix));
+    }
+    r.tok[GP_TOK_LEN - 1] = OUR_TOK_GP;
+    r.nid = q.dest.nid;
+    r.n_nodes = REPLY_NODES;
+    r.has_values = rng() % 16 == 0;
+    for (auto &node : r.nodes) {
+        random_node(node, q.ih, rng);
+    }
+    return r;
+}
+
+static void handle(const Reply &r) {
+    bd::KRPC krpc;
+    krpc.nid = &r.nid;
+    krpc.tok = r.tok;
+    krpc.tok_len = GP_TOK_LEN;
+    krpc.nodes = r.nodes.data();
+    krpc.n_nodes = r.n_nodes;
+    krpc.n_peers = r.has_values;
+    gpm::handle_r_gp(krpc);
+}
+
+static void run_worker(u32 worker, u32 n_workers, Result &res) {
+    if (worker == 0) {
+        gpm::init(n_workers);
+        g_n_ready++;
+    } else {
+        while (g_n_ready == 0) {
+            std::this_thread::yield();
+        }
+        gpm::init_worker(worker);
+        g_n_ready++;
+    }
+    while (g_n_ready < n_workers) {
+        std::this_thread::yield();
+    }
+
+    std::mt19937_64 rng(worker);
+    const u32 max_lookups = gpm::n_free_lookups();
+    auto last_tick = std::chrono::steady_clock::now();
+    bool quiet = false;
+
+    Reply r;
+    gpm::Query q;
+    gpm::Done done;
+
+    while (!g_stop) {
+        bool answering = g_answering;
+
+        if (answering && gpm::n_free_lookups() > 0) {
+            Nih ih;
+            random_bytes(ih.raw.data(), NIH_LEN, rng);
+            std::array<PNode, GPM_K> seeds;
+            for (auto &seed : seeds) {
+                random_node(seed, ih, rng);
+            }
+            gpm::start_lookup(ih, seeds.data(), GPM_K);
+        }
+
+        while (gpm::pop_query(q)) {
+            // unanswered queries are left to time out
+            u32 roll = rng() % 64;
+            if (!answering || roll < 3) {
+                continue;
+            }
+            if (roll == 3) {
+                gpm::fail_query(q.tok);
+                continue;
+            }
+            r = make_reply(q, rng);
+            g_mail[worker * n_workers + rng() % n_workers].push(r);
+            if (roll < 12) {
+                // a duplicate, racing the first for the cell
+                g_mail[worker * n_workers + rng() % n_workers].push(r);
+            }
+        }
+
+        for (u32 from = 0; from < n_workers; from++) {
+            while (g_mail[from * n_workers + worker].pop(r)) {
+                handle(r);
+                res.n_handled += answering;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_tick >= std::chrono::milliseconds(GPM_TICK_MS)) {
+            gpm::tick();
+            last_tick = now;
+        }
+        while (gpm::pop_done(done)) {
+        }
+
+        if (!answering && !quiet && gpm::n_free_lookups() == max_lookups) {
+            quiet = true;
+            g_n_quiet++;
+        }
+    }
+
+    if (gpm::n_free_lookups() != max_lookups) {
+        fprintf(stderr, "worker %u: %u lookups never ended\n", worker,
+                max_lookups - gpm::n_free_lookups());
+        res.ok = false;
+    }
+    if (g_gauges[ST_gpm_inflight] != 0) {
+        fprintf(stderr, "worker %u: %lu toks never came back\n", worker,
+                g_gauges[ST_gpm_inflight]);
+        res.ok = false;
+    }
+}
+
+static bool run(u32 n_workers, double secs) {
+    for (auto &ctr : g_counters) {
+        ctr = 0;
+    }
+    g_mail = std::vector<SpscRing<Reply, MAIL_LOG2>>(n_workers * n_workers);
+    g_n_ready = 0;
+    g_n_quiet = 0;
+    g_answering = true;
+    g_stop = false;
+
+    std::vector<Result> results(n_workers);
+    std::vector<std::thread> threads;
+    for (u32 worker = 0; worker < n_workers; worker++) {
+        threads.emplace_back(run_worker, worker, n_workers,
+                             std::ref(results[worker]));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+    g_answering = false;
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(QUIESCE_MS);
+    while (g_n_quiet < n_workers &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    g_stop = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    bool ok = true;
+    u64 n_handled = 0;
+    for (const auto &res : results) {
+        ok &= res.ok;
+        n_handled += res.n_handled;
+    }
+
+    u64 n_handoffs = g_counters[ST_gpm_handoffs];
+    if (n_workers > 1 && n_handoffs == 0) {
+        fprintf(stderr, "no r_gp was handed off\n");
+        ok = false;
+    }
+
+    printf("%2u workers: %10.0f r_gp/s, %lu handed off, %lu dropped, "
+           "%lu lost races, %lu expired: %s\n",
+           n_workers, double(n_handled) / elapsed, n_handoffs,
+           u64(g_counters[ST_gpm_handoff_dropped]),
+           u64(g_counters[ST_gpm_r_gp_lookup_failed]),
+           u64(g_counters[ST_gpm_tok_expired]), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    double secs = argc > 1 ? atof(argv[1]) : 2;
+
+    bool ok = true;
+    for (u32 n_workers = 1; n_workers <= MAX_WORKERS; n_workers *= 2) {
+        ok &= run(n_workers, secs);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Mirrors cht::trace::Record in cht/trace.hpp.
+struct __attribute__((packed)) record {
+    uint64_t ts_us;
+    uint64_t lookup;
+    uint8_t kind;
+    uint8_t hop;
+    uint8_t dkad;
+    uint8_t aux;
+    uint32_t in_addr;
+    uint16_t port;
+    uint8_t _pad[2];
+    uint8_t nid[20];
+};
+
+_Static_assert(sizeof(struct record) == 48, "record layout");
+
+enum { TR_START = 1, TR_SENT, TR_REPLY, TR_FAILED, TR_END };
+
+static const char *g_outcomes[] = {
+    "?", "values", "stalled", "exhausted", "timeout", "hop_limit",
+    "no_tok", "max_queries",
+};
+#define N_OUTCOMES (sizeof(g_outcomes) / sizeof(g_outcomes[0]))
+
+#define MAX_HOPS 16
+#define RTT_BUCKETS 2048 // 1 ms each, the last one catches everything above
+
+struct hop_stats {
+    uint64_t sent;
+    uint64_t replied;
+    uint64_t failed;
+    uint64_t values;
+    uint64_t nodes;
+    uint64_t rtt_n;
+    uint64_t rtt_sum_us;
+    uint64_t rtt_ms[RTT_BUCKETS];
+};
+
+static struct hop_stats g_hops[MAX_HOPS];
+static uint64_t g_outcome_ctr[N_OUTCOMES];
+static uint64_t g_n_started;
+
+// Send times of get_peers in flight, by lookup and nid checksum. Colliding
+// sends overwrite each other; the few replies this loses are not timed.
+#define N_INFLIGHT (1 << 20)
+static struct {
+    uint64_t lookup;
+    uint32_t checksum;
+    uint64_t ts_us;
+} g_inflight[N_INFLIGHT];
+
+static uint32_t nid_checksum(const struct record *rec) {
+    uint32_t out;
+    memcpy(&out, rec->nid + 16, sizeof(out));
+    return out;
+}
+
+static uint32_t inflight_slot(uint64_t lookup, uint32_t checksum) {
+    uint64_t h = (lookup ^ checksum) * 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(h >> 44) & (N_INFLIGHT - 1);
+}
+
+static void handle_record(const struct record *rec) {
+    uint8_t hop = rec->hop < MAX_HOPS ? rec->hop : MAX_HOPS - 1;
+    struct hop_stats *hs = &g_hops[hop];
+    uint32_t checksum = nid_checksum(rec);
+    uint32_t slot = inflight_slot(rec->lookup, checksum);
+
+    switch (rec->kind) {
+    case TR_START:
+        g_n_started++;
+        break;
+    case TR_SENT:
+        hs->sent++;
+        g_inflight[slot].lookup = rec->lookup;
+        g_inflight[slot].checksum = checksum;
+        g_inflight[slot].ts_us = rec->ts_us;
+        break;
+    case TR_REPLY:
+        hs->replied++;
+        hs->nodes += rec->aux & 0x7f;
+        if (rec->aux & 0x80) {
+            hs->values++;
+        }
+        if (g_inflight[slot].lookup == rec->lookup &&
+            g_inflight[slot].checksum == checksum &&
+            g_inflight[slot].ts_us != 0) {
+            uint64_t rtt = rec->ts_us - g_inflight[slot].ts_us;
+            uint64_t bucket = rtt / 1000;
+            hs->rtt_ms[bucket < RTT_BUCKETS ? bucket : RTT_BUCKETS - 1]++;
+            hs->rtt_n++;
+            hs->rtt_sum_us += rtt;
+            g_inflight[slot].ts_us = 0;
+        }
+        break;
+    case TR_FAILED:
+        hs->failed++;
+        g_inflight[slot].ts_us = 0;
+        break;
+    case TR_END:
+        g_outcome_ctr[rec->aux < N_OUTCOMES ? rec->aux : 0]++;
+        break;
+    default:
+        break;
+    }
+}
+
+static uint64_t rtt_quantile(const struct hop_stats *hs, double q) {
+    if (hs->rtt_n == 0) {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(q * hs->rtt_n);
+    uint64_t seen = 0;
+    for (uint64_t ix = 0; ix < RTT_BUCKETS; ix++) {
+        seen += hs->rtt_ms[ix];
+        if (seen > want) {
+            return ix;
+        }
+    }
+    return RTT_BUCKETS - 1;
+}
+
+static void summarize(void) {
+    printf("lookups started: %lu\n\n", g_n_started);
+
+    printf("%3s %10s %10s %10s %7s %10s %8s %8s %8s %8s\n", "hop", "sent",
+           "replied", "failed", "yield", "values", "nodes/r", "rtt_avg",
+           "rtt_p50", "rtt_p95");
+    for (int hop = 0; hop < MAX_HOPS; hop++) {
+        const struct hop_stats *hs = &g_hops[hop];
+        if (hs->sent == 0 && hs->replied == 0) {
+            continue;
+        }
+        printf("%3d %10lu %10lu %10lu %6.1f%% %10lu %8.2f %6.1fms %6lums "
+               "%6lums\n",
+               hop, hs->sent, hs->replied, hs->failed,
+               hs->sent ? 100.0 * hs->replied / hs->sent : 0.0, hs->values,
+               hs->replied ? (double)hs->nodes / hs->replied : 0.0,
+               hs->rtt_n ? hs->rtt_sum_us / 1000.0 / hs->rtt_n : 0.0,
+               rtt_quantile(hs, 0.5), rtt_quantile(hs, 0.95));
+    }
+
+    printf("\noutcomes:\n");
+    for (size_t ix = 1; ix < N_OUTCOMES; ix++) {
+        printf("%12s %10lu\n", g_outcomes[ix], g_outcome_ctr[ix]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: gptrace [TRACE_FILE]\n");
+        return 1;
+    }
+
+    FILE *f_tr = fopen(argv[1], "r");
+    if (!f_tr) {
+        fprintf(stderr, "Unable to open trace file for reading!\n");
+        return 1;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, 8, f_tr) != 8 || memcmp(magic, "CHTGPTR1", 8) != 0) {
+        fprintf(stderr, "Not a get_peers trace file!\n");
+        fclose(f_tr);
+        return 1;
+    }
+
+    struct record rec;
+    while (fread(&rec, sizeof(rec), 1, f_tr) == 1) {
+        handle_record(&rec);
+    }
+    fclose(f_tr);
+
+    summarize();
+    return 0;
+}
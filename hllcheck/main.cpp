@@ -0,0 +1,187 @@
+// Checks the distinct peer and asker estimates, see cht/hll.cpp: their error
+// from a handful up to a million, through the switch from sparse to dense,
+// that repeats don't count, and that eviction keeps both the table and the
+// sketches within their bounds.
+//
+//     hllc
+//
+// Built with a small HLL_LOG2_SLOTS and HLL_MAX_BYTES, so both bounds are hit.
+
+#include <array>
+
+#include "../cht/hll.hpp"
+#include "../cht/stat.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace cht;
+
+constexpr u32 N_SLOTS = 1 << HLL_LOG2_SLOTS;
+// as in hll
+constexpr u32 MAX_LOAD = N_SLOTS / 8 * 7;
+// standard error of a dense sketch
+const double STD_ERR = 1.04 / std::sqrt(double(1 << HLL_LOG2_REGS));
+
+static std::array<u64, ST__ST_ENUM_END> g_counters;
+static std::array<u64, ST__ST_ENUM_END> g_gauges;
+
+namespace cht {
+void st_inc(stat_t st) {
+    g_counters[st]++;
+}
+void st_set(stat_t st, u64 val) {
+    g_gauges[st] = val;
+}
+} // namespace cht
+
+static u32 g_n_failed = 0;
+
+#define CHECK(cond, ...)                                                       \
+    if (!(cond)) {                                                             \
+        printf("FAIL %s:%d: ", __func__, __LINE__);                            \
+        printf(__VA_ARGS__);                                                   \
+        printf("\n");                                                          \
+        g_n_failed++;                                                          \
+    }
+
+static std::mt19937_64 g_rng(0);
+
+static Nih random_ih() {
+    Nih ih;
+    for (auto &byte : ih.raw) {
+        byte = u8(g_rng());
+    }
+    return ih;
+}
+
+// The n-th of a run of distinct peers.
+static Peerinfo peer_of(u32 run, u32 n) {
+    Peerinfo peer;
+    peer.in_addr = n;
+    peer.sin_port = u16(run);
+    return peer;
+}
+
+// Relative errors at growing counts, over several infohashes each. The
+// smallest counts go by linear counting, and are off only when two peers
+// land in the same register.
+static void check_error() {
+    constexpr u32 N_IHS = 16;
+    constexpr u32 COUNTS[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+    for (u32 count : COUNTS) {
+        double sum_err = 0;
+        double max_err = 0;
+        for (u32 run = 0; run < N_IHS; run++) {
+            Nih ih = random_ih();
+            for (u32 n = 0; n < count; n++) {
+                hll::add_peer(ih, peer_of(run, n));
+                hll::add_asker(ih, n ^ (run << 24));
+            }
+            hll::Estimate est = hll::estimate(ih);
+            for (u32 got : {est.peers, est.askers}) {
+                double err = (double(got) - count) / count;
+                sum_err += err;
+                max_err = std::max(max_err, std::fabs(err));
+            }
+        }
+
+        double mean_err = sum_err / (2 * N_IHS);
+        printf("%8u: mean error %+.4f, max %.4f\n", count, mean_err, max_err);
+        CHECK(count <= 10 ? max_err * count <= 2 : max_err <= 5 * STD_ERR,
+              "error %.4f at %u", max_err, count)
+        CHECK(std::fabs(mean_err) <= 2 * STD_ERR, "bias %.4f at %u", mean_err,
+              count)
+    }
+}
+
+// Repeats must not move the estimate, in sparse and dense sketches alike.
+static void check_repeats() {
+    for (u32 count : {50u, 5000u}) {
+        Nih ih = random_ih();
+        for (u32 n = 0; n < count; n++) {
+            hll::add_peer(ih, peer_of(0, n));
+        }
+        u32 before = hll::estimate(ih).peers;
+        for (u32 pass = 0; pass < 3; pass++) {
+            for (u32 n = 0; n < count; n++) {
+                hll::add_peer(ih, peer_of(0, n));
+            }
+        }
+        CHECK(hll::estimate(ih).peers == before, "repeats moved %u to %u",
+              before, hll::estimate(ih).peers)
+        CHECK(hll::estimate(ih).askers == 0, "askers from peers")
+    }
+}
+
+// Twice as many infohashes as the table takes, with a peer each: the table
+// fills up and then holds the most recent ones.
+static void check_load() {
+    std::vector<Nih> ihs(2 * MAX_LOAD);
+    for (auto &ih : ihs) {
+        ih = random_ih();
+        hll::add_peer(ih, peer_of(0, 0));
+    }
+    hll::report();
+
+    CHECK(g_gauges[ST_hll_ihs] == MAX_LOAD, "%lu infohashes, not %u",
+          g_gauges[ST_hll_ihs], MAX_LOAD)
+    u32 n_recent = 0;
+    u32 n_old = 0;
+    for (u32 ix = 0; ix < MAX_LOAD; ix++) {
+        n_old += hll::estimate(ihs[ix]).peers > 0;
+        n_recent += hll::estimate(ihs[MAX_LOAD + ix]).peers > 0;
+    }
+    CHECK(n_recent == MAX_LOAD && n_old == 0,
+          "%u of the recent and %u of the old infohashes kept", n_recent,
+          n_old)
+}
+
+// Dense sketches until they pass the budget: the memory gauge stays within
+// HLL_MAX_BYTES, and the sketches kept are the most recent.
+static void check_cap() {
+    u64 evicted_before = g_counters[ST_hll_evicted];
+    std::vector<Nih> ihs;
+    u32 per_ih = 4 * HLL_SPARSE_MAX;
+
+    while (ihs.size() < MAX_LOAD / 2) {
+        Nih ih = random_ih();
+        ihs.push_back(ih);
+        for (u32 n = 0; n < per_ih; n++) {
+            hll::add_peer(ih, peer_of(1, n));
+        }
+        hll::report();
+        CHECK(g_gauges[ST_hll_mem_bytes] <= HLL_MAX_BYTES, "%lu bytes",
+              g_gauges[ST_hll_mem_bytes])
+    }
+
+    CHECK(g_counters[ST_hll_evicted] > evicted_before,
+          "%zu dense sketches fit under the cap", ihs.size())
+    CHECK(g_gauges[ST_hll_dense] > 0, "no dense sketches")
+    u32 n_kept = g_gauges[ST_hll_dense];
+    for (u32 ix = 0; ix < ihs.size(); ix++) {
+        bool kept = hll::estimate(ihs[ix]).peers > 0;
+        CHECK(kept == (ix >= ihs.size() - n_kept), "infohash %u of %zu %s", ix,
+              ihs.size(), kept ? "kept" : "dropped")
+    }
+}
+
+int main() {
+    hll::init();
+
+    check_error();
+    check_repeats();
+    check_load();
+    check_cap();
+
+    if (g_n_failed > 0) {
+        printf("%u checks failed\n", g_n_failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,254 @@
+// Checks the infohash index, see cht/ihidx.cpp, through two growths, each
+// cut short by a writer that dies midway and picked up by the next one. The
+// writers are forked children that apply records and exit without cleaning
+// up; the parent only reads, with one Reader kept open the whole time, and
+// checks every infohash against a model. Then it checks that a broken index
+// is moved aside rather than truncated.
+//
+//     ihc
+//
+// Built with a small IHIDX_LOG2_SLOTS_MIN and an IHIDX_FN of its own.
+
+#include <array>
+
+#include "../cht/ihidx.hpp"
+#include "../cht/stat.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if IHIDX_LOG2_SLOTS_MIN > 12
+#error "ihidxcheck needs a small IHIDX_LOG2_SLOTS_MIN"
+#endif
+
+using namespace cht;
+using namespace cht::ihidx;
+
+constexpr u32 BATCH = 16;
+constexpr u32 N_IHS = (1 << IHIDX_LOG2_SLOTS_MIN) * 4;
+
+time_t __g_log_time;
+char __g_log_fmttime[64];
+
+namespace cht {
+void st_set(stat_t, u64) {}
+} // namespace cht
+
+static u32 g_n_failed = 0;
+
+#define CHECK(cond, ...)                                                       \
+    if (!(cond)) {                                                             \
+        printf("FAIL %s:%d: ", __func__, __LINE__);                            \
+        printf(__VA_ARGS__);                                                   \
+        printf("\n");                                                          \
+        g_n_failed++;                                                          \
+    }
+
+// The records applied so far, all drawn from one seeded sequence so the
+// writers and the parent agree on them.
+static std::vector<ihlog::Record> g_recs;
+static std::map<std::array<u8, NIH_LEN>, Entry> g_model;
+
+static void make_records() {
+    std::mt19937_64 rng(0);
+    std::vector<Nih> ihs(N_IHS);
+    for (auto &ih : ihs) {
+        for (auto &byte : ih.raw) {
+            byte = u8(rng());
+        }
+    }
+
+    // a few infohashes come up over and over, the rest once or twice
+    g_recs.resize(3 * N_IHS);
+    for (u32 rx = 0; rx < g_recs.size(); rx++) {
+        ihlog::Record &rec = g_recs[rx];
+        memset(&rec, 0, sizeof(rec));
+        u32 ix = rng() % 4 == 0 ? rng() % 16 : rng() % N_IHS;
+        rec.ih = ihs[ix];
+        rec.ts_ms = 1700000000000ull + u64(rx) * 997 + rng() % 5000;
+        rec.source = ihlog::SRC_Q_GP + rng() % 4;
+    }
+}
+
+static void model_apply(u32 from, u32 to) {
+    for (u32 rx = from; rx < to; rx++) {
+        const ihlog::Record &rec = g_recs[rx];
+        u32 ts_s = rec.ts_ms / 1000;
+        auto [it, fresh] = g_model.try_emplace(rec.ih.raw);
+        Entry &entry = it->second;
+        if (fresh) {
+            entry = {ts_s, ts_s, 0, 0};
+        }
+        entry.first_seen = std::min(entry.first_seen, ts_s);
+        entry.last_seen = std::max(entry.last_seen, ts_s);
+        entry.hits++;
+        entry.sources |= 1 << rec.source;
+    }
+}
+
+static Header read_header(const char *fn) {
+    Header hdr = {0};
+    int fd = open(fn, O_RDONLY);
+    if (fd >= 0) {
+        if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            hdr = {0};
+        }
+        close(fd);
+    }
+    return hdr;
+}
+
+// Where a writer stops: after the first batch that leaves IHIDX_FN with this
+// state and size, and at least n_migrated slots copied.
+struct StopAt {
+    u32 state;
+    u32 log2_slots;
+    u64 n_migrated;
+};
+
+// Runs a writer from record `from` on, until it gets to stop or runs out of
+// records. Returns where it stopped.
+static u32 run_writer(u32 from, StopAt stop) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        ihidx::init();
+        u32 rx = from;
+        while (rx < g_recs.size()) {
+            u32 n = std::min<u32>(BATCH, g_recs.size() - rx);
+            ihidx::apply(&g_recs[rx], n);
+            rx += n;
+            Header hdr = read_header(IHIDX_FN);
+            if (hdr.state == stop.state &&
+                hdr.log2_slots == stop.log2_slots &&
+                hdr.n_migrated >= stop.n_migrated) {
+                break;
+            }
+        }
+        if (write(fds[1], &rx, sizeof(rx)) != sizeof(rx)) {
+            _exit(1);
+        }
+        // dies with its tables mapped, as if killed
+        _exit(0);
+    }
+
+    close(fds[1]);
+    u32 to = from;
+    if (read(fds[0], &to, sizeof(to)) != sizeof(to)) {
+        printf("FAIL: writer died\n");
+        exit(1);
+    }
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    return to;
+}
+
+// The key count is only exact when not growing, and a lower bound
+// otherwise.
+static void check_all(Reader &reader, bool growing, const char *when) {
+    u32 n_wrong = 0;
+    for (auto const &[raw, want] : g_model) {
+        Nih ih;
+        ih.raw = raw;
+        Entry got;
+        if (!reader.find(ih, got) || got.first_seen != want.first_seen ||
+            got.last_seen != want.last_seen || got.hits != want.hits ||
+            got.sources != want.sources) {
+            n_wrong++;
+        }
+    }
+    CHECK(n_wrong == 0, "%s: %u of %zu infohashes wrong", when, n_wrong,
+          g_model.size())
+    u64 n_keys = reader.n_keys();
+    CHECK(growing ? n_keys <= g_model.size() : n_keys == g_model.size(),
+          "%s: %lu keys, not %zu", when, n_keys, g_model.size())
+}
+
+static void check_growths() {
+    Reader reader;
+    u32 rx = 0;
+
+    for (u32 log2_slots = IHIDX_LOG2_SLOTS_MIN;
+         log2_slots < IHIDX_LOG2_SLOTS_MIN + 2; log2_slots++) {
+        // dies a quarter through copying the old table
+        u64 quarter = (u64(1) << log2_slots) / 4;
+        u32 to = run_writer(rx, {TS_GROWING, log2_slots, quarter});
+        model_apply(rx, to);
+        rx = to;
+
+        Header hdr = read_header(IHIDX_FN);
+        CHECK(hdr.state == TS_GROWING && hdr.log2_slots == log2_slots &&
+                  access(IHIDX_NEXT_FN, F_OK) == 0,
+              "2 ** %u slots not growing", log2_slots)
+        check_all(reader, true, "while growing");
+
+        // picks the growth up and finishes it
+        to = run_writer(rx, {TS_ACTIVE, log2_slots + 1, 0});
+        model_apply(rx, to);
+        rx = to;
+
+        hdr = read_header(IHIDX_FN);
+        CHECK(hdr.state == TS_ACTIVE && hdr.log2_slots == log2_slots + 1 &&
+                  access(IHIDX_NEXT_FN, F_OK) != 0,
+              "2 ** %u slots did not grow", log2_slots)
+        check_all(reader, false, "after growing");
+    }
+}
+
+static void check_broken() {
+    // what a reader of the broken index would still see
+    u64 size_before = 0;
+    struct stat info;
+    if (stat(IHIDX_FN, &info) == 0) {
+        size_before = info.st_size;
+    }
+
+    int fd = open(IHIDX_FN, O_WRONLY);
+    u64 junk = 0;
+    CHECK(fd >= 0 && pwrite(fd, &junk, sizeof(junk), 0) == sizeof(junk),
+          "could not break the index")
+    close(fd);
+
+    run_writer(0, {TS_ACTIVE, IHIDX_LOG2_SLOTS_MIN, 0});
+
+    CHECK(stat(IHIDX_BAD_FN, &info) == 0 && u64(info.st_size) == size_before,
+          "broken index not moved aside whole")
+    Header hdr = read_header(IHIDX_FN);
+    CHECK(hdr.magic == IHIDX_MAGIC && hdr.log2_slots >= IHIDX_LOG2_SLOTS_MIN,
+          "no new index")
+}
+
+int main() {
+    unlink(IHIDX_FN);
+    unlink(IHIDX_NEXT_FN);
+    unlink(IHIDX_BAD_FN);
+    make_records();
+
+    check_growths();
+    check_broken();
+
+    unlink(IHIDX_FN);
+    unlink(IHIDX_NEXT_FN);
+    unlink(IHIDX_BAD_FN);
+
+    if (g_n_failed > 0) {
+        printf("%u checks failed\n", g_n_failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Stress test and read benchmark for the seqlocked cells of RT_CONCURRENT,
+// see cht/seqlock.hpp. Writers fill cells with words derived from one random
+// value, readers check every cell they read is whole.
+//
+//     rts [seconds per run]
+
+#include <array>
+
+#include "../cht/seqlock.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace cht;
+
+// as RT::Nodeinfo
+constexpr u32 WORDS = 3;
+constexpr u32 READ_RETRIES = 16;
+constexpr u64 MIX = 0x9e3779b97f4a7c15ull;
+
+struct Table {
+    std::vector<u32> seq;
+    std::vector<u64> words;
+
+    Table(u32 n_cells) : seq(n_cells, 0), words(n_cells * WORDS, 0) {
+        for (u32 ix = 0; ix < n_cells; ix++) {
+            fill(ix, 0, &words[ix * WORDS]);
+        }
+    }
+
+    u32 n_cells() const {
+        return u32(seq.size());
+    }
+
+    static void fill(u32 ix, u64 val, u64 buf[]) {
+        buf[0] = val;
+        buf[1] = val * MIX;
+        buf[2] = ~val ^ ix;
+    }
+
+    static bool whole(u32 ix, const u64 buf[]) {
+        return buf[1] == buf[0] * MIX && buf[2] == (~buf[0] ^ ix);
+    }
+};
+
+struct Counts {
+    u64 reads = 0;
+    u64 torn = 0;
+    u64 gave_up = 0;
+    u64 broken = 0;
+    u64 writes = 0;
+    u64 contended = 0;
+};
+
+static inline u64 next_rand(u64 &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static void writer(Table &table, std::atomic<bool> &stop, Counts &out,
+                   u64 seed) {
+    u64 rng = seed;
+    Counts counts;
+    while (!stop.load(std::memory_order_relaxed)) {
+        u32 ix = u32(next_rand(rng) % table.n_cells());
+        u64 val = next_rand(rng);
+        SeqWrite res = seq_try_update<WORDS>(
+            &table.seq[ix], &table.words[ix * WORDS], [&](u64 buf[]) {
+                Table::fill(ix, val, buf);
+                return true;
+            });
+        counts.writes += res == SW_CHANGED;
+        counts.contended += res == SW_CONTENDED;
+    }
+    out = counts;
+}
+
+static void reader(Table &table, std::atomic<bool> &stop, Counts &out,
+                   u64 seed) {
+    u64 rng = seed;
+    u64 buf[WORDS];
+    Counts counts;
+    while (!stop.load(std::memory_order_relaxed)) {
+        u32 ix = u32(next_rand(rng) % table.n_cells());
+        bool ok = false;
+        for (u32 tries = 0; tries < READ_RETRIES && !ok; tries++) {
+            ok = seq_try_read<WORDS>(&table.seq[ix], &table.words[ix * WORDS],
+                                     buf);
+            counts.torn += !ok;
+        }
+        if (!ok) {
+            counts.gave_up++;
+            continue;
+        }
+        counts.reads++;
+        counts.broken += !Table::whole(ix, buf);
+    }
+    out = counts;
+}
+
+static Counts run(u32 n_cells, u32 n_writers, u32 n_readers, double secs) {
+    Table table(n_cells);
+    std::atomic<bool> stop(false);
+    std::vector<Counts> counts(n_writers + n_readers);
+    std::vector<std::thread> threads;
+
+    for (u32 tx = 0; tx < n_writers; tx++) {
+        threads.emplace_back(writer, std::ref(table), std::ref(stop),
+                             std::ref(counts[tx]), 0x1234567 + tx);
+    }
+    for (u32 tx = 0; tx < n_readers; tx++) {
+        threads.emplace_back(reader, std::ref(table), std::ref(stop),
+                             std::ref(counts[n_writers + tx]), 0x7654321 + tx);
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+    stop.store(true);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    Counts total;
+    for (const auto &cnt : counts) {
+        total.reads += cnt.reads;
+        total.torn += cnt.torn;
+        total.gave_up += cnt.gave_up;
+        total.broken += cnt.broken;
+        total.writes += cnt.writes;
+        total.contended += cnt.contended;
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    double secs = argc > 1 ? atof(argv[1]) : 1.0;
+    bool failed = false;
+
+    printf("torn check, %.1f s per run\n", secs);
+    printf("%8s %8s %8s %12s %12s %10s %10s %10s\n", "cells", "writers",
+           "readers", "reads", "writes", "torn", "gave_up", "broken");
+
+    // a few hot cells make writers collide with readers and each other
+    for (u32 n_cells : {16u, 65536u}) {
+        for (u32 n_writers : {1u, 4u}) {
+            Counts res = run(n_cells, n_writers, 4, secs);
+            printf("%8u %8u %8u %12lu %12lu %10lu %10lu %10lu\n", n_cells,
+                   n_writers, 4u, res.reads, res.writes, res.torn,
+                   res.gave_up, res.broken);
+            failed |= res.broken > 0 || res.reads == 0 || res.writes == 0;
+        }
+    }
+
+    printf("\nread throughput, 65536 cells, 1 writer\n");
+    printf("%8s %14s %14s\n", "readers", "Mreads/s", "per reader");
+    for (u32 n_readers : {1u, 2u, 4u, 8u, 16u}) {
+        Counts res = run(65536, 1, n_readers, secs);
+        double mreads = res.reads / secs / 1e6;
+        printf("%8u %14.1f %14.1f\n", n_readers, mreads, mreads / n_readers);
+        failed |= res.broken > 0;
+    }
+
+    if (failed) {
+        printf("\nFAILED: a reader accepted a torn cell or nothing ran\n");
+        return 1;
+    }
+    printf("\nOK: no reader accepted a torn cell\n");
+    return 0;
+}
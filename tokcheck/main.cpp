@@ -0,0 +1,133 @@
+// Checks siphash24 in cht/util.cpp against the reference vectors of the
+// SipHash paper, and runs announce tokens, see cht/token.cpp, through make,
+// check and rotate.
+//
+//     tokc
+
+#include <array>
+
+#include "../cht/token.hpp"
+#include "../cht/util.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using namespace cht;
+
+time_t __g_log_time;
+char __g_log_fmttime[64];
+
+// SipHash-2-4 of the bytes 00 .. i-1 for i from 0 to 63, keyed with 00 .. 0f
+static constexpr u64 VECTORS[64] = {
+    0x726fdb47dd0e0e31ull, 0x74f839c593dc67fdull, 0x0d6c8009d9a94f5aull,
+    0x85676696d7fb7e2dull, 0xcf2794e0277187b7ull, 0x18765564cd99a68dull,
+    0xcbc9466e58fee3ceull, 0xab0200f58b01d137ull, 0x93f5f5799a932462ull,
+    0x9e0082df0ba9e4b0ull, 0x7a5dbbc594ddb9f3ull, 0xf4b32f46226bada7ull,
+    0x751e8fbc860ee5fbull, 0x14ea5627c0843d90ull, 0xf723ca908e7af2eeull,
+    0xa129ca6149be45e5ull, 0x3f2acc7f57c29bdbull, 0x699ae9f52cbe4794ull,
+    0x4bc1b3f0968dd39cull, 0xbb6dc91da77961bdull, 0xbed65cf21aa2ee98ull,
+    0xd0f2cbb02e3b67c7ull, 0x93536795e3a33e88ull, 0xa80c038ccd5ccec8ull,
+    0xb8ad50c6f649af94ull, 0xbce192de8a85b8eaull, 0x17d835b85bbb15f3ull,
+    0x2f2e6163076bcfadull, 0xde4daaaca71dc9a5ull, 0xa6a2506687956571ull,
+    0xad87a3535c49ef28ull, 0x32d892fad841c342ull, 0x7127512f72f27cceull,
+    0xa7f32346f95978e3ull, 0x12e0b01abb051238ull, 0x15e034d40fa197aeull,
+    0x314dffbe0815a3b4ull, 0x027990f029623981ull, 0xcadcd4e59ef40c4dull,
+    0x9abfd8766a33735cull, 0x0e3ea96b5304a7d0ull, 0xad0c42d6fc585992ull,
+    0x187306c89bc215a9ull, 0xd4a60abcf3792b95ull, 0xf935451de4f21df2ull,
+    0xa9538f0419755787ull, 0xdb9acddff56ca510ull, 0xd06c98cd5c0975ebull,
+    0xe612a3cb9ecba951ull, 0xc766e62cfcadaf96ull, 0xee64435a9752fe72ull,
+    0xa192d576b245165aull, 0x0a8787bf8ecb74b2ull, 0x81b3e73d20b49b6full,
+    0x7fa8220ba3b2eceaull, 0x245731c13ca42499ull, 0xb78dbfaf3a8d83bdull,
+    0xea1ad565322a1a0bull, 0x60e61c23a3795013ull, 0x6606d7e446282b93ull,
+    0x6ca4ecb15c5f91e1ull, 0x9f626da15c9625f3ull, 0xe51b38608ef25f57ull,
+    0x958a324ceb064572ull,  
+};
+
+constexpr u32 N_GUESSES = 1 << 20;
+
+static u32 g_n_failed = 0;
+
+#define CHECK(cond, ...)                                                       \
+    if (!(cond)) {                                                             \
+        printf("FAIL %s:%d: ", __func__, __LINE__);                            \
+        printf(__VA_ARGS__);                                                   \
+        printf("\n");                                                          \
+        g_n_failed++;                                                          \
+    }
+
+static void check_vectors() {
+    u8 key_bytes[16];
+    u8 msg[64];
+    for (u32 ix = 0; ix < 16; ix++) {
+        key_bytes[ix] = ix;
+    }
+    for (u32 ix = 0; ix < 64; ix++) {
+        msg[ix] = ix;
+    }
+    u64 key[2];
+    memcpy(key, key_bytes, sizeof(key));
+
+    for (u32 len = 0; len < 64; len++) {
+        u64 got = siphash24(key, msg, len);
+        CHECK(got == VECTORS[len], "length %u: %016lx, not %016lx", len, got,
+              VECTORS[len])
+    }
+}
+
+static bool check_token(u32 in_addr, const u8 token[TOKEN_LEN]) {
+    return token::check(in_addr, token, TOKEN_LEN);
+}
+
+static void check_round_trip() {
+    std::mt19937_64 rng(0);
+    token::init();
+
+    u32 addr = 0x0100007f;
+    u32 other = 0x0200007f;
+    u8 tok[TOKEN_LEN];
+    u8 tok_other[TOKEN_LEN];
+    token::make(addr, tok);
+    token::make(other, tok_other);
+
+    CHECK(check_token(addr, tok), "fresh token rejected")
+    CHECK(!check_token(other, tok), "token taken from another address")
+    CHECK(memcmp(tok, tok_other, TOKEN_LEN) != 0, "same token for two addrs")
+    CHECK(!token::check(addr, tok, TOKEN_LEN - 1), "short token taken")
+
+    u8 again[TOKEN_LEN];
+    token::make(addr, again);
+    CHECK(memcmp(tok, again, TOKEN_LEN) == 0, "token not stable")
+
+    token::rotate();
+    CHECK(check_token(addr, tok), "token rejected after one rotation")
+    u8 rotated[TOKEN_LEN];
+    token::make(addr, rotated);
+    CHECK(memcmp(tok, rotated, TOKEN_LEN) != 0, "rotation kept the token")
+    CHECK(check_token(addr, rotated), "new token rejected")
+
+    token::rotate();
+    CHECK(!check_token(addr, tok), "token taken after two rotations")
+    CHECK(check_token(addr, rotated), "token rejected after one rotation")
+
+    u32 n_taken = 0;
+    u8 guess[TOKEN_LEN];
+    for (u32 ix = 0; ix < N_GUESSES; ix++) {
+        u64 val = rng();
+        memcpy(guess, &val, TOKEN_LEN);
+        n_taken += check_token(addr, guess);
+    }
+    CHECK(n_taken == 0, "%u of %u guessed tokens taken", n_taken, N_GUESSES)
+}
+
+int main() {
+    check_vectors();
+    check_round_trip();
+
+    if (g_n_failed > 0) {
+        printf("%u checks failed\n", g_n_failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
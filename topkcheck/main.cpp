@@ -0,0 +1,264 @@
+// Checks the Space-Saving summary of cht/topk.cpp, which is included whole so
+// its buckets can be walked. After every message of a skewed stream the
+// buckets must be ordered, linked both ways and agree with their counters,
+// and every counter must be found through the slot table. The counts must
+// bound the true ones as Space-Saving promises, and keep doing so through
+// halving. Then the published file is checked for order.
+//
+//     tkc
+//
+// Built with a small TOPK_LOG2_K and a TOPK_FN of its own.
+
+#include <array>
+
+#include "../cht/topk.cpp"
+
+#include <map>
+#include <random>
+
+#include <unistd.h>
+
+#if TOPK_LOG2_K > 8
+#error "topkcheck needs a small TOPK_LOG2_K"
+#endif
+
+using namespace cht;
+
+constexpr u32 N_IHS = 20000;
+constexpr u32 N_NOTES = 200000;
+
+time_t __g_log_time;
+char __g_log_fmttime[64];
+
+namespace cht {
+void st_inc(stat_t) {}
+void st_set(stat_t, u64) {}
+} // namespace cht
+
+static u32 g_n_failed = 0;
+
+#define CHECK(cond, ...)                                                       \
+    if (!(cond)) {                                                             \
+        printf("FAIL %s:%d: ", __func__, __LINE__);                            \
+        printf(__VA_ARGS__);                                                   \
+        printf("\n");                                                          \
+        g_n_failed++;                                                          \
+    }
+
+using topk::g_buckets;
+using topk::g_ctrs;
+using topk::NIL;
+
+static std::vector<Nih> g_ihs;
+// how often each infohash was noted since the last halving
+static std::vector<u64> g_true;
+
+// Walks the buckets and counters, checking how they are linked. Returns the
+// sum of the counts.
+static u64 check_structure() {
+    u32 n_ctrs = 0;
+    u32 n_buckets = 0;
+    u64 sum = 0;
+    u32 prev = NIL;
+
+    for (u32 bx = topk::g_low; bx != NIL; bx = g_buckets[bx].next) {
+        const topk::Bucket &bucket = g_buckets[bx];
+        n_buckets++;
+        CHECK(bucket.prev == prev, "bucket %u links back to %u, not %u", bx,
+              bucket.prev, prev)
+        CHECK(prev == NIL || g_buckets[prev].count < bucket.count,
+              "bucket counts %u then %u", g_buckets[prev].count, bucket.count)
+        CHECK(bucket.first != NIL, "bucket %u of count %u empty", bx,
+              bucket.count)
+
+        u32 cprev = NIL;
+        for (u32 cx = bucket.first; cx != NIL; cx = g_ctrs[cx].next) {
+            const topk::Counter &ctr = g_ctrs[cx];
+            n_ctrs++;
+            sum += ctr.count;
+            CHECK(ctr.prev == cprev, "counter %u links back wrong", cx)
+            CHECK(ctr.bucket == bx, "counter %u in bucket %u says %u", cx, bx,
+                  ctr.bucket)
+            CHECK(ctr.count == bucket.count, "counter %u of %u in bucket %u",
+                  cx, ctr.count, bucket.count)
+            CHECK(ctr.err <= ctr.count, "counter %u err %u over count %u", cx,
+                  ctr.err, ctr.count)
+
+            auto [found, pos] = topk::find(ctr.ih);
+            CHECK(found && topk::g_slots[pos] == cx + 1,
+                  "counter %u not found by its infohash", cx)
+            cprev = cx;
+            if (n_ctrs > topk::K) {
+                printf("FAIL: counters form a loop\n");
+                exit(1);
+            }
+        }
+
+        prev = bx;
+        if (n_buckets > topk::K) {
+            printf("FAIL: buckets form a loop\n");
+            exit(1);
+        }
+    }
+
+    CHECK(topk::g_high == prev, "high bucket %u, not %u", topk::g_high, prev)
+    CHECK(n_ctrs == topk::g_n_ctrs, "%u counters in buckets, not %u", n_ctrs,
+          topk::g_n_ctrs)
+    CHECK(n_buckets + topk::g_free_buckets.size() == topk::K,
+          "%u buckets and %zu free", n_buckets, topk::g_free_buckets.size())
+
+    u32 n_slots = 0;
+    for (u32 slot : topk::g_slots) {
+        n_slots += slot != 0;
+    }
+    CHECK(n_slots == n_ctrs, "%u slots taken for %u counters", n_slots,
+          n_ctrs)
+    return sum;
+}
+
+// Space-Saving's bounds, which the halvings keep since they halve the true
+// counts too, rounding down like the counters.
+static void check_bounds() {
+    u32 min_count = topk::g_n_ctrs == topk::K ? g_buckets[topk::g_low].count
+                                              : 0;
+    for (u32 ix = 0; ix < N_IHS; ix++) {
+        auto [found, pos] = topk::find(g_ihs[ix]);
+        if (!found) {
+            CHECK(g_true[ix] <= min_count, "infohash %u seen %lu times, "
+                  "over the smallest count %u", ix, g_true[ix], min_count)
+            continue;
+        }
+        const topk::Counter &ctr = g_ctrs[topk::g_slots[pos] - 1];
+        CHECK(g_true[ix] <= ctr.count && ctr.count - ctr.err <= g_true[ix],
+              "infohash %u seen %lu times, counted %u - %u", ix, g_true[ix],
+              ctr.count, ctr.err)
+    }
+}
+
+static void note_stream(std::mt19937_64 &rng, u32 n_notes, bool every) {
+    // Zipf-like, infohash x comes up about 1 / (x + 1) as often as the first
+    std::vector<double> weights(N_IHS);
+    for (u32 ix = 0; ix < N_IHS; ix++) {
+        weights[ix] = 1.0 / (ix + 1);
+    }
+    std::discrete_distribution<u32> pick(weights.begin(), weights.end());
+
+    for (u32 n = 0; n < n_notes; n++) {
+        u32 ix = pick(rng);
+        topk::note(g_ihs[ix]);
+        g_true[ix]++;
+        if (every || n % 1024 == 0) {
+            check_structure();
+        }
+    }
+}
+
+static void check_stream() {
+    std::mt19937_64 rng(0);
+    note_stream(rng, N_NOTES, true);
+
+    u64 sum = check_structure();
+    CHECK(sum == topk::g_n_counted, "counts sum to %lu, not %lu", sum,
+          topk::g_n_counted)
+    check_bounds();
+
+    // the head of a Zipf stream is far above the rest
+    topk::publish();
+    for (u32 ix = 0; ix < 4; ix++) {
+        CHECK(topk::is_hot(g_ihs[ix]), "infohash %u not hot", ix)
+    }
+    CHECK(!topk::is_hot(g_ihs[N_IHS - 1]), "tail infohash hot")
+}
+
+static void check_halving() {
+    std::mt19937_64 rng(1);
+    for (u32 round = 0; round < 3; round++) {
+        std::vector<u32> before(topk::K);
+        for (u32 cx = 0; cx < topk::g_n_ctrs; cx++) {
+            before[cx] = g_ctrs[cx].count;
+        }
+
+        // halves on the last of these
+        while (true) {
+            bool halves = topk::g_rollovers == TOPK_HALVE_EVERY - 1;
+            topk::publish();
+            if (halves) {
+                break;
+            }
+        }
+        for (auto &count : g_true) {
+            count >>= 1;
+        }
+
+        for (u32 cx = 0; cx < topk::g_n_ctrs; cx++) {
+            CHECK(g_ctrs[cx].count == before[cx] / 2, "counter %u went from "
+                  "%u to %u", cx, before[cx], g_ctrs[cx].count)
+        }
+        // sum of halves may round down further than the halved total
+        u64 sum = check_structure();
+        CHECK(sum <= topk::g_n_counted, "counts sum to %lu, over %lu", sum,
+              topk::g_n_counted)
+        check_bounds();
+
+        note_stream(rng, N_NOTES / 4, false);
+        check_structure();
+        check_bounds();
+    }
+}
+
+static void check_file() {
+    topk::publish();
+
+    FILE *f = fopen(TOPK_FN, "r");
+    CHECK(f != nullptr, "no " TOPK_FN)
+    if (f == nullptr) {
+        return;
+    }
+
+    u64 ts, counted;
+    u32 min_count;
+    CHECK(fscanf(f, "# %lu %lu %u\n", &ts, &counted, &min_count) == 3,
+          "bad header")
+    CHECK(min_count == g_buckets[topk::g_low].count, "min_count %u",
+          min_count)
+
+    char hex[2 * NIH_LEN + 1];
+    u32 count, err;
+    u32 last = UINT32_MAX;
+    u32 n_lines = 0;
+    while (fscanf(f, "%40s %u %u\n", hex, &count, &err) == 3) {
+        CHECK(count <= last, "line %u: %u after %u", n_lines, count, last)
+        CHECK(err <= count, "line %u: err %u over %u", n_lines, err, count)
+        last = count;
+        n_lines++;
+    }
+    CHECK(n_lines == TOPK_PUBLISH, "%u lines, not %u", n_lines, TOPK_PUBLISH)
+    CHECK(last >= g_buckets[topk::g_low].count, "listed %u under the min",
+          last)
+    fclose(f);
+    unlink(TOPK_FN);
+}
+
+int main() {
+    topk::init();
+
+    std::mt19937_64 rng(2);
+    g_ihs.resize(N_IHS);
+    g_true.assign(N_IHS, 0);
+    for (auto &ih : g_ihs) {
+        for (auto &byte : ih.raw) {
+            byte = u8(rng());
+        }
+    }
+
+    check_stream();
+    check_halving();
+    check_file();
+
+    if (g_n_failed > 0) {
+        printf("%u checks failed\n", g_n_failed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}